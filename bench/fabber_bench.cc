@@ -0,0 +1,871 @@
+/* fabber_bench.cc - Performance benchmarks for Fabber
+
+ Runs microbenchmarks of the core numerical routines and end-to-end runs
+ of the built-in inference methods on synthetic data. Results are written
+ to stdout as one JSON object per line so they can be collected and
+ compared between builds. Progress messages go to stderr.
+
+ Copyright (C) 2007-2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "dist_mvn.h"
+#include "easylog.h"
+#include "fwdmodel.h"
+#include "fwdmodel_linear.h"
+#include "noisemodel.h"
+#include "priors.h"
+#include "run_context.h"
+#include "rundata.h"
+#include "setup.h"
+#include "tools.h"
+#include "version.h"
+
+#include <newmat.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace NEWMAT;
+
+namespace
+{
+/** Accumulates results so the compiler cannot optimise away the work being timed */
+volatile double sink = 0;
+
+/**
+ * @return Peak resident set size of the process in kB, or -1 if not available
+ *
+ * This is a high-water mark for the whole process, so benchmarks are run in
+ * increasing order of size
+ */
+long PeakRssKb()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return long(pmc.PeakWorkingSetSize / 1024);
+    return -1;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#ifdef __APPLE__
+    // Reported in bytes on Mac
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+string JsonString(const string &str)
+{
+    string out = "\"";
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        if (str[i] == '"' || str[i] == '\\')
+            out += '\\';
+        out += str[i];
+    }
+    return out + "\"";
+}
+
+/**
+ * Unique temporary file which is removed when this goes out of scope
+ */
+class TempFile
+{
+public:
+    TempFile(const string &prefix)
+    {
+#ifdef _WIN32
+        char dir[MAX_PATH], path[MAX_PATH];
+        if (GetTempPathA(MAX_PATH, dir) == 0 || GetTempFileNameA(dir, prefix.c_str(), 0, path) == 0)
+            throw runtime_error("Failed to create temporary file");
+        m_path = path;
+#else
+        const char *dir = getenv("TMPDIR");
+        string path_template = string((dir && *dir) ? dir : "/tmp") + "/" + prefix + "XXXXXX";
+        vector<char> path(path_template.begin(), path_template.end());
+        path.push_back('\0');
+        int fd = mkstemp(&path[0]);
+        if (fd < 0)
+            throw runtime_error("Failed to create temporary file " + path_template);
+        close(fd);
+        m_path = &path[0];
+#endif
+    }
+
+    ~TempFile()
+    {
+        remove(m_path.c_str());
+    }
+
+    const string &Path() const
+    {
+        return m_path;
+    }
+
+private:
+    TempFile(const TempFile &);
+    TempFile &operator=(const TempFile &);
+
+    string m_path;
+};
+
+/**
+ * Log which discards everything written to it
+ *
+ * Logging within benchmarks would otherwise be buffered in memory
+ */
+class NullLog
+{
+public:
+    NullLog()
+        : m_stream(NULL)
+    {
+        m_log.StartLog(m_stream);
+    }
+
+    ~NullLog()
+    {
+        m_log.StopLog();
+    }
+
+    EasyLog *Get()
+    {
+        return &m_log;
+    }
+
+private:
+    std::ostream m_stream;
+    EasyLog m_log;
+};
+
+/**
+ * One line of benchmark output as a flat JSON object
+ */
+class JsonLine
+{
+public:
+    JsonLine &Add(const string &key, const string &value)
+    {
+        Sep() << JsonString(key) << ": " << JsonString(value);
+        return *this;
+    }
+
+    JsonLine &Add(const string &key, double value)
+    {
+        Sep() << JsonString(key) << ": " << value;
+        return *this;
+    }
+
+    JsonLine &Add(const string &key, long value)
+    {
+        Sep() << JsonString(key) << ": " << value;
+        return *this;
+    }
+
+    JsonLine &Add(const string &key, int value)
+    {
+        return Add(key, long(value));
+    }
+
+    void Write(ostream &out) const
+    {
+        out << "{" << m_str.str() << "}" << endl;
+    }
+
+private:
+    ostream &Sep()
+    {
+        if (m_str.tellp() > 0)
+            m_str << ", ";
+        return m_str;
+    }
+    stringstream m_str;
+};
+
+/**
+ * Simple deterministic pseudo-random numbers so that synthetic data is
+ * the same on every platform and run
+ */
+class BenchRandom
+{
+public:
+    BenchRandom(unsigned long seed = 12345)
+        : m_state(seed)
+    {
+    }
+
+    /** @return Uniform random number in (0, 1) */
+    double Uniform()
+    {
+        m_state = (m_state * 1103515245UL + 12345UL) & 0x7fffffffUL;
+        return (double(m_state) + 0.5) / 2147483648.0;
+    }
+
+    /** @return Standard normal random number (Box-Muller) */
+    double Normal()
+    {
+        double u1 = Uniform(), u2 = Uniform();
+        return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+    }
+
+private:
+    unsigned long m_state;
+};
+
+/**
+ * Single exponential decay, S(t) = amp * exp(-r * t)
+ *
+ * The same as the exp example model, included here so benchmarks of a
+ * nonlinear model do not depend on a model library
+ */
+class BenchExpFwdModel : public FwdModel
+{
+public:
+    static FwdModel *NewInstance()
+    {
+        return new BenchExpFwdModel();
+    }
+
+    BenchExpFwdModel()
+        : m_dt(1.0)
+    {
+    }
+
+    string ModelVersion() const
+    {
+        return fabber_version();
+    }
+
+    string GetDescription() const
+    {
+        return "Single exponential decay used for benchmarking";
+    }
+
+    void Initialize(FabberRunData &rundata)
+    {
+        FwdModel::Initialize(rundata);
+        m_dt = rundata.GetDoubleDefault("dt", 1.0);
+    }
+
+    void EvaluateModel(const ColumnVector &params, ColumnVector &result,
+        const string &key = "") const
+    {
+        result.ReSize(data.Nrows());
+        for (int i = 1; i <= data.Nrows(); i++)
+        {
+            result(i) = params(1) * exp(-params(2) * (i - 1) * m_dt);
+        }
+    }
+
+    void InitVoxelPosterior(MVNDist &posterior) const
+    {
+        posterior.means(1) = data.Maximum();
+    }
+
+protected:
+    void GetParameterDefaults(vector<Parameter> &params) const
+    {
+        params.clear();
+        params.push_back(Parameter(0, "amp", DistParams(1, 1e5), DistParams(1, 1.5), PRIOR_NORMAL,
+            TRANSFORM_LOG()));
+        params.push_back(Parameter(
+            1, "r", DistParams(1, 1e5), DistParams(1, 1.5), PRIOR_NORMAL, TRANSFORM_LOG()));
+    }
+
+private:
+    double m_dt;
+};
+
+/**
+ * Gives access to the spatial precision calculation
+ */
+class BenchSpatialPrior : public SpatialPrior
+{
+public:
+    BenchSpatialPrior(const Parameter &param, FabberRunData &rundata)
+        : SpatialPrior(param, rundata)
+    {
+    }
+
+    double aK(const RunContext &ctx)
+    {
+        return CalculateaK(ctx);
+    }
+};
+
+/**
+ * Base class for a microbenchmark
+ *
+ * Setup is called once, then Run is called with an increasing number
+ * of repetitions until the minimum time is reached
+ */
+class MicroBenchmark
+{
+public:
+    MicroBenchmark(const string &name)
+        : m_name(name)
+    {
+    }
+
+    virtual ~MicroBenchmark()
+    {
+    }
+
+    const string &Name() const
+    {
+        return m_name;
+    }
+
+    virtual void Setup()
+    {
+    }
+
+    /** Perform reps operations */
+    virtual void Run(long reps) = 0;
+
+private:
+    string m_name;
+};
+
+/** Voxel co-ordinates of a regular grid */
+Matrix GridCoords(int nx, int ny, int nz)
+{
+    Matrix coords(3, nx * ny * nz);
+    int v = 1;
+    for (int z = 0; z < nz; z++)
+    {
+        for (int y = 0; y < ny; y++)
+        {
+            for (int x = 0; x < nx; x++)
+            {
+                coords(1, v) = x;
+                coords(2, v) = y;
+                coords(3, v) = z;
+                v++;
+            }
+        }
+    }
+    return coords;
+}
+
+/** Inversion of an MVN precision matrix to get the covariance */
+class MvnInverseBench : public MicroBenchmark
+{
+public:
+    MvnInverseBench(int size)
+        : MicroBenchmark("mvn_inverse/" + stringify(size))
+        , m_size(size)
+    {
+    }
+
+    void Setup()
+    {
+        m_prec.ReSize(m_size);
+        for (int i = 1; i <= m_size; i++)
+        {
+            for (int j = 1; j <= i; j++)
+            {
+                m_prec(i, j) = (i == j) ? m_size : 1.0 / (i + j);
+            }
+        }
+        m_mvn.SetSize(m_size);
+    }
+
+    void Run(long reps)
+    {
+        for (long r = 0; r < reps; r++)
+        {
+            m_mvn.SetPrecisions(m_prec);
+            sink += m_mvn.GetCovariance()(1, 1);
+        }
+    }
+
+private:
+    int m_size;
+    SymmetricMatrix m_prec;
+    MVNDist m_mvn;
+};
+
+/**
+ * Benchmarks which need a model and a single voxel of data
+ */
+class ModelBenchmark : public MicroBenchmark
+{
+public:
+    ModelBenchmark(const string &name, const string &model, int ntimes)
+        : MicroBenchmark(name)
+        , m_model_name(model)
+        , m_ntimes(ntimes)
+    {
+    }
+
+    void Setup()
+    {
+        m_rundata.SetLogger(m_log.Get());
+        m_rundata.Set("model", m_model_name);
+        m_rundata.Set("degree", "3");
+        m_rundata.Set("dt", "0.1");
+        m_model.reset(FwdModel::NewFromName(m_model_name));
+        m_model->SetLogger(m_log.Get());
+        m_model->Initialize(m_rundata);
+
+        BenchRandom rand;
+        m_data.ReSize(m_ntimes);
+        for (int t = 1; t <= m_ntimes; t++)
+        {
+            m_data(t) = 100 * exp(-0.1 * t) + rand.Normal();
+        }
+        ColumnVector coords(3);
+        coords = 0;
+        m_model->PassData(1, m_data, coords);
+        m_model->GetInitialPosterior(m_post);
+    }
+
+protected:
+    NullLog m_log;
+    FabberRunData m_rundata;
+    std::auto_ptr<FwdModel> m_model;
+    string m_model_name;
+    int m_ntimes;
+    ColumnVector m_data;
+    MVNDist m_post;
+};
+
+/** Linearization of a model, i.e. evaluation and numerical Jacobian */
+class ReCentreBench : public ModelBenchmark
+{
+public:
+    ReCentreBench(const string &model, int ntimes)
+        : ModelBenchmark("recentre/" + model + "/" + stringify(ntimes), model, ntimes)
+    {
+    }
+
+    void Run(long reps)
+    {
+        LinearizedFwdModel linear(m_model.get());
+        for (long r = 0; r < reps; r++)
+        {
+            linear.ReCentre(m_post.means);
+            ColumnVector offset = linear.Offset();
+            sink += offset(1);
+        }
+    }
+};
+
+/** Noise model theta and noise updates */
+class NoiseUpdateBench : public ModelBenchmark
+{
+public:
+    NoiseUpdateBench(const string &noise, bool theta, int ntimes)
+        : ModelBenchmark("noise_" + string(theta ? "theta/" : "noise/") + noise + "/"
+                  + stringify(ntimes),
+              "poly", ntimes)
+        , m_noise_name(noise)
+        , m_theta(theta)
+    {
+    }
+
+    void Setup()
+    {
+        ModelBenchmark::Setup();
+        m_noise.reset(NoiseModel::NewFromName(m_noise_name));
+        m_noise->SetLogger(m_log.Get());
+        m_noise->Initialize(m_rundata);
+        m_noise_prior.reset(m_noise->NewParams());
+        m_noise_post.reset(m_noise->NewParams());
+        m_noise->HardcodedInitialDists(*m_noise_prior, *m_noise_post);
+        m_noise->Precalculate(*m_noise_post, *m_noise_prior, m_data);
+        m_prior = m_post;
+    }
+
+    void Run(long reps)
+    {
+        LinearizedFwdModel linear(m_model.get());
+        linear.ReCentre(m_post.means);
+        for (long r = 0; r < reps; r++)
+        {
+            if (m_theta)
+            {
+                MVNDist theta(m_post);
+                m_noise->UpdateTheta(*m_noise_post, theta, m_prior, linear, m_data, NULL, 0);
+                sink += theta.means(1);
+            }
+            else
+            {
+                m_noise->UpdateNoise(*m_noise_post, *m_noise_prior, m_post, linear, m_data);
+            }
+        }
+    }
+
+private:
+    string m_noise_name;
+    bool m_theta;
+    std::auto_ptr<NoiseModel> m_noise;
+    std::auto_ptr<NoiseParams> m_noise_prior;
+    std::auto_ptr<NoiseParams> m_noise_post;
+    MVNDist m_prior;
+};
+
+/** Spatial prior application and spatial precision update over a grid */
+class SpatialPriorBench : public MicroBenchmark
+{
+public:
+    SpatialPriorBench(int n, bool ak_only)
+        : MicroBenchmark(string(ak_only ? "spatial_ak/" : "spatial_apply/") + stringify(n * n * n))
+        , m_n(n)
+        , m_ak_only(ak_only)
+        , m_ctx(n * n * n)
+    {
+    }
+
+    void Setup()
+    {
+        m_rundata.SetLogger(m_log.Get());
+        m_rundata.SetVoxelCoords(GridCoords(m_n, m_n, m_n));
+        int nvoxels = m_n * m_n * m_n;
+        BenchRandom rand;
+        MVNDist dist(2, m_log.Get());
+        dist.SetCovariance(IdentityMatrix(2));
+        m_ctx.fwd_post.resize(nvoxels, dist);
+        m_ctx.fwd_prior.resize(nvoxels, dist);
+        for (int v = 0; v < nvoxels; v++)
+        {
+            m_ctx.fwd_post[v].means(1) = rand.Normal();
+        }
+        m_ctx.neighbours = m_rundata.GetNeighbours(3);
+        m_ctx.neighbours2 = m_rundata.GetSecondNeighbours(3);
+        m_ctx.it = 1;
+
+        Parameter param(0, "c0", DistParams(0, 1e-12), DistParams(0, 1), PRIOR_SPATIAL_M);
+        m_prior.reset(new BenchSpatialPrior(param, m_rundata));
+    }
+
+    void Run(long reps)
+    {
+        for (long r = 0; r < reps; r++)
+        {
+            if (m_ak_only)
+            {
+                sink += m_prior->aK(m_ctx);
+            }
+            else
+            {
+                for (m_ctx.v = 1; m_ctx.v <= m_ctx.nvoxels; m_ctx.v++)
+                {
+                    sink += m_prior->ApplyToMVN(&m_ctx.fwd_prior[m_ctx.v - 1], m_ctx);
+                }
+            }
+        }
+    }
+
+private:
+    int m_n;
+    bool m_ak_only;
+    RunContext m_ctx;
+    NullLog m_log;
+    FabberRunData m_rundata;
+    std::auto_ptr<BenchSpatialPrior> m_prior;
+};
+
+/** Calculation of nearest and second nearest neighbour lists */
+class NeighboursBench : public MicroBenchmark
+{
+public:
+    NeighboursBench(int n)
+        : MicroBenchmark("neighbours/" + stringify(n * n * n))
+        , m_coords(GridCoords(n, n, n))
+    {
+    }
+
+    void Run(long reps)
+    {
+        for (long r = 0; r < reps; r++)
+        {
+            FabberRunData rundata;
+            rundata.SetLogger(m_log.Get());
+            rundata.SetVoxelCoords(m_coords);
+            sink += rundata.GetNeighbours(3).size();
+            sink += rundata.GetSecondNeighbours(3).size();
+        }
+    }
+
+private:
+    Matrix m_coords;
+    NullLog m_log;
+};
+
+/**
+ * Time a microbenchmark, doubling the number of repetitions until it runs
+ * for at least the minimum time
+ */
+void RunMicro(MicroBenchmark &bench, double min_time)
+{
+    cerr << "fabber_bench: " << bench.Name() << endl;
+    bench.Setup();
+    long reps = 1;
+    double elapsed = 0;
+    while (true)
+    {
+        double start = fabber::wall_time();
+        bench.Run(reps);
+        elapsed = fabber::wall_time() - start;
+        if (elapsed >= min_time || reps >= (1L << 30))
+            break;
+        // Aim a bit beyond the minimum time, but no more than 10x at a time
+        double factor = (elapsed > 0) ? 1.4 * min_time / elapsed : 10;
+        if (factor > 10)
+            factor = 10;
+        if (factor < 2)
+            factor = 2;
+        reps = long(reps * factor);
+    }
+
+    JsonLine()
+        .Add("type", "micro")
+        .Add("name", bench.Name())
+        .Add("reps", reps)
+        .Add("seconds", elapsed)
+        .Add("ns_per_op", 1e9 * elapsed / reps)
+        .Add("ops_per_second", reps / elapsed)
+        .Add("peak_rss_kb", PeakRssKb())
+        .Write(cout);
+}
+
+/**
+ * Synthetic 4D data set for end-to-end benchmarks
+ *
+ * Parameters vary smoothly across the grid so spatial priors have
+ * something sensible to work with, and Gaussian noise is added
+ */
+void MakeSyntheticData(
+    const string &model, int nx, int ny, int nz, int ntimes, Matrix &coords, Matrix &data)
+{
+    coords = GridCoords(nx, ny, nz);
+    int nvoxels = coords.Ncols();
+    data.ReSize(ntimes, nvoxels);
+    BenchRandom rand;
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        double x = coords(1, v) / nx, y = coords(2, v) / ny, z = coords(3, v) / nz;
+        for (int t = 1; t <= ntimes; t++)
+        {
+            double value;
+            if (model == "exp")
+            {
+                value = (100 + 50 * x) * exp(-(1 + y) * (t - 1) * 0.1);
+            }
+            else if (model == "poly")
+            {
+                value = 100 + 50 * x + (1 + y) * t + 0.1 * z * t * t;
+            }
+            else
+            {
+                // Linear model with the basis from WriteLinearBasis
+                value = (100 + 50 * x) + (5 + y) * t / ntimes + 2 * z * sin(t * 0.5);
+            }
+            data(t, v) = value + rand.Normal();
+        }
+    }
+}
+
+/** Write the design matrix used by the linear model benchmarks */
+void WriteLinearBasis(const string &filename, int ntimes)
+{
+    ofstream out(filename.c_str());
+    for (int t = 1; t <= ntimes; t++)
+    {
+        out << 1 << " " << double(t) / ntimes << " " << sin(t * 0.5) << endl;
+    }
+    if (!out)
+        throw FabberRunDataError("Could not write design matrix file: " + filename);
+}
+
+/**
+ * Run one model/method combination on synthetic data and report the throughput
+ */
+void RunEndToEnd(const string &model, const string &method, int nx, int ny, int nz, int ntimes,
+    const string &basis_file)
+{
+    int nvoxels = nx * ny * nz;
+    string name = "e2e/" + model + "/" + method + "/" + stringify(nvoxels);
+    cerr << "fabber_bench: " << name << endl;
+
+    JsonLine line;
+    line.Add("type", "e2e")
+        .Add("name", name)
+        .Add("model", model)
+        .Add("method", method)
+        .Add("voxels", nvoxels)
+        .Add("timepoints", ntimes);
+
+    try
+    {
+        Matrix coords, data;
+        MakeSyntheticData(model, nx, ny, nz, ntimes, coords, data);
+
+        NullLog log;
+        FabberRunData rundata;
+        rundata.SetLogger(log.Get());
+        rundata.SetVoxelCoords(coords);
+        rundata.SetVoxelData("data", data);
+        rundata.Set("model", model);
+        rundata.Set("method", method);
+        rundata.Set("noise", "white");
+        if (model == "poly")
+            rundata.Set("degree", "2");
+        else if (model == "exp")
+            rundata.Set("dt", "0.1");
+        else
+            rundata.Set("basis", basis_file);
+        if (method == "spatialvb")
+            rundata.Set("param-spatial-priors", "M+");
+
+        double start = fabber::wall_time();
+        rundata.Run();
+        double elapsed = fabber::wall_time() - start;
+
+        line.Add("seconds", elapsed).Add("voxels_per_second", nvoxels / elapsed);
+    }
+    catch (const exception &e)
+    {
+        line.Add("error", e.what());
+    }
+    line.Add("peak_rss_kb", PeakRssKb()).Write(cout);
+}
+
+bool Selected(const string &name, const string &filter)
+{
+    return filter == "" || name.find(filter) != string::npos;
+}
+
+void Usage()
+{
+    cerr << "Usage: fabber_bench [--quick] [--filter=TEXT] [--min-time=SECS]" << endl
+         << endl
+         << "  --quick          Smaller problem sizes for a fast check" << endl
+         << "  --filter=TEXT    Only run benchmarks whose name contains TEXT, e.g. e2e/poly"
+         << endl
+         << "  --min-time=SECS  Minimum time for each microbenchmark (default 0.5)" << endl
+         << "  --no-micro       Skip the microbenchmarks" << endl
+         << "  --no-e2e         Skip the end-to-end benchmarks" << endl
+         << endl
+         << "Results are written to stdout as one JSON object per line" << endl;
+}
+}
+
+int main(int argc, char **argv)
+{
+    try
+    {
+        EasyLog log;
+        FabberRunData args;
+        args.SetLogger(&log);
+        args.Parse(argc, argv);
+        if (args.GetBool("help"))
+        {
+            Usage();
+            return 0;
+        }
+
+        bool quick = args.GetBool("quick");
+        string filter = args.GetStringDefault("filter", "");
+        double min_time = args.GetDoubleDefault("min-time", quick ? 0.1 : 0.5, 0);
+
+        FabberSetup::SetupDefaults();
+        if (!FwdModelFactory::GetInstance()->HasName("exp"))
+        {
+            FwdModelFactory::GetInstance()->Add("exp", &BenchExpFwdModel::NewInstance);
+        }
+
+        JsonLine()
+            .Add("type", "info")
+            .Add("version", fabber_version())
+            .Add("source_date", fabber_source_date())
+            .Add("quick", quick ? 1 : 0)
+            .Write(cout);
+
+        if (!args.GetBool("no-micro"))
+        {
+            vector<MicroBenchmark *> micro;
+            micro.push_back(new MvnInverseBench(4));
+            micro.push_back(new MvnInverseBench(16));
+            micro.push_back(new ReCentreBench("poly", 50));
+            micro.push_back(new ReCentreBench("exp", 50));
+            micro.push_back(new NoiseUpdateBench("white", true, 50));
+            micro.push_back(new NoiseUpdateBench("white", false, 50));
+            micro.push_back(new NoiseUpdateBench("ar", true, 50));
+            micro.push_back(new NoiseUpdateBench("ar", false, 50));
+            micro.push_back(new SpatialPriorBench(quick ? 10 : 30, false));
+            micro.push_back(new SpatialPriorBench(quick ? 10 : 30, true));
+            micro.push_back(new NeighboursBench(quick ? 10 : 30));
+
+            for (unsigned int i = 0; i < micro.size(); i++)
+            {
+                if (Selected(micro[i]->Name(), filter))
+                    RunMicro(*micro[i], min_time);
+                delete micro[i];
+            }
+        }
+
+        if (!args.GetBool("no-e2e"))
+        {
+            const int ntimes = 20;
+            TempFile basis("fabber_bench_basis");
+            const string &basis_file = basis.Path();
+            WriteLinearBasis(basis_file, ntimes);
+
+            // Grid sizes in increasing order, since peak RSS is a high-water mark
+            int sizes[][3] = { { 10, 10, 10 }, { 20, 20, 25 }, { 40, 40, 25 } };
+            int nsizes = quick ? 1 : 3;
+            const char *models[] = { "linear", "poly", "exp" };
+            const char *methods[] = { "vb", "spatialvb", "nlls" };
+            for (int s = 0; s < nsizes; s++)
+            {
+                for (int m = 0; m < 3; m++)
+                {
+                    for (int i = 0; i < 3; i++)
+                    {
+                        string name = string("e2e/") + models[m] + "/" + methods[i] + "/"
+                            + stringify(sizes[s][0] * sizes[s][1] * sizes[s][2]);
+                        if (Selected(name, filter))
+                        {
+                            RunEndToEnd(models[m], methods[i], sizes[s][0], sizes[s][1],
+                                sizes[s][2], ntimes, basis_file);
+                        }
+                    }
+                }
+            }
+        }
+        return 0;
+    }
+    catch (const exception &e)
+    {
+        cerr << "fabber_bench: " << e.what() << endl;
+    }
+    return 1;
+}
@@ -0,0 +1,448 @@
+/*  checkpoint.cc - Saving and restoring the state of a run
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "checkpoint.h"
+
+#include "easylog.h"
+#include "rundata.h"
+
+#include <newmat.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+using namespace std;
+using NEWMAT::Real;
+using NEWMAT::SymmetricMatrix;
+
+// Identifies checkpoint files and the version of their layout
+static const char CHECKPOINT_MAGIC[8] = { 'F', 'A', 'B', 'B', 'E', 'R', 'C', '2' };
+
+// Each block in the file starts with the number of bytes in it
+typedef unsigned long long BlockSize;
+
+struct Checkpoint::Impl
+{
+    Impl()
+        : started(false)
+        , busy(false)
+        , stop(false)
+    {
+    }
+
+    /** Blocks waiting for the writer thread, in order */
+    std::deque<Block> queue;
+
+    /** Last error from the writer thread, not yet reported */
+    std::string error;
+
+    bool started;
+    bool busy;
+    bool stop;
+#ifndef _WIN32
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+#endif
+};
+
+Checkpoint::Checkpoint()
+    : m_pos(0)
+    , m_impl(new Impl)
+{
+#ifndef _WIN32
+    pthread_mutex_init(&m_impl->lock, NULL);
+    pthread_cond_init(&m_impl->wake, NULL);
+    pthread_cond_init(&m_impl->idle, NULL);
+#endif
+    Clear();
+}
+
+Checkpoint::~Checkpoint()
+{
+    Wait();
+#ifndef _WIN32
+    if (m_impl->started)
+    {
+        pthread_mutex_lock(&m_impl->lock);
+        m_impl->stop = true;
+        pthread_cond_signal(&m_impl->wake);
+        pthread_mutex_unlock(&m_impl->lock);
+        pthread_join(m_impl->writer, NULL);
+    }
+    pthread_cond_destroy(&m_impl->idle);
+    pthread_cond_destroy(&m_impl->wake);
+    pthread_mutex_destroy(&m_impl->lock);
+#endif
+    delete m_impl;
+}
+
+void Checkpoint::Clear()
+{
+    m_buf.clear();
+    m_pos = 0;
+}
+
+void Checkpoint::PutBytes(const void *data, size_t size)
+{
+    m_buf.append(static_cast<const char *>(data), size);
+}
+
+void Checkpoint::Put(int value)
+{
+    PutBytes(&value, sizeof(value));
+}
+
+void Checkpoint::Put(double value)
+{
+    PutBytes(&value, sizeof(value));
+}
+
+void Checkpoint::Put(const vector<double> &values)
+{
+    Put(int(values.size()));
+    if (!values.empty())
+        PutBytes(&values[0], values.size() * sizeof(double));
+}
+
+void Checkpoint::Put(const vector<int> &values)
+{
+    Put(int(values.size()));
+    if (!values.empty())
+        PutBytes(&values[0], values.size() * sizeof(int));
+}
+
+void Checkpoint::Put(const MVNDist &mvn)
+{
+    // Precisions are what the VB updates calculate, so store them rather
+    // than the covariance to restore the distribution exactly
+    int size = mvn.GetSize();
+    Put(size);
+    if (size > 0)
+    {
+        PutBytes(mvn.means.Store(), size * sizeof(Real));
+
+        // The lower triangle is written by row since matrix libraries differ
+        // in how they store symmetric matrices
+        const SymmetricMatrix &prec = mvn.GetPrecisions();
+        vector<Real> lower;
+        lower.reserve(size_t(size) * (size + 1) / 2);
+        for (int r = 1; r <= size; r++)
+        {
+            for (int c = 1; c <= r; c++)
+            {
+                lower.push_back(prec(r, c));
+            }
+        }
+        PutBytes(&lower[0], lower.size() * sizeof(Real));
+    }
+}
+
+void Checkpoint::GetBytes(void *data, size_t size)
+{
+    if (m_pos + size > m_buf.size())
+    {
+        throw FabberRunDataError("Checkpoint file is truncated or was saved by a different run");
+    }
+    memcpy(data, m_buf.data() + m_pos, size);
+    m_pos += size;
+}
+
+int Checkpoint::GetInt()
+{
+    int value;
+    GetBytes(&value, sizeof(value));
+    return value;
+}
+
+double Checkpoint::GetDouble()
+{
+    double value;
+    GetBytes(&value, sizeof(value));
+    return value;
+}
+
+int Checkpoint::GetSize(size_t item_size)
+{
+    // Check the size first so a corrupt file cannot cause a huge allocation
+    int size = GetInt();
+    if (size < 0 || size_t(size) > (m_buf.size() - m_pos) / item_size)
+    {
+        throw FabberRunDataError("Checkpoint file is truncated or was saved by a different run");
+    }
+    return size;
+}
+
+void Checkpoint::Get(vector<double> &values)
+{
+    values.resize(GetSize(sizeof(double)));
+    if (!values.empty())
+        GetBytes(&values[0], values.size() * sizeof(double));
+}
+
+void Checkpoint::Get(vector<int> &values)
+{
+    values.resize(GetSize(sizeof(int)));
+    if (!values.empty())
+        GetBytes(&values[0], values.size() * sizeof(int));
+}
+
+void Checkpoint::Get(MVNDist &mvn)
+{
+    int size = GetSize(sizeof(Real));
+    mvn.SetSize(size);
+    if (size > 0)
+    {
+        GetBytes(mvn.means.Store(), size * sizeof(Real));
+        size_t count = size_t(size) * (size + 1) / 2;
+        if (count > (m_buf.size() - m_pos) / sizeof(Real))
+        {
+            throw FabberRunDataError(
+                "Checkpoint file is truncated or was saved by a different run");
+        }
+        vector<Real> lower(count);
+        GetBytes(&lower[0], lower.size() * sizeof(Real));
+        SymmetricMatrix prec(size);
+        size_t i = 0;
+        for (int r = 1; r <= size; r++)
+        {
+            for (int c = 1; c <= r; c++)
+            {
+                prec(r, c) = lower[i++];
+            }
+        }
+        mvn.SetPrecisions(prec);
+    }
+}
+
+void Checkpoint::Save(const string &filename)
+{
+    Queue(filename, false);
+}
+
+void Checkpoint::Append(const string &filename)
+{
+    Queue(filename, true);
+}
+
+void Checkpoint::Queue(const string &filename, bool append)
+{
+    ReportError();
+    Block block;
+    block.filename = filename;
+    block.append = append;
+    block.data.swap(m_buf);
+    Clear();
+
+#ifndef _WIN32
+    pthread_mutex_lock(&m_impl->lock);
+    if (!m_impl->started)
+    {
+        m_impl->started = (pthread_create(&m_impl->writer, NULL, WriterThread, this) == 0);
+    }
+    if (m_impl->started)
+    {
+        if (!append)
+        {
+            // Anything else still to be written to this file would be replaced
+            deque<Block>::iterator iter = m_impl->queue.begin();
+            while (iter != m_impl->queue.end())
+            {
+                if (iter->filename == filename)
+                    iter = m_impl->queue.erase(iter);
+                else
+                    ++iter;
+            }
+        }
+        m_impl->queue.push_back(Block());
+        m_impl->queue.back().filename = filename;
+        m_impl->queue.back().append = append;
+        m_impl->queue.back().data.swap(block.data);
+        pthread_cond_signal(&m_impl->wake);
+        pthread_mutex_unlock(&m_impl->lock);
+        return;
+    }
+    pthread_mutex_unlock(&m_impl->lock);
+#endif
+
+    // No background thread available, so write it now
+    string error = Write(block);
+    if (error != "")
+    {
+        WARN_ONCE_TEXT("Checkpoint::" + error);
+    }
+}
+
+void Checkpoint::Wait()
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&m_impl->lock);
+    while (!m_impl->queue.empty() || m_impl->busy)
+    {
+        pthread_cond_wait(&m_impl->idle, &m_impl->lock);
+    }
+    pthread_mutex_unlock(&m_impl->lock);
+#endif
+    ReportError();
+}
+
+void Checkpoint::ReportError()
+{
+    string error;
+#ifndef _WIN32
+    pthread_mutex_lock(&m_impl->lock);
+    error.swap(m_impl->error);
+    pthread_mutex_unlock(&m_impl->lock);
+#endif
+    if (error != "")
+    {
+        WARN_ONCE_TEXT("Checkpoint::" + error);
+    }
+}
+
+void *Checkpoint::WriterThread(void *checkpoint)
+{
+#ifndef _WIN32
+    // Runs in the background so must not log - errors are reported by the
+    // main thread
+    Impl *impl = static_cast<Checkpoint *>(checkpoint)->m_impl;
+    pthread_mutex_lock(&impl->lock);
+    while (true)
+    {
+        while (impl->queue.empty() && !impl->stop)
+        {
+            pthread_cond_wait(&impl->wake, &impl->lock);
+        }
+        if (impl->queue.empty())
+            break;
+
+        Block block;
+        block.filename = impl->queue.front().filename;
+        block.append = impl->queue.front().append;
+        block.data.swap(impl->queue.front().data);
+        impl->queue.pop_front();
+        impl->busy = true;
+        pthread_mutex_unlock(&impl->lock);
+
+        string error = Write(block);
+
+        pthread_mutex_lock(&impl->lock);
+        impl->busy = false;
+        if (error != "")
+            impl->error = error;
+        pthread_cond_broadcast(&impl->idle);
+    }
+    pthread_mutex_unlock(&impl->lock);
+#endif
+    return NULL;
+}
+
+string Checkpoint::Write(const Block &block)
+{
+    BlockSize size = block.data.size();
+    if (block.append)
+    {
+        FILE *out = fopen(block.filename.c_str(), "ab");
+        if (!out)
+        {
+            return "Could not append to checkpoint " + block.filename;
+        }
+        fseek(out, 0, SEEK_END);
+        bool ok = (ftell(out) > 0)
+            || (fwrite(CHECKPOINT_MAGIC, 1, sizeof(CHECKPOINT_MAGIC), out)
+                   == sizeof(CHECKPOINT_MAGIC));
+        ok = ok && (fwrite(&size, sizeof(size), 1, out) == 1)
+            && (fwrite(block.data.data(), 1, block.data.size(), out) == block.data.size());
+        ok = (fclose(out) == 0) && ok;
+        return ok ? "" : "Failed to append to checkpoint " + block.filename;
+    }
+
+    string tmp = block.filename + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (!out)
+    {
+        return "Could not write checkpoint to " + tmp;
+    }
+    bool ok = (fwrite(CHECKPOINT_MAGIC, 1, sizeof(CHECKPOINT_MAGIC), out)
+                  == sizeof(CHECKPOINT_MAGIC))
+        && (fwrite(&size, sizeof(size), 1, out) == 1)
+        && (fwrite(block.data.data(), 1, block.data.size(), out) == block.data.size());
+    ok = (fclose(out) == 0) && ok;
+    if (!ok)
+    {
+        remove(tmp.c_str());
+        return "Failed to write checkpoint to " + tmp;
+    }
+
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows
+    remove(block.filename.c_str());
+#endif
+    if (rename(tmp.c_str(), block.filename.c_str()) != 0)
+    {
+        return "Could not replace checkpoint " + block.filename;
+    }
+    return "";
+}
+
+void Checkpoint::Load(const string &filename)
+{
+    Wait();
+    ifstream in(filename.c_str(), ios::in | ios::binary);
+    if (!in.good())
+    {
+        throw DataNotFound(filename, "Could not read checkpoint");
+    }
+    ostringstream contents;
+    contents << in.rdbuf();
+    string file = contents.str();
+    if (file.size() < sizeof(CHECKPOINT_MAGIC)
+        || memcmp(file.data(), CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+    {
+        throw FabberRunDataError("Not a checkpoint file: " + filename);
+    }
+
+    // Join the values of the blocks together, ignoring an incomplete block at
+    // the end left by an interrupted append
+    Clear();
+    size_t pos = sizeof(CHECKPOINT_MAGIC);
+    int nblocks = 0;
+    while (pos < file.size())
+    {
+        BlockSize size;
+        if (file.size() - pos < sizeof(size))
+            break;
+        memcpy(&size, file.data() + pos, sizeof(size));
+        pos += sizeof(size);
+        if (file.size() - pos < size)
+            break;
+        m_buf.append(file, pos, size);
+        pos += size;
+        nblocks++;
+    }
+    if (pos < file.size())
+    {
+        WARN_ONCE_TEXT("Checkpoint::Ignoring incomplete data at the end of " + filename);
+    }
+    LOG << "Checkpoint::Loaded " << m_buf.size() << " bytes in " << nblocks << " blocks from "
+        << filename << endl;
+}
+
+bool Checkpoint::AtEnd() const
+{
+    return m_pos >= m_buf.size();
+}
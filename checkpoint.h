@@ -0,0 +1,119 @@
+/*  checkpoint.h - Saving and restoring the state of a run
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#pragma once
+
+#include "dist_mvn.h"
+#include "easylog.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * Binary snapshot of the state of a run, so that it can be resumed
+ *
+ * Values are added to the checkpoint in order with the Put methods and
+ * read back in the same order with the Get methods after loading. The
+ * format is native binary, so a checkpoint can only be resumed on the
+ * same type of machine.
+ *
+ * A checkpoint file is a sequence of blocks. Save replaces the file with a
+ * single block and Append adds one to the end, so state which does not
+ * change once saved need only be written once. Loading reads the values
+ * from all the blocks in order.
+ *
+ * Files are written in a background thread, so the run continues while
+ * they are written. Save writes under a temporary name and renames the file
+ * when complete, so an interrupted write never replaces the previous
+ * checkpoint. An interrupted Append leaves an incomplete last block, which
+ * is ignored when loading.
+ */
+class Checkpoint : public Loggable
+{
+public:
+    Checkpoint();
+
+    /** Waits for any background writes to finish */
+    ~Checkpoint();
+
+    /** Remove all values, ready to build a new checkpoint */
+    void Clear();
+
+    void Put(int value);
+    void Put(double value);
+    void Put(const std::vector<double> &values);
+    void Put(const std::vector<int> &values);
+    void Put(const MVNDist &mvn);
+
+    /**
+     * Replace the file with the values added since the last save, in the
+     * background, and clear them
+     *
+     * Does not wait for earlier writes. Writes to the same file which have
+     * not yet started are dropped, since this replaces them. Failure to save
+     * is reported as a warning, since the run itself can continue.
+     */
+    void Save(const std::string &filename);
+
+    /**
+     * Add the values added since the last save to the end of the file, in
+     * the background, and clear them
+     */
+    void Append(const std::string &filename);
+
+    /**
+     * Wait for all background writes to finish
+     */
+    void Wait();
+
+    /**
+     * Load a checkpoint, ready to read values from the start
+     *
+     * @throw DataNotFound if the file cannot be read
+     * @throw FabberRunDataError if the file is not a checkpoint
+     */
+    void Load(const std::string &filename);
+
+    /** @return true if all the loaded values have been read */
+    bool AtEnd() const;
+
+    /** @throw FabberRunDataError if there are no more values */
+    int GetInt();
+    double GetDouble();
+    void Get(std::vector<double> &values);
+    void Get(std::vector<int> &values);
+    void Get(MVNDist &mvn);
+
+private:
+    void PutBytes(const void *data, size_t size);
+    void GetBytes(void *data, size_t size);
+    int GetSize(size_t item_size);
+
+    /** A block waiting to be written */
+    struct Block
+    {
+        std::string filename;
+        std::string data;
+        bool append;
+    };
+
+    /** Queue a block to be written in the background */
+    void Queue(const std::string &filename, bool append);
+
+    /** Write a block to file, returning an error message or empty */
+    static std::string Write(const Block &block);
+
+    /** Report a write error from the background thread, if any */
+    void ReportError();
+
+    static void *WriterThread(void *checkpoint);
+
+    std::string m_buf;
+    size_t m_pos;
+
+    struct Impl;
+    Impl *m_impl;
+};
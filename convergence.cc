@@ -11,8 +11,11 @@
 #include "easylog.h"
 #include "rundata.h"
 
+#include <math.h>
+
 #include <iostream>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -65,6 +68,19 @@ void CountingConvergenceDetector::Reset(double F)
     m_reason = "";
 }
 
+void CountingConvergenceDetector::GetState(vector<double> &state) const
+{
+    ConvergenceDetector::GetState(state);
+    state.push_back(m_its);
+}
+
+unsigned int CountingConvergenceDetector::SetState(const vector<double> &state)
+{
+    unsigned int n = ConvergenceDetector::SetState(state);
+    m_its = int(state.at(n));
+    return n + 1;
+}
+
 void FchangeConvergenceDetector::Initialize(FabberRunData &params)
 {
     CountingConvergenceDetector::Initialize(params);
@@ -108,6 +124,23 @@ void FchangeConvergenceDetector::Dump(ostream &out, const string &indent) const
     out << indent << "Previous Free Energy == " << m_prev_f << endl;
 }
 
+void FchangeConvergenceDetector::GetState(vector<double> &state) const
+{
+    CountingConvergenceDetector::GetState(state);
+    state.push_back(m_prev_f);
+    state.push_back(m_revert);
+    state.push_back(m_save);
+}
+
+unsigned int FchangeConvergenceDetector::SetState(const vector<double> &state)
+{
+    unsigned int n = CountingConvergenceDetector::SetState(state);
+    m_prev_f = state.at(n);
+    m_revert = (state.at(n + 1) != 0);
+    m_save = (state.at(n + 2) != 0);
+    return n + 3;
+}
+
 void FreduceConvergenceDetector::Initialize(FabberRunData &params)
 {
     FchangeConvergenceDetector::Initialize(params);
@@ -157,6 +190,7 @@ void TrialModeConvergenceDetector::Reset(double F)
     m_trials = 0;
     m_save = true; // FIXME why?
     m_trialmode = false;
+    m_num_reverts = 0;
 }
 
 bool TrialModeConvergenceDetector::Test(double F)
@@ -174,6 +208,7 @@ bool TrialModeConvergenceDetector::Test(double F)
             m_trials = 1;
             m_trialmode = true;
             m_revert = true;
+            ++m_num_reverts;
             m_save = false;
             return false;
         }
@@ -249,6 +284,23 @@ void TrialModeConvergenceDetector::Dump(ostream &out, const string &indent) cons
     out << indent << "Previous Free Energy == " << m_prev_f << endl;
 }
 
+void TrialModeConvergenceDetector::GetState(vector<double> &state) const
+{
+    FchangeConvergenceDetector::GetState(state);
+    state.push_back(m_trials);
+    state.push_back(m_trialmode);
+    state.push_back(m_num_reverts);
+}
+
+unsigned int TrialModeConvergenceDetector::SetState(const vector<double> &state)
+{
+    unsigned int n = FchangeConvergenceDetector::SetState(state);
+    m_trials = int(state.at(n));
+    m_trialmode = (state.at(n + 1) != 0);
+    m_num_reverts = int(state.at(n + 2));
+    return n + 3;
+}
+
 void LMConvergenceDetector::Initialize(FabberRunData &params)
 {
     ConvergenceDetector::Initialize(params);
@@ -273,6 +325,7 @@ void LMConvergenceDetector::Reset(double F)
     m_alpha = 0.0;
     m_alphamax = 1e6;
     m_LM = false;
+    m_num_reverts = 0;
 }
 
 bool LMConvergenceDetector::Test(double F)
@@ -299,6 +352,7 @@ bool LMConvergenceDetector::Test(double F)
         {
             m_LM = true;
             m_revert = true; // revert to the previous solution and try again with LM adjustment
+            ++m_num_reverts;
             m_alpha = m_alphastart;
             // cout << "Entering LM" << endl;
             return false;
@@ -371,6 +425,7 @@ bool LMConvergenceDetector::Test(double F)
         {
             m_alpha *= 10;
             m_revert = true; // revert to the previous solution and try again with new LM adjustment
+            ++m_num_reverts;
             // cout << "Increasing LM" << endl;
             return false;
         }
@@ -383,3 +438,203 @@ void LMConvergenceDetector::Dump(ostream &out, const string &indent) const
         << endl;
     out << indent << "Previous Free Energy == " << m_prev << endl;
 }
+
+void LMConvergenceDetector::GetState(vector<double> &state) const
+{
+    ConvergenceDetector::GetState(state);
+    state.push_back(m_its);
+    state.push_back(m_prev);
+    state.push_back(m_save);
+    state.push_back(m_revert);
+    state.push_back(m_LM);
+    state.push_back(m_num_reverts);
+    state.push_back(m_alpha);
+}
+
+unsigned int LMConvergenceDetector::SetState(const vector<double> &state)
+{
+    unsigned int n = ConvergenceDetector::SetState(state);
+    m_its = int(state.at(n));
+    m_prev = state.at(n + 1);
+    m_save = (state.at(n + 2) != 0);
+    m_revert = (state.at(n + 3) != 0);
+    m_LM = (state.at(n + 4) != 0);
+    m_num_reverts = int(state.at(n + 5));
+    m_alpha = state.at(n + 6);
+    return n + 7;
+}
+
+void AcceleratedConvergenceDetector::Initialize(FabberRunData &params)
+{
+    FchangeConvergenceDetector::Initialize(params);
+
+    string method = params.GetStringDefault("accel-method", "anderson");
+    if ((method != "anderson") && (method != "squarem"))
+        throw InvalidOptionValue("accel-method", method, "Must be anderson or squarem");
+    m_squarem = (method == "squarem");
+
+    m_depth = params.GetIntDefault("accel-depth", 3, 1);
+    Reset();
+}
+
+void AcceleratedConvergenceDetector::Reset(double F)
+{
+    FchangeConvergenceDetector::Reset(F);
+    m_best_f = F;
+    m_x.clear();
+    m_g.clear();
+    m_accepted = 0;
+    m_rejected = 0;
+}
+
+bool AcceleratedConvergenceDetector::Test(double F)
+{
+    // Keep the best solution, since an accepted extrapolation can be
+    // followed by an iteration which reduces F
+    m_save = (F >= m_best_f);
+    m_revert = !m_save;
+    if (m_save)
+        m_best_f = F;
+    return FchangeConvergenceDetector::Test(F);
+}
+
+bool AcceleratedConvergenceDetector::Extrapolate(
+    const NEWMAT::ColumnVector &before, const NEWMAT::ColumnVector &after,
+    NEWMAT::ColumnVector &proposal)
+{
+    m_x.push_back(before);
+    m_g.push_back(after);
+    if (int(m_x.size()) > m_depth + 1)
+    {
+        m_x.erase(m_x.begin());
+        m_g.erase(m_g.begin());
+    }
+
+    bool proposed = m_squarem ? SquaremProposal(proposal) : AndersonProposal(proposal);
+    if (proposed)
+    {
+        for (int i = 1; i <= proposal.Nrows(); i++)
+        {
+            if (!(fabs(proposal(i)) <= 1e300))
+                proposed = false;
+        }
+    }
+    if (m_squarem && m_x.size() >= 2)
+    {
+        // Each SQUAREM step uses two new iterations
+        m_x.clear();
+        m_g.clear();
+    }
+    return proposed;
+}
+
+bool AcceleratedConvergenceDetector::AndersonProposal(NEWMAT::ColumnVector &proposal) const
+{
+    // Minimise the norm of a combination of the residuals g - x of recent
+    // iterations, expressed in terms of differences between successive
+    // residuals, and apply the same combination to the outputs g
+    int k = m_x.size() - 1;
+    if (k < 1)
+        return false;
+
+    int n = m_x[0].Nrows();
+    NEWMAT::Matrix dF(n, k), dG(n, k);
+    NEWMAT::ColumnVector f_k = m_g[k] - m_x[k];
+    for (int j = 0; j < k; j++)
+    {
+        dF.Column(j + 1) = (m_g[j + 1] - m_x[j + 1]) - (m_g[j] - m_x[j]);
+        dG.Column(j + 1) = m_g[j + 1] - m_g[j];
+    }
+
+    NEWMAT::SymmetricMatrix normal;
+    normal << dF.t() * dF;
+    double trace = normal.Trace();
+    if (!(trace > 0))
+        return false;
+    for (int j = 1; j <= k; j++)
+    {
+        normal(j, j) += 1e-10 * trace / k;
+    }
+
+    try
+    {
+        NEWMAT::ColumnVector gamma = normal.i() * (dF.t() * f_k);
+        proposal = m_g[k] - dG * gamma;
+    }
+    catch (NEWMAT::Exception &e)
+    {
+        return false;
+    }
+    return true;
+}
+
+bool AcceleratedConvergenceDetector::SquaremProposal(NEWMAT::ColumnVector &proposal) const
+{
+    // Needs two successive iterations x0 -> x1 -> x2
+    if (m_x.size() < 2)
+        return false;
+
+    const NEWMAT::ColumnVector &x0 = m_x[m_x.size() - 2];
+    const NEWMAT::ColumnVector &x1 = m_g[m_g.size() - 2];
+    const NEWMAT::ColumnVector &x2 = m_g[m_g.size() - 1];
+    NEWMAT::ColumnVector r = x1 - x0;
+    NEWMAT::ColumnVector v = (x2 - x1) - r;
+    double v_norm = sqrt(v.SumSquare());
+    if (!(v_norm > 0))
+        return false;
+
+    // Step length as in the S3 scheme, never shorter than the plain iteration
+    double alpha = -sqrt(r.SumSquare()) / v_norm;
+    if (alpha > -1)
+        alpha = -1;
+    proposal = x0 - 2 * alpha * r + alpha * alpha * v;
+    return true;
+}
+
+void AcceleratedConvergenceDetector::ExtrapolationResult(bool accepted, double F)
+{
+    if (accepted)
+    {
+        ++m_accepted;
+        m_prev_f = F;
+        if (F >= m_best_f)
+        {
+            m_best_f = F;
+            m_save = true;
+            m_revert = false;
+        }
+    }
+    else
+    {
+        // History is no longer a good guide, so start again
+        ++m_rejected;
+        m_x.clear();
+        m_g.clear();
+    }
+}
+
+void AcceleratedConvergenceDetector::Dump(ostream &out, const string &indent) const
+{
+    FchangeConvergenceDetector::Dump(out, indent);
+    out << indent << (m_squarem ? "SQUAREM" : "Anderson") << " extrapolations accepted "
+        << m_accepted << ", rejected " << m_rejected << endl;
+}
+
+void AcceleratedConvergenceDetector::GetState(vector<double> &state) const
+{
+    FchangeConvergenceDetector::GetState(state);
+    state.push_back(m_best_f);
+    state.push_back(m_accepted);
+    state.push_back(m_rejected);
+}
+
+unsigned int AcceleratedConvergenceDetector::SetState(const vector<double> &state)
+{
+    unsigned int n = FchangeConvergenceDetector::SetState(state);
+    m_best_f = state.at(n);
+    m_accepted = int(state.at(n + 1));
+    m_rejected = int(state.at(n + 2));
+    m_x.clear();
+    m_g.clear();
+    return n + 3;
+}
@@ -11,8 +11,11 @@
 #include "factories.h"
 #include "rundata.h"
 
+#include "newmat.h"
+
 #include <ostream>
 #include <string>
+#include <vector>
 
 /**
  * Abstract base class for method of testing whether the free energy maximisation algorithm has
@@ -76,6 +79,41 @@ public:
     {
         return 0.0;
     }
+    /**
+     * Number of times since the last Reset that the detector has backed off
+     * from a decrease in F, e.g. by entering trial mode or increasing the LM
+     * adjustment. Used for diagnostics - detectors which never do this return zero
+     */
+    virtual int NumReverts() const
+    {
+        return 0;
+    }
+    /**
+     * Propose an extrapolated set of parameters to accelerate convergence
+     *
+     * Called after each iteration which has not converged. If a proposal is
+     * made, the caller should move to it only if it increases the free
+     * energy, and must report the outcome with ExtrapolationResult.
+     *
+     * @param before Parameters before the iteration
+     * @param after Parameters after the iteration
+     * @param proposal Returns the proposed parameters
+     * @return true if a proposal was made. The default never proposes
+     */
+    virtual bool Extrapolate(const NEWMAT::ColumnVector &before,
+        const NEWMAT::ColumnVector &after, NEWMAT::ColumnVector &proposal)
+    {
+        return false;
+    }
+    /**
+     * Report whether the last proposal from Extrapolate was accepted
+     *
+     * @param F Free energy at the current parameters, i.e. at the proposal if
+     *          it was accepted
+     */
+    virtual void ExtrapolationResult(bool accepted, double F)
+    {
+    }
     /**
      * Reason convergence reached
      *
@@ -91,6 +129,26 @@ public:
      */
     virtual void Dump(std::ostream &out, const std::string &indent = "") const = 0;
 
+    /**
+     * Get the current state for a checkpoint, as a list of numbers
+     *
+     * Subclasses which add state should append it to their superclass's
+     */
+    virtual void GetState(std::vector<double> &state) const
+    {
+        state.clear();
+    }
+
+    /**
+     * Restore the state saved by GetState
+     *
+     * @return Number of values used. Subclasses should start reading from here
+     */
+    virtual unsigned int SetState(const std::vector<double> &state)
+    {
+        return 0;
+    }
+
 protected:
     std::string m_reason;
 };
@@ -116,6 +174,8 @@ public:
     virtual void Reset(double F = -99e99);
 
     virtual void Dump(std::ostream &out, const std::string &indent = "") const;
+    virtual void GetState(std::vector<double> &state) const;
+    virtual unsigned int SetState(const std::vector<double> &state);
 
 protected:
     int m_its;
@@ -164,6 +224,8 @@ public:
         return m_revert;
     }
     virtual void Dump(std::ostream &out, const std::string &indent = "") const;
+    virtual void GetState(std::vector<double> &state) const;
+    virtual unsigned int SetState(const std::vector<double> &state);
 
 protected:
     double m_prev_f;
@@ -230,12 +292,19 @@ public:
     {
         return m_save;
     }
+    virtual int NumReverts() const
+    {
+        return m_num_reverts;
+    }
     virtual void Dump(std::ostream &out, const std::string &indent = "") const;
+    virtual void GetState(std::vector<double> &state) const;
+    virtual unsigned int SetState(const std::vector<double> &state);
 
 protected:
     int m_trials;
     int m_max_trials;
     bool m_trialmode;
+    int m_num_reverts;
 };
 
 /**
@@ -291,6 +360,12 @@ public:
     {
         return m_alpha;
     }
+    int NumReverts() const
+    {
+        return m_num_reverts;
+    }
+    virtual void GetState(std::vector<double> &state) const;
+    virtual unsigned int SetState(const std::vector<double> &state);
 
 private:
     int m_its;
@@ -300,12 +375,75 @@ private:
     bool m_save;
     bool m_revert;
     bool m_LM;
+    int m_num_reverts;
 
     double m_alpha;
     double m_alphastart;
     double m_alphamax;
 };
 
+/**
+ * Convergence detector which accelerates the VB iterations
+ *
+ * Convergence is detected as for FchangeConvergenceDetector. In addition,
+ * VB is treated as a fixed-point iteration on the parameter means, and the
+ * means before and after recent iterations are used to propose an
+ * extrapolated step, either by Anderson mixing (accel-method=anderson) or
+ * by SQUAREM (accel-method=squarem). Proposals which do not increase the
+ * free energy are rejected, which resets the history. The best solution so
+ * far is saved and reverted to at the end if the final iteration reduced F.
+ */
+class AcceleratedConvergenceDetector : public FchangeConvergenceDetector
+{
+public:
+    static ConvergenceDetector *NewInstance()
+    {
+        return new AcceleratedConvergenceDetector();
+    }
+    virtual void Initialize(FabberRunData &params);
+
+    virtual bool Test(double F);
+
+    virtual void Reset(double F = -99e99);
+
+    virtual bool Extrapolate(const NEWMAT::ColumnVector &before,
+        const NEWMAT::ColumnVector &after, NEWMAT::ColumnVector &proposal);
+    virtual void ExtrapolationResult(bool accepted, double F);
+
+    /**
+     * @return Number of rejected proposals
+     */
+    virtual int NumReverts() const
+    {
+        return m_rejected;
+    }
+    virtual void Dump(std::ostream &out, const std::string &indent = "") const;
+
+    /**
+     * The history of iterates is not saved, so acceleration restarts when a
+     * checkpoint is resumed
+     */
+    virtual void GetState(std::vector<double> &state) const;
+    virtual unsigned int SetState(const std::vector<double> &state);
+
+protected:
+    bool AndersonProposal(NEWMAT::ColumnVector &proposal) const;
+    bool SquaremProposal(NEWMAT::ColumnVector &proposal) const;
+
+    bool m_squarem;
+
+    /** Number of previous iterations used by Anderson mixing */
+    int m_depth;
+
+    /** Parameters before and after recent iterations, oldest first */
+    std::vector<NEWMAT::ColumnVector> m_x;
+    std::vector<NEWMAT::ColumnVector> m_g;
+
+    double m_best_f;
+    int m_accepted;
+    int m_rejected;
+};
+
 inline std::ostream &operator<<(std::ostream &out, const ConvergenceDetector &conv)
 {
     conv.Dump(out);
@@ -1,20 +1,26 @@
 #include "covariance_cache.h"
 
 #include "easylog.h"
+#include "perf.h"
 #include "rundata.h"
 
 #include <newmat.h>
 
+#include <algorithm>
 #include <map>
 #include <math.h>
 #include <string>
-#include <utility>
+#include <vector>
 
 using namespace std;
 using namespace NEWMAT;
 
-// Caching is disabled currently
-#define NOCACHE 1
+// Maximum iterations and relative residual for conjugate gradient solves
+static const int CG_MAX_ITERATIONS = 1000;
+static const double CG_TOLERANCE = 1e-8;
+
+// Ranges of voxels in the k-d tree smaller than this are searched linearly
+static const int KD_LEAF_SIZE = 8;
 
 // Euclidian distance
 static double dist_euclid(double dx, double dy, double dz)
@@ -34,114 +40,345 @@ static double dist_sqeuclid(double dx, double dy, double dz)
 }
 
 /**
- * Calculate a distance matrix
- *
- * FIXME voxelCoords should really be in MM, not indices; only really matters
- * if it's aniostropic or you're using the smoothness values directly.
+ * Wendland's compactly supported covariance function, positive definite
+ * in up to 3 dimensions for Euclidian distance
  *
- * @param voxelCoords List of voxel co-ordinates as a matrix: column = voxel
- * @param distanceMeasure How to measure distance:
- *   dist1 = Euclidian distance,
- *   dist2 = squared Euclidian distance,
- *   mdist = Manhattan distance (|dx| + |dy|)
+ * @param r Distance relative to the support radius
  */
+static double wendland(double r)
+{
+    if (r >= 1)
+        return 0;
+    double s = 1 - r;
+    return s * s * s * s * (4 * r + 1);
+}
+
+static double dot(const vector<double> &a, const vector<double> &b)
+{
+    double sum = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+namespace
+{
+/** Orders voxel indices by one co-ordinate */
+class CoordLess
+{
+public:
+    CoordLess(const vector<double> &coords, int axis)
+        : m_coords(coords)
+        , m_axis(axis)
+    {
+    }
+    bool operator()(int v1, int v2) const
+    {
+        return m_coords[3 * v1 + m_axis] < m_coords[3 * v2 + m_axis];
+    }
+
+private:
+    const vector<double> &m_coords;
+    int m_axis;
+};
+}
+
+CovarianceCache::CovarianceCache(int max_cached)
+    : m_nvoxels(0)
+    , m_max_cached(max_cached)
+    , m_use_count(0)
+{
+}
+
 void CovarianceCache::CalcDistances(
     const NEWMAT::Matrix &voxelCoords, const string &distanceMeasure)
 {
-    const int nVoxels = voxelCoords.Ncols();
-
-    // Create 3 column vectors, one to hold X co-ordinates, one Y and one Z
-    ColumnVector positions[3];
-    positions[0] = voxelCoords.Row(1).t();
-    positions[1] = voxelCoords.Row(2).t();
-    positions[2] = voxelCoords.Row(3).t();
+    if (distanceMeasure != "dist1" && distanceMeasure != "dist2" && distanceMeasure != "mdist")
+        throw InvalidOptionValue(
+            "distance-measure", distanceMeasure, "Unrecognized distance measure");
+
+    m_distance_measure = distanceMeasure;
+    m_nvoxels = voxelCoords.Ncols();
+    m_coords.resize(3 * m_nvoxels);
+    m_tree.resize(m_nvoxels);
+    for (int v = 0; v < m_nvoxels; v++)
+    {
+        // dimSize is already included in voxelCoords
+        // FIXME not obvious that it is, if not this should
+        // be the dimensions of a voxel in mm
+        for (int dim = 0; dim < 3; dim++)
+            m_coords[3 * v + dim] = voxelCoords(dim + 1, v + 1);
+        m_tree[v] = v;
+    }
+    BuildTree(0, m_nvoxels, 0);
+    m_cinv_cache.clear();
+}
 
-    // dimSize is already included in voxelCoords
-    // FIXME not obvious that it is, if not this should
-    // be the dimensions of a voxel in mm
-    const double dimSize[3] = { 1.0, 1.0, 1.0 };
+void CovarianceCache::BuildTree(int start, int end, int depth)
+{
+    if (end - start <= KD_LEAF_SIZE)
+        return;
+
+    int mid = (start + end) / 2;
+    nth_element(m_tree.begin() + start, m_tree.begin() + mid, m_tree.begin() + end,
+        CoordLess(m_coords, depth % 3));
+    BuildTree(start, mid, depth + 1);
+    BuildTree(mid + 1, end, depth + 1);
+}
 
-    if (nVoxels > 7500)
+void CovarianceCache::FindInRadius(
+    int v, double radius, int start, int end, int depth, vector<int> &found) const
+{
+    if (end - start <= KD_LEAF_SIZE)
     {
-        LOG << "SpatialVariationalBayes::CalcDistances Over "
-            << int(2.5 * nVoxels * nVoxels * 8 / 1e9)
-            << " GB of memory will be used just to calculate "
-            << "the distance matrix.  Hope you're not trying to invert this "
-               "sucker!\n"
-            << endl;
+        for (int i = start; i < end; i++)
+        {
+            int v2 = m_tree[i];
+            double dx = m_coords[3 * v] - m_coords[3 * v2];
+            double dy = m_coords[3 * v + 1] - m_coords[3 * v2 + 1];
+            double dz = m_coords[3 * v + 2] - m_coords[3 * v2 + 2];
+            if (dist_euclid(dx, dy, dz) <= radius)
+                found.push_back(v2);
+        }
+        return;
     }
 
-    // 3 NxN symmetric matrices where N is the number of voxels
-    // Each entry gives the absolute difference between
-    // X/Y/Z co-ordinates respectively (FIXME in millimetres
-    // supposedly but perhaps not given comments above)
-    SymmetricMatrix relativePos[3];
+    int mid = (start + end) / 2;
+    int axis = depth % 3;
+    int split = m_tree[mid];
+    double diff = m_coords[3 * v + axis] - m_coords[3 * split + axis];
+    double dx = m_coords[3 * v] - m_coords[3 * split];
+    double dy = m_coords[3 * v + 1] - m_coords[3 * split + 1];
+    double dz = m_coords[3 * v + 2] - m_coords[3 * split + 2];
+    if (dist_euclid(dx, dy, dz) <= radius)
+        found.push_back(split);
+    if (diff - radius <= 0)
+        FindInRadius(v, radius, start, mid, depth + 1, found);
+    if (diff + radius >= 0)
+        FindInRadius(v, radius, mid + 1, end, depth + 1, found);
+}
 
-    // Column vector with one entry per voxel, all set to 1 initially
-    ColumnVector allOnes(nVoxels);
-    allOnes = 1.0;
+double CovarianceCache::Distance(int v1, int v2) const
+{
+    double dx = m_coords[3 * v1] - m_coords[3 * v2];
+    double dy = m_coords[3 * v1 + 1] - m_coords[3 * v2 + 1];
+    double dz = m_coords[3 * v1 + 2] - m_coords[3 * v2 + 2];
+    if (m_distance_measure == "dist2")
+        return dist_sqeuclid(dx, dy, dz);
+    else if (m_distance_measure == "mdist")
+        return dist_manh(dx, dy, dz);
+    else
+        return dist_euclid(dx, dy, dz);
+}
 
-    // FIXME do not understand why this works!
-    for (int dim = 0; dim < 3; dim++)
+void CovarianceCache::CalcC(double delta, SparseCovariance &C) const
+{
+    fabber::ScopedTimer timer("CovarianceCache.CalcC");
+
+    // Euclidian radius which includes every voxel within delta by the
+    // chosen measure. Manhattan distance is never less than Euclidian
+    double radius = delta;
+    if (m_distance_measure == "dist2")
+        radius = max(delta, pow(delta, 1 / 1.99));
+
+    C.row_start.resize(m_nvoxels + 1);
+    C.cols.clear();
+    C.vals.clear();
+    vector<int> found;
+    for (int v = 0; v < m_nvoxels; v++)
     {
-        Matrix rel = dimSize[dim] * (positions[dim] * allOnes.t() - allOnes * positions[dim].t());
-        assert(rel == -rel.t());
-        assert(rel.Nrows() == nVoxels);
-        // Down-convert to symmetric matrix (lower triangle so all positive?)
-        relativePos[dim] << rel;
+        C.row_start[v] = C.cols.size();
+        found.clear();
+        FindInRadius(v, radius, 0, m_nvoxels, 0, found);
+        for (size_t i = 0; i < found.size(); i++)
+        {
+            double c = wendland(Distance(v, found[i]) / delta);
+            if (c > 0)
+            {
+                C.cols.push_back(found[i]);
+                C.vals.push_back(c);
+            }
+        }
     }
+    C.row_start[m_nvoxels] = C.cols.size();
+    C.cinv_diag.clear();
 
-    // Distances is an NxN symmetric matrix where N is number of voxels
-    m_distances.ReSize(nVoxels);
+    LOG_VERBOSE << "CovarianceCache::CalcC delta=" << delta << ": " << C.cols.size()
+                << " non-zero entries" << endl;
+}
 
-    // Clunky but only run once so performance probably not significant
-    for (int a = 1; a <= nVoxels; a++)
+CovarianceCache::SparseCovariance &CovarianceCache::GetC(double delta) const
+{
+    Cinv_cache_type::iterator it = m_cinv_cache.find(delta);
+    if (it == m_cinv_cache.end())
     {
-        for (int b = 1; b <= a; b++)
+        // Make room by discarding the least recently used matrix
+        while (int(m_cinv_cache.size()) >= m_max_cached && !m_cinv_cache.empty())
         {
-            if (distanceMeasure == "dist1")
-                m_distances(a, b)
-                    = dist_euclid(relativePos[0](a, b), relativePos[1](a, b), relativePos[2](a, b));
-            else if (distanceMeasure == "dist2")
-                m_distances(a, b) = dist_sqeuclid(
-                    relativePos[0](a, b), relativePos[1](a, b), relativePos[2](a, b));
-            else if (distanceMeasure == "mdist")
-                m_distances(a, b)
-                    = dist_manh(relativePos[0](a, b), relativePos[1](a, b), relativePos[2](a, b));
-            else
-                throw InvalidOptionValue(
-                    "distance-measure", distanceMeasure, "Unrecognized distance measure");
+            Cinv_cache_type::iterator lru = m_cinv_cache.begin();
+            for (Cinv_cache_type::iterator c = m_cinv_cache.begin(); c != m_cinv_cache.end(); ++c)
+            {
+                if (c->second.last_used < lru->second.last_used)
+                    lru = c;
+            }
+            m_cinv_cache.erase(lru);
         }
+        it = m_cinv_cache.insert(make_pair(delta, SparseCovariance())).first;
+        CalcC(delta, it->second);
     }
+    it->second.last_used = ++m_use_count;
+    return it->second;
 }
 
-const NEWMAT::SymmetricMatrix &CovarianceCache::GetDistances() const
+long CovarianceCache::GetNumNonZero(double delta) const
 {
-    return m_distances;
+    return GetC(delta).cols.size();
 }
-const ReturnMatrix CovarianceCache::GetC(double delta) const
+
+void CovarianceCache::Multiply(double delta, const vector<double> &x, vector<double> &y) const
 {
-    const int Nvoxels = m_distances.Nrows();
+    const SparseCovariance &C = GetC(delta);
+    y.resize(m_nvoxels);
+    for (int v = 0; v < m_nvoxels; v++)
+    {
+        double sum = 0;
+        for (long i = C.row_start[v]; i < C.row_start[v + 1]; i++)
+            sum += C.vals[i] * x[C.cols[i]];
+        y[v] = sum;
+    }
+}
 
-    SymmetricMatrix C(Nvoxels);
-    if (delta == 0)
+void CovarianceCache::Precondition(
+    const SparseCovariance &C, const vector<double> &r, vector<double> &z) const
+{
+    // Symmetric Gauss-Seidel: M = (I + L)(I + U) where C = I + L + U, since the
+    // diagonal of C is 1. M is positive definite whenever C is, so it can be
+    // used with conjugate gradients. Applying it costs about one multiplication
+    z.resize(m_nvoxels);
+    for (int v = 0; v < m_nvoxels; v++)
     {
-        C = IdentityMatrix(Nvoxels);
+        double sum = r[v];
+        for (long i = C.row_start[v]; i < C.row_start[v + 1]; i++)
+        {
+            if (C.cols[i] < v)
+                sum -= C.vals[i] * z[C.cols[i]];
+        }
+        z[v] = sum;
     }
-    else
+    for (int v = m_nvoxels - 1; v >= 0; v--)
     {
-        for (int a = 1; a <= Nvoxels; a++)
-            for (int b = 1; b <= a; b++)
-                C(a, b) = exp(-0.5 * m_distances(a, b) / delta);
+        double sum = z[v];
+        for (long i = C.row_start[v]; i < C.row_start[v + 1]; i++)
+        {
+            if (C.cols[i] > v)
+                sum -= C.vals[i] * z[C.cols[i]];
+        }
+        z[v] = sum;
     }
+}
 
-    // NOTE: when m_distances = squared distance, prior is equivalent to white
-    // noise smoothed with a Gaussian with sigma^2 = 2*delta (haven't actually
-    // double-checked this yet).
-    // BEWARE: delta is measured in millimeters!! (based on NIFTI file info).
+int CovarianceCache::Solve(double delta, const vector<double> &b, vector<double> &x) const
+{
+    // Preconditioned conjugate gradients. The diagonal of C is 1 so Jacobi
+    // preconditioning would have no effect
+    const SparseCovariance &C = GetC(delta);
+    double bnorm = sqrt(dot(b, b));
+    if (int(x.size()) != m_nvoxels || bnorm == 0)
+        x.assign(m_nvoxels, 0);
+
+    vector<double> r(m_nvoxels), z, p, Ap(m_nvoxels);
+    Multiply(delta, x, Ap);
+    for (int v = 0; v < m_nvoxels; v++)
+        r[v] = b[v] - Ap[v];
+    Precondition(C, r, z);
+    p = z;
+
+    double rz = dot(r, z);
+    double rr = dot(r, r);
+    int it = 0;
+    while (sqrt(rr) > CG_TOLERANCE * bnorm && it < CG_MAX_ITERATIONS)
+    {
+        Multiply(delta, p, Ap);
+        double pAp = dot(p, Ap);
+        if (pAp <= 0)
+        {
+            throw FabberRunDataError("Spatial covariance matrix is not positive definite for "
+                                     "distance measure "
+                + m_distance_measure + " - try --distance-measure=dist1");
+        }
+        double alpha = rz / pAp;
+        for (int v = 0; v < m_nvoxels; v++)
+        {
+            x[v] += alpha * p[v];
+            r[v] -= alpha * Ap[v];
+        }
+        Precondition(C, r, z);
+        double rz_new = dot(r, z);
+        for (int v = 0; v < m_nvoxels; v++)
+            p[v] = z[v] + (rz_new / rz) * p[v];
+        rz = rz_new;
+        rr = dot(r, r);
+        it++;
+    }
 
-    C.Release();
-    return C;
+    if (it == CG_MAX_ITERATIONS)
+        WARN_ONCE("CovarianceCache::Solve Conjugate gradient did not converge");
+    fabber::PerfCount("CovarianceCache.CGIterations", it);
+    return it;
+}
+
+const vector<double> &CovarianceCache::GetCinvDiagonal(double delta) const
+{
+    SparseCovariance &C = GetC(delta);
+    if (!C.cinv_diag.empty() || m_nvoxels == 0)
+        return C.cinv_diag;
+
+    fabber::ScopedTimer timer("CovarianceCache.CinvDiagonal");
+
+    // Greedy colouring so that voxels of the same colour are not neighbours in C
+    vector<int> colour(m_nvoxels, -1);
+    int num_colours = 0;
+    vector<int> used;
+    for (int v = 0; v < m_nvoxels; v++)
+    {
+        used.assign(num_colours + 1, 0);
+        for (long i = C.row_start[v]; i < C.row_start[v + 1]; i++)
+        {
+            int c = colour[C.cols[i]];
+            if (c >= 0)
+                used[c] = 1;
+        }
+        int c = 0;
+        while (used[c])
+            c++;
+        colour[v] = c;
+        num_colours = max(num_colours, c + 1);
+    }
+
+    // Solve C x = sum of unit vectors for each colour. x then contains the
+    // diagonal of C^-1 for voxels of that colour, plus the entries of C^-1
+    // linking them to other voxels of the same colour which are small
+    C.cinv_diag.assign(m_nvoxels, 0);
+    vector<double> b(m_nvoxels), x;
+    for (int c = 0; c < num_colours; c++)
+    {
+        for (int v = 0; v < m_nvoxels; v++)
+            b[v] = (colour[v] == c) ? 1 : 0;
+        x.clear();
+        Solve(delta, b, x);
+        for (int v = 0; v < m_nvoxels; v++)
+        {
+            // For a positive definite matrix (A^-1)_vv >= 1 / A_vv, so with a
+            // unit diagonal the true value is at least 1. Entries of C^-1 between
+            // voxels of the same colour can be negative, so the estimate may not be
+            if (colour[v] == c)
+                C.cinv_diag[v] = max(x[v], 1.0);
+        }
+    }
+
+    LOG_VERBOSE << "CovarianceCache::GetCinvDiagonal delta=" << delta << ": " << num_colours
+                << " colours" << endl;
+    return C.cinv_diag;
 }
 
 bool CovarianceCache::GetCachedInRange(
@@ -185,64 +422,3 @@ bool CovarianceCache::GetCachedInRange(
 
     return true;
 }
-
-const SymmetricMatrix &CovarianceCache::GetCinv(double delta) const
-{
-#ifdef NOCACHE
-    WARN_ONCE("CovarianceCache::GetCinv Cache is disabled to avoid memory problems!");
-    m_cinv = GetC(delta);
-
-    // Appears to be memory bug when inverting a 0x0 matrix
-    if (m_cinv.Nrows() > 0)
-    {
-        m_cinv = m_cinv.i();
-    }
-
-    return m_cinv;
-#else
-    if (m_cinv_cache[delta].Nrows() == 0)
-    {
-        m_cinv_cache[delta] = GetC(delta).i();
-    }
-
-    return m_cinv_cache[delta];
-#endif
-}
-
-const SymmetricMatrix &CovarianceCache::GetCiCodistCi(double delta, double *CiCodistTrace) const
-{
-    if (CiCodistCi_cache[delta].first.Nrows() == 0)
-    {
-#ifdef NOCACHE
-        CiCodistCi_cache.clear();
-#endif
-        GetCinv(delta); // for sensible messages, make sure cache hits
-
-        Matrix CiCodist = GetCinv(delta) * SP(GetC(delta), m_distances);
-        CiCodistCi_cache[delta].second = CiCodist.Trace();
-        Matrix CiCodistCi_tmp = CiCodist * GetCinv(delta);
-        CiCodistCi_cache[delta].first << CiCodistCi_tmp; // Force symmetric
-
-        { // check something
-            double maxAbsErr
-                = (CiCodistCi_cache[delta].first - CiCodistCi_tmp).MaximumAbsoluteValue();
-            if (maxAbsErr > CiCodistCi_tmp.MaximumAbsoluteValue() * 1e-5)
-            // If that test fails, you're probably in trouble.
-            // Reducing it to e.g. 1e-5 (to make dist2 work)
-            //   => non-finite alpha in iteration 2
-            // Reduced it to 1e-5 to get mdist to work....
-            //   => same result.  (oops, was mdist2)
-            // Reduced it to 1e-5 to get mdist to work, again...
-            //   =>
-            {
-                LOG << "CovarianceCache::GetCiCodistCi matrix not symmetric!\nError = " << maxAbsErr
-                    << ", maxabsvalue = " << CiCodistCi_tmp.MaximumAbsoluteValue() << endl;
-                assert(false);
-            }
-        }
-    }
-
-    if (CiCodistTrace != NULL)
-        (*CiCodistTrace) = CiCodistCi_cache[delta].second;
-    return CiCodistCi_cache[delta].first;
-}
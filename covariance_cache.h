@@ -13,16 +13,84 @@
 
 #include <map>
 #include <string>
-#include <utility>
+#include <vector>
 
+/**
+ * Sparse spatial covariance matrices for distance-based priors
+ *
+ * The covariance between two voxels is a compactly supported function of
+ * the distance between them, which is zero beyond a support radius delta.
+ * The matrix C(delta) therefore only has entries for pairs of voxels closer
+ * than delta, which are found using a k-d tree of the voxel co-ordinates,
+ * and is stored in compressed row form. Systems C(delta) x = b are solved
+ * by conjugate gradients with a symmetric Gauss-Seidel preconditioner.
+ *
+ * Matrices are kept for the most recently used values of delta, up to a
+ * fixed number, since the smoothness search revisits the same values.
+ */
 class CovarianceCache : public Loggable
 {
 public:
+    /**
+     * @param max_cached Maximum number of values of delta to keep matrices for
+     */
+    explicit CovarianceCache(int max_cached = 4);
+
+    /**
+     * Set the voxel co-ordinates and how to measure distance between them
+     *
+     * FIXME voxelCoords should really be in MM, not indices; only really matters
+     * if it's aniostropic or you're using the smoothness values directly.
+     *
+     * @param voxelCoords List of voxel co-ordinates as a matrix: column = voxel
+     * @param distanceMeasure How to measure distance:
+     *   dist1 = Euclidian distance,
+     *   dist2 = squared Euclidian distance,
+     *   mdist = Manhattan distance (|dx| + |dy|)
+     */
     void CalcDistances(const NEWMAT::Matrix &voxelCoords, const std::string &distanceMeasure);
-    const NEWMAT::SymmetricMatrix &GetDistances() const;
-    const NEWMAT::ReturnMatrix GetC(double delta) const; // quick to calculate
-    const NEWMAT::SymmetricMatrix &GetCinv(double delta) const;
-    const NEWMAT::SymmetricMatrix &GetCiCodistCi(double delta, double *CiCodistTrace = NULL) const;
+
+    /**
+     * @return Number of voxels
+     */
+    int GetNumVoxels() const
+    {
+        return m_nvoxels;
+    }
+
+    /**
+     * @return Number of non-zero entries in C(delta)
+     */
+    long GetNumNonZero(double delta) const;
+
+    /**
+     * Calculate y = C(delta) x
+     */
+    void Multiply(double delta, const std::vector<double> &x, std::vector<double> &y) const;
+
+    /**
+     * Solve C(delta) x = b
+     *
+     * @param x On entry, the starting guess which may be empty to start from zero.
+     *          On exit, the solution
+     * @return Number of iterations required
+     */
+    int Solve(double delta, const std::vector<double> &b, std::vector<double> &x) const;
+
+    /**
+     * Get the diagonal of C(delta)^-1
+     *
+     * This is estimated by probing with one solve for each colour of a
+     * colouring of voxels in which no two voxels of the same colour are
+     * closer than delta. It is exact when C^-1 has no entries between
+     * voxels of the same colour, and otherwise includes their contribution.
+     * On a regular grid this is within 1% for delta up to 1.5 voxels, but
+     * can be out by up to about 25% for larger delta, when voxels just
+     * further apart than delta share a colour. The result is calculated
+     * once for each cached value of delta. The returned reference remains
+     * valid until the next call with a different delta.
+     */
+    const std::vector<double> &GetCinvDiagonal(double delta) const;
 
     /**
      * If there's a cached value in (lower, upper), set *guess = value and
@@ -32,11 +100,51 @@ public:
         double *guess, double lower, double upper, bool allowEndpoints = false) const;
 
 private:
-    typedef std::map<double, NEWMAT::SymmetricMatrix> Cinv_cache_type;
-    typedef std::map<double, std::pair<NEWMAT::SymmetricMatrix, double> > CiCodistCi_cache_type;
+    /**
+     * C(delta) in compressed row form, with the diagonal of its inverse
+     * once it has been calculated
+     */
+    struct SparseCovariance
+    {
+        SparseCovariance()
+            : last_used(0)
+        {
+        }
+        std::vector<long> row_start;
+        std::vector<int> cols;
+        std::vector<double> vals;
+        std::vector<double> cinv_diag;
+        long last_used;
+    };
+    typedef std::map<double, SparseCovariance> Cinv_cache_type;
+
+    /** Get C(delta), calculating it and evicting the least recently used if required */
+    SparseCovariance &GetC(double delta) const;
+
+    /** Calculate C(delta) */
+    void CalcC(double delta, SparseCovariance &C) const;
+
+    /** Apply the conjugate gradient preconditioner for C: z = M^-1 r */
+    void Precondition(
+        const SparseCovariance &C, const std::vector<double> &r, std::vector<double> &z) const;
+
+    /** Distance between two voxels, indexed from 0 */
+    double Distance(int v1, int v2) const;
+
+    /** Build the k-d tree for voxels m_tree[start..end) */
+    void BuildTree(int start, int end, int depth);
+
+    /** Find voxels within Euclidian distance radius of voxel v in m_tree[start..end) */
+    void FindInRadius(
+        int v, double radius, int start, int end, int depth, std::vector<int> &found) const;
 
-    NEWMAT::SymmetricMatrix m_distances;
+    int m_nvoxels;
+    std::string m_distance_measure;
+    /** Co-ordinates of voxel v are m_coords[3*v..3*v+2] */
+    std::vector<double> m_coords;
+    /** Voxel indices ordered as a k-d tree, median of each range is the split point */
+    std::vector<int> m_tree;
+    int m_max_cached;
+    mutable long m_use_count;
     mutable Cinv_cache_type m_cinv_cache;
-    mutable NEWMAT::SymmetricMatrix m_cinv;
-    mutable CiCodistCi_cache_type CiCodistCi_cache;
 };
@@ -0,0 +1,354 @@
+/*  data_cache.cc - On-disk cache of preprocessed voxel data
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "data_cache.h"
+
+#include "easylog.h"
+#include "rundata.h"
+#include "tools.h"
+
+#include <newmat.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include "direct.h"
+#include <process.h>
+#include <windows.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+using NEWMAT::Matrix;
+using NEWMAT::Real;
+
+namespace
+{
+const char CACHE_MAGIC[8] = { 'F', 'A', 'B', 'D', 'A', 'T', 'A', '2' };
+
+// Header flag set when the entry contains neighbour lists
+const uint32_t CACHE_HAVE_NEIGHBOURS = 1;
+
+// FNV-1a 64 bit hash
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+struct CacheHeader
+{
+    char magic[8];
+    uint64_t key;
+    uint32_t nvoxels;
+    uint32_t ntimes;
+    uint32_t nsupp;
+    uint32_t nneighbours;
+    uint32_t nneighbours2;
+    uint32_t flags;
+};
+
+bool FileExists(const string &filename)
+{
+    struct stat s;
+    return stat(filename.c_str(), &s) == 0;
+}
+
+// Name of a new temporary file alongside filename, unique to this call even
+// when other threads or processes are saving the same cache entry. Returns
+// an empty string if the file could not be created
+string CreateTempFile(const string &filename)
+{
+#ifdef _WIN32
+    static volatile LONG counter = 0;
+    stringstream name;
+    name << filename << ".tmp" << getpid() << "_" << InterlockedIncrement(&counter);
+    return name.str();
+#else
+    string pattern = filename + ".tmpXXXXXX";
+    vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    int fd = mkstemp(&name[0]);
+    if (fd < 0)
+        return "";
+    close(fd);
+    return string(&name[0]);
+#endif
+}
+
+void WriteMatrix(ofstream &out, const Matrix &mat)
+{
+    // The file is in row order whatever the layout of the matrix library
+    fabber::MatrixLayout layout(mat);
+    vector<float> buf(size_t(mat.Nrows()) * mat.Ncols());
+    const Real *src = mat.Store();
+    size_t i = 0;
+    for (int r = 1; r <= mat.Nrows(); r++)
+    {
+        for (int c = 1; c <= mat.Ncols(); c++)
+        {
+            buf[i++] = float(src[layout.Index(r, c)]);
+        }
+    }
+    if (buf.size() > 0)
+        out.write((const char *)&buf[0], buf.size() * sizeof(float));
+}
+
+void ReadMatrix(ifstream &in, Matrix &mat, int nrows, int ncols)
+{
+    mat.ReSize(nrows, ncols);
+    vector<float> buf(nrows * ncols);
+    if (buf.size() > 0)
+        in.read((char *)&buf[0], buf.size() * sizeof(float));
+    fabber::MatrixLayout layout(mat);
+    Real *dest = mat.Store();
+    size_t i = 0;
+    for (int r = 1; r <= nrows; r++)
+    {
+        for (int c = 1; c <= ncols; c++)
+        {
+            dest[layout.Index(r, c)] = buf[i++];
+        }
+    }
+}
+
+// Neighbour lists are stored in compressed row form: nvoxels + 1 offsets
+// followed by the concatenated lists
+void WriteNeighbours(ofstream &out, const vector<vector<int> > &neighbours)
+{
+    vector<int32_t> offsets(1, 0);
+    vector<int32_t> ids;
+    for (unsigned int v = 0; v < neighbours.size(); v++)
+    {
+        ids.insert(ids.end(), neighbours[v].begin(), neighbours[v].end());
+        offsets.push_back(ids.size());
+    }
+    out.write((const char *)&offsets[0], offsets.size() * sizeof(int32_t));
+    if (ids.size() > 0)
+        out.write((const char *)&ids[0], ids.size() * sizeof(int32_t));
+}
+
+void ReadNeighbours(ifstream &in, vector<vector<int> > &neighbours, int nvoxels, int nentries)
+{
+    vector<int32_t> offsets(nvoxels + 1);
+    vector<int32_t> ids(nentries);
+    in.read((char *)&offsets[0], offsets.size() * sizeof(int32_t));
+    if (nentries > 0)
+        in.read((char *)&ids[0], ids.size() * sizeof(int32_t));
+    if (!in || offsets[nvoxels] != nentries)
+        return;
+
+    neighbours.resize(nvoxels);
+    for (int v = 0; v < nvoxels; v++)
+    {
+        neighbours[v].assign(ids.begin() + offsets[v], ids.begin() + offsets[v + 1]);
+    }
+}
+
+unsigned int CountEntries(const vector<vector<int> > &neighbours)
+{
+    unsigned int n = 0;
+    for (unsigned int v = 0; v < neighbours.size(); v++)
+    {
+        n += neighbours[v].size();
+    }
+    return n;
+}
+}
+
+DataCache::DataCache(const string &dir, EasyLog *log)
+    : Loggable(log)
+    , m_dir(dir)
+    , m_hash(FNV_OFFSET)
+{
+    if (!FileExists(m_dir))
+    {
+        errno = 0;
+        int ret = 0;
+#ifdef _WIN32
+        ret = _mkdir(m_dir.c_str());
+#else
+        ret = mkdir(m_dir.c_str(), 0777);
+#endif
+        if (ret != 0 && errno != EEXIST)
+        {
+            throw FabberRunDataError("Could not create data cache directory: " + m_dir);
+        }
+    }
+}
+
+void DataCache::Hash(const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        m_hash ^= (unsigned char)data[i];
+        m_hash *= FNV_PRIME;
+    }
+}
+
+void DataCache::AddFile(const string &filename)
+{
+    if (filename == "")
+        return;
+
+    // Find the actual files for an image name which may not have an extension
+    const char *exts[] = { "", ".nii.gz", ".nii", ".hdr", ".img", ".hdr.gz", ".img.gz", NULL };
+    vector<string> files;
+    for (int i = 0; exts[i] != NULL; i++)
+    {
+        if (FileExists(filename + exts[i]))
+        {
+            files.push_back(filename + exts[i]);
+            if (i == 0)
+                break;
+        }
+    }
+    if (files.empty())
+    {
+        throw DataNotFound(filename, "File is invalid or does not exist");
+    }
+
+    // The name is part of the key as well as the content, so that a file used
+    // as mask is not confused with the same file used as data
+    Hash(filename.c_str(), filename.size() + 1);
+    vector<char> buf(1 << 20);
+    for (unsigned int i = 0; i < files.size(); i++)
+    {
+        ifstream in(files[i].c_str(), ios::in | ios::binary);
+        while (in)
+        {
+            in.read(&buf[0], buf.size());
+            Hash(&buf[0], in.gcount());
+        }
+    }
+}
+
+void DataCache::AddOption(const string &key, const string &value)
+{
+    Hash(key.c_str(), key.size() + 1);
+    Hash(value.c_str(), value.size() + 1);
+}
+
+string DataCache::GetFilename() const
+{
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)m_hash);
+    return m_dir + "/" + hex + ".fabcache";
+}
+
+bool DataCache::Load(Matrix &coords, Matrix &data, Matrix &suppdata,
+    vector<vector<int> > &neighbours, vector<vector<int> > &neighbours2) const
+{
+    string filename = GetFilename();
+    ifstream in(filename.c_str(), ios::in | ios::binary);
+    if (!in)
+    {
+        LOG << "DataCache::No cached data found in " << filename << endl;
+        return false;
+    }
+
+    CacheHeader header;
+    in.read((char *)&header, sizeof(header));
+    if (!in || memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+        || header.key != m_hash)
+    {
+        LOG << "DataCache::Ignoring invalid cache file " << filename << endl;
+        return false;
+    }
+
+    ReadMatrix(in, coords, 3, header.nvoxels);
+    ReadMatrix(in, data, header.ntimes, header.nvoxels);
+    ReadMatrix(in, suppdata, header.nsupp, header.nvoxels);
+    if (header.nsupp == 0)
+        suppdata.ReSize(0, 0);
+    neighbours.clear();
+    neighbours2.clear();
+    bool have_neighbours = (header.flags & CACHE_HAVE_NEIGHBOURS) != 0;
+    if (have_neighbours)
+    {
+        ReadNeighbours(in, neighbours, header.nvoxels, header.nneighbours);
+        ReadNeighbours(in, neighbours2, header.nvoxels, header.nneighbours2);
+    }
+    if (!in || (have_neighbours && (neighbours.size() != header.nvoxels
+                                       || neighbours2.size() != header.nvoxels)))
+    {
+        LOG << "DataCache::Ignoring truncated cache file " << filename << endl;
+        return false;
+    }
+
+    LOG << "DataCache::Loaded " << header.nvoxels << " voxels";
+    if (have_neighbours)
+        LOG << " and neighbour lists";
+    LOG << " from " << filename << endl;
+    return true;
+}
+
+void DataCache::Save(const Matrix &coords, const Matrix &data, const Matrix &suppdata,
+    const vector<vector<int> > &neighbours, const vector<vector<int> > &neighbours2) const
+{
+    string filename = GetFilename();
+
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.key = m_hash;
+    header.nvoxels = coords.Ncols();
+    header.ntimes = data.Nrows();
+    header.nsupp = suppdata.Nrows();
+    header.nneighbours = CountEntries(neighbours);
+    header.nneighbours2 = CountEntries(neighbours2);
+    header.flags = 0;
+    if (neighbours.size() > 0 || neighbours2.size() > 0)
+    {
+        header.flags |= CACHE_HAVE_NEIGHBOURS;
+    }
+    if ((header.flags & CACHE_HAVE_NEIGHBOURS) && ((int)neighbours.size() != coords.Ncols()
+                                                      || (int)neighbours2.size() != coords.Ncols()))
+    {
+        throw FabberInternalError("DataCache::Save - Neighbour lists do not match voxels");
+    }
+
+    string tmpname = CreateTempFile(filename);
+    if (tmpname.empty())
+    {
+        LOG_WARN << "DataCache::WARNING: Failed to create temporary file for " << filename << endl;
+        return;
+    }
+
+    {
+        ofstream out(tmpname.c_str(), ios::out | ios::binary);
+        out.write((const char *)&header, sizeof(header));
+        WriteMatrix(out, coords);
+        WriteMatrix(out, data);
+        WriteMatrix(out, suppdata);
+        if (header.flags & CACHE_HAVE_NEIGHBOURS)
+        {
+            WriteNeighbours(out, neighbours);
+            WriteNeighbours(out, neighbours2);
+        }
+        if (!out)
+        {
+            LOG_WARN << "DataCache::WARNING: Failed to write cache file " << tmpname << endl;
+            remove(tmpname.c_str());
+            return;
+        }
+    }
+
+    if (rename(tmpname.c_str(), filename.c_str()) != 0)
+    {
+        LOG_WARN << "DataCache::WARNING: Failed to create cache file " << filename << endl;
+        remove(tmpname.c_str());
+        return;
+    }
+    LOG << "DataCache::Saved " << header.nvoxels << " voxels to " << filename << endl;
+}
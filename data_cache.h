@@ -0,0 +1,93 @@
+/*  data_cache.h - On-disk cache of preprocessed voxel data
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#pragma once
+
+#include "easylog.h"
+
+#include <newmat.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * On-disk cache of preprocessed voxel data
+ *
+ * Repeated runs on identical inputs can skip decompression, masking, co-ordinate
+ * generation, combination of multiple data sets and neighbour calculation by
+ * reloading the result of a previous run.
+ *
+ * The cache key is a hash of the contents of the input files and of any options
+ * which affect the preprocessing. Each cache entry is a single flat binary file
+ * containing a header followed by the arrays in sequence, with voxel data stored
+ * as single precision. Entries are read back in full and converted to the
+ * matrix type, so loading costs one sequential read of the file. Neighbour lists
+ * are optional, so runs which do not need them never calculate them. Entries are
+ * written to a temporary file and renamed so that concurrent runs never see a
+ * partially written entry.
+ */
+class DataCache : public Loggable
+{
+public:
+    /**
+     * @param dir Directory in which cache entries are stored. Created if it does not exist
+     */
+    DataCache(const std::string &dir, EasyLog *log = 0);
+
+    /**
+     * Add the contents of an input file to the cache key
+     *
+     * Image filenames may be given without an extension as for NIFTI loading.
+     * An empty filename is ignored.
+     */
+    void AddFile(const std::string &filename);
+
+    /**
+     * Add an option value to the cache key
+     */
+    void AddOption(const std::string &key, const std::string &value);
+
+    /**
+     * @return Filename of the cache entry for the current key
+     */
+    std::string GetFilename() const;
+
+    /**
+     * Load cached data for the current key
+     *
+     * @param coords Voxel co-ordinates, 3 x number of voxels
+     * @param data Main voxel data after masking and combining multiple data sets
+     * @param suppdata Supplementary data, empty if there is none
+     * @param neighbours Nearest neighbour lists as returned by FabberRunData::GetNeighbours.
+     *                   Empty if the entry was saved without neighbour lists
+     * @param neighbours2 Second nearest neighbour lists as returned by
+     *                    FabberRunData::GetSecondNeighbours. Empty if the entry was
+     *                    saved without neighbour lists
+     * @return true if a valid entry was found and loaded, false otherwise
+     */
+    bool Load(NEWMAT::Matrix &coords, NEWMAT::Matrix &data, NEWMAT::Matrix &suppdata,
+        std::vector<std::vector<int> > &neighbours,
+        std::vector<std::vector<int> > &neighbours2) const;
+
+    /**
+     * Save data to the cache under the current key
+     *
+     * The neighbour lists may both be empty, in which case the entry is saved
+     * without them. An existing entry for the key is replaced.
+     *
+     * @see Load
+     */
+    void Save(const NEWMAT::Matrix &coords, const NEWMAT::Matrix &data,
+        const NEWMAT::Matrix &suppdata, const std::vector<std::vector<int> > &neighbours,
+        const std::vector<std::vector<int> > &neighbours2) const;
+
+private:
+    void Hash(const char *data, size_t len);
+
+    std::string m_dir;
+    uint64_t m_hash;
+};
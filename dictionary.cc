@@ -0,0 +1,347 @@
+/*  dictionary.cc - Initial parameter estimates by matching precomputed model simulations
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "dictionary.h"
+
+#include "checkpoint.h"
+#include "easylog.h"
+#include "perf.h"
+#include "rundata.h"
+#include "tools.h"
+
+#include <newmat.h>
+
+#include <math.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace NEWMAT;
+using fabber::MaskRows;
+
+namespace
+{
+/**
+ * Element of the Halton sequence in a given base, in (0, 1) for index > 0
+ */
+double RadicalInverse(int index, int base)
+{
+    double f = 1, result = 0;
+    while (index > 0)
+    {
+        f /= base;
+        result += f * (index % base);
+        index /= base;
+    }
+    return result;
+}
+
+/**
+ * @return The first n primes, used as the bases of the Halton sequence in
+ *         each dimension
+ */
+vector<int> Primes(int n)
+{
+    vector<int> primes;
+    for (int candidate = 2; int(primes.size()) < n; candidate++)
+    {
+        bool prime = true;
+        for (unsigned int i = 0; i < primes.size() && primes[i] * primes[i] <= candidate; i++)
+        {
+            if (candidate % primes[i] == 0)
+            {
+                prime = false;
+                break;
+            }
+        }
+        if (prime)
+            primes.push_back(candidate);
+    }
+    return primes;
+}
+
+bool IsFinite(const ColumnVector &v)
+{
+    for (int i = 1; i <= v.Nrows(); i++)
+    {
+        if (!(fabs(v(i)) <= 1e300))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Append the values of a vector to a key, replacing non-finite values so
+ * that keys can be compared
+ */
+void AddToKey(vector<double> &key, const ColumnVector &v)
+{
+    key.push_back(v.Nrows());
+    for (int i = 1; i <= v.Nrows(); i++)
+    {
+        key.push_back(fabs(v(i)) <= 1e300 ? v(i) : 1e300);
+    }
+}
+
+/**
+ * Subtract the mean from each column and scale it to unit length. Columns
+ * with no variation are set to zero
+ */
+void NormaliseColumns(Matrix &m)
+{
+    for (int c = 1; c <= m.Ncols(); c++)
+    {
+        ColumnVector col = m.Column(c);
+        col -= col.Sum() / col.Nrows();
+        double norm = sqrt(col.SumSquare());
+        m.Column(c) = (norm > 0) ? ColumnVector(col / norm) : ColumnVector(col * 0);
+    }
+}
+
+// Values are in row order whatever the layout of the matrix library
+vector<double> ToVector(const Matrix &m)
+{
+    fabber::MatrixLayout layout(m);
+    vector<double> values;
+    values.reserve(size_t(m.Nrows()) * m.Ncols());
+    for (int r = 1; r <= m.Nrows(); r++)
+    {
+        for (int c = 1; c <= m.Ncols(); c++)
+        {
+            values.push_back(m.Store()[layout.Index(r, c)]);
+        }
+    }
+    return values;
+}
+
+void FromVector(const vector<double> &values, int nrows, int ncols, Matrix &m)
+{
+    if (int(values.size()) != nrows * ncols)
+    {
+        throw FabberRunDataError("Dictionary cache file is inconsistent");
+    }
+    m.ReSize(nrows, ncols);
+    fabber::MatrixLayout layout(m);
+    vector<double>::const_iterator value = values.begin();
+    for (int r = 1; r <= nrows; r++)
+    {
+        for (int c = 1; c <= ncols; c++)
+        {
+            m.Store()[layout.Index(r, c)] = *value++;
+        }
+    }
+}
+}
+
+ModelDictionary::ModelDictionary(EasyLog *log)
+    : Loggable(log)
+{
+}
+
+void ModelDictionary::Create(const FwdModel *model, const vector<Parameter> &params, int nsamples,
+    double range, const vector<int> &masked_tpoints, const string &cache_file)
+{
+    fabber::ScopedTimer timer("CreateDictionary");
+    int nparams = params.size();
+    m_masked_tpoints = masked_tpoints;
+
+    // Sampled range of each parameter, and a second point at which to
+    // evaluate the model to identify it
+    ColumnVector centre(nparams), width(nparams), offset(nparams);
+    for (int p = 1; p <= nparams; p++)
+    {
+        double sd = sqrt(params[p - 1].prior.var());
+        centre(p) = params[p - 1].prior.mean();
+        width(p) = range * sd;
+        offset(p) = centre(p) + 0.1 * sd;
+    }
+
+    ColumnVector pred;
+    m_key.clear();
+    m_key.push_back(nsamples);
+    m_key.push_back(range);
+    AddToKey(m_key, centre);
+    AddToKey(m_key, width);
+    for (unsigned int i = 0; i < masked_tpoints.size(); i++)
+    {
+        m_key.push_back(masked_tpoints[i]);
+    }
+    model->EvaluateFabber(offset, pred);
+    AddToKey(m_key, pred);
+    model->EvaluateFabber(centre, pred);
+    AddToKey(m_key, pred);
+
+    if (cache_file != "" && Load(cache_file))
+    {
+        LOG << "ModelDictionary::Loaded " << Size() << " simulations from " << cache_file << endl;
+        return;
+    }
+
+    int ntimes = MaskRows(pred, m_masked_tpoints).Nrows();
+    vector<int> bases = Primes(nparams);
+    Matrix samples(nparams, nsamples), sims(ntimes, nsamples);
+    int nvalid = 0;
+    for (int i = 1; i <= nsamples; i++)
+    {
+        ColumnVector sample(nparams);
+        for (int p = 1; p <= nparams; p++)
+        {
+            sample(p) = centre(p) + (2 * RadicalInverse(i, bases[p - 1]) - 1) * width(p);
+        }
+
+        // Parts of the prior range where the model can't be evaluated are
+        // simply left out of the dictionary
+        try
+        {
+            model->EvaluateFabber(sample, pred);
+        }
+        catch (Exception &e)
+        {
+            continue;
+        }
+        catch (std::exception &e)
+        {
+            // Includes FabberError from models which reject the parameters
+            continue;
+        }
+        ColumnVector masked = MaskRows(pred, m_masked_tpoints);
+        if (masked.Nrows() != ntimes || !IsFinite(masked))
+            continue;
+
+        nvalid++;
+        samples.Column(nvalid) = sample;
+        sims.Column(nvalid) = masked;
+    }
+    if (nvalid == 0)
+    {
+        throw FabberRunDataError("Model could not be evaluated anywhere in the dictionary range");
+    }
+
+    m_samples = samples.Columns(1, nvalid);
+    m_sims = sims.Columns(1, nvalid);
+    LOG << "ModelDictionary::Simulated " << nvalid << " of " << nsamples << " samples" << endl;
+
+    if (cache_file != "")
+    {
+        Save(cache_file);
+    }
+}
+
+void ModelDictionary::Match(const Matrix &data, bool correlation, Matrix &params) const
+{
+    fabber::ScopedTimer timer("MatchDictionary");
+    int nvoxels = data.Ncols();
+    int nsims = m_sims.Ncols();
+    params.ReSize(m_samples.Nrows(), nvoxels);
+
+    // For Euclidian distance the closest simulation has the largest value of
+    // 2 y.s - |s|^2, so only the products of the data and simulations are
+    // needed for each voxel
+    Matrix sims = m_sims;
+    ColumnVector sim_norm2(nsims);
+    sim_norm2 = 0;
+    if (correlation)
+    {
+        NormaliseColumns(sims);
+    }
+    else
+    {
+        for (int n = 1; n <= nsims; n++)
+        {
+            sim_norm2(n) = m_sims.Column(n).SumSquare();
+        }
+    }
+
+    // Voxels are done in blocks to limit the size of the product matrix
+    const int BLOCK_SIZE = 1000;
+    for (int first = 1; first <= nvoxels; first += BLOCK_SIZE)
+    {
+        int last = min(first + BLOCK_SIZE - 1, nvoxels);
+        Matrix block = MaskRows(data.Columns(first, last), m_masked_tpoints);
+        if (block.Nrows() != sims.Nrows())
+        {
+            throw FabberInternalError("ModelDictionary::Match - data does not match dictionary");
+        }
+        if (correlation)
+        {
+            NormaliseColumns(block);
+        }
+
+        // With correlation the norms are zero, so the same score can be used
+        Matrix scores = sims.t() * block;
+        for (int b = 1; b <= block.Ncols(); b++)
+        {
+            int best = 1;
+            double best_score = 2 * scores(1, b) - sim_norm2(1);
+            for (int n = 2; n <= nsims; n++)
+            {
+                double score = 2 * scores(n, b) - sim_norm2(n);
+                if (score > best_score)
+                {
+                    best = n;
+                    best_score = score;
+                }
+            }
+            params.Column(first + b - 1) = m_samples.Column(best);
+        }
+    }
+}
+
+bool ModelDictionary::Load(const string &filename)
+{
+    ifstream exists(filename.c_str());
+    if (!exists.good())
+    {
+        return false;
+    }
+    exists.close();
+
+    try
+    {
+        Checkpoint cache;
+        cache.SetLogger(m_log);
+        cache.Load(filename);
+        vector<double> key, values;
+        cache.Get(key);
+        if (key != m_key)
+        {
+            LOG << "ModelDictionary::Cache " << filename
+                << " was created with a different model or options" << endl;
+            return false;
+        }
+        int nparams = cache.GetInt();
+        int ntimes = cache.GetInt();
+        int nsims = cache.GetInt();
+        cache.Get(values);
+        FromVector(values, nparams, nsims, m_samples);
+        cache.Get(values);
+        FromVector(values, ntimes, nsims, m_sims);
+        return true;
+    }
+    catch (FabberRunDataError &e)
+    {
+        WARN_ONCE_TEXT(string("ModelDictionary::Could not read cache - ") + e.what());
+        return false;
+    }
+}
+
+void ModelDictionary::Save(const string &filename) const
+{
+    Checkpoint cache;
+    cache.SetLogger(m_log);
+    cache.Put(m_key);
+    cache.Put(m_samples.Nrows());
+    cache.Put(m_sims.Nrows());
+    cache.Put(m_samples.Ncols());
+    cache.Put(ToVector(m_samples));
+    cache.Put(ToVector(m_sims));
+    cache.Save(filename);
+    cache.Wait();
+    LOG << "ModelDictionary::Saved " << Size() << " simulations to " << filename << endl;
+}
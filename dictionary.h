@@ -0,0 +1,92 @@
+/*  dictionary.h - Initial parameter estimates by matching precomputed model simulations
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#pragma once
+
+#include "easylog.h"
+#include "fwdmodel.h"
+
+#include "newmat.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * Dictionary of model simulations used to find initial parameter estimates
+ *
+ * The model is evaluated at quasi-random (Halton sequence) points covering
+ * the prior of each parameter, in Fabber's internal parameter space. Each
+ * voxel's data is then matched to the simulation which it is closest to,
+ * either by Euclidian distance or by normalised correlation, and the
+ * parameters of that simulation are used as the starting point for the
+ * fit. This is the same idea as MR fingerprinting, but only used as a
+ * warm start.
+ *
+ * Time series are too long for a k-d tree to help, so matching is a brute
+ * force search done as matrix products over blocks of voxels.
+ */
+class ModelDictionary : public Loggable
+{
+public:
+    explicit ModelDictionary(EasyLog *log = 0);
+
+    /**
+     * Create the dictionary, loading it from a cache file if possible
+     *
+     * The model must already have been passed the data of a voxel, so that
+     * it knows the number of time points to simulate. Models whose
+     * predictions depend on the voxel are simulated for that voxel only.
+     *
+     * @param model Forward model to simulate
+     * @param params Model parameters, with priors in Fabber space
+     * @param nsamples Number of simulations
+     * @param range Half-width of the sampled range of each parameter in
+     *              prior standard deviations
+     * @param masked_tpoints Time points to ignore when matching, from 1
+     * @param cache_file File to load the dictionary from if it was created
+     *                   with the same model and options, and to save it to
+     *                   otherwise. Empty for no cache
+     */
+    void Create(const FwdModel *model, const std::vector<Parameter> &params, int nsamples,
+        double range, const std::vector<int> &masked_tpoints, const std::string &cache_file = "");
+
+    /**
+     * Find the simulation which best matches each voxel
+     *
+     * @param data Voxel data, one column per voxel
+     * @param correlation If true match by normalised correlation, otherwise
+     *                    by Euclidian distance
+     * @param params Returns the parameters of the best match for each voxel
+     *               in Fabber space, one column per voxel
+     */
+    void Match(const NEWMAT::Matrix &data, bool correlation, NEWMAT::Matrix &params) const;
+
+    /** @return Number of simulations in the dictionary */
+    int Size() const
+    {
+        return m_samples.Ncols();
+    }
+
+private:
+    /** @return true if the cache file exists and matches m_key */
+    bool Load(const std::string &filename);
+    void Save(const std::string &filename) const;
+
+    /**
+     * Describes how the dictionary was created - the sampling options, the
+     * priors, and the model prediction at two points, which changes if the
+     * model's options do
+     */
+    std::vector<double> m_key;
+
+    /** Parameters of each simulation in Fabber space, one column each */
+    NEWMAT::Matrix m_samples;
+
+    /** Simulated time series with masked time points removed, one column each */
+    NEWMAT::Matrix m_sims;
+
+    std::vector<int> m_masked_tpoints;
+};
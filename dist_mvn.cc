@@ -10,12 +10,221 @@
 #include "easylog.h"
 #include "tools.h"
 
+#include <limits.h>
 #include <math.h>
 #include <newmatio.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <fstream>
 
 using fabber::read_matrix_file;
 using namespace NEWMAT;
 
+namespace
+{
+// Compact MVN file format. All values are little-endian.
+//
+// Header:  magic (8 bytes), nparams, nvoxels, flags, voxels per block (all uint32)
+// Blocks:  raw size, stored size (uint32) followed by the block data. If the
+//          stored size equals the raw size the block is uncompressed, otherwise
+//          it is zlib-compressed.
+// Voxel:   P means, P variances (float32) then, unless MVN_DIAG_ONLY is set,
+//          the P(P-1)/2 off-diagonal terms in lower-triangle row order, either as
+//          float32 covariances or (if MVN_HALF is set) float16 correlations
+const char MVN_MAGIC[8] = { 'F', 'A', 'B', 'M', 'V', 'N', 'C', '1' };
+const uint32_t MVN_DIAG_ONLY = 1;
+const uint32_t MVN_HALF = 2;
+const uint32_t MVN_BLOCK_VOXELS = 4096;
+
+const size_t MVN_HEADER_SIZE = sizeof(MVN_MAGIC) + 4 * sizeof(uint32_t);
+
+struct MVNCompactHeader
+{
+    uint32_t nparams;
+    uint32_t nvoxels;
+    uint32_t flags;
+    uint32_t block_voxels;
+};
+
+// Values are written a byte at a time so the files are the same on any platform
+void PutUint16(char *&ptr, uint16_t val)
+{
+    *ptr++ = char(val & 0xff);
+    *ptr++ = char(val >> 8);
+}
+
+void PutUint32(char *&ptr, uint32_t val)
+{
+    for (int b = 0; b < 4; b++)
+    {
+        *ptr++ = char((val >> (8 * b)) & 0xff);
+    }
+}
+
+void PutFloat(char *&ptr, float val)
+{
+    uint32_t x;
+    memcpy(&x, &val, sizeof(x));
+    PutUint32(ptr, x);
+}
+
+uint16_t GetUint16(const char *&ptr)
+{
+    const unsigned char *bytes = (const unsigned char *)ptr;
+    ptr += 2;
+    return uint16_t(bytes[0] | (bytes[1] << 8));
+}
+
+uint32_t GetUint32(const char *&ptr)
+{
+    const unsigned char *bytes = (const unsigned char *)ptr;
+    ptr += 4;
+    return uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16)
+        | (uint32_t(bytes[3]) << 24);
+}
+
+float GetFloat(const char *&ptr)
+{
+    uint32_t x = GetUint32(ptr);
+    float val;
+    memcpy(&val, &x, sizeof(val));
+    return val;
+}
+
+/**
+ * Read the header of a compact MVN file
+ *
+ * @return false if the stream does not start with a compact MVN header
+ */
+bool ReadCompactHeader(istream &in, MVNCompactHeader &header)
+{
+    char buf[MVN_HEADER_SIZE];
+    in.read(buf, MVN_HEADER_SIZE);
+    if (!in || memcmp(buf, MVN_MAGIC, sizeof(MVN_MAGIC)) != 0)
+        return false;
+
+    const char *ptr = buf + sizeof(MVN_MAGIC);
+    header.nparams = GetUint32(ptr);
+    header.nvoxels = GetUint32(ptr);
+    header.flags = GetUint32(ptr);
+    header.block_voxels = GetUint32(ptr);
+    return true;
+}
+
+void WriteCompactHeader(ostream &out, const MVNCompactHeader &header)
+{
+    char buf[MVN_HEADER_SIZE];
+    memcpy(buf, MVN_MAGIC, sizeof(MVN_MAGIC));
+    char *ptr = buf + sizeof(MVN_MAGIC);
+    PutUint32(ptr, header.nparams);
+    PutUint32(ptr, header.nvoxels);
+    PutUint32(ptr, header.flags);
+    PutUint32(ptr, header.block_voxels);
+    out.write(buf, MVN_HEADER_SIZE);
+}
+
+/**
+ * @return Number of parameters in MVN voxel data with the given number of rows
+ */
+int NumParamsFromRows(int nrows)
+{
+    // This formula for the number of parameters, P given
+    // the number of rows, N, is found by inverting the formula
+    // for N as a function of P given in Load, using the quadratic
+    // formula.
+    const int nParams = ((int)sqrt(double(8 * nrows + 1)) - 3) / 2;
+    if (nrows != nParams * (nParams + 1) / 2 + nParams + 1)
+    {
+        throw FabberRunDataError("MVNDist::Load  - Incorrect number of rows for an MVN input");
+    }
+    return nParams;
+}
+
+uint16_t FloatToHalf(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int exp = int((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+
+    if (((x >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (exp >= 31)
+        return sign | 0x7c00;
+    if (exp <= 0)
+    {
+        // Subnormal or underflow to zero
+        if (exp < -10)
+            return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        uint32_t h = mant >> shift;
+        if ((mant >> (shift - 1)) & 1)
+            h++;
+        return sign | h;
+    }
+    // Rounding carry into the exponent is correct behaviour here
+    uint32_t h = sign | (exp << 10) | (mant >> 13);
+    if (mant & 0x1000)
+        h++;
+    return h;
+}
+
+float HalfToFloat(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (exp == 0)
+    {
+        if (mant == 0)
+        {
+            x = sign;
+        }
+        else
+        {
+            // Normalize subnormal value
+            exp = 127 - 15 + 1;
+            while (!(mant & 0x400))
+            {
+                mant <<= 1;
+                exp--;
+            }
+            mant &= 0x3ff;
+            x = sign | (exp << 23) | (mant << 13);
+        }
+    }
+    else if (exp == 31)
+    {
+        x = sign | 0x7f800000 | (mant << 13);
+    }
+    else
+    {
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+/** Size in bytes of a single voxel record */
+size_t VoxelRecordSize(uint32_t nparams, uint32_t flags)
+{
+    size_t size = 2 * nparams * sizeof(float);
+    if (!(flags & MVN_DIAG_ONLY))
+    {
+        size_t noffdiag = nparams * (nparams - 1) / 2;
+        size += noffdiag * ((flags & MVN_HALF) ? sizeof(uint16_t) : sizeof(float));
+    }
+    return size;
+}
+}
+
 // Constructors
 
 MVNDist::MVNDist(EasyLog *log)
@@ -215,7 +424,7 @@ const SymmetricMatrix &MVNDist::GetPrecisions() const
         {
             // Failure to invert matrix - this hack adds a tiny amount to the diagonal and tries
             // again
-            WARN_ONCE("MVN precision (m_size==" + stringify(m_size)
+            WARN_ONCE_TEXT("MVN precision (m_size==" + stringify(m_size)
                 + ") was singular, adding 1e-10 to diagonal");
             LOG << means.t() << endl;
             LOG << covariance << endl;
@@ -250,7 +459,7 @@ const SymmetricMatrix &MVNDist::GetCovariance() const
         {
             // Failure to invert matrix - this hack adds a tiny amount to the diagonal and tries
             // again
-            WARN_ONCE("MVN precision (m_size==" + stringify(m_size)
+            WARN_ONCE_TEXT("MVN precision (m_size==" + stringify(m_size)
                 + ") was singular, adding 1e-10 to diagonal");
             LOG << means.t() << endl;
             LOG << precisions << endl;
@@ -316,6 +525,16 @@ void MVNDist::Load(
     // Load. First this is converted into
     // a matrix whose columns are the voxels
     // and rows are the data
+    //
+    // Compact binary MVN files are detected from their header and loaded
+    // directly
+    string data_key = data.GetVoxelDataKey(filename);
+    if (IsCompactFile(data_key))
+    {
+        LoadCompact(mvns, data_key, log, data.GetVoxelCoords().Ncols());
+        return;
+    }
+
     Matrix voxel_data = data.GetVoxelData(filename);
     MVNDist::Load(mvns, voxel_data, log);
 }
@@ -333,16 +552,7 @@ void MVNDist::Load(vector<MVNDist *> &mvns, Matrix &voxel_data, EasyLog *log)
         assert(mvns[i] == NULL); // should've deleted everything first.
     mvns.resize(nVoxels, NULL);
 
-    // This formula for the number of parameters, P given
-    // the number of rows, N, is found by inverting the formula
-    // for N as a function of P given in Load, using the quadratic
-    // formula.
-    const int nParams = ((int)sqrt(double(8 * voxel_data.Nrows() + 1)) - 3) / 2;
-    if (voxel_data.Nrows() != nParams * (nParams + 1) / 2 + nParams + 1)
-    {
-        throw FabberRunDataError("MVNDist::Load  - Incorrect number of rows for an MVN input");
-    }
-
+    const int nParams = NumParamsFromRows(voxel_data.Nrows());
     SymmetricMatrix tmp(nParams);
 
     // Create a new MVN dist for each voxel,
@@ -359,8 +569,8 @@ void MVNDist::Load(vector<MVNDist *> &mvns, Matrix &voxel_data, EasyLog *log)
 
         assert(index == nParams * (nParams + 1) / 2);
         mvn->SetCovariance(tmp);
-        mvn->means = voxel_data.Column(vox).Rows(
-            nParams * (nParams + 1) / 2 + 1, nParams * (nParams + 1) / 2 + nParams);
+        for (int p = 1; p <= nParams; p++)
+            mvn->means(p) = voxel_data(++index, vox);
 
         if (voxel_data(voxel_data.Nrows(), vox) != 1)
         {
@@ -379,8 +589,31 @@ void MVNDist::Save(const vector<MVNDist *> &mvns, const string &filename, Fabber
     // last row/col is the means (1 in the corner).
     // Note that I'm using the 4th dim and should really be using the 5th,
     // according to the specification -- but I don't think it really matters.
+    //
+    // Alternatively the compact binary format can be selected. The run data
+    // decides where this goes - a file in the output directory, or memory
+    string format = data.GetStringDefault("save-mvn-format", "nifti");
+    VoxelDataType data_type = VDT_MVN;
+    if (format == "compact")
+    {
+        data_type = VDT_MVN_COMPACT;
+    }
+    else if (format != "nifti")
+    {
+        throw InvalidOptionValue("save-mvn-format", format, "Must be nifti or compact");
+    }
+
+    // Compact files are written straight from the MVNs if the run data saves files
+    if (data_type == VDT_MVN_COMPACT && data.SaveCompactMVN(filename, mvns))
+        return;
+
     Matrix vols;
+    ToVoxelData(mvns, vols);
+    data.SaveVoxelData(filename, vols, data_type);
+}
 
+void MVNDist::ToVoxelData(const vector<MVNDist *> &mvns, Matrix &vols)
+{
     const int nVoxels = mvns.size();
     int nParams = 0; // In case we have no voxels
     if (nVoxels != 0)
@@ -415,6 +648,11 @@ void MVNDist::Save(const vector<MVNDist *> &mvns, const string &filename, Fabber
         // Note that AsColumn for a SymmetricMatrix uses row ordering on the
         // lower triangular part, returning (1,1) (2,1) (2,2) (3,1).. as
         // required by NIFTI_INTENT_SYMMATRIX
+        if (mvns.at(vox - 1)->means.Nrows() != nParams)
+        {
+            throw FabberRunDataError(
+                "MVNDist::Save - MVNs do not all have the same number of parameters");
+        }
         ColumnVector cov(nCov);
         int idx=1;
         for (int row=1; row <=nParams; row++) 
@@ -427,8 +665,326 @@ void MVNDist::Save(const vector<MVNDist *> &mvns, const string &filename, Fabber
 
         vols.Column(vox) = cov & mvns.at(vox - 1)->means & aOne;
     }
+}
 
-    data.SaveVoxelData(filename, vols, VDT_MVN);
+void MVNDist::SaveCompact(
+    const vector<MVNDist *> &mvns, const string &filename, bool diag_only, bool half_precision)
+{
+    // Written straight from the distributions, without building the voxel data
+    int nParams = 0;
+    if (!mvns.empty())
+    {
+        nParams = mvns[0]->means.Nrows();
+    }
+    MVNCompactWriter writer(filename, nParams, mvns.size(), diag_only, half_precision);
+    for (unsigned int vox = 0; vox < mvns.size(); vox++)
+    {
+        if (mvns[vox]->means.Nrows() != nParams)
+        {
+            throw FabberRunDataError(
+                "MVNDist::SaveCompact - MVNs do not all have the same number of parameters");
+        }
+        writer.Add(mvns[vox]->means, mvns[vox]->GetCovariance());
+    }
+    writer.Close();
+}
+
+void MVNDist::SaveCompact(
+    const Matrix &voxel_data, const string &filename, bool diag_only, bool half_precision)
+{
+    const int nVoxels = voxel_data.Ncols();
+    int nParams = 0;
+    if (nVoxels > 0)
+    {
+        nParams = NumParamsFromRows(voxel_data.Nrows());
+    }
+
+    // Voxel data has the lower triangle of the covariance in row order,
+    // followed by the means
+    MVNCompactWriter writer(filename, nParams, nVoxels, diag_only, half_precision);
+    ColumnVector means(nParams);
+    SymmetricMatrix cov(nParams);
+    for (int vox = 1; vox <= nVoxels; vox++)
+    {
+        int index = 0;
+        for (int r = 1; r <= nParams; r++)
+            for (int c = 1; c <= r; c++)
+                cov(r, c) = voxel_data(++index, vox);
+        for (int p = 1; p <= nParams; p++)
+            means(p) = voxel_data(++index, vox);
+        writer.Add(means, cov);
+    }
+    writer.Close();
+}
+
+bool MVNDist::IsCompactFile(const string &filename)
+{
+    return GetCompactFileVoxels(filename) >= 0;
+}
+
+int MVNDist::GetCompactFileVoxels(const string &filename)
+{
+    ifstream in(filename.c_str(), ios::in | ios::binary);
+    MVNCompactHeader header;
+    if (!in || !ReadCompactHeader(in, header))
+        return -1;
+    return header.nvoxels;
+}
+
+void MVNDist::LoadCompact(
+    vector<MVNDist *> &mvns, const string &filename, EasyLog *log, int nvoxels)
+{
+    MVNCompactReader reader(filename, nvoxels);
+
+    for (unsigned i = 0; i < mvns.size(); i++)
+        assert(mvns[i] == NULL); // should've deleted everything first.
+    mvns.resize(reader.NumVoxels(), NULL);
+
+    for (int vox = 0; vox < reader.NumVoxels(); vox++)
+    {
+        MVNDist *mvn = new MVNDist(reader.NumParams(), log);
+        try
+        {
+            reader.Next(*mvn);
+        }
+        catch (...)
+        {
+            delete mvn;
+            throw;
+        }
+        mvns[vox] = mvn;
+    }
+}
+
+MVNCompactWriter::MVNCompactWriter(
+    const string &filename, int nparams, int nvoxels, bool diag_only, bool half_precision)
+    : m_filename(filename)
+    , m_nparams(nparams)
+    , m_nvoxels(nvoxels)
+    , m_added(0)
+    , m_flags(0)
+{
+    if (diag_only)
+        m_flags |= MVN_DIAG_ONLY;
+    else if (half_precision)
+        m_flags |= MVN_HALF;
+
+    m_out.open(filename.c_str(), ios::out | ios::binary);
+    if (!m_out)
+    {
+        throw FabberRunDataError("MVNDist::SaveCompact - Could not open file: " + filename);
+    }
+
+    MVNCompactHeader header;
+    header.nparams = nparams;
+    header.nvoxels = nvoxels;
+    header.flags = m_flags;
+    header.block_voxels = MVN_BLOCK_VOXELS;
+    WriteCompactHeader(m_out, header);
+    m_raw.reserve(min(nvoxels, int(MVN_BLOCK_VOXELS)) * VoxelRecordSize(nparams, m_flags));
+}
+
+void MVNCompactWriter::Add(const ColumnVector &means, const SymmetricMatrix &cov)
+{
+    if (m_added >= m_nvoxels || means.Nrows() != m_nparams || cov.Nrows() != m_nparams)
+    {
+        throw FabberInternalError("MVNCompactWriter::Add - Voxel does not match the header");
+    }
+
+    size_t offset = m_raw.size();
+    m_raw.resize(offset + VoxelRecordSize(m_nparams, m_flags));
+    char *ptr = &m_raw[offset];
+    for (int p = 1; p <= m_nparams; p++)
+    {
+        PutFloat(ptr, means(p));
+    }
+    for (int p = 1; p <= m_nparams; p++)
+    {
+        PutFloat(ptr, cov(p, p));
+    }
+    if (!(m_flags & MVN_DIAG_ONLY))
+    {
+        for (int row = 2; row <= m_nparams; row++)
+        {
+            for (int col = 1; col < row; col++)
+            {
+                if (m_flags & MVN_HALF)
+                {
+                    double norm = sqrt(cov(row, row) * cov(col, col));
+                    PutUint16(ptr, FloatToHalf(norm > 0 ? cov(row, col) / norm : 0));
+                }
+                else
+                {
+                    PutFloat(ptr, cov(row, col));
+                }
+            }
+        }
+    }
+    assert(ptr == &m_raw[0] + m_raw.size());
+
+    ++m_added;
+    if (m_added % MVN_BLOCK_VOXELS == 0)
+    {
+        WriteBlock();
+    }
+}
+
+void MVNCompactWriter::WriteBlock()
+{
+    if (m_raw.empty())
+        return;
+
+    uLongf stored_size = compressBound(m_raw.size());
+    m_compressed.resize(stored_size);
+    const char *block = &m_compressed[0];
+    if (compress2((Bytef *)&m_compressed[0], &stored_size, (const Bytef *)&m_raw[0],
+            m_raw.size(), Z_BEST_SPEED)
+            != Z_OK
+        || stored_size >= m_raw.size())
+    {
+        // Store uncompressed if compression fails or does not help
+        stored_size = m_raw.size();
+        block = &m_raw[0];
+    }
+    char sizes[2 * sizeof(uint32_t)];
+    char *sizes_ptr = sizes;
+    PutUint32(sizes_ptr, m_raw.size());
+    PutUint32(sizes_ptr, stored_size);
+    m_out.write(sizes, sizeof(sizes));
+    m_out.write(block, stored_size);
+    m_raw.clear();
+}
+
+void MVNCompactWriter::Close()
+{
+    if (m_added != m_nvoxels)
+    {
+        throw FabberInternalError("MVNCompactWriter::Close - " + stringify(m_added)
+            + " voxels were added but the header has " + stringify(m_nvoxels));
+    }
+    WriteBlock();
+    m_out.close();
+    if (!m_out)
+    {
+        throw FabberRunDataError("MVNDist::SaveCompact - Error writing file: " + m_filename);
+    }
+}
+
+MVNCompactReader::MVNCompactReader(const string &filename, int nvoxels)
+    : m_filename(filename)
+    , m_read(0)
+    , m_ptr(NULL)
+{
+    m_in.open(filename.c_str(), ios::in | ios::binary);
+    MVNCompactHeader header;
+    if (!ReadCompactHeader(m_in, header))
+    {
+        throw FabberRunDataError("MVNDist::LoadCompact - Not a compact MVN file: " + filename);
+    }
+    if (header.nvoxels == 0)
+    {
+        throw FabberRunDataError("MVNDist::LoadCompact - Voxel data is empty");
+    }
+    if (header.nparams == 0 || header.block_voxels == 0 || header.nvoxels > INT_MAX
+        || header.nparams > INT_MAX || header.block_voxels > INT_MAX)
+    {
+        throw FabberRunDataError("MVNDist::LoadCompact - Invalid header in " + filename);
+    }
+    if (nvoxels >= 0 && int(header.nvoxels) != nvoxels)
+    {
+        throw FabberRunDataError("MVNDist::LoadCompact - " + filename + " contains "
+            + stringify(header.nvoxels) + " voxels but the mask has " + stringify(nvoxels));
+    }
+    m_nparams = header.nparams;
+    m_nvoxels = header.nvoxels;
+    m_block_voxels = header.block_voxels;
+    m_flags = header.flags;
+    m_cov.ReSize(m_nparams);
+}
+
+void MVNCompactReader::ReadBlock()
+{
+    int nblock = min(m_block_voxels, m_nvoxels - m_read);
+    char sizes_buf[2 * sizeof(uint32_t)];
+    m_in.read(sizes_buf, sizeof(sizes_buf));
+    const char *sizes_ptr = sizes_buf;
+    uint32_t sizes[2];
+    sizes[0] = GetUint32(sizes_ptr);
+    sizes[1] = GetUint32(sizes_ptr);
+    if (!m_in || sizes[0] != nblock * VoxelRecordSize(m_nparams, m_flags) || sizes[1] > sizes[0])
+    {
+        throw FabberRunDataError("MVNDist::LoadCompact - Corrupt block in " + m_filename);
+    }
+
+    m_raw.resize(sizes[0]);
+    if (sizes[1] == sizes[0])
+    {
+        m_in.read(&m_raw[0], sizes[0]);
+    }
+    else
+    {
+        m_stored.resize(sizes[1]);
+        m_in.read(&m_stored[0], sizes[1]);
+        uLongf raw_size = sizes[0];
+        if (!m_in
+            || uncompress((Bytef *)&m_raw[0], &raw_size, (const Bytef *)&m_stored[0], sizes[1])
+                != Z_OK
+            || raw_size != sizes[0])
+        {
+            throw FabberRunDataError(
+                "MVNDist::LoadCompact - Failed to decompress block in " + m_filename);
+        }
+    }
+    if (!m_in)
+    {
+        throw FabberRunDataError("MVNDist::LoadCompact - Unexpected end of file: " + m_filename);
+    }
+    m_ptr = &m_raw[0];
+}
+
+void MVNCompactReader::Next(MVNDist &mvn)
+{
+    if (m_read >= m_nvoxels)
+    {
+        throw FabberInternalError("MVNCompactReader::Next - All voxels have been read");
+    }
+    if (m_read % m_block_voxels == 0)
+    {
+        ReadBlock();
+    }
+
+    const bool diag_only = (m_flags & MVN_DIAG_ONLY) != 0;
+    const bool half_precision = (m_flags & MVN_HALF) != 0;
+    mvn.SetSize(m_nparams);
+    for (int p = 1; p <= m_nparams; p++)
+    {
+        mvn.means(p) = GetFloat(m_ptr);
+    }
+    for (int p = 1; p <= m_nparams; p++)
+    {
+        m_cov(p, p) = GetFloat(m_ptr);
+    }
+    for (int row = 2; row <= m_nparams; row++)
+    {
+        for (int col = 1; col < row; col++)
+        {
+            if (diag_only)
+            {
+                m_cov(row, col) = 0;
+            }
+            else if (half_precision)
+            {
+                m_cov(row, col)
+                    = HalfToFloat(GetUint16(m_ptr)) * sqrt(m_cov(row, row) * m_cov(col, col));
+            }
+            else
+            {
+                m_cov(row, col) = GetFloat(m_ptr);
+            }
+        }
+    }
+    mvn.SetCovariance(m_cov);
+    ++m_read;
 }
 
 void MVNDist::Dump(ostream &out) const
@@ -12,6 +12,7 @@
 #include "rundata.h"
 
 #include <newmat.h>
+#include <fstream>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -66,10 +67,71 @@ public:
      * file NIFTI_INTENT_SYMMATRIX will be set. The resulting data is in the same
      * format expected by Load.
      *
+     * With --save-mvn-format=compact, run data which saves to files writes the
+     * compact binary format straight from the MVNs. Otherwise the voxel data is
+     * saved with type VDT_MVN_COMPACT.
+     *
      * @param mvns One MVN for each voxel
      */
     static void Save(const vector<MVNDist *> &mvns, const string &filename, FabberRunData &data);
 
+    /**
+     * Convert a per-voxel vector of MVN distributions to voxel data in the
+     * format written by Save
+     *
+     * @param mvns One MVN for each voxel
+     * @param vols Returns the voxel data, one column per voxel
+     */
+    static void ToVoxelData(const vector<MVNDist *> &mvns, NEWMAT::Matrix &vols);
+
+    /**
+     * Save a per-voxel vector of MVN distributions in the compact binary format
+     *
+     * The file starts with a fixed header giving the number of parameters,
+     * number of voxels and storage flags, followed by blocks of voxels which are
+     * individually zlib-compressed. Each voxel record contains the means and variances
+     * as single precision floats, followed (unless diag_only is set) by the
+     * off-diagonal covariance terms in lower-triangle row order.
+     *
+     * @param mvns One MVN for each voxel
+     * @param filename Output filename, used as-is
+     * @param diag_only If true, only the variances are stored and off-diagonal
+     *                  covariances are discarded
+     * @param half_precision If true, off-diagonal terms are stored as half-precision
+     *                       correlation coefficients rather than single precision covariances
+     */
+    static void SaveCompact(const vector<MVNDist *> &mvns, const string &filename,
+        bool diag_only = false, bool half_precision = false);
+
+    /**
+     * Save MVN voxel data, in the format written by Save, in the compact binary format
+     */
+    static void SaveCompact(const NEWMAT::Matrix &voxel_data, const string &filename,
+        bool diag_only = false, bool half_precision = false);
+
+    /**
+     * Load a per-voxel vector of MVN distributions from a file in the compact
+     * binary format written by SaveCompact
+     *
+     * @param mvns Vector which should initially be empty, as for Load
+     * @param filename Filename, used as-is
+     * @param nvoxels Number of voxels expected, e.g. in the mask, or -1 to
+     *                accept any number
+     */
+    static void LoadCompact(std::vector<MVNDist *> &mvns, const string &filename, EasyLog *log,
+        int nvoxels = -1);
+
+    /**
+     * @return true if filename exists and is a compact binary MVN file
+     */
+    static bool IsCompactFile(const string &filename);
+
+    /**
+     * @return Number of voxels in a compact binary MVN file, or -1 if
+     *         filename is not a compact MVN file
+     */
+    static int GetCompactFileVoxels(const string &filename);
+
     /**
      * Default constructor
      *
@@ -224,3 +286,84 @@ inline std::ostream &operator<<(std::ostream &out, const MVNDist &dist)
     dist.Dump(out);
     return out;
 }
+
+/**
+ * Writes a compact binary MVN file (see MVNDist::SaveCompact) one voxel at a time
+ *
+ * Only the current block of voxels is held in memory, so distributions can be
+ * written straight from wherever they are stored
+ */
+class MVNCompactWriter
+{
+public:
+    /**
+     * Open the file and write the header
+     *
+     * @param nvoxels Number of voxels which will be added
+     */
+    MVNCompactWriter(const std::string &filename, int nparams, int nvoxels,
+        bool diag_only = false, bool half_precision = false);
+
+    /**
+     * Add the next voxel's distribution
+     */
+    void Add(const NEWMAT::ColumnVector &means, const NEWMAT::SymmetricMatrix &cov);
+
+    /**
+     * Write the last block and check the file was written successfully
+     */
+    void Close();
+
+private:
+    void WriteBlock();
+
+    std::string m_filename;
+    std::ofstream m_out;
+    int m_nparams;
+    int m_nvoxels;
+    int m_added;
+    unsigned int m_flags;
+    std::vector<char> m_raw;
+    std::vector<char> m_compressed;
+};
+
+/**
+ * Reads a compact binary MVN file one voxel at a time
+ *
+ * Only the current block of voxels is held in memory, so distributions can be
+ * copied straight into the caller's storage, e.g. the posteriors of a run
+ */
+class MVNCompactReader
+{
+public:
+    /**
+     * Open the file and read the header
+     *
+     * @param nvoxels Number of voxels expected, e.g. in the mask, or -1 to
+     *                accept any number
+     */
+    MVNCompactReader(const std::string &filename, int nvoxels = -1);
+
+    int NumVoxels() const { return m_nvoxels; }
+    int NumParams() const { return m_nparams; }
+
+    /**
+     * Read the next voxel's distribution into mvn, which is resized if required
+     */
+    void Next(MVNDist &mvn);
+
+private:
+    void ReadBlock();
+
+    std::string m_filename;
+    std::ifstream m_in;
+    int m_nparams;
+    int m_nvoxels;
+    int m_block_voxels;
+    int m_read;
+    unsigned int m_flags;
+    std::vector<char> m_raw;
+    std::vector<char> m_stored;
+    const char *m_ptr;
+    NEWMAT::SymmetricMatrix m_cov;
+};
@@ -8,7 +8,9 @@
 
 #include "easylog.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <deque>
 #include <errno.h>
 #include <fstream>
 #include <stdexcept>
@@ -16,60 +18,349 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#define FABBER_THREAD_LOCAL __declspec(thread)
+#else
+#include <pthread.h>
+#define FABBER_THREAD_LOCAL __thread
+#endif
+
 using namespace std;
 
+namespace
+{
+volatile long num_logs = 0;
+volatile long num_threads = 0;
+volatile long num_warn_sites = 0;
+
+// Identifies the calling thread, and the log and stream it last used so
+// repeated logging from the same thread does not need a lock
+FABBER_THREAD_LOCAL long thread_id = 0;
+FABBER_THREAD_LOCAL long cached_log_id = 0;
+FABBER_THREAD_LOCAL ostream *cached_stream = NULL;
+
+long AtomicIncrement(volatile long *value)
+{
+#ifdef _WIN32
+    return InterlockedIncrement(value);
+#else
+    return __sync_add_and_fetch(value, 1);
+#endif
+}
+
+/** Set value to replacement if it is zero. Returns the resulting value */
+long AtomicSetIfZero(volatile long *value, long replacement)
+{
+#ifdef _WIN32
+    long previous = InterlockedCompareExchange(value, replacement, 0);
+#else
+    long previous = __sync_val_compare_and_swap(value, 0, replacement);
+#endif
+    return (previous == 0) ? replacement : previous;
+}
+
+#ifdef _WIN32
+class Mutex
+{
+public:
+    Mutex()
+    {
+        InitializeSRWLock(&m_lock);
+    }
+    void Lock()
+    {
+        AcquireSRWLockExclusive(&m_lock);
+    }
+    void Unlock()
+    {
+        ReleaseSRWLockExclusive(&m_lock);
+    }
+    SRWLOCK m_lock;
+};
+
+class Condition
+{
+public:
+    Condition()
+    {
+        InitializeConditionVariable(&m_cond);
+    }
+    void Wait(Mutex &mutex)
+    {
+        SleepConditionVariableSRW(&m_cond, &mutex.m_lock, INFINITE, 0);
+    }
+    void Signal()
+    {
+        WakeConditionVariable(&m_cond);
+    }
+    void Broadcast()
+    {
+        WakeAllConditionVariable(&m_cond);
+    }
+    CONDITION_VARIABLE m_cond;
+};
+#else
+class Mutex
+{
+public:
+    Mutex()
+    {
+        pthread_mutex_init(&m_lock, NULL);
+    }
+    ~Mutex()
+    {
+        pthread_mutex_destroy(&m_lock);
+    }
+    void Lock()
+    {
+        pthread_mutex_lock(&m_lock);
+    }
+    void Unlock()
+    {
+        pthread_mutex_unlock(&m_lock);
+    }
+    pthread_mutex_t m_lock;
+};
+
+class Condition
+{
+public:
+    Condition()
+    {
+        pthread_cond_init(&m_cond, NULL);
+    }
+    ~Condition()
+    {
+        pthread_cond_destroy(&m_cond);
+    }
+    void Wait(Mutex &mutex)
+    {
+        pthread_cond_wait(&m_cond, &mutex.m_lock);
+    }
+    void Signal()
+    {
+        pthread_cond_signal(&m_cond);
+    }
+    void Broadcast()
+    {
+        pthread_cond_broadcast(&m_cond);
+    }
+    pthread_cond_t m_cond;
+};
+#endif
+
+class ScopedLock
+{
+public:
+    explicit ScopedLock(Mutex &mutex)
+        : m_mutex(mutex)
+    {
+        m_mutex.Lock();
+    }
+    ~ScopedLock()
+    {
+        m_mutex.Unlock();
+    }
+
+private:
+    Mutex &m_mutex;
+};
+
+// A single background thread writes queued text for every log which writes
+// to a file. It is started when first needed and runs until the process exits,
+// so the state it uses is never destroyed
+Mutex &writer_lock = *new Mutex();
+Condition &writer_wake = *new Condition();
+Condition &writer_idle = *new Condition();
+deque<EasyLog *> &writer_pending = *new deque<EasyLog *>();
+EasyLog *writer_current = NULL;
+bool writer_started = false;
+}
+
+/**
+ * Buffer for the log output of a single thread
+ *
+ * Text is collected until the stream is flushed, then passed to the log as
+ * a single block
+ */
+class EasyLog::ThreadBuffer : public stringbuf
+{
+public:
+    explicit ThreadBuffer(EasyLog *log)
+        : m_log(log)
+        , m_stream(this)
+    {
+    }
+
+    ostream &Stream()
+    {
+        return m_stream;
+    }
+
+protected:
+    virtual int sync()
+    {
+        string text = str();
+        if (!text.empty())
+        {
+            str("");
+            m_log->Submit(text);
+        }
+        return 0;
+    }
+
+private:
+    EasyLog *m_log;
+    ostream m_stream;
+};
+
+struct EasyLog::Impl
+{
+    Impl()
+        : started(false)
+        , async(false)
+        , scheduled(false)
+    {
+    }
+
+#ifdef _WIN32
+    static DWORD WINAPI WriterThread(LPVOID)
+    {
+        EasyLog::WriterLoop();
+        return 0;
+    }
+#else
+    static void *WriterThread(void *)
+    {
+        EasyLog::WriterLoop();
+        return NULL;
+    }
+#endif
+
+    /** Protects the thread buffers and warning records */
+    Mutex state_lock;
+    /** Protects the queue and the started and async flags */
+    Mutex queue_lock;
+    /** Held while writing to the output stream so queued text is written in order */
+    Mutex output_lock;
+
+    std::string queue;
+    bool started;
+    /** If true queued text is written by the writer thread, otherwise by the thread which logged it */
+    bool async;
+    /** True if this log is waiting for the writer thread. Protected by writer_lock */
+    bool scheduled;
+    std::map<long, ThreadBuffer *> buffers;
+};
+
 EasyLog::EasyLog()
     : m_stream(0)
     , m_outdir("")
+    , m_level(LEVEL_INFO)
+    , m_id(AtomicIncrement(&num_logs))
+    , m_impl(new Impl())
 {
+    for (int i = 0; i < MAX_WARN_SITES; i++)
+        m_sitecount[i] = 0;
 }
 
 EasyLog::~EasyLog()
 {
+    Detach();
+    if (m_stream != NULL)
+    {
+        ScopedLock output_lock(m_impl->output_lock);
+        WriteQueued();
+        m_stream->flush();
+        if (m_outdir != "")
+            delete m_stream;
+    }
+    for (map<long, ThreadBuffer *>::iterator it = m_impl->buffers.begin();
+         it != m_impl->buffers.end(); ++it)
+    {
+        delete it->second;
+    }
+    delete m_impl;
 }
+
 void EasyLog::StartLog(const string &outDir)
 {
     assert(m_stream == NULL);
     assert(outDir != "");
 
-    m_stream = new ofstream((outDir + "/logfile").c_str());
-    if (!m_stream->good())
+    ofstream *stream = new ofstream((outDir + "/logfile").c_str());
+    if (!stream->good())
     {
-        delete m_stream;
-        m_stream = NULL;
+        delete stream;
         cerr << "Cannot open logfile in " << outDir << endl;
         throw runtime_error("Cannot open logfile!");
     }
 
-    // Flush any temporary logging
-    *m_stream << m_templog.str() << flush;
+    Start(*stream, true);
     m_outdir = outDir;
 }
 
 void EasyLog::StartLog(ostream &s)
+{
+    // Other streams, e.g. the console, are written synchronously so log
+    // output stays in order with anything written to them directly
+    Start(s, false);
+}
+
+void EasyLog::Start(ostream &s, bool async)
 {
     assert(m_stream == NULL);
-    m_stream = &s;
+    {
+        // Flush any temporary logging
+        ScopedLock output_lock(m_impl->output_lock);
+        m_stream = &s;
+        WriteQueued();
+        m_stream->flush();
+    }
     m_outdir = "";
 
-    // Flush any temporary logging
-    *m_stream << m_templog.str() << flush;
+    ScopedLock queue_lock(m_impl->queue_lock);
+    m_impl->started = true;
+    m_impl->async = async;
 }
 
 void EasyLog::StopLog(bool gzip)
 {
     assert(m_stream != NULL);
 
+    // Other threads should have finished logging by now, so include their
+    // partial lines as well as our own
+    {
+        ScopedLock state_lock(m_impl->state_lock);
+        for (map<long, ThreadBuffer *>::iterator it = m_impl->buffers.begin();
+             it != m_impl->buffers.end(); ++it)
+        {
+            it->second->pubsync();
+        }
+    }
+    {
+        ScopedLock queue_lock(m_impl->queue_lock);
+        m_impl->started = false;
+        m_impl->async = false;
+    }
+    Detach();
+    {
+        ScopedLock output_lock(m_impl->output_lock);
+        WriteQueued();
+        m_stream->flush();
+    }
+
     if (m_outdir != "")
     {
         if (gzip)
         {
 #ifdef _WIN32
-            LogStream() << "EasyLog::GZIP logfile not supported under Windows" << std::endl;
+            *m_stream << "EasyLog::GZIP logfile not supported under Windows" << std::endl;
 #else
             int retVal = system(("gzip " + m_outdir + "/logfile").c_str());
             if (retVal != 0)
-                LogStream() << "Failed to gzip logfile.  Oh well." << std::endl;
+                *m_stream << "Failed to gzip logfile.  Oh well." << std::endl;
 #endif
         }
         // We created this ofstream and need to tidy it up
@@ -82,6 +373,17 @@ void EasyLog::StopLog(bool gzip)
     m_outdir = "";
 }
 
+void EasyLog::Flush()
+{
+    ThreadStream().flush();
+    ScopedLock output_lock(m_impl->output_lock);
+    if (m_stream != NULL)
+    {
+        WriteQueued();
+        m_stream->flush();
+    }
+}
+
 bool EasyLog::LogStarted()
 {
     return m_stream != NULL;
@@ -92,35 +394,233 @@ const string &EasyLog::GetOutputDirectory()
 }
 std::ostream &EasyLog::LogStream()
 {
-    if (m_stream == NULL)
+    if (cached_log_id == m_id)
+        return *cached_stream;
+    else
+        return ThreadStream();
+}
+
+std::ostream &EasyLog::ThreadStream()
+{
+    if (thread_id == 0)
+        thread_id = AtomicIncrement(&num_threads);
+
+    ScopedLock state_lock(m_impl->state_lock);
+    ThreadBuffer *&buffer = m_impl->buffers[thread_id];
+    if (buffer == NULL)
+        buffer = new ThreadBuffer(this);
+    cached_log_id = m_id;
+    cached_stream = &buffer->Stream();
+    return *cached_stream;
+}
+
+void EasyLog::Submit(const string &text)
+{
+    bool write_now = false, schedule = false;
     {
-        return m_templog;
+        ScopedLock queue_lock(m_impl->queue_lock);
+        m_impl->queue += text;
+        if (m_impl->started)
+        {
+            schedule = m_impl->async;
+            write_now = !m_impl->async;
+        }
     }
-    else
+    if (schedule)
+        write_now = !Schedule();
+    if (write_now)
+    {
+        ScopedLock output_lock(m_impl->output_lock);
+        if (m_stream != NULL)
+        {
+            WriteQueued();
+            m_stream->flush();
+        }
+    }
+}
+
+void EasyLog::WriteQueued()
+{
+    string text;
+    {
+        ScopedLock queue_lock(m_impl->queue_lock);
+        text.swap(m_impl->queue);
+    }
+    if (!text.empty())
+        *m_stream << text;
+}
+
+bool EasyLog::Schedule()
+{
+    ScopedLock lock(writer_lock);
+    if (!writer_started)
+    {
+#ifdef _WIN32
+        HANDLE thread = CreateThread(NULL, 0, Impl::WriterThread, NULL, 0, NULL);
+        if (thread != NULL)
+        {
+            CloseHandle(thread);
+            writer_started = true;
+        }
+#else
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, Impl::WriterThread, NULL) == 0)
+        {
+            pthread_detach(thread);
+            writer_started = true;
+        }
+#endif
+        if (!writer_started)
+            return false;
+        // Write anything still queued if the process exits without stopping its logs
+        atexit(FlushAtExit);
+    }
+    if (!m_impl->scheduled)
     {
-        return *m_stream;
+        m_impl->scheduled = true;
+        writer_pending.push_back(this);
+        writer_wake.Signal();
     }
+    return true;
+}
+
+void EasyLog::Detach()
+{
+    ScopedLock lock(writer_lock);
+    if (m_impl->scheduled)
+    {
+        writer_pending.erase(find(writer_pending.begin(), writer_pending.end(), this));
+        m_impl->scheduled = false;
+    }
+    while (writer_current == this)
+        writer_idle.Wait(writer_lock);
+}
+
+void EasyLog::WriterLoop()
+{
+    while (true)
+    {
+        EasyLog *log;
+        {
+            ScopedLock lock(writer_lock);
+            while (writer_pending.empty())
+                writer_wake.Wait(writer_lock);
+            log = writer_pending.front();
+            writer_pending.pop_front();
+            log->m_impl->scheduled = false;
+            writer_current = log;
+        }
+        {
+            ScopedLock output_lock(log->m_impl->output_lock);
+            if (log->m_stream != NULL)
+            {
+                log->WriteQueued();
+                log->m_stream->flush();
+            }
+        }
+        ScopedLock lock(writer_lock);
+        writer_current = NULL;
+        writer_idle.Broadcast();
+    }
+}
+
+void EasyLog::FlushAtExit()
+{
+    ScopedLock lock(writer_lock);
+    while (writer_current != NULL)
+        writer_idle.Wait(writer_lock);
+    while (!writer_pending.empty())
+    {
+        EasyLog *log = writer_pending.front();
+        writer_pending.pop_front();
+        log->m_impl->scheduled = false;
+        ScopedLock output_lock(log->m_impl->output_lock);
+        if (log->m_stream != NULL)
+        {
+            log->WriteQueued();
+            log->m_stream->flush();
+        }
+    }
+}
+
+bool EasyLog::ParseLevel(const string &name, int &level)
+{
+    if (name == "warn")
+        level = LEVEL_WARN;
+    else if (name == "info")
+        level = LEVEL_INFO;
+    else if (name == "verbose")
+        level = LEVEL_VERBOSE;
+    else if (name == "debug")
+        level = LEVEL_DEBUG;
+    else
+        return false;
+    return true;
 }
 
 void EasyLog::WarnOnce(const string &text)
 {
-    if (++m_warncount[text] == 1)
+    int count;
+    {
+        ScopedLock state_lock(m_impl->state_lock);
+        count = ++m_warncount[text];
+    }
+    if (count == 1)
         LogStream() << "WARNING ONCE: " << text << std::endl;
 }
 
+long EasyLog::CountWarning(long &site)
+{
+    if (site == 0)
+    {
+        // Racing threads may both allocate an ID but only one is kept
+        long id = AtomicIncrement(&num_warn_sites);
+        site = AtomicSetIfZero(&site, id);
+    }
+    if (site > MAX_WARN_SITES)
+        return 1;
+    return AtomicIncrement(&m_sitecount[site - 1]);
+}
+
+void EasyLog::WarnOnce(const string &text, long site)
+{
+    if (site > MAX_WARN_SITES)
+    {
+        WarnOnce(text);
+        return;
+    }
+    {
+        ScopedLock state_lock(m_impl->state_lock);
+        m_sitetext[site] = text;
+    }
+    LogStream() << "WARNING ONCE: " << text << std::endl;
+}
+
 void EasyLog::WarnAlways(const string &text)
 {
-    ++m_warncount[text];
+    {
+        ScopedLock state_lock(m_impl->state_lock);
+        ++m_warncount[text];
+    }
     LogStream() << "WARNING ALWAYS: " << text << std::endl;
 }
 
 void EasyLog::ReissueWarnings()
 {
-    if (m_warncount.size() == 0)
+    // Copy the counts so we do not hold the lock while logging
+    map<string, long> counts;
+    {
+        ScopedLock state_lock(m_impl->state_lock);
+        for (map<string, int>::iterator it = m_warncount.begin(); it != m_warncount.end(); ++it)
+            counts[it->first] += it->second;
+        for (map<long, string>::iterator it = m_sitetext.begin(); it != m_sitetext.end(); ++it)
+            counts[it->second] += m_sitecount[it->first - 1];
+    }
+    if (counts.size() == 0)
         return; // avoid issuing pointless message
 
-    LogStream() << "\nSummary of warnings (" << m_warncount.size() << " distinct warnings)\n";
-    for (map<string, int>::iterator it = m_warncount.begin(); it != m_warncount.end(); ++it)
+    LogStream() << "\nSummary of warnings (" << counts.size() << " distinct warnings)\n";
+    for (map<string, long>::iterator it = counts.begin(); it != counts.end(); ++it)
         LogStream() << "Issued "
                     << ((it->second == 1) ? "once: " : stringify(it->second) + " times: ")
                     << it->first << std::endl;
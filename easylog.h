@@ -17,17 +17,70 @@
 #include <vector>
 
 /**
- * Use LOG just like you'd use cout.  (i.e. LOG << your_data << endl;)
- * Your class must be derived from Loggable.
+ * The log stream whatever the log level, for use where a stream is required,
+ * e.g. passing to a function. Your class must be derived from Loggable.
  *
  * If the log member variable m_log is not set, log output goes to stderr
  */
-#define LOG ((m_log == 0) ? std::cerr : m_log->LogStream())
-#define LOG_ERR(x) ((void)((LOG << x)))
+#define LOG_STREAM ((m_log == 0) ? std::cerr : m_log->LogStream())
+#define LOG_ERR(x) ((void)((LOG_STREAM << x)))
+
+/**
+ * Log at a given level, e.g. LOG_AT(EasyLog::LEVEL_VERBOSE) << data << endl;
+ *
+ * If the level is not enabled nothing following the macro is evaluated, so
+ * the cost of a disabled message is a single comparison. This is a
+ * statement, not an expression, written as a loop which runs at most once so
+ * it can be used in an if without braces.
+ */
+#define LOG_AT(level)                                                                              \
+    for (bool log_enabled = EasyLog::Enabled(m_log, level); log_enabled; log_enabled = false)      \
+    LOG_STREAM
+
+/**
+ * Use LOG just like you'd use cout.  (i.e. LOG << your_data << endl;)
+ *
+ * These are the usual progress messages, which are not logged with
+ * --log-level=warn
+ */
+#define LOG LOG_AT(EasyLog::LEVEL_INFO)
 
+/** Problems which are logged at every log level but are not worth a WARN_ONCE */
+#define LOG_WARN LOG_AT(EasyLog::LEVEL_WARN)
+
+/** Per-iteration progress information, e.g. spatial prior hyperparameter updates */
+#define LOG_VERBOSE LOG_AT(EasyLog::LEVEL_VERBOSE)
+
+/** Per-voxel tracing, only useful for very small numbers of voxels */
+#define LOG_DEBUG LOG_AT(EasyLog::LEVEL_DEBUG)
+
+/**
+ * Issue a warning once for each call site
+ *
+ * Repeat warnings from the same site only increment a counter, without
+ * evaluating the message. Messages which contain variable values therefore
+ * only report the first value - use WARN_ONCE_TEXT if each distinct message
+ * should appear in the log.
+ */
 #define WARN_ONCE(x)                                                                               \
-    if (m_log)                                                                                     \
-    m_log->WarnOnce(x)
+    do                                                                                             \
+    {                                                                                              \
+        static long warn_site = 0;                                                                 \
+        if (m_log && m_log->CountWarning(warn_site) == 1)                                          \
+            m_log->WarnOnce(x, warn_site);                                                         \
+    } while (0)
+/**
+ * Issue a warning once for each distinct message
+ *
+ * The message is always evaluated and looked up under a lock, so this
+ * should not be used in hot loops
+ */
+#define WARN_ONCE_TEXT(x)                                                                          \
+    do                                                                                             \
+    {                                                                                              \
+        if (m_log)                                                                                 \
+            m_log->WarnOnce(x);                                                                    \
+    } while (0)
 #define WARN_ALWAYS(x)                                                                             \
     if (m_log)                                                                                     \
     m_log->WarnAlways(x)
@@ -36,8 +89,16 @@
  * Sends logging information to an output stream
  *
  * StartLog() is used to tell the logger where to put the output - any log
- * calls made before this are stored in a temporary stringstream and then
- * flushed to the log once StartLog is called.
+ * calls made before this are stored in memory and then flushed to the log
+ * once StartLog is called.
+ *
+ * Each thread writes into its own buffer, which is passed to the log when it
+ * is flushed (e.g. by std::endl), so threads do not interleave partial lines.
+ * When logging to a file, completed messages are written by a background
+ * thread shared by all logs so threads do not wait for the output. Other
+ * streams, e.g. the console, are written by the logging thread so output
+ * stays in order with anything written to them directly. StopLog() and
+ * Flush() write everything logged so far.
  *
  * If you want to dump variables directly to this stream, just implement
  * std::ostream& operator<<(std::ostream& stream, const your_type& data);
@@ -45,6 +106,23 @@
 class EasyLog
 {
 public:
+    /**
+     * Log levels, in increasing order of detail
+     */
+    enum Level
+    {
+        LEVEL_WARN = 0,
+        LEVEL_INFO = 1,
+        LEVEL_VERBOSE = 2,
+        LEVEL_DEBUG = 3
+    };
+
+    /**
+     * Maximum number of distinct WARN_ONCE call sites which are counted
+     * without a lock. Any further sites use the same path as WarnOnce(text)
+     */
+    static const int MAX_WARN_SITES = 256;
+
     /**
      * Log output to an existing stream
      *
@@ -84,6 +162,14 @@ public:
      */
     void StopLog(bool gzip = false);
 
+    /**
+     * Write all messages logged so far to the output stream
+     *
+     * Partial lines in the calling thread's buffer are included. Has no
+     * effect before StartLog has been called
+     */
+    void Flush();
+
     /**
      * @return true if StartLog has been called
      */
@@ -94,6 +180,40 @@ public:
      */
     std::ostream &LogStream();
 
+    /**
+     * Set the most detailed level of messages which will be logged
+     *
+     * LOG itself is always at LEVEL_INFO
+     */
+    void SetLevel(int level)
+    {
+        m_level = level;
+    }
+
+    /**
+     * @return the current log level
+     */
+    int GetLevel() const
+    {
+        return m_level;
+    }
+
+    /**
+     * Convert a level name (warn, info, verbose, debug) to a level
+     *
+     * @return false if the name was not recognized
+     */
+    static bool ParseLevel(const std::string &name, int &level);
+
+    /**
+     * @return true if messages at the given level should be logged. A NULL log
+     *         has the default level, LEVEL_INFO
+     */
+    static bool Enabled(const EasyLog *log, int level)
+    {
+        return level <= (log ? log->m_level : int(LEVEL_INFO));
+    }
+
     /**
      * Issue a warning
      *
@@ -104,6 +224,22 @@ public:
      */
     void WarnOnce(const std::string &text);
 
+    /**
+     * Count a warning from a WARN_ONCE call site
+     *
+     * The site is identified by a static long which is zero until the
+     * first call, when it is assigned an ID. No lock is taken.
+     *
+     * @return number of times this site has issued a warning to this log,
+     *         including this one
+     */
+    long CountWarning(long &site);
+
+    /**
+     * Issue the first warning from a WARN_ONCE call site
+     */
+    void WarnOnce(const std::string &text, long site);
+
     /**
      * Issue a warning
      *
@@ -117,10 +253,50 @@ public:
     void ReissueWarnings();
 
 private:
+    // Not copyable - the writer and per-thread buffers refer to this instance
+    EasyLog(const EasyLog &);
+    EasyLog &operator=(const EasyLog &);
+
+    class ThreadBuffer;
+    friend class ThreadBuffer;
+    struct Impl;
+
+    /** Queue completed text from a thread buffer for writing */
+    void Submit(const std::string &text);
+
+    /** Start logging to a stream, optionally using the background writer */
+    void Start(std::ostream &s, bool async);
+
+    /** Write everything which is queued. The output lock must be held */
+    void WriteQueued();
+
+    /**
+     * Ask the background writer to write this log's queue, starting it if required
+     *
+     * @return false if the writer could not be started
+     */
+    bool Schedule();
+
+    /** Remove this log from the background writer, waiting if it is being written */
+    void Detach();
+
+    /** Entry point for the background writer thread */
+    static void WriterLoop();
+
+    /** Write logs which are still waiting for the writer when the process exits */
+    static void FlushAtExit();
+
+    /** Get the stream for the calling thread, creating it if required */
+    std::ostream &ThreadStream();
+
     std::ostream *m_stream;
-    std::stringstream m_templog;
     std::string m_outdir;
+    int m_level;
+    long m_id;
+    Impl *m_impl;
     std::map<std::string, int> m_warncount;
+    volatile long m_sitecount[MAX_WARN_SITES];
+    std::map<long, std::string> m_sitetext;
 };
 
 class Loggable
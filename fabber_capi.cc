@@ -15,6 +15,7 @@
 #include "inference.h"
 #include "rundata_array.h"
 #include "setup.h"
+#include "tools.h"
 
 #include "newmat.h"
 
@@ -26,9 +27,142 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
 using NEWMAT::Matrix;
 using namespace std;
 
+namespace
+{
+/** Set a flag shared between threads, with a full memory barrier */
+void AtomicSetFlag(volatile long *flag, long value)
+{
+#ifdef _WIN32
+    InterlockedExchange(flag, value);
+#else
+    __sync_lock_test_and_set(flag, value);
+    __sync_synchronize();
+#endif
+}
+
+/** Read a flag shared between threads, with a full memory barrier */
+long AtomicGetFlag(volatile long *flag)
+{
+#ifdef _WIN32
+    return InterlockedCompareExchange(flag, 0, 0);
+#else
+    return __sync_add_and_fetch(flag, 0);
+#endif
+}
+}
+
+/**
+ * State belonging to a single API handle.
+ *
+ * Nothing in here is shared between handles so different handles may be
+ * used concurrently from different threads. A single handle must not be
+ * used from more than one thread at a time.
+ */
+struct FabberHandle
+{
+    FabberHandle()
+        : rundata(false)
+        , null_stream(NULL)
+        , cancel_requested(0)
+    {
+        null_log.StartLog(null_stream);
+        rundata.SetLogger(&null_log);
+    }
+
+    /**
+     * Log used by fabber_dorun. This persists for the lifetime of the handle
+     * since a prepared session keeps using it between runs
+     */
+    EasyLog run_log;
+
+    /** Options, voxel data and output data for this handle */
+    FabberRunDataArray rundata;
+
+    /** Discards log output from calls other than fabber_dorun */
+    std::ostream null_stream;
+    EasyLog null_log;
+
+    /**
+     * Set by fabber_cancel, possibly from another thread, so only accessed
+     * using AtomicSetFlag and AtomicGetFlag
+     */
+    volatile long cancel_requested;
+};
+
+/**
+ * Progress checker which forwards to the callbacks passed to fabber_dorun_callbacks
+ */
+class CallbackRunControl : public ProgressCheck
+{
+public:
+    CallbackRunControl(FabberHandle *handle, void (*progress_cb)(int, int),
+        int (*cancel_cb)(void *), int block_size,
+        void (*results_cb)(int, int, int, const float *, const float *, void *), void *user_data)
+        : m_handle(handle)
+        , m_progress_cb(progress_cb)
+        , m_cancel_cb(cancel_cb)
+        , m_block_size(block_size)
+        , m_results_cb(results_cb)
+        , m_user_data(user_data)
+    {
+    }
+
+    void Progress(int voxel, int nVoxels)
+    {
+        if (m_progress_cb)
+            m_progress_cb(voxel, nVoxels);
+    }
+
+    bool Cancelled()
+    {
+        return AtomicGetFlag(&m_handle->cancel_requested)
+            || (m_cancel_cb && m_cancel_cb(m_user_data));
+    }
+
+    int PartialResultsInterval()
+    {
+        return m_results_cb ? m_block_size : 0;
+    }
+
+    void PartialResults(int first_voxel, const Matrix &means, const Matrix &variances)
+    {
+        int nparams = means.Nrows();
+        int nvoxels = means.Ncols();
+        m_means.resize(nparams * nvoxels);
+        m_vars.resize(nparams * nvoxels);
+        for (int v = 0; v < nvoxels; v++)
+        {
+            for (int p = 0; p < nparams; p++)
+            {
+                m_means[v * nparams + p] = means(p + 1, v + 1);
+                m_vars[v * nparams + p] = variances(p + 1, v + 1);
+            }
+        }
+        m_results_cb(
+            first_voxel - 1, nvoxels, nparams, &m_means[0], &m_vars[0], m_user_data);
+    }
+
+private:
+    FabberHandle *m_handle;
+    void (*m_progress_cb)(int, int);
+    int (*m_cancel_cb)(void *);
+    int m_block_size;
+    void (*m_results_cb)(int, int, int, const float *, const float *, void *);
+    void *m_user_data;
+    vector<float> m_means, m_vars;
+};
+
 static int fabber_err(int code, const char *msg, char *err_buf)
 {
     // Error buffer is optional
@@ -47,8 +181,7 @@ void *fabber_new(char *err_buf)
     try
     {
         FabberSetup::SetupDefaults();
-        FabberRunDataArray *rundata = new FabberRunDataArray(false);
-        return rundata;
+        return new FabberHandle();
     }
     catch (...)
     {
@@ -85,9 +218,10 @@ int fabber_set_extent(
     if ((nx <= 0) || (ny <= 0) || (nz <= 0))
         return fabber_err(FABBER_ERR_FATAL, "Dimensions must be >0", err_buf);
 
+    fabber::MatrixLock matrix_lock;
     try
     {
-        FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+        FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
         rundata->SetExtent(nx, ny, nz, mask);
         return 0;
     }
@@ -115,7 +249,9 @@ int fabber_set_opt(void *fab, const char *key, const char *value, char *err_buf)
 
     try
     {
-        FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+        // Options cannot change within a session
+        FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
+        rundata->EndSession();
         rundata->Set(key, value);
         return 0;
     }
@@ -137,9 +273,8 @@ int fabber_set_data(
     if (data_size <= 0)
         return fabber_err(FABBER_ERR_FATAL, "Data size must be >0", err_buf);
 
-    FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-    EasyLog log;
-    rundata->SetLogger(&log); // Ignored but avoids it going to stdout
+    fabber::MatrixLock matrix_lock;
+    FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
     try
     {
         rundata->SetVoxelDataArray(name, data_size, data);
@@ -155,6 +290,61 @@ int fabber_set_data(
     return 0;
 }
 
+int fabber_set_data_buffer(void *fab, const char *name, unsigned int data_size,
+    const float *data, int masked, char *err_buf)
+{
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    if (!data)
+        return fabber_err(FABBER_ERR_FATAL, "Data buffer is NULL", err_buf);
+    if (!name)
+        return fabber_err(FABBER_ERR_FATAL, "Data name is NULL", err_buf);
+    if (data_size <= 0)
+        return fabber_err(FABBER_ERR_FATAL, "Data size must be >0", err_buf);
+
+    fabber::MatrixLock matrix_lock;
+    FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
+    try
+    {
+        rundata->SetVoxelDataBuffer(name, data_size, data, masked != 0);
+    }
+    catch (exception &e)
+    {
+        return fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
+    }
+    catch (...)
+    {
+        return fabber_err(FABBER_ERR_FATAL, "Error setting data buffer", err_buf);
+    }
+    return 0;
+}
+
+int fabber_set_output_buffer(void *fab, const char *name, unsigned int buf_size,
+    float *data_buf, int masked, char *err_buf)
+{
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    if (!data_buf)
+        return fabber_err(FABBER_ERR_FATAL, "Data buffer is NULL", err_buf);
+    if (!name)
+        return fabber_err(FABBER_ERR_FATAL, "Data name is NULL", err_buf);
+
+    FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
+    try
+    {
+        rundata->SetOutputBuffer(name, buf_size, data_buf, masked != 0);
+    }
+    catch (exception &e)
+    {
+        return fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
+    }
+    catch (...)
+    {
+        return fabber_err(FABBER_ERR_FATAL, "Error setting output buffer", err_buf);
+    }
+    return 0;
+}
+
 int fabber_get_data_size(void *fab, const char *name, char *err_buf)
 {
     if (!fab)
@@ -162,9 +352,8 @@ int fabber_get_data_size(void *fab, const char *name, char *err_buf)
     if (!name)
         return fabber_err(FABBER_ERR_FATAL, "Data name is NULL", err_buf);
 
-    FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-    EasyLog log;
-    rundata->SetLogger(&log); // Ignored but avoids it going to stdout
+    fabber::MatrixLock matrix_lock;
+    FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
     try
     {
         return rundata->GetVoxelDataSize(name);
@@ -188,9 +377,8 @@ int fabber_get_data(void *fab, const char *name, float *data_buf, char *err_buf)
     if (!data_buf)
         return fabber_err(FABBER_ERR_FATAL, "Data name is NULL", err_buf);
 
-    FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-    EasyLog log;
-    rundata->SetLogger(&log); // Ignored but avoids it going to stdout
+    fabber::MatrixLock matrix_lock;
+    FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
     try
     {
         rundata->GetVoxelDataArray(name, data_buf);
@@ -209,8 +397,14 @@ int fabber_get_data(void *fab, const char *name, float *data_buf, char *err_buf)
 int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_buf,
     void (*progress_cb)(int, int))
 {
-    EasyLog log;
+    return fabber_dorun_callbacks(
+        fab, log_bufsize, log_buf, err_buf, progress_cb, NULL, 0, NULL, NULL);
+}
 
+int fabber_dorun_callbacks(void *fab, unsigned int log_bufsize, char *log_buf, char *err_buf,
+    void (*progress_cb)(int, int), int (*cancel_cb)(void *), int block_size,
+    void (*results_cb)(int, int, int, const float *, const float *, void *), void *user_data)
+{
     if (!fab)
         return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
     if (!log_buf)
@@ -219,24 +413,29 @@ int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_b
         return fabber_err(FABBER_ERR_FATAL, "Error buffer is NULL", err_buf);
     if (log_bufsize > 0 && !log_buf)
         return fabber_err(FABBER_ERR_FATAL, "Log buffer is NULL", err_buf);
+    if (results_cb && block_size <= 0)
+        return fabber_err(FABBER_ERR_FATAL, "Block size for partial results must be > 0", err_buf);
 
+    fabber::MatrixLock matrix_lock;
     int ret = 0;
-    FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+    EasyLog &log = ((FabberHandle *)fab)->run_log;
+    FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
     rundata->SetLogger(&log);
     stringstream logstr;
     try
     {
         log.StartLog(logstr);
-        if (progress_cb)
-        {
-            CallbackProgressCheck prog(progress_cb);
-            rundata->Run(&prog);
-        }
-        else
-        {
-            rundata->Run();
-        }
+        AtomicSetFlag(&((FabberHandle *)fab)->cancel_requested, 0);
+        CallbackRunControl control(
+            (FabberHandle *)fab, progress_cb, cancel_cb, block_size, results_cb, user_data);
+        rundata->Run(&control);
+        log.ReissueWarnings();
+    }
+    catch (const FabberRunCancelled &e)
+    {
         log.ReissueWarnings();
+        log.LogStream() << e.what() << endl;
+        ret = fabber_err(FABBER_ERR_CANCELLED, e.what(), err_buf);
     }
     catch (const FabberError &e)
     {
@@ -264,6 +463,7 @@ int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_b
     }
 
     log.StopLog();
+    rundata->SetLogger(&((FabberHandle *)fab)->null_log);
 
     strncpy(log_buf, logstr.str().c_str(), log_bufsize - 1);
     log_buf[log_bufsize - 1] = '\0';
@@ -271,15 +471,46 @@ int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_b
     return ret;
 }
 
-void fabber_destroy(void *fab)
+void fabber_cancel(void *fab)
 {
     if (fab)
+        AtomicSetFlag(&((FabberHandle *)fab)->cancel_requested, 1);
+}
+
+int fabber_prepare(void *fab, char *err_buf)
+{
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+
+    fabber::MatrixLock matrix_lock;
+    FabberHandle *handle = (FabberHandle *)fab;
+    int ret = 0;
+    handle->rundata.SetLogger(&handle->run_log);
+    try
+    {
+        handle->rundata.StartSession();
+    }
+    catch (NEWMAT::Exception &e)
     {
-        // Get rid of registered models etc
-        FabberSetup::Destroy();
-        FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-        delete rundata;
+        ret = fabber_err(FABBER_ERR_NEWMAT, e.what(), err_buf);
+    }
+    catch (exception &e)
+    {
+        ret = fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
     }
+    catch (...)
+    {
+        ret = fabber_err(FABBER_ERR_FATAL, "Error preparing session", err_buf);
+    }
+    handle->rundata.SetLogger(&handle->null_log);
+    return ret;
+}
+
+void fabber_destroy(void *fab)
+{
+    fabber::MatrixLock matrix_lock;
+    // Registered models etc are shared between handles and are not destroyed here
+    delete (FabberHandle *)fab;
 }
 
 int fabber_get_options(void *fab, const char *key, const char *value, unsigned int out_bufsize,
@@ -422,9 +653,10 @@ int fabber_get_model_params(void *fab, unsigned int out_bufsize, char *out_buf,
     if (!out_buf)
         return fabber_err(FABBER_ERR_FATAL, "Output buffer is NULL", err_buf);
 
+    fabber::MatrixLock matrix_lock;
     try
     {
-        FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+        FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
         std::auto_ptr<FwdModel> model(FwdModel::NewFromName(rundata->GetString("model")));
         EasyLog log;
         model->SetLogger(&log); // We ignore the log but this stops it going to cerr
@@ -463,9 +695,10 @@ int fabber_get_model_param_descs(void *fab, unsigned int out_bufsize, char *out_
     if (!out_buf)
         return fabber_err(FABBER_ERR_FATAL, "Output buffer is NULL", err_buf);
 
+    fabber::MatrixLock matrix_lock;
     try
     {
-        FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+        FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
         std::auto_ptr<FwdModel> model(FwdModel::NewFromName(rundata->GetString("model")));
         EasyLog log;
         model->SetLogger(&log); // We ignore the log but this stops it going to cerr
@@ -509,9 +742,10 @@ int fabber_get_model_outputs(void *fab, unsigned int out_bufsize, char *out_buf,
     if (!out_buf)
         return fabber_err(FABBER_ERR_FATAL, "Output buffer is NULL", err_buf);
 
+    fabber::MatrixLock matrix_lock;
     try
     {
-        FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+        FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
         std::auto_ptr<FwdModel> model(FwdModel::NewFromName(rundata->GetString("model")));
         EasyLog log;
         model->SetLogger(&log); // We ignore the log but this stops it going to cerr
@@ -562,12 +796,13 @@ int fabber_model_evaluate_output(void *fab, unsigned int n_params, float *params
     if (!output)
         return fabber_err(FABBER_ERR_FATAL, "Output buffer is NULL", err_buf);
 
+    fabber::MatrixLock matrix_lock;
     EasyLog log;
     int ret = FABBER_ERR_FATAL;
     stringstream logstr;
     try
     {
-        FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+        FabberRunDataArray *rundata = &((FabberHandle *)fab)->rundata;
         std::auto_ptr<FwdModel> model(FwdModel::NewFromName(rundata->GetString("model")));
 
         log.StartLog(logstr);
@@ -621,3 +856,148 @@ int fabber_model_evaluate_output(void *fab, unsigned int n_params, float *params
     log.StopLog();
     return ret;
 }
+
+int fabber_model_evaluate_batch(void *fab, unsigned int n_rows, unsigned int n_params,
+    const float *params, unsigned int n_ts, const float *indata, const char *output_name,
+    float *output, char *err_buf)
+{
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    if (!params)
+        return fabber_err(FABBER_ERR_FATAL, "Params array is NULL", err_buf);
+    if (!output_name)
+        return fabber_err(FABBER_ERR_FATAL, "Output name is NULL", err_buf);
+    if (!output)
+        return fabber_err(FABBER_ERR_FATAL, "Output buffer is NULL", err_buf);
+
+    // Rows are only evaluated in parallel if the matrix library allows it
+    fabber::MatrixLock matrix_lock;
+    int n_threads = 1;
+#ifdef _OPENMP
+    n_threads = fabber::MatrixLock::ThreadSafe() ? omp_get_max_threads() : 1;
+    if (n_threads > (int)n_rows)
+        n_threads = n_rows;
+    if (n_threads < 1)
+        n_threads = 1;
+#endif
+
+    // Each thread gets its own model instance since models may store per-voxel
+    // state. These are initialized up front as reading options is not thread-safe.
+    // Log output is discarded using the handle's null log, which any thread may use
+    FabberHandle *handle = (FabberHandle *)fab;
+    vector<FwdModel *> models;
+    int ret = 0;
+    string err;
+    try
+    {
+        FabberRunDataArray *rundata = &handle->rundata;
+        for (int t = 0; t < n_threads; t++)
+        {
+            models.push_back(FwdModel::NewFromName(rundata->GetString("model")));
+            models[t]->SetLogger(&handle->null_log);
+            models[t]->Initialize(*rundata);
+        }
+
+        // The parameter buffer is indexed using n_params, so it must match the model
+        if (models[0]->NumParams() != (int)n_params)
+        {
+            ret = FABBER_ERR_FATAL;
+            err = "Model has " + stringify(models[0]->NumParams()) + " parameters but "
+                + stringify(n_params) + " were given";
+        }
+    }
+    catch (exception &e)
+    {
+        ret = FABBER_ERR_FATAL;
+        err = e.what();
+    }
+    catch (...)
+    {
+        ret = FABBER_ERR_FATAL;
+        err = "Error initializing model";
+    }
+
+    if (ret == 0)
+    {
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads)
+#endif
+        {
+            int thread = 0;
+#ifdef _OPENMP
+            thread = omp_get_thread_num();
+#endif
+            FwdModel *model = models[thread];
+            NEWMAT::ColumnVector p_vec(n_params);
+            NEWMAT::ColumnVector o_vec(n_ts);
+            NEWMAT::ColumnVector data_vec(n_ts);
+            NEWMAT::ColumnVector coords(3);
+            coords = 1;
+            data_vec = 0;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+            for (int row = 0; row < (int)n_rows; row++)
+            {
+                // Exceptions must not escape the parallel region
+                try
+                {
+                    const float *row_params = params + (size_t)row * n_params;
+                    float *row_output = output + (size_t)row * n_ts;
+                    for (unsigned int i = 0; i < n_params; i++)
+                    {
+                        p_vec(i + 1) = row_params[i];
+                    }
+                    if (indata)
+                    {
+                        const float *row_data = indata + (size_t)row * n_ts;
+                        for (unsigned int i = 0; i < n_ts; i++)
+                        {
+                            data_vec(i + 1) = row_data[i];
+                        }
+                    }
+                    model->PassData(row + 1, data_vec, coords);
+                    model->EvaluateModel(p_vec, o_vec, output_name);
+                    for (unsigned int i = 0; i < n_ts; i++)
+                    {
+                        // Model may not return the same number of timepoints as passed in!
+                        if ((int)i < o_vec.Nrows())
+                            row_output[i] = o_vec(i + 1);
+                        else
+                            row_output[i] = 0;
+                    }
+                }
+                catch (exception &e)
+                {
+#ifdef _OPENMP
+#pragma omp critical(fabber_batch_error)
+#endif
+                    {
+                        ret = FABBER_ERR_FATAL;
+                        err = e.what();
+                    }
+                }
+                catch (...)
+                {
+#ifdef _OPENMP
+#pragma omp critical(fabber_batch_error)
+#endif
+                    {
+                        ret = FABBER_ERR_FATAL;
+                        err = "Error evaluating model";
+                    }
+                }
+            }
+        }
+    }
+
+    for (unsigned int t = 0; t < models.size(); t++)
+    {
+        delete models[t];
+    }
+
+    if (ret != 0)
+        return fabber_err(ret, err.c_str(), err_buf);
+    return 0;
+}
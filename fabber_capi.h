@@ -24,6 +24,32 @@
 #define FABBER_ERR_MAXC 255
 #define FABBER_ERR_FATAL -255
 #define FABBER_ERR_NEWMAT -254
+#define FABBER_ERR_CANCELLED -253
+
+/*
+ * Thread safety
+ *
+ * Each handle returned by fabber_new holds all of its own options, data and
+ * run state, so different handles may be used from different threads at the
+ * same time. A single handle must not be used from more than one thread at a
+ * time.
+ *
+ * The registries of known models and inference methods are shared by all
+ * handles in the process and are safe to access concurrently. Models loaded
+ * using fabber_load_models become available to all handles.
+ *
+ * The original NEWMAT matrix library is not thread safe - it records the
+ * function being executed through a single global pointer. So by default,
+ * calls which use matrices (setting and getting data, runs, sessions and
+ * model evaluations) hold a process-wide lock and calls on different handles
+ * take turns rather than running in parallel. fabber_cancel does not take
+ * the lock, so a run may be cancelled from another thread. Batch evaluation
+ * uses a single thread.
+ *
+ * Builds configured with THREADSAFE_MATRIX (for a thread-safe matrix library)
+ * define FABBER_THREADSAFE_MATRIX and do not take the lock, so runs on
+ * different handles and batch evaluations proceed in parallel.
+ */
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,6 +68,8 @@ FABBER_DLL_API void *fabber_new(char *err_buf);
 /**
  * Load models from a dynamic library
  *
+ * Models are registered for the whole process, not just this context.
+ *
  * @param fab Fabber context, returned by fabber_new
  * @param libpath Path to library, non NULL, not empty
  * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
@@ -73,7 +101,8 @@ FABBER_DLL_API int fabber_set_extent(
 /**
  * Destroy fabber context previously created in fabber_new
  *
- * Will not return any errors.
+ * Will not return any errors. Other contexts, and the models registered
+ * for the process, are not affected.
  *
  * @param fab Fabber context, returned by fabber_new. NULL will be ignored. Anything
  *            else will probably cause a crash.
@@ -109,6 +138,52 @@ FABBER_DLL_API int fabber_set_opt(void *fab, const char *key, const char *value,
 FABBER_DLL_API int fabber_set_data(
     void *fab, const char *name, unsigned int data_size, const float *data, char *err_buf);
 
+/**
+ * Register an externally owned voxel data buffer
+ *
+ * Unlike fabber_set_data the data is not copied when this function is called.
+ * It is read directly from the buffer when required, so the buffer must remain
+ * valid and unchanged until fabber_dorun has returned.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param name Name of data. Main timeseries has name 'data'. Not null, not empty
+ * @param data_size Number of data values for each voxel, e.g. number of t-slices for
+ *                  the main timeseries, 1 for simple image data.
+ * @param data If masked is zero, array of size nx*ny*nz*data_size in column-major order
+ *             (see fabber_set_data). If masked is non-zero, array of size
+ *             nvoxels*data_size containing only voxels inside the mask, in voxel-major
+ *             order, i.e. all data_size values for the first masked voxel, followed by
+ *             the values for the second masked voxel, etc. Masked voxels are in
+ *             column-major order.
+ * @param masked Non-zero if the buffer contains masked voxels only
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ *
+ * @return 0 on success, <0 on failure
+ */
+FABBER_DLL_API int fabber_set_data_buffer(void *fab, const char *name, unsigned int data_size,
+    const float *data, int masked, char *err_buf);
+
+/**
+ * Register an externally owned buffer to receive output voxel data
+ *
+ * When the named output is saved during fabber_dorun, it is written directly
+ * into the buffer rather than being stored internally. It will not be available
+ * using fabber_get_data. The buffer must remain valid until fabber_dorun has returned.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param name Name of output data, e.g. 'mean_c0'. Not null, not empty
+ * @param buf_size Size of the buffer as a number of floats. If this is too small for
+ *                 the output data, fabber_dorun will fail.
+ * @param data_buf Output buffer, in the same layout as for fabber_set_data_buffer.
+ *                 Voxels outside the mask are set to zero for full volume output.
+ * @param masked Non-zero if the buffer should receive masked voxels only
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ *
+ * @return 0 on success, <0 on failure
+ */
+FABBER_DLL_API int fabber_set_output_buffer(void *fab, const char *name, unsigned int buf_size,
+    float *data_buf, int masked, char *err_buf);
+
 /**
  * Get the size of output voxel data
  *
@@ -136,6 +211,9 @@ FABBER_DLL_API int fabber_get_data(void *fab, const char *name, float *data_buf,
 /**
  * Run Fabber model fitting on already configured options and data
  *
+ * Runs on different contexts may proceed concurrently in separate threads.
+ * The progress callback is called on the thread which called this function.
+ *
  * @param fab Fabber context, returned by fabber_new
  * @param log_bufsize Size of the log buffer. If too small, only this number of characters
  *                    will be returned.
@@ -149,6 +227,74 @@ FABBER_DLL_API int fabber_get_data(void *fab, const char *name, float *data_buf,
 FABBER_DLL_API int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_buf,
     void (*progress_cb)(int, int));
 
+/**
+ * Run Fabber model fitting with cancellation and partial results
+ *
+ * This behaves as fabber_dorun but additionally allows the run to be stopped early,
+ * and delivers intermediate results to the caller as they become available. All
+ * callbacks are called on the thread which called this function.
+ *
+ * The cancel callback is checked at voxel and iteration boundaries. If it returns
+ * nonzero, or fabber_cancel has been called, the run stops and FABBER_ERR_CANCELLED
+ * is returned. No output data is available from a cancelled run.
+ *
+ * The results callback receives parameter means and variances for blocks of
+ * block_size voxels as they are completed. Voxel indices refer to the masked
+ * voxels in the order used by fabber_set_data. For methods which update all
+ * voxels together (spatial VB) the callback is instead called after each
+ * iteration with the current estimates for all voxels. The means and variances
+ * arrays are in voxel-major order (index = voxel * num_params + param) and are
+ * only valid for the duration of the callback.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param log_bufsize Size of the log buffer
+ * @param log_buf Char buffer of size log_bufsize to receive output log
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ * @param progress_cb As for fabber_dorun. May be NULL
+ * @param cancel_cb Function pointer which is passed user_data and returns nonzero
+ *                  to cancel the run. May be NULL
+ * @param block_size Number of voxels in each block of partial results
+ * @param results_cb Function pointer taking (first voxel index from 0, number of voxels,
+ *                   number of parameters, means, variances, user_data). May be NULL
+ * @param user_data Passed to cancel_cb and results_cb
+ *
+ * @return 0 on success, FABBER_ERR_CANCELLED if cancelled, other <0 values on failure
+ */
+FABBER_DLL_API int fabber_dorun_callbacks(void *fab, unsigned int log_bufsize, char *log_buf,
+    char *err_buf, void (*progress_cb)(int, int), int (*cancel_cb)(void *), int block_size,
+    void (*results_cb)(int, int, int, const float *, const float *, void *), void *user_data);
+
+/**
+ * Request cancellation of a run in progress
+ *
+ * Unlike other functions this may be called from a different thread to the
+ * one running fabber_dorun or fabber_dorun_callbacks on the same context. The
+ * run stops at the next voxel or iteration boundary.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ */
+FABBER_DLL_API void fabber_cancel(void *fab);
+
+/**
+ * Prepare the model and inference method for repeated runs
+ *
+ * The forward model and inference method are created and initialized once
+ * from the current options. Subsequent calls to fabber_dorun reuse them so
+ * only the voxel data needs to be replaced between runs, e.g. using
+ * fabber_set_data. If fabber_set_extent is called with the same extent and
+ * mask the voxel neighbour lists are also reused.
+ *
+ * Setting any option using fabber_set_opt ends the session; subsequent runs
+ * will create the model and method as normal unless fabber_prepare is called
+ * again.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ *
+ * @return 0 on success, <0 on failure
+ */
+FABBER_DLL_API int fabber_prepare(void *fab, char *err_buf);
+
 /**
  * Get fabber options, optionally for a specific method or model
  *
@@ -278,6 +424,33 @@ FABBER_DLL_API int fabber_model_evaluate(void *fab, unsigned int n_params, float
 FABBER_DLL_API int fabber_model_evaluate_output(void *fab, unsigned int n_params, float *params, 
     unsigned int n_ts, float *indata, const char *output_name, float *output, char *err_buf);
 
+/**
+ * Evaluate the model for many sets of parameters
+ *
+ * The model is initialized once from the current options and then evaluated
+ * for each row of the parameter array. If Fabber was built with OpenMP support,
+ * rows are evaluated in parallel.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param n_rows Number of parameter sets to evaluate
+ * @param n_params Number of parameters in each set. Must be the number of model parameters
+ * @param params Array of size n_rows*n_params. Each row contains the parameter
+ *               values for one evaluation in the order returned by
+ *               fabber_get_model_params
+ * @param n_ts Number of t-points to evaluate for each row
+ * @param indata Array of size n_rows*n_ts containing input data for each row,
+ *               or NULL if not passing any input data
+ * @param output_name Name of output to return - empty string for the default output
+ * @param output Array of size n_rows*n_ts to receive the output. Each row contains
+ *               the n_ts output values for the corresponding parameter set
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ *
+ * @return 0 on success, <0 on failure
+ */
+FABBER_DLL_API int fabber_model_evaluate_batch(void *fab, unsigned int n_rows,
+    unsigned int n_params, const float *params, unsigned int n_ts, const float *indata,
+    const char *output_name, float *output, char *err_buf);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,6 +7,7 @@
 /*  CCOPYRIGHT */
 
 #include "fabber_core.h"
+#include "fabber_server.h"
 #include "fwdmodel.h"
 #include "inference.h"
 #include "rundata_newimage.h"
@@ -249,6 +250,21 @@ int execute(int argc, char **argv)
 
             return 0;
         }
+        else if (params->GetBool("serve"))
+        {
+            FabberServer server(params->GetStringDefault("socket", "fabber.sock"),
+                params->GetIntDefault("serve-threads", 1),
+                params->GetStringDefault("data-cache", ""));
+            server.SetLogger(&log);
+            log.StartLog(cerr);
+            server.Serve();
+            return 0;
+        }
+        else if (params->HaveKey("submit"))
+        {
+            return SubmitServerJob(params->GetStringDefault("socket", "fabber.sock"),
+                params->GetString("submit"));
+        }
         // Make sure command line tool creates a parameter names file
         params->SetBool("dump-param-names");
         // Link to latest run
@@ -257,7 +273,11 @@ int execute(int argc, char **argv)
         simple_output = params->GetBool("simple-output");
 
         log.StartLog(params->GetOutputDir());
-        if (!simple_output)
+        if (params->GetBool("merge"))
+        {
+            params->MergeParts();
+        }
+        else if (!simple_output)
         {
             cout << "----------------------" << endl;
             cout << "Welcome to FABBER " << fabber_version() << endl;
@@ -0,0 +1,661 @@
+/*  fabber_server.cc - Local job server for the Fabber executable
+
+ Copyright (C) 2007-2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "fabber_server.h"
+
+#include "rundata_newimage.h"
+#include "tools.h"
+
+#include <ctype.h>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+/**
+ * Options which cannot be used in a server job
+ *
+ * Models are shared by every job in the server process so must be loaded when the
+ * server is started, and the remainder select a different mode of the executable
+ * rather than options of a run.
+ */
+const char *SERVER_JOB_UNSUPPORTED[] = { "loadmodels", "help", "version", "listmodels",
+    "listmethods", "listparams", "descparams", "listoutputs", "evaluate", "merge", "serve",
+    "serve-threads", "socket", "submit", NULL };
+
+void CheckServerJobKey(const string &key, const string &value)
+{
+    for (int i = 0; SERVER_JOB_UNSUPPORTED[i]; i++)
+    {
+        if (key == SERVER_JOB_UNSUPPORTED[i])
+        {
+            if (key == "loadmodels")
+            {
+                throw InvalidOptionValue(key, value,
+                    "Not supported in server jobs - load models when starting the server");
+            }
+            throw InvalidOptionValue(key, value, "Not supported in server jobs");
+        }
+    }
+}
+
+/**
+ * Minimal parser for a flat JSON object of option names to scalar values
+ */
+class JobJsonParser
+{
+public:
+    JobJsonParser(const string &text)
+        : m_text(text)
+        , m_pos(0)
+    {
+    }
+
+    void Parse(FabberRunData &rundata)
+    {
+        Expect('{');
+        SkipSpace();
+        if (Peek() == '}')
+        {
+            m_pos++;
+            return;
+        }
+        while (true)
+        {
+            string key = ParseString();
+            Expect(':');
+            SkipSpace();
+            if (Peek() == '"')
+            {
+                string value = ParseString();
+                CheckServerJobKey(key, value);
+                rundata.Set(key, value);
+            }
+            else
+            {
+                string literal = ParseLiteral();
+                if (literal == "true")
+                {
+                    CheckServerJobKey(key, "");
+                    rundata.SetBool(key);
+                }
+                else if (literal != "false" && literal != "null")
+                {
+                    CheckServerJobKey(key, literal);
+                    rundata.Set(key, literal);
+                }
+            }
+            SkipSpace();
+            if (Peek() == ',')
+            {
+                m_pos++;
+            }
+            else
+            {
+                Expect('}');
+                break;
+            }
+        }
+        SkipSpace();
+        if (m_pos != m_text.size())
+        {
+            Fail("unexpected text after end of object");
+        }
+    }
+
+private:
+    char Peek()
+    {
+        if (m_pos >= m_text.size())
+            Fail("unexpected end of input");
+        return m_text[m_pos];
+    }
+
+    void SkipSpace()
+    {
+        while (m_pos < m_text.size() && isspace((unsigned char)m_text[m_pos]))
+            m_pos++;
+    }
+
+    void Expect(char c)
+    {
+        SkipSpace();
+        if (Peek() != c)
+            Fail(string("expected '") + c + "'");
+        m_pos++;
+    }
+
+    string ParseString()
+    {
+        Expect('"');
+        string ret;
+        while (Peek() != '"')
+        {
+            char c = m_text[m_pos++];
+            if (c == '\\')
+            {
+                c = Peek();
+                m_pos++;
+                switch (c)
+                {
+                case 'n':
+                    c = '\n';
+                    break;
+                case 't':
+                    c = '\t';
+                    break;
+                case '"':
+                case '\\':
+                case '/':
+                    break;
+                default:
+                    Fail(string("unsupported escape sequence \\") + c);
+                }
+            }
+            ret += c;
+        }
+        m_pos++;
+        return ret;
+    }
+
+    string ParseLiteral()
+    {
+        size_t start = m_pos;
+        while (m_pos < m_text.size() && m_text[m_pos] != ',' && m_text[m_pos] != '}'
+            && !isspace((unsigned char)m_text[m_pos]))
+        {
+            m_pos++;
+        }
+        if (m_pos == start)
+            Fail("expected a value");
+        return m_text.substr(start, m_pos - start);
+    }
+
+    void Fail(const string &msg)
+    {
+        ostringstream err;
+        err << "Invalid JSON job at character " << m_pos << ": " << msg;
+        throw FabberRunDataError(err.str());
+    }
+
+    const string &m_text;
+    size_t m_pos;
+};
+}
+
+void ParseServerJob(const string &text, FabberRunData &rundata)
+{
+    size_t start = text.find_first_not_of(" \t\r\n");
+    if (start != string::npos && text[start] == '{')
+    {
+        JobJsonParser(text.substr(start)).Parse(rundata);
+    }
+    else
+    {
+        // Check keys before parsing as some options take effect as soon as they are parsed
+        istringstream lines(text);
+        string line;
+        while (getline(lines, line))
+        {
+            size_t key_start = line.find_first_not_of(" \t\r");
+            if (key_start == string::npos || line[key_start] == '#')
+                continue;
+            size_t eq = line.find('=', key_start);
+            string key = line.substr(key_start, eq == string::npos ? string::npos : eq - key_start);
+            key = key.substr(0, key.find_last_not_of(" \t\r") + 1);
+            CheckServerJobKey(key, eq == string::npos ? "" : line.substr(eq + 1));
+        }
+
+        istringstream is(text);
+        rundata.ParseParams(is);
+    }
+}
+
+#ifdef _WIN32
+
+FabberServer::FabberServer(const string &socket_path, int num_threads, const string &data_cache)
+    : m_socket_path(socket_path)
+    , m_num_threads(num_threads)
+    , m_data_cache(data_cache)
+{
+}
+
+void FabberServer::Serve()
+{
+    throw FabberRunDataError("Server mode is not supported on Windows");
+}
+
+int SubmitServerJob(const string &socket_path, const string &job_file)
+{
+    throw FabberRunDataError("Server mode is not supported on Windows");
+}
+
+#else
+
+namespace
+{
+/**
+ * Seconds to wait for a client to send its job before giving up on it
+ */
+const int JOB_READ_TIMEOUT = 30;
+
+struct Job
+{
+    int id;
+    int fd;
+    string text;
+};
+
+/**
+ * Job queue shared between the accepting thread and the workers
+ */
+struct JobQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    deque<Job> jobs;
+    string data_cache;
+};
+
+/**
+ * Write a status line to a client
+ *
+ * Errors are ignored - if the client has gone away the job still runs to completion
+ */
+void SendLine(int fd, const string &line)
+{
+    string msg = line + "\n";
+    size_t sent = 0;
+    while (sent < msg.size())
+    {
+        ssize_t n = send(fd, msg.data() + sent, msg.size() - sent, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        sent += n;
+    }
+}
+
+/**
+ * Reports progress to the client in whole percentages
+ */
+class SocketProgressCheck : public ProgressCheck
+{
+public:
+    SocketProgressCheck(int fd, int id)
+        : m_fd(fd)
+        , m_id(id)
+        , m_last(-1)
+    {
+    }
+
+    void Progress(int voxel, int nVoxels)
+    {
+        if (nVoxels <= 0)
+            return;
+        int percent = (100 * voxel) / nVoxels;
+        if (percent > m_last)
+        {
+            m_last = percent;
+            ostringstream line;
+            line << "PROGRESS " << m_id << " " << percent;
+            SendLine(m_fd, line.str());
+        }
+    }
+
+private:
+    int m_fd;
+    int m_id;
+    int m_last;
+};
+
+void RunJob(const Job &job, const string &data_cache)
+{
+    EasyLog log;
+    bool gzLog = false;
+    string result;
+    ostringstream id;
+    id << job.id;
+
+    try
+    {
+        FabberRunDataNewimage rundata(true);
+        rundata.SetLogger(&log);
+        ParseServerJob(job.text, rundata);
+        if (data_cache != "" && !rundata.HaveKey("data-cache"))
+        {
+            rundata.Set("data-cache", data_cache);
+        }
+        rundata.SetBool("dump-param-names");
+        rundata.SetExtentFromData();
+
+        log.StartLog(rundata.GetOutputDir());
+        SendLine(job.fd, "RUNNING " + id.str() + " " + log.GetOutputDirectory());
+
+        SocketProgressCheck progress(job.fd, job.id);
+        rundata.Run(&progress);
+
+        log.ReissueWarnings();
+        gzLog = rundata.GetBool("gzip-log");
+        result = "DONE " + id.str() + " " + log.GetOutputDirectory();
+    }
+    catch (NEWMAT::Exception &e)
+    {
+        log.ReissueWarnings();
+        log.LogStream() << "NEWMAT exception caught in fabber:\n  " << e.what() << endl;
+        result = "FAILED " + id.str() + " " + e.what();
+    }
+    catch (const exception &e)
+    {
+        log.ReissueWarnings();
+        log.LogStream() << "Exception caught in fabber:\n  " << e.what() << endl;
+        result = "FAILED " + id.str() + " " + e.what();
+    }
+    catch (...)
+    {
+        log.ReissueWarnings();
+        log.LogStream() << "Some other exception caught in fabber!" << endl;
+        result = "FAILED " + id.str() + " Unknown error";
+    }
+
+    if (log.LogStarted())
+    {
+        log.StopLog(gzLog);
+    }
+
+    // Only report the result once the logfile is complete. Exception messages
+    // may span several lines but the client expects one line per status
+    for (size_t i = 0; i < result.size(); i++)
+    {
+        if (result[i] == '\n')
+            result[i] = ' ';
+    }
+    SendLine(job.fd, result);
+    close(job.fd);
+}
+
+void *WorkerMain(void *arg)
+{
+    JobQueue *queue = (JobQueue *)arg;
+    while (true)
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->jobs.empty())
+        {
+            pthread_cond_wait(&queue->ready, &queue->lock);
+        }
+        Job job = queue->jobs.front();
+        queue->jobs.pop_front();
+        pthread_mutex_unlock(&queue->lock);
+
+        RunJob(job, queue->data_cache);
+    }
+    return NULL;
+}
+
+/**
+ * Read everything the client sends until it shuts down its side of the connection
+ *
+ * Fails if the client sends nothing for JOB_READ_TIMEOUT seconds
+ */
+bool ReadAll(int fd, string &text)
+{
+    struct timeval timeout;
+    timeout.tv_sec = JOB_READ_TIMEOUT;
+    timeout.tv_usec = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0)
+        return false;
+
+    char buf[4096];
+    while (true)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        if (n == 0)
+            return true;
+        text.append(buf, n);
+    }
+}
+
+/**
+ * A newly accepted connection, read by its own thread so slow clients cannot
+ * hold up others
+ */
+struct Connection
+{
+    Job job;
+    JobQueue *queue;
+};
+
+void *ReaderMain(void *arg)
+{
+    Connection *conn = (Connection *)arg;
+    Job job = conn->job;
+    JobQueue *queue = conn->queue;
+    delete conn;
+
+    ostringstream id;
+    id << job.id;
+    if (!ReadAll(job.fd, job.text))
+    {
+        SendLine(job.fd, "FAILED " + id.str() + " Failed to read job from client");
+        close(job.fd);
+        return NULL;
+    }
+
+    // Reject jobs which can never run before they take a place in the queue
+    try
+    {
+        FabberRunData check(false);
+        ParseServerJob(job.text, check);
+    }
+    catch (const exception &e)
+    {
+        string msg = e.what();
+        for (size_t i = 0; i < msg.size(); i++)
+        {
+            if (msg[i] == '\n')
+                msg[i] = ' ';
+        }
+        SendLine(job.fd, "FAILED " + id.str() + " " + msg);
+        close(job.fd);
+        return NULL;
+    }
+
+    SendLine(job.fd, "QUEUED " + id.str());
+
+    pthread_mutex_lock(&queue->lock);
+    queue->jobs.push_back(job);
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+void GetSocketAddress(const string &socket_path, struct sockaddr_un &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+    {
+        throw InvalidOptionValue("socket", socket_path, "Socket path is too long");
+    }
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+}
+}
+
+FabberServer::FabberServer(const string &socket_path, int num_threads, const string &data_cache)
+    : m_socket_path(socket_path)
+    , m_num_threads(num_threads)
+    , m_data_cache(data_cache)
+{
+    if (m_num_threads < 1)
+    {
+        ostringstream val;
+        val << num_threads;
+        throw InvalidOptionValue("serve-threads", val.str(), "Must be at least 1");
+    }
+}
+
+void FabberServer::Serve()
+{
+    struct sockaddr_un addr;
+    GetSocketAddress(m_socket_path, addr);
+
+    // Clients which disconnect early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0)
+    {
+        throw FabberRunDataError(string("Failed to create socket: ") + strerror(errno));
+    }
+    unlink(m_socket_path.c_str());
+    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(server_fd, 16) != 0)
+    {
+        string err = strerror(errno);
+        close(server_fd);
+        throw FabberRunDataError("Failed to listen on socket " + m_socket_path + ": " + err);
+    }
+
+    // The queue and workers live for the lifetime of the process
+    JobQueue *queue = new JobQueue();
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+    queue->data_cache = m_data_cache;
+    for (int i = 0; i < m_num_threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, WorkerMain, queue) != 0)
+        {
+            throw FabberRunDataError("Failed to start server worker thread");
+        }
+        pthread_detach(thread);
+    }
+
+    LOG << "FabberServer::Listening on " << m_socket_path << " with " << m_num_threads
+        << " worker threads" << endl;
+    if (m_num_threads > 1 && !fabber::MatrixLock::ThreadSafe())
+    {
+        LOG << "FabberServer::Matrix library is not thread safe - jobs will take turns" << endl;
+    }
+
+    int next_id = 1;
+    while (true)
+    {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno != EINTR)
+            {
+                LOG_WARN << "FabberServer::Failed to accept connection: " << strerror(errno) << endl;
+            }
+            continue;
+        }
+
+        int id = next_id++;
+        Connection *conn = new Connection();
+        conn->job.id = id;
+        conn->job.fd = fd;
+        conn->queue = queue;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ReaderMain, conn) != 0)
+        {
+            LOG << "FabberServer::Failed to start thread for job " << id << endl;
+            close(fd);
+            delete conn;
+            continue;
+        }
+        pthread_detach(thread);
+        LOG << "FabberServer::Accepted job " << id << endl;
+    }
+}
+
+int SubmitServerJob(const string &socket_path, const string &job_file)
+{
+    ifstream is(job_file.c_str());
+    if (!is.good())
+    {
+        throw FabberRunDataError("Couldn't read job file: " + job_file);
+    }
+    ostringstream text;
+    text << is.rdbuf();
+
+    struct sockaddr_un addr;
+    GetSocketAddress(socket_path, addr);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        string err = strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        throw FabberRunDataError("Failed to connect to server at " + socket_path + ": " + err);
+    }
+
+    string job = text.str();
+    size_t sent = 0;
+    while (sent < job.size())
+    {
+        ssize_t n = send(fd, job.data() + sent, job.size() - sent, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            close(fd);
+            throw FabberRunDataError("Failed to send job to server");
+        }
+        sent += n;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // Echo status lines as they arrive and remember the last one
+    string reply, last;
+    char buf[4096];
+    while (true)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        reply.append(buf, n);
+        size_t eol;
+        while ((eol = reply.find('\n')) != string::npos)
+        {
+            last = reply.substr(0, eol);
+            cout << last << endl;
+            reply.erase(0, eol + 1);
+        }
+    }
+    close(fd);
+
+    return (last.compare(0, 5, "DONE ") == 0) ? 0 : 1;
+}
+
+#endif
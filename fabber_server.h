@@ -0,0 +1,85 @@
+/*  fabber_server.h - Local job server for the Fabber executable
+
+ Copyright (C) 2007-2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#pragma once
+
+#include "easylog.h"
+
+#include <string>
+
+class FabberRunData;
+
+/**
+ * Parse the text of a submitted job into run options
+ *
+ * Two formats are accepted. If the text starts with '{' it is treated as a flat
+ * JSON object of option names to values. A value of true sets a boolean option,
+ * false is ignored and anything else is set as a string. Otherwise the text is
+ * parsed as an options file with one option=value per line, in the same form as
+ * used with -f.
+ *
+ * Options which select a different mode of the executable, and loadmodels, are
+ * not supported in jobs. Models must be loaded when the server is started.
+ *
+ * @throw FabberRunDataError if the JSON could not be parsed
+ * @throw InvalidOptionValue if the job contains an unsupported option
+ */
+void ParseServerJob(const std::string &text, FabberRunData &rundata);
+
+/**
+ * Serves Fabber runs to local clients over a Unix domain socket
+ *
+ * Each connection submits a single job and receives a stream of
+ * status lines while the job is processed:
+ *
+ *   QUEUED <id>
+ *   RUNNING <id> <output directory>
+ *   PROGRESS <id> <percent>
+ *   DONE <id> <output directory>     or     FAILED <id> <message>
+ *
+ * A job which cannot be read within 30 seconds, or which fails to parse, is
+ * rejected with a FAILED line before being queued.
+ *
+ * Jobs are run by a fixed pool of worker threads. Each job is an independent run
+ * with its own logfile in its output directory. If the server was given a data
+ * cache directory it is used by all jobs which do not specify their own, so
+ * repeated jobs on the same data do not need to reload and preprocess it.
+ * Unless the matrix library is thread safe (see MatrixLock) the workers take
+ * turns to run, so extra workers only allow jobs to be read and queued while
+ * another is running.
+ *
+ * Relative paths in jobs are resolved against the working directory of the server.
+ */
+class FabberServer : public Loggable
+{
+public:
+    /**
+     * @param socket_path Filesystem path of the Unix domain socket
+     * @param num_threads Number of jobs which may run simultaneously
+     * @param data_cache Default data cache directory for jobs, or empty for none
+     */
+    FabberServer(const std::string &socket_path, int num_threads, const std::string &data_cache);
+
+    /**
+     * Listen for jobs and run them. Does not return unless the socket could not be set up.
+     *
+     * @throw FabberRunDataError on failure to create or listen on the socket
+     */
+    void Serve();
+
+private:
+    std::string m_socket_path;
+    int m_num_threads;
+    std::string m_data_cache;
+};
+
+/**
+ * Submit a job file to a running server and echo its status lines to stdout
+ *
+ * @return 0 if the server reported the job as done, 1 otherwise
+ * @throw FabberRunDataError if the job file could not be read or the server contacted
+ */
+int SubmitServerJob(const std::string &socket_path, const std::string &job_file);
@@ -11,8 +11,41 @@
 #include <string>
 #include <vector>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 using namespace std;
 
+// Statically initialized so the lock is usable before any constructors run
+#ifdef _WIN32
+static SRWLOCK factory_lock = SRWLOCK_INIT;
+
+FactoryLock::FactoryLock()
+{
+    AcquireSRWLockExclusive(&factory_lock);
+}
+
+FactoryLock::~FactoryLock()
+{
+    ReleaseSRWLockExclusive(&factory_lock);
+}
+#else
+static pthread_mutex_t factory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+FactoryLock::FactoryLock()
+{
+    pthread_mutex_lock(&factory_lock);
+}
+
+FactoryLock::~FactoryLock()
+{
+    pthread_mutex_unlock(&factory_lock);
+}
+#endif
+
 Dispatcher::Dispatcher()
 {
     // No-op.
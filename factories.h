@@ -12,12 +12,34 @@
 #include <string>
 #include <vector>
 
+/**
+ * Scoped lock protecting the process-wide factory registries.
+ *
+ * The lock is acquired on construction and released on destruction. It
+ * is statically initialized so may be used safely during static
+ * registration of models, e.g. when a model library is loaded.
+ * It is not recursive.
+ */
+class FactoryLock
+{
+public:
+    FactoryLock();
+    ~FactoryLock();
+
+private:
+    FactoryLock(const FactoryLock &);
+    FactoryLock &operator=(const FactoryLock &);
+};
+
 /**
  * Template factory class.
  *
  * Manages a map from names to function pointers. Each function
  * pointer is assumed to point to a function that returns a pointer to
  * an object of type T.
+ *
+ * All methods are thread-safe so names may be added and objects created
+ * from multiple threads concurrently.
  */
 template <class T> class TemplateFactory
 {
@@ -74,6 +96,7 @@ template <class T> TemplateFactory<T>::~TemplateFactory()
 }
 template <class T> std::vector<std::string> TemplateFactory<T>::GetNames()
 {
+    FactoryLock lock;
     std::vector<std::string> names;
     for (typename std::map<std::string, Function>::iterator it = functionMap_.begin();
          it != functionMap_.end(); ++it)
@@ -85,19 +108,32 @@ template <class T> std::vector<std::string> TemplateFactory<T>::GetNames()
 
 template <class T> bool TemplateFactory<T>::HasName(const std::string &name)
 {
+    FactoryLock lock;
     return (functionMap_.find(name) != functionMap_.end());
 }
 
 template <class T> void TemplateFactory<T>::Add(const std::string &name, Function function)
 {
+    FactoryLock lock;
     functionMap_[name] = function;
 }
 
 template <class T> T *TemplateFactory<T>::Create(const std::string &name)
 {
-    if (functionMap_.count(name))
+    // Only hold the lock while looking up the function, not while
+    // constructing the object
+    Function function = NULL;
+    {
+        FactoryLock lock;
+        typename std::map<std::string, Function>::iterator it = functionMap_.find(name);
+        if (it != functionMap_.end())
+        {
+            function = it->second;
+        }
+    }
+    if (function)
     {
-        return functionMap_[name]();
+        return function();
     }
     return NULL;
 }
@@ -117,6 +153,9 @@ public:
     static SingletonFactory *GetInstance();
     /**
      * Delete the singleton instance.
+     *
+     * This must not be called while any other thread may be using
+     * the factory.
      */
     static void Destroy();
 
@@ -134,17 +173,20 @@ template <class T> SingletonFactory<T>::SingletonFactory()
 
 template <class T> void SingletonFactory<T>::Destroy()
 {
-    if (singleton_ != NULL)
+    SingletonFactory *instance;
     {
-        delete singleton_;
+        FactoryLock lock;
+        instance = singleton_;
         singleton_ = NULL;
     }
+    delete instance;
 }
 
 template <class T> SingletonFactory<T> *SingletonFactory<T>::singleton_ = NULL;
 
 template <class T> SingletonFactory<T> *SingletonFactory<T>::GetInstance()
 {
+    FactoryLock lock;
     if (singleton_ == NULL)
     {
         singleton_ = new SingletonFactory<T>();
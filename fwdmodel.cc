@@ -60,6 +60,13 @@ string GetLastErrorAsString()
 #define GETERROR dlerror
 #endif
 
+// Count of model evaluations, per thread so concurrent runs do not interfere
+#ifdef _WIN32
+static __declspec(thread) long evaluation_count = 0;
+#else
+static __thread long evaluation_count = 0;
+#endif
+
 void FwdModel::LoadFromDynamicLibrary(const std::string &filename, EasyLog *log)
 {
     FwdModelFactory *factory = FwdModelFactory::GetInstance();
@@ -266,7 +273,7 @@ void FwdModel::GetParameters(FabberRunData &rundata, vector<Parameter> &params)
         }
 
         if (p->prior.prec() > 1e12) {
-            WARN_ONCE("Specified precision " + stringify(p->prior.prec()) + " is very high - this can trigger numerical instability. Using 1e12 instead");
+            WARN_ONCE_TEXT("Specified precision " + stringify(p->prior.prec()) + " is very high - this can trigger numerical instability. Using 1e12 instead");
             p->prior = DistParams(p->prior.mean(), 1e-12);
         }
 
@@ -351,10 +358,17 @@ void FwdModel::GetParameterDefaults(vector<Parameter> &params) const
     }
 }
 
+long FwdModel::EvaluationCount()
+{
+    return evaluation_count;
+}
+
 void FwdModel::EvaluateFabber(
     const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result, const std::string &key) const
 {
     assert((m_params.size() == 0) || (int(m_params.size()) == params.Nrows()));
+    ++evaluation_count;
+    fabber::PerfCount("ModelEvaluations");
     if (m_params.size() == 0)
     {
         EvaluateModel(params, result, key);
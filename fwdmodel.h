@@ -110,6 +110,18 @@ public:
     virtual void GetOutputs(std::vector<std::string> &outputs) const
     {
     }
+    /**
+     * Does the model output depend on the voxel co-ordinates?
+     *
+     * If so, voxels with the same data at different positions are never
+     * treated as duplicates by --dedup-voxels. Models which only use the
+     * voxel data and supplementary data should override this to return
+     * false so that duplicate voxels can be found.
+     */
+    virtual bool UsesCoords() const
+    {
+        return true;
+    }
     /**
      * Voxelwise initialization of the posterior in model space
      *
@@ -218,6 +230,13 @@ public:
     void EvaluateFabber(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
         const std::string &key = "") const;
 
+    /**
+     * @return Number of calls to EvaluateFabber made by the calling thread, for
+     *         any model. Used to measure the cost of a calculation by taking the
+     *         difference between two calls
+     */
+    static long EvaluationCount();
+
     /**
      * Transform an MVN containing model values to Fabber internal values.
      *
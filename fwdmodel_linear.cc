@@ -126,11 +126,15 @@ LinearizedFwdModel::LinearizedFwdModel(const LinearizedFwdModel &from)
 void LinearizedFwdModel::ReCentre(const ColumnVector &about)
 {
     assert(about == about); // isfinite
+    fabber::ScopedTimer timer("ReCentre");
 
     // Store new centre & offset
     m_centre = about;
 
-    m_model->EvaluateFabber(m_centre, m_offset);
+    {
+        fabber::ScopedTimer eval_timer("ReCentre.Evaluate");
+        m_model->EvaluateFabber(m_centre, m_offset);
+    }
     if (0 * m_offset != 0 * m_offset)
     {
         LOG_ERR("LinearizedFwdModel::about:\n" << about);
@@ -150,6 +154,7 @@ void LinearizedFwdModel::ReCentre(const ColumnVector &about)
     // numerical differentiation to calculate it.
     if (true)
     {
+        fabber::ScopedTimer jacobian_timer("ReCentre.Jacobian");
         ColumnVector centre2, centre3;
         ColumnVector offset2, offset3;
         for (int i = 1; i <= m_centre.Nrows(); i++)
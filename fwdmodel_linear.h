@@ -35,6 +35,10 @@ public:
     virtual std::string ModelVersion() const;
 
     virtual void Initialize(FabberRunData &args);
+    virtual bool UsesCoords() const
+    {
+        return false;
+    }
 
     /**
      * Evaluate the model.
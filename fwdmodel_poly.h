@@ -38,6 +38,10 @@ public:
     std::string ModelVersion() const;
 
     void Initialize(FabberRunData &args);
+    bool UsesCoords() const
+    {
+        return false;
+    }
     void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
         const std::string &key = "") const;
 
@@ -8,12 +8,17 @@
 
 #include "inference.h"
 #include "easylog.h"
+#include "perf.h"
+#include "priors.h"
+#include "tools.h"
 
 #include <newmat.h>
 
 #include <fstream>
 #include <iomanip>
+#include <map>
 #include <math.h>
+#include <string.h>
 
 using namespace std;
 using namespace NEWMAT;
@@ -56,6 +61,10 @@ InferenceTechnique::InferenceTechnique()
     : m_model(NULL)
     , m_num_params(0)
     , m_halt_bad_voxel(true)
+    , m_save_diagnostics(false)
+    , m_time_budget(0)
+    , m_budget_min_its(2)
+    , m_dedup(false)
 {
 }
 
@@ -90,6 +99,17 @@ void InferenceTechnique::Initialize(FwdModel *fwd_model, FabberRunData &rundata)
     // will drag its neighbours around... but can never recover!  Maybe a more
     // sensible approach is to reset bad voxels to the prior on each iteration.
     // Spatial VB ignores this parameter, presumably for the above reason
+    m_time_budget = rundata.GetDoubleDefault("time-budget", 0, 0);
+    m_budget_min_its = rundata.GetIntDefault("time-budget-min-its", 2, 1);
+    if (m_time_budget > 0)
+    {
+        LOG << "InferenceTechnique::Time budget " << m_time_budget << "s with at least "
+            << m_budget_min_its << " iterations per voxel" << endl;
+    }
+
+    m_save_diagnostics = rundata.GetBool("save-voxel-diagnostics");
+    m_dedup = rundata.GetBool("dedup-voxels");
+
     m_halt_bad_voxel = !rundata.GetBool("allow-bad-voxels");
     if (m_halt_bad_voxel)
     {
@@ -156,6 +176,45 @@ void InferenceTechnique::SaveResults(FabberRunData &rundata) const
         }
     }
 
+    if (!resultIterations.empty())
+    {
+        LOG << "InferenceTechnique::Writing iteration counts and convergence status" << endl;
+        Matrix iterations(1, nVoxels), convergence(1, nVoxels);
+        for (int vox = 1; vox <= nVoxels; vox++)
+        {
+            iterations(1, vox) = resultIterations.at(vox - 1);
+            convergence(1, vox) = resultConvergence.at(vox - 1);
+        }
+        rundata.SaveVoxelData("iterations", iterations);
+        rundata.SaveVoxelData("convergence", convergence);
+    }
+
+    if (m_save_diagnostics)
+    {
+        LOG << "InferenceTechnique::Writing per-voxel diagnostics" << endl;
+        Matrix time(1, nVoxels), iterations(1, nVoxels), evaluations(1, nVoxels),
+            reverts(1, nVoxels), ignored(1, nVoxels);
+        time = 0;
+        iterations = 0;
+        evaluations = 0;
+        reverts = 0;
+        ignored = 0;
+        for (int vox = 1; vox <= nVoxels && vox <= int(resultDiagnostics.size()); vox++)
+        {
+            const VoxelDiagnostics &diag = resultDiagnostics[vox - 1];
+            time(1, vox) = diag.time;
+            iterations(1, vox) = diag.iterations;
+            evaluations(1, vox) = diag.evaluations;
+            reverts(1, vox) = diag.reverts;
+            ignored(1, vox) = diag.ignored ? 1 : 0;
+        }
+        rundata.SaveVoxelData("diag_time", time);
+        rundata.SaveVoxelData("diag_iterations", iterations);
+        rundata.SaveVoxelData("diag_evaluations", evaluations);
+        rundata.SaveVoxelData("diag_reverts", reverts);
+        rundata.SaveVoxelData("diag_ignored", ignored);
+    }
+
     // Produce the model fit and residual volume series
     bool saveModelFit = rundata.GetBool("save-model-fit");
     bool saveResiduals = rundata.GetBool("save-residuals");
@@ -211,21 +270,21 @@ void InferenceTechnique::SaveResults(FabberRunData &rundata) const
                 {
                     if (*iter != "") 
                     {
-                        LOG << "InferenceTechnique::NEWMAT error generating output " << *iter << " for voxel " << vox << " : " << e.what() << endl;
+                        LOG_WARN << "InferenceTechnique::NEWMAT error generating output " << *iter << " for voxel " << vox << " : " << e.what() << endl;
                     } 
                 }
                 catch (std::exception &e)
                 {
                     if (*iter != "") 
                     {
-                        LOG << "InferenceTechnique::Error generating output " << *iter << " for voxel " << vox << " : " << e.what() << endl;
+                        LOG_WARN << "InferenceTechnique::Error generating output " << *iter << " for voxel " << vox << " : " << e.what() << endl;
                     } 
                 }
                 catch (...)
                 {
                     if (*iter != "") 
                     {
-                        LOG << "InferenceTechnique::Unexpected error generating output " << *iter << " for voxel " << vox << " : no message available" << endl;
+                        LOG_WARN << "InferenceTechnique::Unexpected error generating output " << *iter << " for voxel " << vox << " : no message available" << endl;
                     }  
                 }
             }
@@ -433,10 +492,205 @@ void InferenceTechnique::InitMVNFromFile(FabberRunData &rundata, string paramFil
 }
 
 InferenceTechnique::~InferenceTechnique()
+{
+    ClearResults();
+}
+
+void InferenceTechnique::PartialResults(
+    FabberRunData &rundata, int first_voxel, const vector<MVNDist> &dists)
+{
+    Matrix means(m_num_params, dists.size());
+    Matrix variances(m_num_params, dists.size());
+    for (unsigned int v = 0; v < dists.size(); v++)
+    {
+        SymmetricMatrix cov = dists[v].GetCovariance();
+        for (int p = 1; p <= m_num_params; p++)
+        {
+            means(p, v + 1) = dists[v].means(p);
+            variances(p, v + 1) = cov(p, p);
+        }
+    }
+    rundata.PartialResults(first_voxel, means, variances);
+}
+
+void InferenceTechnique::VoxelCompleted(FabberRunData &rundata, int voxel, int nvoxels)
+{
+    int interval = rundata.PartialResultsInterval();
+    if (interval > 0 && (voxel % interval == 0 || voxel == nvoxels))
+    {
+        int first_voxel = voxel - (voxel - 1) % interval;
+        vector<MVNDist> dists;
+        for (int v = first_voxel; v <= voxel; v++)
+        {
+            dists.push_back(*resultMVNs[v - 1]);
+        }
+        PartialResults(rundata, first_voxel, dists);
+    }
+    rundata.CheckCancelled();
+}
+
+InferenceTechnique::VoxelDiagnostics *InferenceTechnique::Diagnostics(int v)
+{
+    if (!m_save_diagnostics)
+        return NULL;
+    if (int(resultDiagnostics.size()) < v)
+        resultDiagnostics.resize(v);
+    return &resultDiagnostics[v - 1];
+}
+
+void InferenceTechnique::MarkBadVoxel(int v)
+{
+    VoxelDiagnostics *diag = Diagnostics(v);
+    if (diag)
+        diag->ignored = true;
+}
+
+InferenceTechnique::VoxelCost::VoxelCost(InferenceTechnique &infer, int v)
+    : m_infer(infer)
+    , m_v(v)
+    , m_start(0)
+    , m_evaluations(0)
+{
+    if (m_infer.m_save_diagnostics)
+    {
+        m_start = fabber::wall_time();
+        m_evaluations = FwdModel::EvaluationCount();
+    }
+}
+
+InferenceTechnique::VoxelCost::~VoxelCost()
+{
+    VoxelDiagnostics *diag = m_infer.Diagnostics(m_v);
+    if (diag)
+    {
+        diag->time += fabber::wall_time() - m_start;
+        diag->evaluations += FwdModel::EvaluationCount() - m_evaluations;
+    }
+}
+
+namespace
+{
+/**
+ * FNV-1a hash of the values of one voxel in a set of voxel data matrices
+ */
+size_t HashVoxel(const vector<const Matrix *> &inputs, int v)
+{
+    size_t hash = 2166136261u;
+    for (unsigned int i = 0; i < inputs.size(); i++)
+    {
+        const Matrix &m = *inputs[i];
+        for (int r = 1; r <= m.Nrows(); r++)
+        {
+            Real value = m(r, v);
+            unsigned char bytes[sizeof(Real)];
+            memcpy(bytes, &value, sizeof(Real));
+            for (unsigned int b = 0; b < sizeof(Real); b++)
+            {
+                hash = (hash ^ bytes[b]) * 16777619u;
+            }
+        }
+    }
+    return hash;
+}
+
+/**
+ * @return true if two voxels have bitwise identical values in every matrix
+ */
+bool SameVoxel(const vector<const Matrix *> &inputs, int v1, int v2)
+{
+    for (unsigned int i = 0; i < inputs.size(); i++)
+    {
+        const Matrix &m = *inputs[i];
+        for (int r = 1; r <= m.Nrows(); r++)
+        {
+            Real value1 = m(r, v1), value2 = m(r, v2);
+            if (memcmp(&value1, &value2, sizeof(Real)) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+}
+
+void InferenceTechnique::FindDuplicateVoxels(FabberRunData &rundata)
+{
+    m_duplicate_of.clear();
+    if (!m_dedup)
+        return;
+
+    fabber::ScopedTimer timer("FindDuplicateVoxels");
+    vector<const Matrix *> inputs;
+    inputs.push_back(&rundata.GetMainVoxelData());
+    if (rundata.GetVoxelSuppData().Ncols() > 0)
+        inputs.push_back(&rundata.GetVoxelSuppData());
+    if (m_model->UsesCoords())
+    {
+        // Voxels at different positions can give different model output
+        // even if the data is the same
+        inputs.push_back(&rundata.GetVoxelCoords());
+    }
+
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    for (unsigned int p = 0; p < params.size(); p++)
+    {
+        if (params[p].prior_type != PRIOR_IMAGE)
+            continue;
+        map<string, string>::const_iterator image = params[p].options.find("image");
+        if (image == params[p].options.end())
+        {
+            throw FabberInternalError("Parameter " + params[p].name + " has an image prior but no image data");
+        }
+        inputs.push_back(&rundata.GetVoxelData(image->second));
+    }
+
+    // Voxels which are fitted, grouped by hash. Nearly all groups have a
+    // single member, so exact comparisons are rare
+    int nvoxels = inputs[0]->Ncols();
+    int ndistinct = 0;
+    map<size_t, vector<int> > fitted;
+    m_duplicate_of.assign(nvoxels, 0);
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        vector<int> &group = fitted[HashVoxel(inputs, v)];
+        for (unsigned int i = 0; i < group.size(); i++)
+        {
+            if (SameVoxel(inputs, group[i], v))
+            {
+                m_duplicate_of[v - 1] = group[i];
+                break;
+            }
+        }
+        if (m_duplicate_of[v - 1] == 0)
+        {
+            group.push_back(v);
+            ndistinct++;
+        }
+    }
+
+    LOG << "InferenceTechnique::" << ndistinct << " distinct voxels out of " << nvoxels;
+    if (ndistinct > 0)
+        LOG << " (dedup ratio " << double(nvoxels) / ndistinct << ")";
+    LOG << endl;
+}
+
+void InferenceTechnique::CopyVoxelResult(int v, int rep)
+{
+    MVNDist *copy = new MVNDist(*resultMVNs.at(rep - 1));
+    if (int(resultMVNs.size()) < v)
+        resultMVNs.resize(v, NULL);
+    resultMVNs[v - 1] = copy;
+}
+
+void InferenceTechnique::ClearResults()
 {
     while (!resultMVNs.empty())
     {
         delete resultMVNs.back();
         resultMVNs.pop_back();
     }
+    resultIterations.clear();
+    resultConvergence.clear();
+    resultDiagnostics.clear();
+    m_duplicate_of.clear();
 }
@@ -96,6 +96,14 @@ public:
      */
     virtual void SaveResults(FabberRunData &rundata) const;
 
+    /**
+     * Discard the results of a previous call to DoCalculations
+     *
+     * This allows the same initialized inference technique to be
+     * used for another set of voxel data.
+     */
+    virtual void ClearResults();
+
     /**
      * Destructor.
      */
@@ -104,6 +112,117 @@ public:
 protected:
     void InitMVNFromFile(FabberRunData &rundata, std::string paramFilename);
 
+    /**
+     * Pass the current estimates for a consecutive set of voxels to the caller's
+     * progress checker. Only the model parameters are included.
+     *
+     * @param first_voxel Index of the voxel corresponding to dists[0], starting at 1
+     */
+    void PartialResults(FabberRunData &rundata, int first_voxel, const std::vector<MVNDist> &dists);
+
+    /**
+     * Called by voxelwise methods once resultMVNs has been set for a voxel
+     *
+     * Delivers the block of partial results which ends at this voxel, if any, and
+     * stops the run if it has been cancelled
+     *
+     * @param voxel Index of the completed voxel, starting at 1
+     * @param nvoxels Total number of voxels
+     */
+    void VoxelCompleted(FabberRunData &rundata, int voxel, int nvoxels);
+
+    /**
+     * Find voxels whose inputs are identical to an earlier voxel
+     *
+     * The data, supplementary data and image prior values of each voxel are
+     * hashed, and voxels with the same hash are compared exactly. Voxelwise
+     * methods need only fit the first voxel of each group and copy its result
+     * to the others with CopyVoxelResult. Does nothing unless --dedup-voxels
+     * is set, in which case the proportion of distinct voxels is logged.
+     */
+    void FindDuplicateVoxels(FabberRunData &rundata);
+
+    /**
+     * @return Index of the earlier voxel with identical inputs to v, or 0 if
+     *         v must be fitted. Indices start at 1
+     */
+    int DuplicateOf(int v) const
+    {
+        return m_duplicate_of.empty() ? 0 : m_duplicate_of[v - 1];
+    }
+
+    /**
+     * Set the result for a voxel to a copy of the result for another voxel
+     *
+     * @param v Voxel to set, starting at 1
+     * @param rep Voxel whose results have already been set, starting at 1
+     */
+    virtual void CopyVoxelResult(int v, int rep);
+
+    /**
+     * Cost of the calculations for a single voxel
+     */
+    struct VoxelDiagnostics
+    {
+        VoxelDiagnostics()
+            : time(0)
+            , iterations(0)
+            , evaluations(0)
+            , reverts(0)
+            , ignored(false)
+        {
+        }
+
+        /** Wall clock time in seconds */
+        double time;
+
+        /** Number of iterations of the inference method */
+        int iterations;
+
+        /** Number of forward model evaluations */
+        long evaluations;
+
+        /** Number of times the convergence detector reverted to a previous solution */
+        int reverts;
+
+        /** True if the voxel was excluded from further updates after a numerical error */
+        bool ignored;
+    };
+
+    /**
+     * @return Diagnostics for a voxel, or NULL if they are not being saved
+     *
+     * @param v Voxel index, starting at 1
+     */
+    VoxelDiagnostics *Diagnostics(int v);
+
+    /**
+     * Record in the diagnostics that a voxel was abandoned after a numerical error
+     *
+     * @param v Voxel index, starting at 1
+     */
+    void MarkBadVoxel(int v);
+
+    /**
+     * Adds the wall time and model evaluations spent while in scope to the
+     * diagnostics for a voxel. Does nothing if diagnostics are not being saved
+     */
+    class VoxelCost
+    {
+    public:
+        VoxelCost(InferenceTechnique &infer, int v);
+        ~VoxelCost();
+
+    private:
+        VoxelCost(const VoxelCost &);
+        VoxelCost &operator=(const VoxelCost &);
+
+        InferenceTechnique &m_infer;
+        int m_v;
+        double m_start;
+        long m_evaluations;
+    };
+
     /**
      * Pointer to forward model, passed in to initialize.
      *
@@ -135,6 +254,54 @@ protected:
      */
     std::vector<MVNDist *> resultMVNs;
 
+    /**
+     * Number of iterations performed for each voxel
+     *
+     * This, and resultConvergence, are only filled in when running with
+     * a time budget, and are saved as the 'iterations' and 'convergence'
+     * outputs
+     */
+    std::vector<int> resultIterations;
+
+    /**
+     * Convergence status for each voxel: 1=converged, 0=stopped by the
+     * time budget, -1=stopped by a numerical error
+     */
+    std::vector<int> resultConvergence;
+
+    /**
+     * Per-voxel cost diagnostics, only filled in when running with
+     * --save-voxel-diagnostics
+     */
+    std::vector<VoxelDiagnostics> resultDiagnostics;
+
+    /**
+     * Whether to record and save per-voxel cost diagnostics
+     */
+    bool m_save_diagnostics;
+
+    /**
+     * Time budget for the calculations in seconds, or 0 for no limit
+     */
+    double m_time_budget;
+
+    /**
+     * Minimum number of iterations each voxel gets before the remaining
+     * time budget is allocated to voxels which are changing most
+     */
+    int m_budget_min_its;
+
+    /**
+     * Whether to fit only one voxel of each group with identical inputs
+     */
+    bool m_dedup;
+
+    /**
+     * For each voxel, the index of the earlier voxel with identical inputs, or
+     * 0. Empty if duplicates have not been searched for
+     */
+    std::vector<int> m_duplicate_of;
+
     /**
      * List of masked timepoints
      *
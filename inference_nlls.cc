@@ -19,7 +19,10 @@
 
 #include <newmat.h>
 
+#include <algorithm>
+#include <queue>
 #include <string>
+#include <utility>
 #include <vector>
 
 using namespace std;
@@ -27,11 +30,21 @@ using namespace MISCMATHS;
 using namespace NEWMAT;
 using fabber::MaskRows;
 
-static int NUM_OPTIONS = 1;
+static int NUM_OPTIONS = 5;
 static OptionSpec OPTIONS[] = {
     { "vb-init", OPT_BOOL, "Whether NLLS is being run in isolation or as a pre-step for VB",
         OPT_NONREQ, "" },
     { "lm", OPT_BOOL, "Whether to use LM convergence (default is L)", OPT_NONREQ, "" },
+    { "time-budget", OPT_FLOAT, "Time limit for the calculations in seconds. When it is reached the "
+                                "best fit so far is used for each voxel",
+        OPT_NONREQ, "" },
+    { "time-budget-min-its", OPT_INT, "With a time budget, minimum number of iterations for every "
+                                      "voxel before the remaining time is given to voxels which "
+                                      "are changing most",
+        OPT_NONREQ, "2" },
+    { "dedup-voxels", OPT_BOOL, "Fit only one of each group of voxels with identical data and "
+                                "copy its results to the others",
+        OPT_NONREQ, "" },
 };
 
 void NLLSInferenceTechnique::GetOptions(vector<OptionSpec> &opts) const
@@ -101,19 +114,35 @@ void NLLSInferenceTechnique::DoCalculations(FabberRunData &allData)
         m_model->PassData(1, data.Column(1), coords.Column(1));
     }
 
+    if (m_time_budget > 0)
+    {
+        DoCalculationsBudget(allData);
+        return;
+    }
+
     // Check how many samples in time series (ignoring any masked time points)
     int Nsamples = data.Nrows() - m_masked_tpoints.size();
+    FindDuplicateVoxels(allData);
 
     // Loop over voxels. The result for each voxel is
     // stored as a MVN distribution for its parameters
     // in resultMVNs.
     for (unsigned int voxel = 1; voxel <= Nvoxels; voxel++)
     {
+        int rep = DuplicateOf(voxel);
+        if (rep > 0)
+        {
+            CopyVoxelResult(voxel, rep);
+            VoxelCompleted(allData, voxel, Nvoxels);
+            continue;
+        }
+
         ColumnVector y = data.Column(voxel);
         ColumnVector vcoords = coords.Column(voxel);
 
         // Some models might want more information about the data
         m_model->PassData(voxel, y, vcoords);
+        VoxelCost cost(*this, voxel);
 
         LinearizedFwdModel linear(m_model);
 
@@ -151,6 +180,9 @@ void NLLSInferenceTechnique::DoCalculations(FabberRunData &allData)
             // Run the nonlinear optimizer
             // output variable is unused - unsure if nonlin has any effect
             nonlin(nlinpar, costfn);
+            VoxelDiagnostics *diag = Diagnostics(voxel);
+            if (diag)
+                diag->iterations = nlinpar.NIter();
 
 #if 0
 			LOG << "NLLSInferenceTechnique::The solution is: " << nlinpar.Par() << endl;
@@ -165,32 +197,7 @@ void NLLSInferenceTechnique::DoCalculations(FabberRunData &allData)
 			}
 #endif
             // Get the new parameters
-            fwdPosterior.means = nlinpar.Par();
-
-            // Recenter linearized model on new parameters
-            linear.ReCentre(fwdPosterior.means);
-            Matrix J = linear.Jacobian();
-            MaskRows(J, m_masked_tpoints);
-
-            // Calculate the NLLS precision
-            // This is (J'*J)/mse
-            // The covariance is the inverse
-            SymmetricMatrix nllsprec;
-            double sqerr = costfn.cf(fwdPosterior.means);
-            double mse = sqerr / (Nsamples - Nparams);
-            nllsprec << J.t() * J / mse;
-
-            // Look for zero diagonal elements (implies parameter is not observable)
-            // and set precision small, but non-zero - so that covariance can be calculated
-            for (int i = 1; i <= nllsprec.Nrows(); i++)
-            {
-                if (nllsprec(i, i) < 1e-6)
-                {
-                    nllsprec(i, i) = 1e-6;
-                }
-            }
-            fwdPosterior.SetPrecisions(nllsprec);
-            fwdPosterior.GetCovariance();
+            CalculatePosterior(fwdPosterior, nlinpar.Par(), costfn, Nsamples);
         }
         catch (Exception &e)
         {
@@ -198,6 +205,7 @@ void NLLSInferenceTechnique::DoCalculations(FabberRunData &allData)
 
             if (m_halt_bad_voxel)
                 throw;
+            MarkBadVoxel(voxel);
 
             LOG << "NLLSInferenceTechnique::Estimates in this voxel may be unreliable" << endl
                 << "   (precision matrix will be set manually)" << endl
@@ -215,6 +223,187 @@ void NLLSInferenceTechnique::DoCalculations(FabberRunData &allData)
 
         resultMVNs.push_back(new MVNDist(fwdPosterior));
         assert(resultMVNs.size() == voxel);
+        VoxelCompleted(allData, voxel, Nvoxels);
+    }
+}
+
+void NLLSInferenceTechnique::CalculatePosterior(
+    MVNDist &fwdPosterior, const ColumnVector &params, const NLLSCF &costfn, int Nsamples)
+{
+    int Nparams = params.Nrows();
+    fwdPosterior.means = params;
+
+    // Recenter linearized model on new parameters
+    LinearizedFwdModel linear(m_model);
+    linear.ReCentre(fwdPosterior.means);
+    Matrix J = linear.Jacobian();
+    MaskRows(J, m_masked_tpoints);
+
+    // Calculate the NLLS precision
+    // This is (J'*J)/mse
+    // The covariance is the inverse
+    SymmetricMatrix nllsprec;
+    double sqerr = costfn.cf(fwdPosterior.means);
+    double mse = sqerr / (Nsamples - Nparams);
+    nllsprec << J.t() * J / mse;
+
+    // Look for zero diagonal elements (implies parameter is not observable)
+    // and set precision small, but non-zero - so that covariance can be calculated
+    for (int i = 1; i <= nllsprec.Nrows(); i++)
+    {
+        if (nllsprec(i, i) < 1e-6)
+        {
+            nllsprec(i, i) = 1e-6;
+        }
+    }
+    fwdPosterior.SetPrecisions(nllsprec);
+    fwdPosterior.GetCovariance();
+}
+
+void NLLSInferenceTechnique::DoCalculationsBudget(FabberRunData &allData)
+{
+    double deadline = fabber::wall_time() + m_time_budget;
+    const Matrix &data = allData.GetMainVoxelData();
+    const Matrix &coords = allData.GetVoxelCoords();
+    int Nvoxels = data.Ncols();
+    int Nsamples = data.Nrows() - m_masked_tpoints.size();
+    int Nparams = initialFwdPosterior->GetSize();
+
+    // Each call to the optimizer continues from where the previous call for the
+    // voxel stopped. At least two iterations per call are needed for the optimizer
+    // to be able to detect convergence
+    int its_per_call = max(m_budget_min_its, 2);
+
+    vector<ColumnVector> fit(Nvoxels, initialFwdPosterior->means);
+    resultIterations.assign(Nvoxels, 0);
+    resultConvergence.assign(Nvoxels, 0);
+
+    // Voxels which have not converged, ordered by the reduction in the cost
+    // function on their most recent call to the optimizer
+    priority_queue<pair<double, int> > active;
+    bool out_of_time = false;
+
+    LOG << "NLLSInferenceTechnique::Time budget of " << m_time_budget << "s" << endl;
+
+    // Every voxel first gets the minimum number of iterations
+    for (int voxel = 1; voxel <= Nvoxels; voxel++)
+    {
+        if (fabber::wall_time() > deadline)
+        {
+            out_of_time = true;
+            break;
+        }
+        allData.Progress(voxel, Nvoxels);
+        double cf_change = OptimizeVoxel(allData, data, coords, voxel, its_per_call, fit[voxel - 1]);
+        if (resultConvergence[voxel - 1] == 0)
+        {
+            active.push(make_pair(cf_change, voxel));
+        }
+    }
+
+    // Remaining time is spent on the voxels whose fit is improving most
+    while (!out_of_time && !active.empty())
+    {
+        if (fabber::wall_time() > deadline)
+        {
+            out_of_time = true;
+            break;
+        }
+        int voxel = active.top().second;
+        active.pop();
+        double cf_change = OptimizeVoxel(allData, data, coords, voxel, its_per_call, fit[voxel - 1]);
+        if (resultConvergence[voxel - 1] == 0)
+        {
+            active.push(make_pair(cf_change, voxel));
+        }
+    }
+
+    if (out_of_time)
+    {
+        LOG << "NLLSInferenceTechnique::Time budget exhausted, "
+            << count(resultConvergence.begin(), resultConvergence.end(), 0)
+            << " voxels did not converge" << endl;
+    }
+
+    // Calculate the posterior from the best fit so far in each voxel
+    for (int voxel = 1; voxel <= Nvoxels; voxel++)
+    {
+        ColumnVector y = data.Column(voxel);
+        m_model->PassData(voxel, y, coords.Column(voxel));
+        NLLSCF costfn(y, m_model, m_masked_tpoints);
+
+        VoxelDiagnostics *diag = Diagnostics(voxel);
+        if (diag)
+            diag->iterations = resultIterations[voxel - 1];
+
+        MVNDist fwdPosterior;
+        fwdPosterior.SetSize(Nparams);
+        try
+        {
+            CalculatePosterior(fwdPosterior, fit[voxel - 1], costfn, Nsamples);
+        }
+        catch (Exception &e)
+        {
+            LOG << "NLLSInferenceTechnique::NEWMAT Exception in this voxel:\n" << e.what() << endl;
+
+            if (m_halt_bad_voxel)
+                throw;
+            MarkBadVoxel(voxel);
+
+            // precision matrix is probably singular so set manually
+            fwdPosterior.means = fit[voxel - 1];
+            fwdPosterior.SetPrecisions(IdentityMatrix(Nparams) * 1e-12);
+        }
+
+        resultMVNs.push_back(new MVNDist(fwdPosterior));
+        VoxelCompleted(allData, voxel, Nvoxels);
+    }
+}
+
+double NLLSInferenceTechnique::OptimizeVoxel(FabberRunData &allData, const Matrix &data,
+    const Matrix &coords, int voxel, int max_its, ColumnVector &params)
+{
+    allData.CheckCancelled();
+    VoxelCost cost(*this, voxel);
+
+    ColumnVector y = data.Column(voxel);
+    m_model->PassData(voxel, y, coords.Column(voxel));
+    NLLSCF costfn(y, m_model, m_masked_tpoints);
+
+    NonlinParam nlinpar(params.Nrows(), NL_LM);
+    if (!m_lm)
+    {
+        nlinpar.SetGaussNewtonType(LM_L);
+    }
+    nlinpar.SetStartingEstimate(params);
+    nlinpar.SetMaxIter(max_its);
+
+    try
+    {
+        double cf_before = costfn.cf(params);
+        NonlinOut status = nonlin(nlinpar, costfn);
+        params = nlinpar.Par();
+        resultIterations[voxel - 1] += nlinpar.NIter();
+
+        // Stop when the optimizer has converged, or can no longer improve the fit
+        double cf_change = cf_before - costfn.cf(params);
+        if ((status != NL_MAXITER && status != NL_LM_MAXITER) || cf_change <= 0)
+        {
+            resultConvergence[voxel - 1] = 1;
+        }
+        return cf_change;
+    }
+    catch (Exception &e)
+    {
+        LOG << "NLLSInferenceTechnique::NEWMAT Exception in voxel " << voxel << ":\n"
+            << e.what() << endl;
+
+        if (m_halt_bad_voxel)
+            throw;
+
+        resultConvergence[voxel - 1] = -1;
+        MarkBadVoxel(voxel);
+        return 0;
     }
 }
 
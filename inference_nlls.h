@@ -15,6 +15,8 @@
 
 #include <boost/shared_ptr.hpp>
 
+class NLLSCF;
+
 /**
  * Inference technique using non-linear least squares
  */
@@ -40,6 +42,32 @@ public:
     virtual void DoCalculations(FabberRunData &data);
 
 protected:
+    /**
+     * Fit each voxel in turn, stopping early if the time budget is exhausted
+     *
+     * Every voxel first gets a minimum number of iterations. The remaining time is
+     * then spent on the voxels whose cost function is still reducing the most
+     */
+    void DoCalculationsBudget(FabberRunData &data);
+
+    /**
+     * Run the optimizer on a voxel for a limited number of iterations, updating its
+     * iteration count and convergence status
+     *
+     * @param data Main voxel data, as returned by FabberRunData::GetMainVoxelData
+     * @param coords Voxel coordinates, as returned by FabberRunData::GetVoxelCoords
+     * @param params Parameters to start from, replaced by the fitted parameters
+     * @return Reduction in the cost function
+     */
+    double OptimizeVoxel(FabberRunData &rundata, const NEWMAT::Matrix &data,
+        const NEWMAT::Matrix &coords, int voxel, int max_its, NEWMAT::ColumnVector &params);
+
+    /**
+     * Set the posterior for a voxel from the best fit parameters
+     */
+    void CalculatePosterior(MVNDist &fwdPosterior, const NEWMAT::ColumnVector &params,
+        const NLLSCF &costfn, int Nsamples);
+
     const MVNDist *initialFwdPosterior;
     bool m_vbinit;
     bool m_lm;
@@ -9,22 +9,41 @@
 #include "inference_vb.h"
 
 #include "convergence.h"
+#include "dictionary.h"
 #include "easylog.h"
+#include "perf.h"
 #include "priors.h"
 #include "run_context.h"
+#include "rundata_coarse.h"
+#include "rundata_subset.h"
 #include "tools.h"
 #include "version.h"
 
 #include <miscmaths/miscmaths.h>
 #include <newmatio.h>
 
+#include <algorithm>
 #include <math.h>
+#include <queue>
+#include <set>
+#include <utility>
 
 using MISCMATHS::sign;
 
 static OptionSpec OPTIONS[] = {
     { "noise", OPT_STR, "Noise model to use (white or ar1)", OPT_REQ, "" },
     { "convergence", OPT_STR, "Name of method for detecting convergence", OPT_NONREQ, "maxits" },
+    { "time-budget", OPT_FLOAT, "Time limit for the calculations in seconds. When it is reached the "
+                                "best solution so far is used for each voxel",
+        OPT_NONREQ, "" },
+    { "time-budget-min-its", OPT_INT, "With a time budget, minimum number of iterations for every "
+                                      "voxel before the remaining time is given to voxels which "
+                                      "are changing most",
+        OPT_NONREQ, "2" },
+    { "dedup-voxels", OPT_BOOL, "Fit only one of each group of voxels with identical data, "
+                                "supplementary data and image priors and copy its results to "
+                                "the others. Not used with spatial priors",
+        OPT_NONREQ, "" },
     { "max-iterations", OPT_STR,
         "number of iterations of VB to use with the maxits convergence detector", OPT_NONREQ,
         "10" },
@@ -34,6 +53,12 @@ static OptionSpec OPTIONS[] = {
     { "max-trials", OPT_STR, "When using the trial mode convergence detector, the maximum number "
                              "of trials after an initial reduction in F",
         OPT_NONREQ, "10" },
+    { "accel-method", OPT_STR, "When using the accel convergence detector, how steps are "
+                               "extrapolated: anderson or squarem",
+        OPT_NONREQ, "anderson" },
+    { "accel-depth", OPT_INT, "When using the accel convergence detector with anderson, number of "
+                              "previous iterations to combine",
+        OPT_NONREQ, "3" },
     { "print-free-energy", OPT_BOOL, "Output the free energy", OPT_NONREQ, "" },
     { "mcsteps", OPT_INT, "Number of motion correction steps", OPT_NONREQ, "0" },
     { "continue-from-mvn", OPT_MVN, "Continue previous run from output MVN files", OPT_NONREQ, "" },
@@ -58,12 +83,70 @@ static OptionSpec OPTIONS[] = {
         OPT_NONREQ, "dual" },
     { "spatial-dims", OPT_INT, "Number of spatial dimensions", OPT_NONREQ, "3" },
     { "spatial-speed", OPT_STR, "Restrict speed of spatial smoothing", OPT_NONREQ, "-1" },
-    { "distance-measure", OPT_STR, "", OPT_NONREQ, "dist1" },
+    { "distance-measure", OPT_STR,
+        "Distance between voxels for distance-based priors: dist1=Euclidian, "
+        "dist2=squared Euclidian, mdist=Manhattan",
+        OPT_NONREQ, "dist1" },
     { "param-spatial-priors", OPT_STR,
         "Type of spatial priors for each parameter, as a sequence of characters. "
-        "N=nonspatial, M=Markov random field, P=Penny, A=ARD",
+        "N=nonspatial, M=Markov random field, P=Penny, D=distance-based, A=ARD",
         OPT_NONREQ, "N+" },
+    { "dist-prior-delta", OPT_FLOAT,
+        "Initial support radius of the covariance for distance-based priors", OPT_NONREQ, "2" },
+    { "dist-prior-delta-min", OPT_FLOAT,
+        "Minimum support radius when adapting the smoothness of distance-based priors",
+        OPT_NONREQ, "1.5" },
+    { "dist-prior-delta-max", OPT_FLOAT,
+        "Maximum support radius when adapting the smoothness of distance-based priors",
+        OPT_NONREQ, "3" },
     { "update-spatial-prior-on-first-iteration", OPT_BOOL, "", OPT_NONREQ, "" },
+    { "spatial-solver", OPT_STR,
+        "How to update the means of parameters with MRF (M or m) spatial priors: sweep=voxel "
+        "by voxel, pcg=solve for all voxels together using conjugate gradients",
+        OPT_NONREQ, "sweep" },
+    { "domain-transport", OPT_STR,
+        "Run as one process of a domain-decomposed spatial VB run, communicating with the "
+        "others using socket (Unix domain sockets) or mpi",
+        OPT_NONREQ, "" },
+    { "domain-size", OPT_INT, "Number of processes with domain-transport=socket", OPT_NONREQ,
+        "1" },
+    { "domain-rank", OPT_INT, "Rank of this process from 0 with domain-transport=socket",
+        OPT_NONREQ, "0" },
+    { "domain-socket-dir", OPT_STR,
+        "Directory for the sockets of the processes with domain-transport=socket", OPT_NONREQ,
+        "." },
+    { "domain-timeout", OPT_INT,
+        "Seconds to wait for a message from another process of a domain-decomposed run before "
+        "giving up",
+        OPT_NONREQ, "3600" },
+    { "checkpoint-its", OPT_INT, "In spatial mode, save a checkpoint of the run after every "
+                                 "<n> iterations so it can be resumed with --resume-from",
+        OPT_NONREQ, "0" },
+    { "checkpoint-voxels", OPT_INT, "In voxelwise mode, save a checkpoint of the run after every "
+                                    "<n> voxels so it can be resumed with --resume-from",
+        OPT_NONREQ, "0" },
+    { "checkpoint-file", OPT_STR, "File to save checkpoints to. Default is checkpoint in the "
+                                  "output directory",
+        OPT_NONREQ, "" },
+    { "resume-from", OPT_FILE, "Resume a run from a checkpoint file. The data and options must be "
+                               "the same as for the original run",
+        OPT_NONREQ, "" },
+    { "multires", OPT_INT, "Number of resolution levels. The data is repeatedly downsampled by "
+                           "averaging 2x2x2 blocks and each level is initialized from the "
+                           "result of the coarser level",
+        OPT_NONREQ, "1" },
+    { "init-dict", OPT_INT, "Number of model simulations in a dictionary used to find the "
+                            "initial parameter values of each voxel. 0 for no dictionary",
+        OPT_NONREQ, "0" },
+    { "init-dict-match", OPT_STR, "How voxels are matched to the dictionary: euclid (closest "
+                                  "simulation) or corr (highest normalised correlation)",
+        OPT_NONREQ, "euclid" },
+    { "init-dict-range", OPT_FLOAT, "Range of each parameter covered by the dictionary, in "
+                                    "standard deviations of its prior either side of the mean",
+        OPT_NONREQ, "2" },
+    { "init-dict-file", OPT_FILE, "File to cache the dictionary in. It is reused by later runs "
+                                  "with the same model and options",
+        OPT_NONREQ, "" },
     { "locked-linear-from-mvn", OPT_MVN, "MVN file containing fixed centres for linearization",
         OPT_NONREQ, "" },
     { "" },
@@ -121,6 +204,32 @@ void Vb::Initialize(FwdModel *fwd_model, FabberRunData &rundata)
 
     // Locked linearizations, if requested
     m_locked_linear = rundata.GetStringDefault("locked-linear-from-mvn", "") != "";
+
+    m_multires = rundata.GetIntDefault("multires", 1, 1);
+
+    string solver = rundata.GetStringDefault("spatial-solver", "sweep");
+    if ((solver != "sweep") && (solver != "pcg"))
+    {
+        throw InvalidOptionValue("spatial-solver", solver, "Must be sweep or pcg");
+    }
+    m_spatial_pcg = (solver == "pcg");
+
+    m_dict_size = rundata.GetIntDefault("init-dict", 0, 0);
+    m_dict_range = rundata.GetDoubleDefault("init-dict-range", 2, 0);
+    m_dict_file = rundata.GetStringDefault("init-dict-file", "");
+    string dict_match = rundata.GetStringDefault("init-dict-match", "euclid");
+    if ((dict_match != "euclid") && (dict_match != "corr"))
+    {
+        throw InvalidOptionValue("init-dict-match", dict_match, "Must be euclid or corr");
+    }
+    m_dict_corr = (dict_match == "corr");
+
+    m_checkpoint_its = rundata.GetIntDefault("checkpoint-its", 0, 0);
+    m_checkpoint_voxels = rundata.GetIntDefault("checkpoint-voxels", 0, 0);
+    m_checkpoint_file = rundata.GetStringDefault("checkpoint-file", "");
+    m_resume_from = rundata.GetStringDefault("resume-from", "");
+
+    m_transport.reset(Transport::NewFromRunData(rundata));
 }
 
 void Vb::InitializeNoiseFromParam(FabberRunData &rundata, NoiseParams *dist, string param_key)
@@ -137,6 +246,8 @@ void Vb::InitializeNoiseFromParam(FabberRunData &rundata, NoiseParams *dist, str
 
 void Vb::SetupPerVoxelDists(FabberRunData &rundata)
 {
+    fabber::ScopedTimer timer("SetupPerVoxelDists");
+
     // Initialized in voxel loop below (from file or default as required)
     m_ctx->noise_post.resize(m_nvoxels, NULL);
     m_ctx->noise_prior.resize(m_nvoxels, NULL);
@@ -159,8 +270,13 @@ void Vb::SetupPerVoxelDists(FabberRunData &rundata)
     resultFs.resize(m_nvoxels, 9999); // 9999 is a garbage default value
     resultFsHistory.resize(m_nvoxels);
 
+    // Compact MVN files are read a voxel at a time in the voxel loop below,
+    // rather than creating an MVN for every voxel up front
+    MVNDist voxelMvn(m_log);
+
     // Whether to fix the linearization centres (default: false)
     vector<MVNDist *> lockedLinearDists;
+    auto_ptr<MVNCompactReader> compactLocked;
     Matrix lockedLinearCentres;
     if (m_locked_linear)
     {
@@ -168,27 +284,56 @@ void Vb::SetupPerVoxelDists(FabberRunData &rundata)
         LOG << "Vb::Loading fixed linearization centres from the MVN '" << file
             << "'\nNOTE: This does not check if the correct "
                "number of parameters is present!\n";
-        MVNDist::Load(lockedLinearDists, file, rundata, m_log);
+        string key = rundata.GetVoxelDataKey(file);
+        if (MVNDist::IsCompactFile(key))
+            compactLocked.reset(new MVNCompactReader(key, m_nvoxels));
+        else
+            MVNDist::Load(lockedLinearDists, file, rundata, m_log);
         lockedLinearCentres.ReSize(m_num_params, m_nvoxels);
     }
 
     // If we are resuming from a previous run, there will be data containing a per-voxel
     // distribution of the model parameters, and noise as well.
+    // Compact MVN files are not image data so are checked for separately
     bool continueFromMvn = false;
-    try {
-        rundata.GetVoxelData("continue-from-mvn");
+    if (rundata.HaveKey("continue-from-mvn")
+        && MVNDist::IsCompactFile(rundata.GetVoxelDataKey("continue-from-mvn")))
+    {
         continueFromMvn = true;
     }
-    catch(DataNotFound &e) {
-        // no worries
+    else
+    {
+        try {
+            rundata.GetVoxelData("continue-from-mvn");
+            continueFromMvn = true;
+        }
+        catch(DataNotFound &e) {
+            // no worries
+        }
     }
 
+    // Compact MVN files without a parameter list go straight into the posteriors
+    auto_ptr<MVNCompactReader> compactMvn;
     if (continueFromMvn)
     {
         LOG << "Vb::Continuing from MVN" << endl;
         // Optional list of parameters in MVN
         string paramFilename = rundata.GetStringDefault("continue-from-params", ""); 
-        InitMVNFromFile(rundata, paramFilename);
+        string key = rundata.GetVoxelDataKey("continue-from-mvn");
+        if (paramFilename == "" && MVNDist::IsCompactFile(key))
+        {
+            compactMvn.reset(new MVNCompactReader(key, m_nvoxels));
+            if (compactMvn->NumParams() != m_num_params + m_noise_params)
+            {
+                throw InvalidOptionValue("continue-from-mvn", key,
+                    "MVN has " + stringify(compactMvn->NumParams()) + " parameters, expected "
+                        + stringify(m_num_params + m_noise_params));
+            }
+        }
+        else
+        {
+            InitMVNFromFile(rundata, paramFilename);
+        }
     }
 
     // Initial noise distributions
@@ -202,11 +347,17 @@ void Vb::SetupPerVoxelDists(FabberRunData &rundata)
     {
         if (continueFromMvn)
         {
-            m_ctx->fwd_post[v - 1] = resultMVNs.at(v - 1)->GetSubmatrix(1, m_num_params);
-            assert(m_num_params + m_noise_params == resultMVNs.at(v - 1)->GetSize());
+            MVNDist *mvn = resultMVNs.at(v - 1);
+            if (compactMvn.get())
+            {
+                compactMvn->Next(voxelMvn);
+                mvn = &voxelMvn;
+            }
+            m_ctx->fwd_post[v - 1] = mvn->GetSubmatrix(1, m_num_params);
+            assert(m_num_params + m_noise_params == mvn->GetSize());
             m_ctx->noise_post[v - 1] = m_noise->NewParams();
-            m_ctx->noise_post[v - 1]->InputFromMVN(resultMVNs.at(v - 1)->GetSubmatrix(
-                m_num_params + 1, m_num_params + m_noise_params));
+            m_ctx->noise_post[v - 1]->InputFromMVN(
+                mvn->GetSubmatrix(m_num_params + 1, m_num_params + m_noise_params));
         }
         else
         {
@@ -220,8 +371,10 @@ void Vb::SetupPerVoxelDists(FabberRunData &rundata)
 
         if (m_locked_linear)
         {
-            lockedLinearCentres.Column(v)
-                = lockedLinearDists.at(v - 1)->means.Rows(1, m_num_params);
+            const MVNDist *centre = compactLocked.get() ? &voxelMvn : lockedLinearDists.at(v - 1);
+            if (compactLocked.get())
+                compactLocked->Next(voxelMvn);
+            lockedLinearCentres.Column(v) = centre->means.Rows(1, m_num_params);
             m_lin_model[v - 1].ReCentre(lockedLinearCentres.Column(v));
         }
         else
@@ -233,12 +386,105 @@ void Vb::SetupPerVoxelDists(FabberRunData &rundata)
         // inefficient but not harmful because all convergence detectors are the same type
         m_conv[v - 1] = ConvergenceDetector::NewFromName(conv_name);
         m_conv[v - 1]->Initialize(rundata);
-        m_needF = m_conv[v - 1]->UseF() || m_printF || m_saveF || m_saveFsHistory;
+        m_needF = m_conv[v - 1]->UseF() || m_printF || m_saveF || m_saveFsHistory
+            || m_time_budget > 0;
 
         m_ctx->noise_prior[v - 1] = initialNoisePrior->Clone();
         m_noise->Precalculate(
             *m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1], m_origdata->Column(v));
     }
+
+    if (m_resume_from != "")
+    {
+        LoadCheckpoint(rundata);
+    }
+    else if (m_multires > 1 && !continueFromMvn)
+    {
+        InitFromCoarseLevel(rundata);
+    }
+    else if (m_dict_size > 0 && !continueFromMvn && m_nvoxels > 0)
+    {
+        InitFromDictionary(rundata);
+    }
+}
+
+void Vb::InitFromDictionary(FabberRunData &rundata)
+{
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+
+    // Model needs voxel data to know the number of time points to simulate
+    PassModelData(1);
+    ModelDictionary dict(m_log);
+    dict.Create(m_model, params, m_dict_size, m_dict_range, m_masked_tpoints, m_dict_file);
+
+    Matrix means;
+    dict.Match(*m_origdata, m_dict_corr, means);
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        m_ctx->fwd_post[v - 1].means = means.Column(v);
+        if (!m_locked_linear)
+        {
+            PassModelData(v);
+            m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+        }
+    }
+    LOG << "Vb::Initialized " << m_nvoxels << " voxels from a dictionary of " << dict.Size()
+        << " simulations" << endl;
+}
+
+void Vb::InitFromCoarseLevel(FabberRunData &rundata)
+{
+    FabberRunDataCoarse coarse(rundata, m_spatial_dims > 0 ? m_spatial_dims : 3);
+    const vector<int> &coarse_voxels = coarse.GetCoarseVoxels();
+    int ncoarse = coarse.GetVoxelCoords().Ncols();
+    if (ncoarse == m_nvoxels)
+    {
+        LOG << "Vb::Data cannot be downsampled further - not using coarser levels" << endl;
+        return;
+    }
+
+    // The coarse run is only used to initialize this one so it does not
+    // save anything, and it does not share the time budget
+    coarse.Set("multires", m_multires - 1);
+    coarse.Unset("time-budget");
+    coarse.Unset("locked-linear-from-mvn");
+    coarse.Unset("save-free-energy");
+    coarse.Unset("save-free-energy-history");
+    coarse.Unset("save-voxel-diagnostics");
+    coarse.Unset("checkpoint-its");
+    coarse.Unset("checkpoint-voxels");
+    coarse.Unset("checkpoint-file");
+    coarse.Unset("resume-from");
+
+    LOG << "Vb::Fitting " << ncoarse << " voxels at resolution level " << m_multires - 1 << endl;
+    Vb coarse_vb;
+    coarse_vb.Initialize(m_model, coarse);
+    coarse_vb.DoCalculations(coarse);
+    LOG << "Vb::Done fitting resolution level " << m_multires - 1 << endl;
+
+    // Only the model parameters are prolonged. The noise is lower in the
+    // averaged data so its posterior would not be a good starting point
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        const MVNDist *coarse_post = coarse_vb.resultMVNs.at(coarse_voxels[v - 1] - 1);
+        if (!coarse_post)
+            continue;
+        m_ctx->fwd_post[v - 1].means = coarse_post->means.Rows(1, m_num_params);
+        if (!m_locked_linear)
+        {
+            PassModelData(v);
+            m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+        }
+    }
+
+    // Differences between neighbours are halved at the finer level for a smooth
+    // image, so the spatial precision of the differences is four times larger
+    m_initial_aK = coarse_vb.m_final_aK;
+    for (unsigned int k = 0; k < m_initial_aK.size(); k++)
+    {
+        m_initial_aK[k] *= 4;
+    }
 }
 
 void Vb::PassModelData(int v)
@@ -259,9 +505,10 @@ void Vb::PassModelData(int v)
 
 void Vb::IgnoreVoxel(int v)
 {
-    LOG << "Vb::IgnoreVoxel This voxel will be ignored in further updates" << endl;
+    LOG_VERBOSE << "Vb::IgnoreVoxel Voxel " << v << " will be ignored in further updates" << endl;
 
     m_ctx->ignore_voxels.push_back(v);
+    MarkBadVoxel(v);
 
     // Remove voxel from lists of neighbours of other voxels.
     // We identify affected voxels by looking in the neighbour
@@ -293,11 +540,12 @@ void Vb::IgnoreVoxel(int v)
 /**
  * Calculate free energy. Note that this is currently unused in spatial VB
  */
-double Vb::CalculateF(int v, string label, double Fprior)
+double Vb::CalculateF(int v, const char *label, double Fprior)
 {
     double F = 1234.5678;
     if (m_needF)
     {
+        fabber::ScopedTimer timer("CalculateF");
         F = m_noise->CalcFreeEnergy(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
             m_ctx->fwd_post[v - 1], m_ctx->fwd_prior[v - 1], m_lin_model[v - 1],
             m_origdata->Column(v));
@@ -344,6 +592,7 @@ bool Vb::IsSpatial(FabberRunData &rundata) const
             case PRIOR_SPATIAL_m:
             case PRIOR_SPATIAL_P:
             case PRIOR_SPATIAL_p:
+            case PRIOR_SPATIAL_D:
                 return true;
             }
         }
@@ -353,6 +602,32 @@ bool Vb::IsSpatial(FabberRunData &rundata) const
 
 void Vb::DoCalculations(FabberRunData &rundata)
 {
+    if (m_transport && m_domain_owned.empty())
+    {
+        // If this process fails, the others must be told so they do not
+        // wait for it
+        try
+        {
+            DoCalculationsDomain(rundata);
+        }
+        catch (NEWMAT::Exception &e)
+        {
+            m_transport->Abort(e.what());
+            throw;
+        }
+        catch (std::exception &e)
+        {
+            m_transport->Abort(e.what());
+            throw;
+        }
+        catch (...)
+        {
+            m_transport->Abort("Unexpected error");
+            throw;
+        }
+        return;
+    }
+
     // extract data (and the coords) from rundata for the (first) VB run
     // Rows are volumes
     // Columns are (time) series
@@ -363,6 +638,8 @@ void Vb::DoCalculations(FabberRunData &rundata)
     m_suppdata = &rundata.GetVoxelSuppData();
     m_nvoxels = m_origdata->Ncols();
     m_ctx = new RunContext(m_nvoxels);
+    m_ctx->owned = m_domain_owned;
+    m_ctx->transport = m_transport.get();
 
     // pass in some (dummy) data/coords here just in case the model relies upon it
     // use the first voxel values as our dummies FIXME this shouldn't really be
@@ -374,20 +651,52 @@ void Vb::DoCalculations(FabberRunData &rundata)
     assert(resultMVNs.empty());
     assert(resultFs.empty());
 
+    if (m_checkpoint_its > 0 || m_checkpoint_voxels > 0)
+    {
+        if (m_checkpoint_file == "")
+        {
+            m_checkpoint_file = rundata.GetOutputDir() + "/checkpoint";
+        }
+        m_checkpoint.reset(new Checkpoint());
+        m_checkpoint->SetLogger(m_log);
+        m_checkpoint_written = 0;
+    }
+
     SetupPerVoxelDists(rundata);
 
-    if (rundata.GetBool("output-only"))
+    try
     {
-        // Do no calculations - now we have set resultMVNs we can finish
-        LOG << "Vb::DoCalculations output-only set - not performing any calculations" << endl;
+        if (rundata.GetBool("output-only"))
+        {
+            // Do no calculations - now we have set resultMVNs we can finish
+            LOG << "Vb::DoCalculations output-only set - not performing any calculations" << endl;
+        }
+        else if (IsSpatial(rundata))
+        {
+            DoCalculationsSpatial(rundata);
+        }
+        else if (m_time_budget > 0)
+        {
+            DoCalculationsVoxelwiseBudget(rundata);
+        }
+        else
+        {
+            DoCalculationsVoxelwise(rundata);
+        }
     }
-    else if (IsSpatial(rundata))
+    catch (...)
     {
-        DoCalculationsSpatial(rundata);
+        // Run was cancelled or failed
+        if (m_checkpoint)
+            m_checkpoint->Wait();
+        FreeRunContext();
+        throw;
     }
-    else
+
+    if (m_checkpoint)
     {
-        DoCalculationsVoxelwise(rundata);
+        // Make sure the final checkpoint is complete before the run ends
+        m_checkpoint->Wait();
     }
 
     if (!m_needF)
@@ -396,6 +705,11 @@ void Vb::DoCalculations(FabberRunData &rundata)
         resultFs.clear();
     }
 
+    FreeRunContext();
+}
+
+void Vb::FreeRunContext()
+{
     // Delete stuff (avoid memory leaks)
     for (int v = 1; v <= m_nvoxels; v++)
     {
@@ -403,7 +717,35 @@ void Vb::DoCalculations(FabberRunData &rundata)
         delete m_ctx->noise_prior[v - 1];
         delete m_conv[v - 1];
     }
+    m_conv.clear();
     delete m_ctx;
+    m_ctx = NULL;
+}
+
+namespace
+{
+/**
+ * Deletes the priors for a run when it goes out of scope, including when the
+ * run is cancelled or fails
+ */
+class PriorListDeleter
+{
+public:
+    explicit PriorListDeleter(vector<Prior *> &priors)
+        : m_priors(priors)
+    {
+    }
+    ~PriorListDeleter()
+    {
+        for (unsigned int i = 0; i < m_priors.size(); i++)
+        {
+            delete m_priors[i];
+        }
+    }
+
+private:
+    vector<Prior *> &m_priors;
+};
 }
 
 void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
@@ -411,12 +753,38 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
     vector<Parameter> params;
     m_model->GetParameters(rundata, params);
     vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
+    PriorListDeleter delete_priors(priors);
 
     LOG << "Vb::Voxelwise calculations loop" << endl;
+
+    // Voxels which start from their own initial posterior can't share results
+    if (m_dedup && (m_multires > 1 || m_locked_linear
+                       || rundata.GetStringDefault("continue-from-mvn", "") != ""))
+    {
+        WARN_ONCE("Vb::dedup-voxels is not used with multires, continue-from-mvn or "
+                  "locked-linear-from-mvn");
+    }
+    else
+    {
+        FindDuplicateVoxels(rundata);
+    }
+
+    // Voxels before the checkpoint we are resuming from are already done
+    int first_voxel = (m_resume_position >= 0) ? m_resume_position + 1 : 1;
+
     // Loop over voxels
-    for (int v = 1; v <= m_nvoxels; v++)
+    for (int v = first_voxel; v <= m_nvoxels; v++)
     {
+        int rep = DuplicateOf(v);
+        if (rep > 0)
+        {
+            CopyVoxelResult(v, rep);
+            VoxelCompleted(rundata, v, m_nvoxels);
+            continue;
+        }
+
         PassModelData(v);
+        VoxelCost cost(*this, v);
 
         m_ctx->v = v;
         m_ctx->it = 0;
@@ -431,6 +799,7 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
         rundata.Progress(v, m_nvoxels);
         double F = 1234.5678;
         double Fprior = 0;
+        bool converged = false;
 
         try
         {
@@ -441,6 +810,8 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
             // convergence testing)
             do
             {
+                rundata.CheckCancelled();
+
                 // Save old values if the convergence detector found that they were the best so far
                 if (m_conv[v - 1]->NeedSave())
                 {
@@ -451,51 +822,26 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
                         DebugVoxel(v, "Saving as best solution so far");
                 }
 
-                for (int k = 0; k < m_num_params; k++)
+                ColumnVector before = m_ctx->fwd_post[v - 1].means;
+                F = VoxelIteration(v, priors, Fprior);
+                ++m_ctx->it;
+                converged = m_conv[v - 1]->Test(F);
+                if (!converged)
                 {
-                    Fprior = priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
+                    F = Extrapolate(v, before, F, Fprior);
                 }
-
-                if (m_debug)
-                    DebugVoxel(v, "Applied priors");
-
-                F = CalculateF(v, "before", Fprior);
-
-                m_noise->UpdateTheta(*m_ctx->noise_post[v - 1], m_ctx->fwd_post[v - 1],
-                    m_ctx->fwd_prior[v - 1], m_lin_model[v - 1], m_origdata->Column(v), NULL,
-                    m_conv[v - 1]->LMalpha());
-
-                if (m_debug)
-                    DebugVoxel(v, "Updated params");
-
-                F = CalculateF(v, "theta", Fprior);
-
-                m_noise->UpdateNoise(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
-                    m_ctx->fwd_post[v - 1], m_lin_model[v - 1], m_origdata->Column(v));
-
-                if (m_debug)
-                    DebugVoxel(v, "Updated noise");
-
-                F = CalculateF(v, "phi", Fprior);
-
-                // Linearization update
-                // Update the linear model before doing Free energy calculation
-                // (and ready for next round of theta and phi updates)
-                m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
-
-                if (m_debug)
-                    DebugVoxel(v, "Re-centered");
-
-                F = CalculateF(v, "lin", Fprior);
-                if (m_saveFsHistory) 
-                    resultFsHistory.at(v - 1).push_back(F);
-
-                ++m_ctx->it;
-            } while (!m_conv[v - 1]->Test(F));
+            } while (!converged);
 
             if (m_debug)
                 LOG << "Converged after " << m_ctx->it << " iterations" << endl;
 
+            VoxelDiagnostics *diag = Diagnostics(v);
+            if (diag)
+            {
+                diag->iterations = m_ctx->it;
+                diag->reverts = m_conv[v - 1]->NumReverts();
+            }
+
             // Save old values if best so far FIXME is this needed?
             if (m_conv[v - 1]->NeedSave())
             {
@@ -520,13 +866,19 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
 
             delete noisePosteriorSave;
         }
+        catch (FabberRunCancelled &e)
+        {
+            delete noisePosteriorSave;
+            throw;
+        }
         catch (FabberInternalError &e)
         {
-            LOG << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
+            LOG_WARN << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
                 << " : " << e.what() << endl;
 
             if (m_halt_bad_voxel)
                 throw;
+            MarkBadVoxel(v);
         }
         catch (NEWMAT::Exception &e)
         {
@@ -535,105 +887,962 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
 
             if (m_halt_bad_voxel)
                 throw;
+            MarkBadVoxel(v);
         }
 
-        // now write the results to resultMVNs
-        try
+        SetVoxelResult(v, F);
+        VoxelCompleted(rundata, v, m_nvoxels);
+
+        if (m_checkpoint_voxels > 0 && v % m_checkpoint_voxels == 0 && v < m_nvoxels)
         {
-            resultMVNs.at(v - 1)
-                = new MVNDist(m_ctx->fwd_post[v - 1], m_ctx->noise_post[v - 1]->OutputAsMVN());
-            if (m_needF)
-                resultFs.at(v - 1) = F;
-            if (m_saveFsHistory) 
-                resultFsHistory.at(v - 1).push_back(F);
+            SaveCheckpoint(v, priors, NULL);
         }
-        catch (...)
+    }
+
+    if (m_extrap_proposed > 0)
+    {
+        LOG << "Vb::Accepted " << m_extrap_accepted << " of " << m_extrap_proposed
+            << " extrapolated steps" << endl;
+    }
+}
+
+double Vb::VoxelIteration(int v, vector<Prior *> &priors, double &Fprior)
+{
+    {
+        fabber::ScopedTimer timer("ApplyPriors");
+        for (int k = 0; k < m_num_params; k++)
         {
-            // Even that can fail, due to results being singular
-            LOG << "Vb::Can't give any sensible answer for this voxel; outputting zero +- "
-                   "identity\n";
-            MVNDist *tmp = new MVNDist(m_log);
-            tmp->SetSize(m_ctx->fwd_post[v - 1].means.Nrows()
-                + m_ctx->noise_post[v - 1]->OutputAsMVN().means.Nrows());
-            tmp->SetCovariance(IdentityMatrix(tmp->means.Nrows()));
-            resultMVNs.at(v - 1) = tmp;
-            if (m_needF)
-                resultFs.at(v - 1) = F;
-            if (m_saveFsHistory) 
-                resultFsHistory.at(v - 1).push_back(F);
+            Fprior = priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
         }
     }
-    for (unsigned int i = 0; i < priors.size(); i++)
+
+    if (m_debug)
+        DebugVoxel(v, "Applied priors");
+
+    double F = CalculateF(v, "before", Fprior);
+
+    m_noise->UpdateTheta(*m_ctx->noise_post[v - 1], m_ctx->fwd_post[v - 1],
+        m_ctx->fwd_prior[v - 1], m_lin_model[v - 1], m_origdata->Column(v), NULL,
+        m_conv[v - 1]->LMalpha());
+
+    if (m_debug)
+        DebugVoxel(v, "Updated params");
+
+    F = CalculateF(v, "theta", Fprior);
+
+    m_noise->UpdateNoise(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
+        m_ctx->fwd_post[v - 1], m_lin_model[v - 1], m_origdata->Column(v));
+
+    if (m_debug)
+        DebugVoxel(v, "Updated noise");
+
+    F = CalculateF(v, "phi", Fprior);
+
+    // Linearization update
+    // Update the linear model before doing Free energy calculation
+    // (and ready for next round of theta and phi updates)
+    m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+
+    if (m_debug)
+        DebugVoxel(v, "Re-centered");
+
+    F = CalculateF(v, "lin", Fprior);
+    if (m_saveFsHistory)
+        resultFsHistory.at(v - 1).push_back(F);
+
+    return F;
+}
+
+double Vb::Extrapolate(int v, const ColumnVector &before, double F, double Fprior)
+{
+    ColumnVector proposal;
+    if (!m_conv[v - 1]->Extrapolate(before, m_ctx->fwd_post[v - 1].means, proposal))
+        return F;
+
+    fabber::ScopedTimer timer("Extrapolate");
+    ColumnVector current = m_ctx->fwd_post[v - 1].means;
+    LinearizedFwdModel current_lin(m_lin_model[v - 1]);
+    m_ctx->fwd_post[v - 1].means = proposal;
+    m_lin_model[v - 1].ReCentre(proposal);
+    ++m_ctx->it;
+    double Fnew = CalculateF(v, "extrapolated", Fprior);
+
+    // The free energy safeguards the step - a proposal which is no better is
+    // undone, as when a convergence detector reverts
+    bool accepted = (Fnew > F);
+    if (!accepted)
     {
-        delete priors[i];
+        // Restore the linearization rather than evaluating the model again
+        m_ctx->fwd_post[v - 1].means = current;
+        m_lin_model[v - 1] = current_lin;
     }
+    m_extrap_proposed++;
+    if (accepted)
+        m_extrap_accepted++;
+    if (m_debug)
+        DebugVoxel(v, accepted ? "Accepted extrapolation" : "Rejected extrapolation");
+
+    m_conv[v - 1]->ExtrapolationResult(accepted, accepted ? Fnew : F);
+    return accepted ? Fnew : F;
 }
 
-void Vb::DoCalculationsSpatial(FabberRunData &rundata)
+void Vb::SetVoxelResult(int v, double F)
 {
-    // Pass in some (dummy) data/coords here just in case the model relies upon it
-    // use the first voxel values as our dummies FIXME this shouldn't really be
-    // necessary, need to find way for model to know about the data beforehand.
-    if (m_nvoxels > 0)
-        PassModelData(1);
+    // now write the results to resultMVNs
+    try
+    {
+        resultMVNs.at(v - 1)
+            = new MVNDist(m_ctx->fwd_post[v - 1], m_ctx->noise_post[v - 1]->OutputAsMVN());
+        if (m_needF)
+            resultFs.at(v - 1) = F;
+        if (m_saveFsHistory)
+            resultFsHistory.at(v - 1).push_back(F);
+    }
+    catch (...)
+    {
+        // Even that can fail, due to results being singular
+        LOG << "Vb::Can't give any sensible answer for this voxel; outputting zero +- "
+               "identity\n";
+        MVNDist *tmp = new MVNDist(m_log);
+        tmp->SetSize(m_ctx->fwd_post[v - 1].means.Nrows()
+            + m_ctx->noise_post[v - 1]->OutputAsMVN().means.Nrows());
+        tmp->SetCovariance(IdentityMatrix(tmp->means.Nrows()));
+        resultMVNs.at(v - 1) = tmp;
+        if (m_needF)
+            resultFs.at(v - 1) = F;
+        if (m_saveFsHistory)
+            resultFsHistory.at(v - 1).push_back(F);
+    }
+}
 
-    // Make the neighbours[] lists if required
-    // if (m_prior_types_str.find_first_of("mMpP") != string::npos)
-    if (true) // FIXME
+void Vb::CopyVoxelResult(int v, int rep)
+{
+    InferenceTechnique::CopyVoxelResult(v, rep);
+
+    // Final distributions are also needed for checkpoints
+    m_ctx->fwd_post[v - 1] = m_ctx->fwd_post[rep - 1];
+    m_ctx->fwd_prior[v - 1] = m_ctx->fwd_prior[rep - 1];
+    m_ctx->noise_post[v - 1]->InputFromMVN(m_ctx->noise_post[rep - 1]->OutputAsMVN());
+    if (m_needF)
+        resultFs.at(v - 1) = resultFs.at(rep - 1);
+    if (m_saveFsHistory)
+        resultFsHistory.at(v - 1) = resultFsHistory.at(rep - 1);
+}
+
+void Vb::DoCalculationsVoxelwiseBudget(FabberRunData &rundata)
+{
+    if (m_checkpoint_voxels > 0 || m_resume_from != "")
     {
-        CalcNeighbours(*m_coords);
+        throw FabberRunDataError("Checkpoints are not supported with a time budget");
     }
+    double deadline = fabber::wall_time() + m_time_budget;
 
     vector<Parameter> params;
     m_model->GetParameters(rundata, params);
     vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
+    PriorListDeleter delete_priors(priors);
 
-    // Spatial loop currently uses a global convergence detector FIXME
-    // needs to change
-    CountingConvergenceDetector conv;
-    conv.Initialize(rundata);
-    double Fglobal = 1234.5678;
-    int maxits = convertTo<int>(rundata.GetStringDefault("max-iterations", "10"));
+    resultIterations.assign(m_nvoxels, 0);
+    resultConvergence.assign(m_nvoxels, 0);
+    vector<BudgetVoxel> state(m_nvoxels);
 
-    // MAIN ITERATION LOOP
-    do
+    LOG << "Vb::Voxelwise calculations with time budget of " << m_time_budget << "s" << endl;
+    try
     {
-        LOG << endl << "*** Spatial iteration *** " << (m_ctx->it + 1) << endl;
+        // Voxels which have not converged, ordered by the absolute change in F on
+        // their most recent iteration
+        priority_queue<pair<double, int> > active;
+        bool out_of_time = false;
 
-        // Give an indication of the progress through the voxels;
-        rundata.Progress(m_ctx->it, maxits);
-        double Fprior = 0;
+        // Every voxel first gets the minimum number of iterations
+        for (int v = 1; v <= m_nvoxels && !out_of_time; v++)
+        {
+            rundata.Progress(v, m_nvoxels);
+            while (resultConvergence[v - 1] == 0 && resultIterations[v - 1] < m_budget_min_its)
+            {
+                if (fabber::wall_time() > deadline)
+                {
+                    out_of_time = true;
+                    break;
+                }
+                BudgetIteration(rundata, v, priors, state[v - 1]);
+            }
+            if (resultConvergence[v - 1] == 0 && resultIterations[v - 1] > 0)
+            {
+                active.push(make_pair(state[v - 1].Fchange, v));
+            }
+        }
 
-        // ITERATE OVER VOXELS
-        for (int v = 1; v <= m_nvoxels; v++)
+        // Remaining time is spent on the voxels whose free energy is changing most
+        while (!active.empty())
         {
-            m_ctx->v = v;
+            if (fabber::wall_time() > deadline)
+            {
+                out_of_time = true;
+                break;
+            }
+            int v = active.top().second;
+            active.pop();
+            BudgetIteration(rundata, v, priors, state[v - 1]);
+            if (resultConvergence[v - 1] == 0)
+            {
+                active.push(make_pair(state[v - 1].Fchange, v));
+            }
+        }
 
-            PassModelData(v);
+        if (out_of_time)
+        {
+            LOG << "Vb::Time budget exhausted, "
+                << count(resultConvergence.begin(), resultConvergence.end(), 0)
+                << " voxels did not converge" << endl;
+        }
 
-            // The steps below are essentially the same as regular VB, although
-            // the code looks different as the per-voxel dists are set up at the
-            // start rather than as we go
-            try
+        // Use the best solution so far for each voxel
+        for (int v = 1; v <= m_nvoxels; v++)
+        {
+            BudgetVoxel &vstate = state[v - 1];
+            if (vstate.noise_post_save && resultConvergence[v - 1] >= 0)
             {
-                Fprior = 0;
-
-                // Apply prior updates for spatial or ARD priors
-                for (int k = 0; k < m_num_params; k++)
+                PassModelData(v);
+                m_ctx->v = v;
+                m_ctx->it = resultIterations[v - 1];
+                try
                 {
-                    Fprior += priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
+                    if (m_conv[v - 1]->NeedSave())
+                    {
+                        *vstate.noise_post_save = *m_ctx->noise_post[v - 1];
+                        vstate.fwd_post_save = m_ctx->fwd_post[v - 1];
+                        vstate.fwd_prior_save = m_ctx->fwd_prior[v - 1];
+                    }
+                    if (m_conv[v - 1]->NeedRevert())
+                    {
+                        *m_ctx->noise_post[v - 1] = *vstate.noise_post_save;
+                        m_ctx->fwd_post[v - 1] = vstate.fwd_post_save;
+                        m_ctx->fwd_prior[v - 1] = vstate.fwd_prior_save;
+                        m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+                        if (m_debug)
+                            DebugVoxel(v, "Reverted to better solution");
+                        vstate.F = CalculateF(v, "revert", vstate.Fprior);
+                    }
                 }
-                if (m_debug)
-                    DebugVoxel(v, "Priors set");
-
-                // Ignore voxels where numerical issues have occurred
-                if (std::find(m_ctx->ignore_voxels.begin(), m_ctx->ignore_voxels.end(), v)
-                    != m_ctx->ignore_voxels.end())
+                catch (NEWMAT::Exception &e)
                 {
-                    LOG << "Ignoring voxel " << v << endl;
-                    continue;
+                    LOG << "Vb::NEWMAT exception for voxel " << v << " at "
+                        << m_coords->Column(v).t() << " : " << e.what() << endl;
+                    if (m_halt_bad_voxel)
+                        throw;
                 }
-
+            }
+            VoxelDiagnostics *diag = Diagnostics(v);
+            if (diag)
+            {
+                diag->iterations = resultIterations[v - 1];
+                diag->reverts = m_conv[v - 1]->NumReverts();
+            }
+            SetVoxelResult(v, vstate.F);
+            VoxelCompleted(rundata, v, m_nvoxels);
+        }
+    }
+    catch (...)
+    {
+        for (int v = 0; v < m_nvoxels; v++)
+        {
+            delete state[v].noise_post_save;
+        }
+        throw;
+    }
+
+    for (int v = 0; v < m_nvoxels; v++)
+    {
+        delete state[v].noise_post_save;
+    }
+}
+
+void Vb::BudgetIteration(FabberRunData &rundata, int v, vector<Prior *> &priors, BudgetVoxel &state)
+{
+    rundata.CheckCancelled();
+    PassModelData(v);
+    VoxelCost cost(*this, v);
+    m_ctx->v = v;
+    m_ctx->it = resultIterations[v - 1];
+
+    try
+    {
+        if (!state.noise_post_save)
+        {
+            // First iteration for this voxel. Save our model parameters in case we need
+            // to revert later. Note need to save prior in case ARD is being used
+            state.noise_post_save = m_ctx->noise_post[v - 1]->Clone();
+            state.fwd_post_save = m_ctx->fwd_post[v - 1];
+            state.fwd_prior_save = m_ctx->fwd_prior[v - 1];
+            m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+            m_conv[v - 1]->Reset();
+        }
+        else if (m_conv[v - 1]->NeedSave())
+        {
+            // Save old values if the convergence detector found that they were the best so far
+            *state.noise_post_save = *m_ctx->noise_post[v - 1];
+            state.fwd_post_save = m_ctx->fwd_post[v - 1];
+            state.fwd_prior_save = m_ctx->fwd_prior[v - 1];
+            if (m_debug)
+                DebugVoxel(v, "Saving as best solution so far");
+        }
+
+        double Fprev = state.F;
+        state.F = VoxelIteration(v, priors, state.Fprior);
+        ++resultIterations[v - 1];
+        state.Fchange = (resultIterations[v - 1] == 1) ? DBL_MAX : fabs(state.F - Fprev);
+
+        if (m_conv[v - 1]->Test(state.F))
+        {
+            resultConvergence[v - 1] = 1;
+        }
+    }
+    catch (FabberInternalError &e)
+    {
+        LOG_WARN << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t() << " : "
+            << e.what() << endl;
+
+        if (m_halt_bad_voxel)
+            throw;
+        resultConvergence[v - 1] = -1;
+        MarkBadVoxel(v);
+    }
+    catch (NEWMAT::Exception &e)
+    {
+        LOG << "Vb::NEWMAT exception for voxel " << v << " at " << m_coords->Column(v).t()
+            << " : " << e.what() << endl;
+
+        if (m_halt_bad_voxel)
+            throw;
+        resultConvergence[v - 1] = -1;
+        MarkBadVoxel(v);
+    }
+}
+
+void Vb::SpatialSolveRhs(int v, const vector<int> &coupled,
+    const vector<SpatialPrior *> &coupled_priors, vector<double> &rhs)
+{
+    const MVNDist &post = m_ctx->fwd_post[v - 1];
+    ColumnVector b = post.GetPrecisions() * post.means;
+
+    // The prior mean of a coupled parameter is the spatial precision times the
+    // sum of the neighbours' means, divided by the prior precision. This
+    // assumes the parameter is independent of the others in the prior
+    const vector<int> &neighbours = m_ctx->neighbours[v - 1];
+    for (unsigned int j = 0; j < coupled.size(); j++)
+    {
+        int k = coupled[j] + 1;
+        double sum = 0;
+        for (unsigned int n = 0; n < neighbours.size(); n++)
+        {
+            sum += m_ctx->fwd_post[neighbours[n] - 1].means(k);
+        }
+        b(k) -= coupled_priors[j]->GetaK() * sum;
+    }
+
+    std::copy(b.Store(), b.Store() + m_num_params, rhs.begin() + (v - 1) * m_num_params);
+}
+
+void Vb::SpatialSolveMultiply(const vector<int> &coupled, const vector<double> &weights,
+    const vector<double> &prec, const vector<char> &active, const vector<double> &x,
+    vector<double> &y) const
+{
+    const int np = m_num_params;
+    for (int v = 0; v < m_nvoxels; v++)
+    {
+        const double *xv = &x[v * np];
+        double *yv = &y[v * np];
+        if (!active[v])
+        {
+            std::copy(xv, xv + np, yv);
+            continue;
+        }
+
+        const double *pv = &prec[v * np * np];
+        for (int i = 0; i < np; i++)
+        {
+            double sum = 0;
+            for (int j = 0; j < np; j++)
+            {
+                sum += pv[i * np + j] * xv[j];
+            }
+            yv[i] = sum;
+        }
+
+        const vector<int> &neighbours = m_ctx->neighbours[v];
+        for (unsigned int j = 0; j < coupled.size(); j++)
+        {
+            int k = coupled[j];
+            double sum = 0;
+            for (unsigned int n = 0; n < neighbours.size(); n++)
+            {
+                sum += x[(neighbours[n] - 1) * np + k];
+            }
+            yv[k] -= weights[j] * sum;
+        }
+    }
+}
+
+void Vb::SpatialSolve(const vector<int> &coupled, const vector<SpatialPrior *> &coupled_priors,
+    const vector<double> &rhs)
+{
+    fabber::ScopedTimer timer("SpatialSolve");
+    const int np = m_num_params;
+    const int n = m_nvoxels * np;
+
+    vector<double> weights(coupled.size());
+    for (unsigned int j = 0; j < coupled.size(); j++)
+    {
+        weights[j] = coupled_priors[j]->GetaK();
+    }
+
+    // Ignored voxels keep their current means
+    vector<char> active(m_nvoxels, 1);
+    for (unsigned int i = 0; i < m_ctx->ignore_voxels.size(); i++)
+    {
+        active[m_ctx->ignore_voxels[i] - 1] = 0;
+    }
+
+    // Voxel posterior precisions, and covariances for the preconditioner
+    vector<double> prec(m_nvoxels * np * np, 0), cov(m_nvoxels * np * np, 0);
+    vector<double> x(n), b(n);
+    for (int v = 0; v < m_nvoxels; v++)
+    {
+        const MVNDist &post = m_ctx->fwd_post[v];
+        std::copy(post.means.Store(), post.means.Store() + np, x.begin() + v * np);
+        if (!active[v])
+        {
+            std::copy(x.begin() + v * np, x.begin() + (v + 1) * np, b.begin() + v * np);
+            continue;
+        }
+        std::copy(rhs.begin() + v * np, rhs.begin() + (v + 1) * np, b.begin() + v * np);
+        const SymmetricMatrix &p = post.GetPrecisions();
+        const SymmetricMatrix &c = post.GetCovariance();
+        for (int i = 0; i < np; i++)
+        {
+            for (int j = 0; j < np; j++)
+            {
+                prec[(v * np + i) * np + j] = p(i + 1, j + 1);
+                cov[(v * np + i) * np + j] = c(i + 1, j + 1);
+            }
+        }
+    }
+
+    // Preconditioned conjugate gradients, starting from the result of the sweep
+    vector<double> r(n), z(n), p(n), q(n);
+    SpatialSolveMultiply(coupled, weights, prec, active, x, q);
+    double bnorm = 0, rnorm = 0;
+    for (int i = 0; i < n; i++)
+    {
+        r[i] = b[i] - q[i];
+        bnorm += b[i] * b[i];
+        rnorm += r[i] * r[i];
+    }
+    bnorm = sqrt(bnorm);
+    const double tol = 1e-8 * (bnorm > 0 ? bnorm : 1);
+
+    int it = 0;
+    double rz = 0;
+    while (sqrt(rnorm) > tol && it < 1000)
+    {
+        for (int v = 0; v < m_nvoxels; v++)
+        {
+            const double *cv = &cov[v * np * np];
+            for (int i = 0; i < np; i++)
+            {
+                double sum = 0;
+                if (active[v])
+                {
+                    for (int j = 0; j < np; j++)
+                    {
+                        sum += cv[i * np + j] * r[v * np + j];
+                    }
+                }
+                z[v * np + i] = sum;
+            }
+        }
+
+        double rz_new = 0;
+        for (int i = 0; i < n; i++)
+        {
+            rz_new += r[i] * z[i];
+        }
+        double beta = (it == 0) ? 0 : rz_new / rz;
+        rz = rz_new;
+        for (int i = 0; i < n; i++)
+        {
+            p[i] = z[i] + beta * p[i];
+        }
+
+        SpatialSolveMultiply(coupled, weights, prec, active, p, q);
+        double pq = 0;
+        for (int i = 0; i < n; i++)
+        {
+            pq += p[i] * q[i];
+        }
+        if (pq <= 0)
+        {
+            WARN_ONCE("Vb::SpatialSolve - system is not positive definite, keeping voxelwise "
+                      "updates");
+            return;
+        }
+
+        double alpha = rz / pq;
+        rnorm = 0;
+        for (int i = 0; i < n; i++)
+        {
+            x[i] += alpha * p[i];
+            r[i] -= alpha * q[i];
+            rnorm += r[i] * r[i];
+        }
+        ++it;
+    }
+    fabber::PerfCount("SpatialSolveIterations", it);
+    LOG_VERBOSE << "Vb::SpatialSolve " << it << " iterations, residual " << sqrt(rnorm) << endl;
+
+    for (int v = 0; v < m_nvoxels; v++)
+    {
+        if (active[v])
+        {
+            ColumnVector &means = m_ctx->fwd_post[v].means;
+            std::copy(x.begin() + v * np, x.begin() + (v + 1) * np, means.Store());
+        }
+    }
+}
+
+void Vb::DoCalculationsDomain(FabberRunData &rundata)
+{
+    const int rank = m_transport->GetRank();
+    const int size = m_transport->GetSize();
+    const Matrix &coords = rundata.GetVoxelCoords();
+    const int nvoxels = coords.Ncols();
+    if (nvoxels < size)
+    {
+        throw InvalidOptionValue("domain-size", stringify(size), "More processes than voxels");
+    }
+
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    for (unsigned int k = 0; k < params.size(); k++)
+    {
+        if (params[k].prior_type == PRIOR_SPATIAL_D)
+        {
+            throw InvalidOptionValue("param-spatial-priors",
+                rundata.GetStringDefault("param-spatial-priors", ""),
+                "Distance-based priors cannot be used in a domain-decomposed run");
+        }
+    }
+
+    // Each process owns a range of consecutive voxels. Voxels are ordered by z,
+    // then y, then x so these are slabs of the volume
+    vector<int> first(size + 1);
+    vector<int> owner(nvoxels);
+    for (int r = 0; r <= size; r++)
+    {
+        first[r] = 1 + int((long long)nvoxels * r / size);
+    }
+    for (int r = 0; r < size; r++)
+    {
+        for (int v = first[r]; v < first[r + 1]; v++)
+        {
+            owner[v - 1] = r;
+        }
+    }
+
+    // Spatial priors need the means of the nearest and second nearest
+    // neighbours of every owned voxel, and the owned voxels which are in
+    // these halos for other processes must be sent to them
+    set<int> voxel_set;
+    map<int, set<int> > send;
+    for (int v = first[rank]; v < first[rank + 1]; v++)
+    {
+        voxel_set.insert(v);
+    }
+    if (IsSpatial(rundata))
+    {
+        const vector<vector<int> > &neighbours = rundata.GetNeighbours(m_spatial_dims);
+        const vector<vector<int> > &neighbours2 = rundata.GetSecondNeighbours(m_spatial_dims);
+        for (int v = first[rank]; v < first[rank + 1]; v++)
+        {
+            const vector<int> *lists[2] = { &neighbours[v - 1], &neighbours2[v - 1] };
+            for (int l = 0; l < 2; l++)
+            {
+                for (unsigned int n = 0; n < lists[l]->size(); n++)
+                {
+                    int nv = (*lists[l])[n];
+                    if (owner[nv - 1] != rank)
+                    {
+                        voxel_set.insert(nv);
+                        send[owner[nv - 1]].insert(v);
+                    }
+                }
+            }
+        }
+    }
+
+    vector<int> voxels(voxel_set.begin(), voxel_set.end());
+    map<int, int> local_index;
+    vector<char> owned(voxels.size());
+    for (unsigned int i = 0; i < voxels.size(); i++)
+    {
+        local_index[voxels[i]] = i + 1;
+        owned[i] = (owner[voxels[i] - 1] == rank);
+    }
+
+    m_halo.clear();
+    for (map<int, set<int> >::iterator iter = send.begin(); iter != send.end(); ++iter)
+    {
+        if (abs(iter->first - rank) > 1)
+        {
+            // The socket transport only connects neighbouring processes
+            throw InvalidOptionValue("domain-size", stringify(size),
+                "Too many processes - each part must be at least two slices thick");
+        }
+        HaloLink link;
+        link.rank = iter->first;
+        for (set<int>::iterator v = iter->second.begin(); v != iter->second.end(); ++v)
+        {
+            link.send.push_back(local_index[*v]);
+        }
+        for (unsigned int i = 0; i < voxels.size(); i++)
+        {
+            if (owner[voxels[i] - 1] == link.rank)
+                link.recv.push_back(i + 1);
+        }
+        m_halo.push_back(link);
+    }
+
+    LOG << "Vb::Process " << rank << " owns voxels " << first[rank] << "-"
+        << first[rank + 1] - 1 << " with " << voxels.size() - (first[rank + 1] - first[rank])
+        << " halo voxels" << endl;
+
+    FabberRunDataSubset local(rundata, voxels);
+    local.Unset("domain-transport");
+    if (m_multires > 1)
+    {
+        WARN_ONCE("Vb::multires is not supported in a domain-decomposed run - ignoring");
+        local.Unset("multires");
+    }
+    if (m_dict_file != "")
+    {
+        // Processes would all write the same file
+        WARN_ONCE("Vb::init-dict-file is not used in a domain-decomposed run");
+        local.Unset("init-dict-file");
+    }
+    if (m_spatial_pcg)
+    {
+        WARN_ONCE("Vb::spatial-solver=pcg is not supported in a domain-decomposed run - using "
+                  "sweep");
+        local.Unset("spatial-solver");
+    }
+    if (m_checkpoint_its > 0 || m_checkpoint_voxels > 0 || m_resume_from != "")
+    {
+        throw FabberRunDataError("Checkpoints are not supported in a domain-decomposed run");
+    }
+
+    Vb local_vb;
+    local_vb.Initialize(m_model, local);
+    local_vb.m_transport = m_transport;
+    local_vb.m_domain_owned = owned;
+    local_vb.m_halo = m_halo;
+    local_vb.DoCalculations(local);
+
+    // Collect the free energy, final distribution, iterations and convergence
+    // with a time budget, and cost diagnostics of each owned voxel on process 0,
+    // which saves the results. Only the lower triangle of the covariance is sent
+    const int mvn_size = m_num_params + m_noise_params;
+    const int ncov = mvn_size * (mvn_size + 1) / 2;
+    const int record = 1 + mvn_size + ncov + 7;
+    vector<double> results;
+    results.reserve((first[rank + 1] - first[rank]) * record);
+    for (unsigned int i = 0; i < voxels.size(); i++)
+    {
+        if (!owned[i])
+            continue;
+        const MVNDist *mvn = local_vb.resultMVNs.at(i);
+        results.push_back(local_vb.resultFs.empty() ? 0 : local_vb.resultFs.at(i));
+        for (int p = 1; p <= mvn_size; p++)
+        {
+            results.push_back(mvn->means(p));
+        }
+        const SymmetricMatrix &cov = mvn->GetCovariance();
+        for (int p = 1; p <= mvn_size; p++)
+        {
+            for (int q = 1; q <= p; q++)
+            {
+                results.push_back(cov(p, q));
+            }
+        }
+        results.push_back(local_vb.resultIterations.empty() ? 0 : local_vb.resultIterations.at(i));
+        results.push_back(
+            local_vb.resultConvergence.empty() ? 0 : local_vb.resultConvergence.at(i));
+        VoxelDiagnostics none;
+        const VoxelDiagnostics *diag = local_vb.Diagnostics(i + 1);
+        if (!diag)
+            diag = &none;
+        results.push_back(diag->time);
+        results.push_back(diag->iterations);
+        results.push_back(diag->evaluations);
+        results.push_back(diag->reverts);
+        results.push_back(diag->ignored ? 1 : 0);
+    }
+
+    vector<vector<double> > all;
+    m_transport->Gather(results, all);
+    m_needF = local_vb.m_needF;
+    if (rank == 0)
+    {
+        resultMVNs.resize(nvoxels, NULL);
+        resultFs.resize(nvoxels);
+        if (m_time_budget > 0)
+        {
+            resultIterations.assign(nvoxels, 0);
+            resultConvergence.assign(nvoxels, 0);
+        }
+        for (int r = 0; r < size; r++)
+        {
+            if ((int)all[r].size() != (first[r + 1] - first[r]) * record)
+            {
+                throw FabberInternalError(
+                    "Vb::DoCalculationsDomain - wrong size of results from process "
+                    + stringify(r));
+            }
+            const double *rec = &all[r][0];
+            for (int v = first[r]; v < first[r + 1]; v++)
+            {
+                MVNDist *mvn = new MVNDist(mvn_size, m_log);
+                resultFs[v - 1] = rec[0];
+                SymmetricMatrix cov(mvn_size);
+                const double *lower = rec + 1 + mvn_size;
+                for (int p = 1; p <= mvn_size; p++)
+                {
+                    mvn->means(p) = rec[p];
+                    for (int q = 1; q <= p; q++)
+                    {
+                        cov(p, q) = *lower++;
+                    }
+                }
+                mvn->SetCovariance(cov);
+                resultMVNs[v - 1] = mvn;
+
+                const double *extra = rec + 1 + mvn_size + ncov;
+                if (m_time_budget > 0)
+                {
+                    resultIterations[v - 1] = int(extra[0]);
+                    resultConvergence[v - 1] = int(extra[1]);
+                }
+                VoxelDiagnostics *diag = Diagnostics(v);
+                if (diag)
+                {
+                    diag->time = extra[2];
+                    diag->iterations = int(extra[3]);
+                    diag->evaluations = long(extra[4]);
+                    diag->reverts = int(extra[5]);
+                    diag->ignored = (extra[6] != 0);
+                }
+                rec += record;
+            }
+        }
+        if (!m_needF)
+        {
+            resultFs.clear();
+        }
+    }
+}
+
+void Vb::ExchangeHalo()
+{
+    fabber::ScopedTimer timer("ExchangeHalo");
+    for (unsigned int i = 0; i < m_halo.size(); i++)
+    {
+        const HaloLink &link = m_halo[i];
+
+        // Each voxel sends its means followed by 1 if it is being ignored
+        const int record = m_num_params + 1;
+        vector<double> send, recv;
+        send.reserve(link.send.size() * record);
+        for (unsigned int j = 0; j < link.send.size(); j++)
+        {
+            int v = link.send[j];
+            const ColumnVector &means = m_ctx->fwd_post[v - 1].means;
+            send.insert(send.end(), means.Store(), means.Store() + m_num_params);
+            bool ignored = std::find(m_ctx->ignore_voxels.begin(), m_ctx->ignore_voxels.end(), v)
+                != m_ctx->ignore_voxels.end();
+            send.push_back(ignored ? 1 : 0);
+        }
+
+        m_transport->Exchange(link.rank, send, recv);
+        if (recv.size() != link.recv.size() * record)
+        {
+            throw FabberInternalError(
+                "Vb::ExchangeHalo - wrong number of means from process " + stringify(link.rank));
+        }
+        for (unsigned int j = 0; j < link.recv.size(); j++)
+        {
+            int v = link.recv[j];
+            ColumnVector &means = m_ctx->fwd_post[v - 1].means;
+            std::copy(recv.begin() + j * record, recv.begin() + j * record + m_num_params,
+                means.Store());
+
+            // A voxel ignored by its owner must be dropped from the neighbour
+            // lists here too, as it would be in a single process
+            if (recv[j * record + m_num_params] != 0
+                && std::find(m_ctx->ignore_voxels.begin(), m_ctx->ignore_voxels.end(), v)
+                    == m_ctx->ignore_voxels.end())
+            {
+                IgnoreVoxel(v);
+            }
+        }
+    }
+}
+
+void Vb::DoCalculationsSpatial(FabberRunData &rundata)
+{
+    // Pass in some (dummy) data/coords here just in case the model relies upon it
+    // use the first voxel values as our dummies FIXME this shouldn't really be
+    // necessary, need to find way for model to know about the data beforehand.
+    if (m_nvoxels > 0)
+        PassModelData(1);
+
+    // Make the neighbours[] lists if required. These are obtained from the run
+    // data which may have them already, e.g. from a data cache. They are copied
+    // because IgnoreVoxel modifies them
+    // if (m_prior_types_str.find_first_of("mMpP") != string::npos)
+    if (true) // FIXME
+    {
+        CheckCoordMatrixCorrectlyOrdered(*m_coords);
+        m_ctx->neighbours = rundata.GetNeighbours(m_spatial_dims);
+        m_ctx->neighbours2 = rundata.GetSecondNeighbours(m_spatial_dims);
+    }
+
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
+    PriorListDeleter delete_priors(priors);
+
+    // Start from the spatial precisions found at a coarser resolution
+    for (unsigned int k = 0; k < m_initial_aK.size() && k < priors.size(); k++)
+    {
+        SpatialPrior *spatial_prior = dynamic_cast<SpatialPrior *>(priors[k]);
+        if (spatial_prior && m_initial_aK[k] > 0)
+        {
+            spatial_prior->SetaK(m_initial_aK[k]);
+        }
+    }
+
+    // Parameters with MRF priors for the global solve. Other spatial priors
+    // depend on more distant voxels so are not supported
+    vector<int> coupled;
+    vector<SpatialPrior *> coupled_priors;
+    vector<double> solve_rhs;
+    bool global_solve = m_spatial_pcg;
+    for (unsigned int k = 0; global_solve && k < params.size(); k++)
+    {
+        char type = params[k].prior_type;
+        if ((type == PRIOR_SPATIAL_M) || (type == PRIOR_SPATIAL_m))
+        {
+            coupled.push_back(k);
+            coupled_priors.push_back(dynamic_cast<SpatialPrior *>(priors[k]));
+        }
+        else if ((type == PRIOR_SPATIAL_P) || (type == PRIOR_SPATIAL_p)
+            || (type == PRIOR_SPATIAL_D))
+        {
+            WARN_ONCE("Vb::spatial-solver=pcg only supports M and m spatial priors - using sweep");
+            global_solve = false;
+        }
+    }
+    if (global_solve)
+    {
+        global_solve = !coupled.empty();
+        solve_rhs.resize(m_nvoxels * m_num_params);
+    }
+
+    // Spatial loop currently uses a global convergence detector FIXME
+    // needs to change
+    CountingConvergenceDetector conv;
+    conv.Initialize(rundata);
+    double Fglobal = 1234.5678;
+
+    if (m_resume_position >= 0)
+    {
+        for (unsigned int i = 0; i < m_resume_ignore.size(); i++)
+        {
+            IgnoreVoxel(m_resume_ignore[i]);
+        }
+        for (unsigned int k = 0; k < m_resume_aK.size() && k < priors.size(); k++)
+        {
+            SpatialPrior *spatial_prior = dynamic_cast<SpatialPrior *>(priors[k]);
+            if (spatial_prior && m_resume_aK[k] > 0)
+            {
+                spatial_prior->SetaK(m_resume_aK[k]);
+            }
+            if (dynamic_cast<DistancePrior *>(priors[k]))
+            {
+                WARN_ONCE("Vb::Smoothness of distance-based priors is not saved in checkpoints "
+                          "and will be re-estimated");
+            }
+        }
+        conv.SetState(m_resume_conv);
+        m_ctx->it = m_resume_position;
+    }
+    int maxits = convertTo<int>(rundata.GetStringDefault("max-iterations", "10"));
+
+    // With a time budget, all voxels stop together at the first iteration which
+    // ends after the deadline
+    double deadline = fabber::wall_time() + m_time_budget;
+    bool converged = false;
+
+    // MAIN ITERATION LOOP
+    do
+    {
+        LOG << endl << "*** Spatial iteration *** " << (m_ctx->it + 1) << endl;
+
+        // Give an indication of the progress through the voxels;
+        rundata.Progress(m_ctx->it, maxits);
+        rundata.CheckCancelled();
+        double Fprior = 0;
+
+        // ITERATE OVER VOXELS
+        for (int v = 1; v <= m_nvoxels; v++)
+        {
+            m_ctx->v = v;
+            VoxelCost cost(*this, v);
+
+            PassModelData(v);
+
+            // The steps below are essentially the same as regular VB, although
+            // the code looks different as the per-voxel dists are set up at the
+            // start rather than as we go
+            try
+            {
+                Fprior = 0;
+
+                // Apply prior updates for spatial or ARD priors
+                {
+                    fabber::ScopedTimer timer("ApplyPriors");
+                    for (int k = 0; k < m_num_params; k++)
+                    {
+                        Fprior += priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
+                    }
+                }
+                if (m_debug)
+                    DebugVoxel(v, "Priors set");
+
+                // Halo voxels are updated by the process which owns them. Priors
+                // are still applied so spatial priors update their precision
+                // at the same point in every process
+                if (!m_ctx->IsOwned(v))
+                    continue;
+
+                // Ignore voxels where numerical issues have occurred
+                if (std::find(m_ctx->ignore_voxels.begin(), m_ctx->ignore_voxels.end(), v)
+                    != m_ctx->ignore_voxels.end())
+                {
+                    LOG_DEBUG << "Vb::Ignoring voxel " << v << endl;
+                    continue;
+                }
+
                 CalculateF(v, "before", Fprior);
 
                 m_noise->UpdateTheta(*m_ctx->noise_post[v - 1], m_ctx->fwd_post[v - 1],
@@ -642,10 +1851,13 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
                     DebugVoxel(v, "Theta updated");
 
                 CalculateF(v, "theta", Fprior);
+
+                if (global_solve)
+                    SpatialSolveRhs(v, coupled, coupled_priors, solve_rhs);
             }
             catch (FabberInternalError &e)
             {
-                LOG << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
+                LOG_WARN << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
                     << " : " << e.what() << endl;
 
                 if (m_halt_bad_voxel)
@@ -665,15 +1877,29 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
             }
         }
 
+        if (global_solve)
+        {
+            SpatialSolve(coupled, coupled_priors, solve_rhs);
+        }
+
+        if (m_transport)
+        {
+            ExchangeHalo();
+        }
+
         Fglobal = 0;
         for (int v = 1; v <= m_nvoxels; v++)
         {
+            if (!m_ctx->IsOwned(v))
+                continue;
+
+            VoxelCost cost(*this, v);
             try {
                 // Ignore voxels where numerical issues have occurred
                 if (std::find(m_ctx->ignore_voxels.begin(), m_ctx->ignore_voxels.end(), v)
                     != m_ctx->ignore_voxels.end())
                 {
-                    LOG << "Ignoring voxel " << v << endl;
+                    LOG_DEBUG << "Vb::Ignoring voxel " << v << endl;
                     continue;
                 }
 
@@ -695,7 +1921,7 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
             }
             catch (FabberInternalError &e)
             {
-                LOG << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
+                LOG_WARN << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
                     << " : " << e.what() << endl;
 
                 if (m_halt_bad_voxel)
@@ -716,7 +1942,64 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
         }
 
         ++m_ctx->it;
-    } while (!conv.Test(Fglobal));
+
+        vector<double> global(1, Fglobal);
+        m_ctx->SumOverDomain(global);
+        Fglobal = global[0];
+
+        // Current estimates for all voxels are the partial results of a spatial run
+        if (rundata.PartialResultsInterval() > 0)
+        {
+            PartialResults(rundata, 1, m_ctx->fwd_post);
+        }
+
+        converged = conv.Test(Fglobal);
+        if (!converged && m_checkpoint_its > 0 && m_ctx->it % m_checkpoint_its == 0)
+        {
+            SaveCheckpoint(m_ctx->it, priors, &conv);
+        }
+
+        bool out_of_time = false;
+        if (!converged && m_time_budget > 0)
+        {
+            // All processes must stop on the same iteration
+            vector<double> late(1, fabber::wall_time() > deadline ? 1 : 0);
+            m_ctx->SumOverDomain(late);
+            out_of_time = (late[0] > 0);
+        }
+        if (out_of_time)
+        {
+            LOG << "Vb::Time budget exhausted after " << m_ctx->it << " iterations" << endl;
+            break;
+        }
+    } while (!converged);
+
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        VoxelDiagnostics *diag = Diagnostics(v);
+        if (diag)
+            diag->iterations = m_ctx->it;
+    }
+
+    m_final_aK.assign(priors.size(), -1);
+    for (unsigned int k = 0; k < priors.size(); k++)
+    {
+        SpatialPrior *spatial_prior = dynamic_cast<SpatialPrior *>(priors[k]);
+        if (spatial_prior)
+        {
+            m_final_aK[k] = spatial_prior->GetaK();
+        }
+    }
+
+    if (m_time_budget > 0)
+    {
+        resultIterations.assign(m_nvoxels, m_ctx->it);
+        resultConvergence.assign(m_nvoxels, converged ? 1 : 0);
+        for (unsigned int i = 0; i < m_ctx->ignore_voxels.size(); i++)
+        {
+            resultConvergence.at(m_ctx->ignore_voxels[i] - 1) = -1;
+        }
+    }
 
     // Interesting addition: calculate "coefficient resels" from Penny et al. 2005
     for (int k = 1; k <= m_num_params; k++)
@@ -754,211 +2037,228 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
         resultMVNs[v - 1]
             = new MVNDist(m_ctx->fwd_post[v - 1], m_ctx->noise_post[v - 1]->OutputAsMVN());
     }
-    for (unsigned int i = 0; i < priors.size(); i++)
-    {
-        delete priors[i];
-    }
 }
 
-void Vb::CheckCoordMatrixCorrectlyOrdered(const Matrix &coords)
+void Vb::SaveCheckpoint(int position, const vector<Prior *> &priors, const ConvergenceDetector *conv)
 {
-    // Only 3D
-    assert(coords.Nrows() == 3);
+    fabber::ScopedTimer timer("SaveCheckpoint");
 
-    // Voxels are stored one per column, each column is the x/y/z coords
-    const int m_nvoxels = coords.Ncols();
+    bool spatial = (conv != NULL);
+    Checkpoint &cp = *m_checkpoint;
+    if (spatial || m_checkpoint_written == 0)
+    {
+        cp.Put(int(spatial));
+        cp.Put(m_nvoxels);
+        cp.Put(m_num_params);
+        cp.Put(m_noise_params);
+    }
 
-    // Go through each voxel one at a time apart from last
-    for (int v = 1; v <= m_nvoxels - 1; v++)
+    if (!spatial)
     {
-        // Find difference between current coords and next
-        ColumnVector diff = coords.Column(v + 1) - coords.Column(v);
+        // Voxels finished before the last checkpoint are already in the file
+        // and will not change, so only the new ones are appended. The rest
+        // will start from their initial distributions.
+        int first = m_checkpoint_written + 1;
+        cp.Put(first);
+        cp.Put(position);
+        for (int v = first; v <= position; v++)
+        {
+            SaveCheckpointVoxel(cp, v);
+            cp.Put(resultFs.empty() ? 0.0 : resultFs[v - 1]);
+            cp.Put(resultFsHistory[v - 1]);
+        }
 
-        // Check order
-        // +1 = +x, +10 = +y, +100 = +z, -100 = -z+x, etc.
-        int d = sign(diff(1)) + 10 * sign(diff(2)) + 100 * sign(diff(3));
-        if (d <= 0)
+        LOG << "Vb::Saving checkpoint after " << position << " voxels to " << m_checkpoint_file
+            << endl;
+        if (m_checkpoint_written == 0)
+            cp.Save(m_checkpoint_file);
+        else
+            cp.Append(m_checkpoint_file);
+        m_checkpoint_written = position;
+        return;
+    }
+
+    cp.Put(position);
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        SaveCheckpointVoxel(cp, v);
+    }
+    cp.Put(m_ctx->ignore_voxels);
+
+    vector<double> aK(priors.size(), -1);
+    for (unsigned int k = 0; k < priors.size(); k++)
+    {
+        SpatialPrior *spatial_prior = dynamic_cast<SpatialPrior *>(priors[k]);
+        if (spatial_prior)
         {
-            LOG << "Vb::Found mis-ordered voxels " << v << " and " << v + 1 << ": d=" << d << endl;
-            throw FabberInternalError(
-                "Coordinate matrix must be in correct order to use adjacency-based priors.");
+            aK[k] = spatial_prior->GetaK();
         }
     }
+    cp.Put(aK);
+
+    vector<double> conv_state;
+    conv->GetState(conv_state);
+    cp.Put(conv_state);
+
+    cp.Put(resultFs);
+    cp.Put(int(resultFsHistory.size()));
+    for (unsigned int v = 0; v < resultFsHistory.size(); v++)
+    {
+        cp.Put(resultFsHistory[v]);
+    }
+
+    LOG << "Vb::Saving checkpoint after " << position << " iterations to " << m_checkpoint_file
+        << endl;
+    cp.Save(m_checkpoint_file);
 }
 
-// Binary search for data(index) == num
-// Assumes data is sorted ascending!!
-// Either returns an index such that data(index) == num
-//   or -1 if num is not present in data.
-static inline int binarySearch(const ColumnVector &data, int num)
+void Vb::SaveCheckpointVoxel(Checkpoint &cp, int v)
 {
-    int first = 1, last = data.Nrows();
+    cp.Put(m_ctx->fwd_post[v - 1]);
+    cp.Put(m_ctx->fwd_prior[v - 1]);
+    cp.Put(m_ctx->noise_post[v - 1]->OutputAsMVN());
+    cp.Put(m_ctx->noise_prior[v - 1]->OutputAsMVN());
+}
 
-    while (first <= last)
+void Vb::LoadCheckpointVoxel(Checkpoint &cp, int v)
+{
+    MVNDist noise(m_log);
+    cp.Get(m_ctx->fwd_post[v - 1]);
+    cp.Get(m_ctx->fwd_prior[v - 1]);
+    cp.Get(noise);
+    m_ctx->noise_post[v - 1]->InputFromMVN(noise);
+    cp.Get(noise);
+    m_ctx->noise_prior[v - 1]->InputFromMVN(noise);
+
+    if (!m_locked_linear)
     {
-        int test = (first + last) / 2;
+        PassModelData(v);
+        m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+    }
+    m_noise->Precalculate(
+        *m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1], m_origdata->Column(v));
+}
 
-        if (data(test) < num)
+void Vb::LoadCheckpoint(FabberRunData &rundata)
+{
+    fabber::ScopedTimer timer("LoadCheckpoint");
+    Checkpoint cp;
+    cp.SetLogger(m_log);
+    cp.Load(m_resume_from);
+
+    bool spatial = (cp.GetInt() != 0);
+    int nvoxels = cp.GetInt();
+    int nparams = cp.GetInt();
+    int nnoise = cp.GetInt();
+    if ((spatial != IsSpatial(rundata)) || (nvoxels != m_nvoxels) || (nparams != m_num_params)
+        || (nnoise != m_noise_params))
+    {
+        throw InvalidOptionValue("resume-from", m_resume_from,
+            "Checkpoint was saved by a run with different data or options");
+    }
+
+    int position = 0;
+    if (spatial)
+    {
+        position = cp.GetInt();
+        for (int v = 1; v <= m_nvoxels; v++)
         {
-            first = test + 1;
+            LoadCheckpointVoxel(cp, v);
         }
-        else if (data(test) > num)
+        cp.Get(m_resume_ignore);
+        cp.Get(m_resume_aK);
+        cp.Get(m_resume_conv);
+
+        vector<double> Fs;
+        cp.Get(Fs);
+        if (int(Fs.size()) == m_nvoxels)
         {
-            last = test - 1;
+            resultFs = Fs;
         }
-        else if (data(test) == num)
+        int nhistory = cp.GetInt();
+        for (int v = 1; v <= nhistory && v <= m_nvoxels; v++)
         {
-            return test;
+            cp.Get(resultFsHistory[v - 1]);
         }
-        else
+    }
+    else
+    {
+        // Each block holds the voxels finished since the one before
+        while (!cp.AtEnd())
         {
-            assert(false); // logic error!  data wasn't sorted?
+            int first = cp.GetInt();
+            int last = cp.GetInt();
+            if (first != position + 1 || last < first || last > m_nvoxels)
+            {
+                throw InvalidOptionValue(
+                    "resume-from", m_resume_from, "Checkpoint voxels are not in sequence");
+            }
+            for (int v = first; v <= last; v++)
+            {
+                LoadCheckpointVoxel(cp, v);
+                double F = cp.GetDouble();
+                if (!resultFs.empty())
+                    resultFs[v - 1] = F;
+                cp.Get(resultFsHistory[v - 1]);
+
+                // Finished voxels have their final results
+                resultMVNs[v - 1] = new MVNDist(
+                    m_ctx->fwd_post[v - 1], m_ctx->noise_post[v - 1]->OutputAsMVN());
+            }
+            position = last;
         }
     }
-    return -1;
+
+    m_resume_position = position;
+    LOG << "Vb::Resuming from checkpoint after " << position
+        << (spatial ? " iterations" : " voxels") << endl;
 }
 
-/**
- * Calculate nearest and second-nearest neighbours for the voxels
- */
-void Vb::CalcNeighbours(const Matrix &coords)
+void Vb::CheckCoordMatrixCorrectlyOrdered(const Matrix &coords)
 {
-    const int nVoxels = coords.Ncols();
-    if (nVoxels == 0)
-        return;
-
-    // Voxels must be ordered by increasing z, y and x values respectively
-    // otherwise binary search for voxel by offset will not work
-    CheckCoordMatrixCorrectlyOrdered(coords);
-
-    // Create a column vector with one entry per voxel.
-    ColumnVector offsets(nVoxels);
-
-    // Populate offsets with the offset into the
-    // matrix of each voxel. We assume that co-ordinates
-    // could be zero but not negative
-    int xsize = coords.Row(1).Maximum() + 1;
-    int ysize = coords.Row(2).Maximum() + 1;
-    for (int v = 1; v <= nVoxels; v++)
-    {
-        int x = coords(1, v);
-        int y = coords(2, v);
-        int z = coords(3, v);
-        int offset = z * xsize * ysize + y * xsize + x;
-        offsets(v) = offset;
-    }
-
-    // Delta is a list of offsets to find nearest
-    // neighbours in x y and z direction (not diagonally)
-    // Of course applying these offsets naively would not
-    // always work, e.g. offset of -1 in the x direction
-    // will not be a nearest neighbour for the first voxel
-    // so need to check for this in subsequent code
-    vector<int> delta;
-    delta.push_back(1);              // next row
-    delta.push_back(-1);             // prev row
-    delta.push_back(xsize);          // next column
-    delta.push_back(-xsize);         // prev column
-    delta.push_back(xsize * ysize);  // next slice
-    delta.push_back(-xsize * ysize); // prev slice
-
-    // Don't look for neighbours in all dimensions.
-    // For example if spatialDims=2, max_delta=3 so we
-    // only look for neighbours in rows and columns
-    //
-    // However note we still need the full list of 3D deltas for later
-    int max_delta = m_spatial_dims * 2 - 1;
-
-    // Neighbours is a vector of vectors, so each voxel
-    // will have an entry which is a vector of its neighbours
-    m_ctx->neighbours.resize(nVoxels);
-
-    // Go through each voxel. Note that offsets is indexed from 1 not 0
-    // however the offsets themselves (potentially) start at 0.
-    for (int vid = 1; vid <= nVoxels; vid++)
-    {
-        // Get the voxel offset into the matrix
-        int pos = int(offsets(vid));
-
-        // Now search for neighbours
-        for (int n = 0; n <= max_delta; n++)
-        {
-            // is there a voxel at this neighbour position?
-            // indexed from 1; id == -1 if not found.
-            int id = binarySearch(offsets, pos + delta[n]);
-
-            // No such voxel: continue
-            if (id < 0)
-                continue;
+    // Only 3D
+    assert(coords.Nrows() == 3);
 
-            // Check for wrap-around
+    // Voxels are stored one per column, each column is the x/y/z coords
+    const int m_nvoxels = coords.Ncols();
 
-            // Don't check for wrap around on final co-ord
-            // PREVIOUSLY		if (delta.size() >= n + 2)
-            // Changed (fixed)? because if spatialDims != 3 we still need
-            // to check for wrap around in y-coordinate FIXME check
-            if (n < 4)
-            {
-                bool ignore = false;
-                if (delta[n] > 0)
-                {
-                    int test = delta[n + 2];
-                    if (test > 0)
-                        ignore = (pos % test) >= test - delta[n];
-                }
-                else
-                {
-                    int test = -delta[n + 2];
-                    if (test > 0)
-                        ignore = (pos % test) < -delta[n];
-                }
-                if (ignore)
-                {
-                    continue;
-                }
-            }
+    // Go through each voxel one at a time apart from last
+    for (int v = 1; v <= m_nvoxels - 1; v++)
+    {
+        // Find difference between current coords and next
+        ColumnVector diff = coords.Column(v + 1) - coords.Column(v);
 
-            // If we get this far, add it to the list
-            m_ctx->neighbours.at(vid - 1).push_back(id);
+        // Check order
+        // +1 = +x, +10 = +y, +100 = +z, -100 = -z+x, etc.
+        int d = sign(diff(1)) + 10 * sign(diff(2)) + 100 * sign(diff(3));
+        if (d <= 0)
+        {
+            LOG << "Vb::Found mis-ordered voxels " << v << " and " << v + 1 << ": d=" << d << endl;
+            throw FabberInternalError(
+                "Coordinate matrix must be in correct order to use adjacency-based priors.");
         }
     }
+}
 
-    // Similar algorithm but looking for Neighbours-of-neighbours, excluding self,
-    // but including duplicates if there are two routes to get there
-    // (diagonally connected)
-    m_ctx->neighbours2.resize(nVoxels);
-
-    for (int vid = 1; vid <= nVoxels; vid++)
-    {
-        // Go through the list of neighbours for each voxel.
-        for (unsigned n1 = 0; n1 < m_ctx->neighbours.at(vid - 1).size(); n1++)
-        {
-            // n1id is the voxel index (not the offset) of the neighbour
-            int n1id = m_ctx->neighbours[vid - 1].at(n1);
-            int checkNofN = 0;
-            // Go through each of it's neighbours. Add each, apart from original voxel
-            for (unsigned n2 = 0; n2 < m_ctx->neighbours.at(n1id - 1).size(); n2++)
-            {
-                int n2id = m_ctx->neighbours[n1id - 1].at(n2);
-                if (n2id != vid)
-                {
-                    m_ctx->neighbours2[vid - 1].push_back(n2id);
-                }
-                else
-                    checkNofN++;
-            }
+void Vb::ClearResults()
+{
+    InferenceTechnique::ClearResults();
+    resultFs.clear();
+    resultFsHistory.clear();
 
-            if (checkNofN != 1)
-            {
-                throw FabberInternalError("Each of this voxel's neighbours must have "
-                                          "this voxel as a neighbour");
-            }
-        }
-    }
+    // Per-voxel state is sized to the voxel data in DoCalculations
+    m_lin_model.clear();
+    m_conv.clear();
 }
 
 void Vb::SaveResults(FabberRunData &rundata) const
 {
+    if (m_transport && m_transport->GetRank() > 0)
+    {
+        LOG << "Vb::Results of domain-decomposed run are saved by process 0" << endl;
+        return;
+    }
+
     InferenceTechnique::SaveResults(rundata);
 
     LOG << "Vb::Preparing to save results..." << endl;
@@ -6,13 +6,20 @@
 
 /*  CCOPYRIGHT */
 
+#include "checkpoint.h"
 #include "convergence.h"
 #include "inference.h"
 #include "run_context.h"
+#include "transport.h"
+
+#include <boost/shared_ptr.hpp>
 
 #include <string>
 #include <vector>
 
+class Prior;
+class SpatialPrior;
+
 class Vb : public InferenceTechnique
 {
 public:
@@ -30,6 +37,17 @@ public:
         , m_num_mcsteps(0)
         , m_spatial_dims(-1)
         , m_locked_linear(false)
+        , m_multires(1)
+        , m_spatial_pcg(false)
+        , m_dict_size(0)
+        , m_dict_range(2)
+        , m_dict_corr(false)
+        , m_checkpoint_its(0)
+        , m_checkpoint_voxels(0)
+        , m_checkpoint_written(0)
+        , m_resume_position(-1)
+        , m_extrap_proposed(0)
+        , m_extrap_accepted(0)
     {
     }
 
@@ -41,6 +59,7 @@ public:
     virtual void DoCalculations(FabberRunData &data);
 
     virtual void SaveResults(FabberRunData &rundata) const;
+    virtual void ClearResults();
 
 protected:
     /**
@@ -66,6 +85,23 @@ protected:
      */
     bool IsSpatial(FabberRunData &rundata) const;
 
+    /**
+     * Do calculations for one part of a domain-decomposed run
+     *
+     * Each process owns a slab of consecutive voxels and runs VB on these,
+     * together with a halo of the neighbours and second neighbours required
+     * by spatial priors. The halo means are exchanged with the processes
+     * which own them after each iteration. The results are collected on
+     * process 0, which saves them.
+     */
+    void DoCalculationsDomain(FabberRunData &rundata);
+
+    /**
+     * Send the posterior means of owned voxels in the halos of other processes,
+     * and receive the means of our own halo voxels
+     */
+    void ExchangeHalo();
+
     /**
      * Do calculations loop in voxelwise mode (i.e. all iterations for
      * one voxel, then all iterations for the next voxel, etc)
@@ -78,10 +114,121 @@ protected:
      */
     virtual void DoCalculationsSpatial(FabberRunData &data);
 
+    /**
+     * Calculate the right hand side of the global system for the parameter
+     * means in a voxel, after its parameters have been updated
+     *
+     * This is the posterior precision times the posterior means, less the
+     * contribution of the neighbouring voxels' means through the spatial
+     * priors of the coupled parameters.
+     *
+     * @param coupled Indices of parameters with MRF spatial priors, from 0
+     * @param coupled_priors Corresponding spatial priors
+     * @param rhs Right hand side for all voxels, parameters for each voxel contiguous
+     */
+    void SpatialSolveRhs(int v, const std::vector<int> &coupled,
+        const std::vector<SpatialPrior *> &coupled_priors, std::vector<double> &rhs);
+
+    /**
+     * Solve for the parameter means of all voxels together
+     *
+     * The parameter updates of all voxels with MRF spatial priors form a single
+     * sparse linear system, with the voxels' posterior precisions on the
+     * diagonal and the spatial precision linking neighbouring voxels. Sweeping
+     * through the voxels is a Gauss-Seidel iteration for this system, which
+     * only propagates information one voxel per iteration. Here it is solved
+     * by conjugate gradients preconditioned by the voxel posterior covariances.
+     * The means are unchanged if the solve fails.
+     */
+    void SpatialSolve(const std::vector<int> &coupled,
+        const std::vector<SpatialPrior *> &coupled_priors, const std::vector<double> &rhs);
+
+    /**
+     * Multiply by the matrix of the global system for the parameter means
+     */
+    void SpatialSolveMultiply(const std::vector<int> &coupled,
+        const std::vector<double> &weights, const std::vector<double> &prec,
+        const std::vector<char> &active, const std::vector<double> &x,
+        std::vector<double> &y) const;
+
+    /**
+     * Per-voxel state for voxelwise calculations with a time budget
+     */
+    struct BudgetVoxel
+    {
+        BudgetVoxel()
+            : noise_post_save(NULL)
+            , F(1234.5678)
+            , Fprior(0)
+            , Fchange(0)
+        {
+        }
+
+        /** Best solution so far, used if the convergence detector asks to revert */
+        NoiseParams *noise_post_save;
+        MVNDist fwd_post_save;
+        MVNDist fwd_prior_save;
+
+        /** Free energy after the most recent iteration, and the prior contribution */
+        double F;
+        double Fprior;
+
+        /** Absolute change in free energy on the most recent iteration */
+        double Fchange;
+    };
+
+    /**
+     * Do calculations loop in voxelwise mode with a time budget
+     *
+     * Every voxel first gets a minimum number of iterations. The remaining
+     * time is then spent on the voxels whose free energy is changing most.
+     * When the time runs out the best solution so far for each voxel is used.
+     */
+    virtual void DoCalculationsVoxelwiseBudget(FabberRunData &data);
+
+    /**
+     * Perform a single iteration on a voxel during time-budgeted calculations,
+     * updating its iteration count and convergence status
+     */
+    void BudgetIteration(
+        FabberRunData &rundata, int v, std::vector<Prior *> &priors, BudgetVoxel &state);
+
+    /**
+     * Perform a single VB update of the priors, parameters, noise and linearization
+     * for a voxel
+     *
+     * @param Fprior Returns the contribution of the priors to the free energy
+     * @return Free energy after the update
+     */
+    double VoxelIteration(int v, std::vector<Prior *> &priors, double &Fprior);
+
+    /**
+     * Move to an extrapolated set of parameter means, if the convergence
+     * detector proposes one and it increases the free energy
+     *
+     * Trying a proposal costs a linearization, so it is counted as an
+     * iteration of the voxel.
+     *
+     * @param before Parameter means before the latest iteration
+     * @param F Free energy after the latest iteration
+     * @return Free energy at the current parameters
+     */
+    double Extrapolate(int v, const NEWMAT::ColumnVector &before, double F, double Fprior);
+
+    /**
+     * Store the final posterior and free energy of a voxel in the results
+     */
+    void SetVoxelResult(int v, double F);
+
+    /**
+     * Copy the final distributions and free energy of an identical voxel
+     */
+    virtual void CopyVoxelResult(int v, int rep);
+
     /**
      * Calculate free energy if required, and display if required
      */
-    double CalculateF(int v, std::string label, double Fprior);
+    double CalculateF(int v, const char *label, double Fprior);
 
     /**
      * Output detailed debugging information for a voxel
@@ -99,6 +246,51 @@ protected:
      */
     void SetupPerVoxelDists(FabberRunData &allData);
 
+    /**
+     * Initialize the posterior means from a run on downsampled data
+     *
+     * The data is averaged over 2x2x2 blocks and fitted with m_multires-1
+     * levels of multiresolution, so the coarsest level is fitted first.
+     * Each voxel starts from the posterior means of the block containing
+     * it, and spatial priors start from the final spatial precisions of
+     * the coarse run.
+     */
+    void InitFromCoarseLevel(FabberRunData &rundata);
+
+    /**
+     * Initialize the posterior means from the best match of each voxel in a
+     * dictionary of model simulations
+     */
+    void InitFromDictionary(FabberRunData &rundata);
+
+    /**
+     * Save the state of the run to the checkpoint file in the background
+     *
+     * In voxelwise mode only the voxels finished since the last checkpoint
+     * are written, appended to the file.
+     *
+     * @param position Number of spatial iterations completed, or number of
+     *                 voxels completed in voxelwise mode
+     * @param priors Priors in use, whose spatial precisions are saved
+     * @param conv Global convergence detector in spatial mode, NULL in
+     *             voxelwise mode
+     */
+    void SaveCheckpoint(
+        int position, const std::vector<Prior *> &priors, const ConvergenceDetector *conv);
+
+    /**
+     * Restore the state of the run from the file given by --resume-from
+     *
+     * Per-voxel distributions and results are restored immediately. The
+     * position, ignored voxels, spatial precisions and convergence state
+     * are kept to be applied when the calculation loop starts.
+     */
+    void LoadCheckpoint(FabberRunData &rundata);
+
+    /** Save or restore the distributions of a voxel in a checkpoint */
+    void SaveCheckpointVoxel(Checkpoint &cp, int v);
+    void LoadCheckpointVoxel(Checkpoint &cp, int v);
+
     /**
     * Check voxels are listed in order
     *
@@ -110,11 +302,6 @@ protected:
     */
     void CheckCoordMatrixCorrectlyOrdered(const NEWMAT::Matrix &voxelCoords);
 
-    /**
-     * Calculate first and second nearest neighbours of each voxel
-    */
-    void CalcNeighbours(const NEWMAT::Matrix &voxelCoords);
-
     /**
      * Ignore this voxel in future updates.
      *
@@ -124,6 +311,11 @@ protected:
      */
     void IgnoreVoxel(int v);
 
+    /**
+     * Free the per-voxel state created by DoCalculations
+     */
+    void FreeRunContext();
+
     /** Number of voxels in data */
     int m_nvoxels;
 
@@ -193,4 +385,91 @@ protected:
      * centres are generally loaded from an MVN file
      */
     bool m_locked_linear;
+
+    /** Number of resolution levels to fit, 1 for the original data only */
+    int m_multires;
+
+    /**
+     * Initial spatial precision for each parameter with a spatial prior,
+     * from a coarser level. Empty or <= 0 to use the prior's own default
+     */
+    std::vector<double> m_initial_aK;
+
+    /** Final spatial precision for each parameter, <= 0 if not spatial */
+    std::vector<double> m_final_aK;
+
+    /**
+     * Solve for the means of parameters with MRF spatial priors in all voxels
+     * together, rather than voxel by voxel
+     */
+    bool m_spatial_pcg;
+
+    /** Number of simulations in the initialization dictionary, 0 for none */
+    int m_dict_size;
+
+    /** Range of the dictionary in prior standard deviations */
+    double m_dict_range;
+
+    /** If true, match voxels to the dictionary by correlation, not distance */
+    bool m_dict_corr;
+
+    /** File to cache the dictionary in, or empty */
+    std::string m_dict_file;
+
+    /** File which checkpoints are saved to */
+    std::string m_checkpoint_file;
+
+    /** Number of spatial iterations between checkpoints, 0 for none */
+    int m_checkpoint_its;
+
+    /** Number of voxels between checkpoints in voxelwise mode, 0 for none */
+    int m_checkpoint_voxels;
+
+    /** Number of voxels already in the checkpoint file in voxelwise mode */
+    int m_checkpoint_written;
+
+    /** Writes checkpoints in the background */
+    boost::shared_ptr<Checkpoint> m_checkpoint;
+
+    /** Checkpoint file to resume from, or empty */
+    std::string m_resume_from;
+
+    /**
+     * Iterations or voxels completed when the checkpoint being resumed
+     * from was saved, -1 if not resuming
+     */
+    int m_resume_position;
+
+    /** Ignored voxels, spatial precisions and convergence state to resume with */
+    std::vector<int> m_resume_ignore;
+    std::vector<double> m_resume_aK;
+    std::vector<double> m_resume_conv;
+
+    /** Extrapolated steps proposed and accepted in voxelwise mode */
+    int m_extrap_proposed;
+    int m_extrap_accepted;
+
+    /** Communication with the other processes of a domain-decomposed run, if any */
+    boost::shared_ptr<Transport> m_transport;
+
+    /**
+     * For one part of a domain-decomposed run, flags for the voxels owned by
+     * this process. Empty otherwise
+     */
+    std::vector<char> m_domain_owned;
+
+    /**
+     * Voxels exchanged with another process in a domain-decomposed run
+     */
+    struct HaloLink
+    {
+        int rank;
+        /** Owned voxels in the other process's halo, from 1 */
+        std::vector<int> send;
+        /** Voxels in our halo owned by the other process, from 1 */
+        std::vector<int> recv;
+    };
+
+    /** Halo exchanges, in increasing order of rank */
+    std::vector<HaloLink> m_halo;
 };
@@ -36,6 +36,12 @@ int main(int argc, char **argv)
         args.Set("data", args.GetString("input"));
         args.SetExtentFromData();
 
+        // Keep the output in the same format as a compact MVN input
+        if (MVNDist::IsCompactFile(args.GetString("input")) && !args.HaveKey("save-mvn-format"))
+        {
+            args.Set("save-mvn-format", "compact");
+        }
+
         if ((argc == 1) || args.ReadBool("help"))
         {
             Usage();
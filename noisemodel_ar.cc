@@ -395,6 +395,7 @@ void Ar1cNoiseModel::HardcodedInitialDists(NoiseParams &priorIn, NoiseParams &po
 void Ar1cNoiseModel::UpdateNoise(NoiseParams &noise, const NoiseParams &noisePrior,
     const MVNDist &theta, const LinearFwdModel &linear, const NEWMAT::ColumnVector &data) const
 {
+    fabber::ScopedTimer timer("UpdateNoise");
     UpdateAlpha(noise, noisePrior, theta, linear, data);
     UpdatePhi(noise, noisePrior, theta, linear, data);
 }
@@ -505,7 +506,7 @@ void Ar1cNoiseModel::UpdateAlpha(NoiseParams &noise, const NoiseParams &noisePri
     // Warn if any alphas are significantly larger than 1
     if (posterior.alpha.means.MaximumAbsoluteValue() > 1)
     {
-        LOG << "Warning: alpha magnitude > 1... "
+        LOG_WARN << "Warning: alpha magnitude > 1... "
             << "maybe right but probably bad" << endl;
         LOG << "Values: " << posterior.alpha.means.t();
         // throw overflow_exception("Alpha > 1 detected");
@@ -549,6 +550,7 @@ void Ar1cNoiseModel::UpdateTheta(const NoiseParams &noise, MVNDist &theta,
     const MVNDist &thetaPrior, const LinearFwdModel &linear, const ColumnVector &data,
     MVNDist *thetaWithoutPrior, float LMalpha) const
 {
+    fabber::ScopedTimer timer("UpdateTheta");
     const Ar1cParams &posterior = dynamic_cast<const Ar1cParams &>(noise);
     const Ar1cMatrixCache &alphaMat = posterior.alphaMat;
 
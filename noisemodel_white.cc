@@ -228,6 +228,7 @@ void WhiteNoiseModel::MakeQis(int dataLen) const
 void WhiteNoiseModel::UpdateNoise(NoiseParams &noise, const NoiseParams &noisePrior,
     const MVNDist &theta, const LinearFwdModel &linear, const ColumnVector &data) const
 {
+    fabber::ScopedTimer timer("UpdateNoise");
     WhiteParams &posterior = dynamic_cast<WhiteParams &>(noise);
     const WhiteParams &prior = dynamic_cast<const WhiteParams &>(noisePrior);
 
@@ -276,6 +277,7 @@ void WhiteNoiseModel::UpdateTheta(const NoiseParams &noiseIn, MVNDist &theta,
     const MVNDist &thetaPrior, const LinearFwdModel &linear, const ColumnVector &data,
     MVNDist *thetaWithoutPrior, float LMalpha) const
 {
+    fabber::ScopedTimer timer("UpdateTheta");
     const WhiteParams &noise = dynamic_cast<const WhiteParams &>(noiseIn);
 
     const ColumnVector &ml = linear.Centre();
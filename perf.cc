@@ -0,0 +1,392 @@
+/*  perf.cc - Lightweight timing and counter instrumentation
+
+ Copyright (C) 2007-2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "perf.h"
+
+#include "rundata.h"
+#include "tools.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#define FABBER_THREAD_LOCAL __declspec(thread)
+#else
+#include <pthread.h>
+#define FABBER_THREAD_LOCAL __thread
+#endif
+
+using namespace std;
+
+namespace fabber
+{
+namespace
+{
+FABBER_THREAD_LOCAL PerfStats *current_stats = NULL;
+FABBER_THREAD_LOCAL int thread_index = 0;
+int num_threads = 0;
+
+// Buffer the calling thread last recorded into, so recording does not need
+// the lock unless the thread changes collector or the collector is restarted
+FABBER_THREAD_LOCAL const PerfStats *cached_owner = NULL;
+FABBER_THREAD_LOCAL long cached_generation = 0;
+FABBER_THREAD_LOCAL void *cached_buffer = NULL;
+long perf_generation = 0;
+
+#ifdef _WIN32
+SRWLOCK perf_lock = SRWLOCK_INIT;
+
+class PerfLock
+{
+public:
+    PerfLock()
+    {
+        AcquireSRWLockExclusive(&perf_lock);
+    }
+    ~PerfLock()
+    {
+        ReleaseSRWLockExclusive(&perf_lock);
+    }
+};
+#else
+pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+class PerfLock
+{
+public:
+    PerfLock()
+    {
+        pthread_mutex_lock(&perf_lock);
+    }
+    ~PerfLock()
+    {
+        pthread_mutex_unlock(&perf_lock);
+    }
+};
+#endif
+
+/** Small integer identifying the calling thread. Must be called with the lock held */
+int ThreadIndex()
+{
+    if (thread_index == 0)
+        thread_index = ++num_threads;
+    return thread_index;
+}
+
+/** Quote a string for inclusion in JSON output */
+string JsonString(const string &str)
+{
+    stringstream out;
+    out << '"';
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        char c = str[i];
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c == '\n')
+            out << "\\n";
+        else if (c == '\t')
+            out << "\\t";
+        else if ((unsigned char)c < 0x20)
+            out << "\\u" << hex << setw(4) << setfill('0') << int(c) << dec << setfill(' ');
+        else
+            out << c;
+    }
+    out << '"';
+    return out.str();
+}
+
+bool ByTotalDescending(const pair<string, double> &a, const pair<string, double> &b)
+{
+    return a.second > b.second;
+}
+}
+
+PerfStats::PerfStats()
+    : m_enabled(false)
+    , m_trace(false)
+    , m_start_time(0)
+    , m_generation(0)
+{
+}
+
+PerfStats::PerfStats(const PerfStats &)
+    : m_enabled(false)
+    , m_trace(false)
+    , m_start_time(0)
+    , m_generation(0)
+{
+}
+
+PerfStats &PerfStats::operator=(const PerfStats &other)
+{
+    if (this != &other)
+        Reset();
+    return *this;
+}
+
+PerfStats::~PerfStats()
+{
+    PerfLock lock;
+    ClearThreads();
+}
+
+void PerfStats::Start(bool trace)
+{
+    PerfLock lock;
+    ClearThreads();
+    m_trace = trace;
+    m_start_time = wall_time();
+    m_generation = ++perf_generation;
+    m_enabled = true;
+}
+
+void PerfStats::Reset()
+{
+    PerfLock lock;
+    m_enabled = false;
+    m_trace = false;
+    ClearThreads();
+    m_generation = ++perf_generation;
+}
+
+void PerfStats::ClearThreads()
+{
+    for (size_t i = 0; i < m_threads.size(); i++)
+    {
+        delete m_threads[i];
+    }
+    m_threads.clear();
+}
+
+PerfStats::ThreadStats &PerfStats::ThreadBuffer()
+{
+    if (cached_owner == this && cached_generation == m_generation)
+        return *(ThreadStats *)cached_buffer;
+
+    PerfLock lock;
+    int thread = ThreadIndex();
+    ThreadStats *stats = NULL;
+    for (size_t i = 0; i < m_threads.size() && !stats; i++)
+    {
+        if (m_threads[i]->thread == thread)
+            stats = m_threads[i];
+    }
+    if (!stats)
+    {
+        stats = new ThreadStats();
+        stats->thread = thread;
+        m_threads.push_back(stats);
+    }
+    cached_owner = this;
+    cached_generation = m_generation;
+    cached_buffer = stats;
+    return *stats;
+}
+
+void PerfStats::AddTime(const char *name, double start, double end, const string &detail)
+{
+    if (!m_enabled)
+        return;
+
+    ThreadStats &stats = ThreadBuffer();
+    double duration = end - start;
+    PhaseTotal &total = stats.totals[name];
+    total.calls++;
+    total.total += duration;
+    if (duration > total.max)
+        total.max = duration;
+
+    if (m_trace)
+    {
+        if (stats.events.size() < MAX_EVENTS)
+        {
+            Event event;
+            event.name = name;
+            event.thread = stats.thread;
+            event.start = start;
+            event.duration = duration;
+            event.detail = detail;
+            stats.events.push_back(event);
+        }
+        else
+        {
+            stats.events_dropped = true;
+        }
+    }
+}
+
+void PerfStats::AddCount(const char *name, long count)
+{
+    if (m_enabled)
+        ThreadBuffer().counters[name] += count;
+}
+
+void PerfStats::MergeTotals(map<string, PhaseTotal> &totals, map<string, long> &counters) const
+{
+    for (size_t i = 0; i < m_threads.size(); i++)
+    {
+        const ThreadStats &stats = *m_threads[i];
+        for (map<const char *, PhaseTotal>::const_iterator it = stats.totals.begin();
+             it != stats.totals.end(); ++it)
+        {
+            PhaseTotal &total = totals[it->first];
+            total.calls += it->second.calls;
+            total.total += it->second.total;
+            if (it->second.max > total.max)
+                total.max = it->second.max;
+        }
+        for (map<const char *, long>::const_iterator it = stats.counters.begin();
+             it != stats.counters.end(); ++it)
+        {
+            counters[it->first] += it->second;
+        }
+    }
+}
+
+void PerfStats::LogSummary(ostream &out) const
+{
+    PerfLock lock;
+    double elapsed = wall_time() - m_start_time;
+    map<string, PhaseTotal> totals;
+    map<string, long> counters;
+    MergeTotals(totals, counters);
+
+    // Sort phases by total time so the most expensive are listed first
+    vector<pair<string, double> > order;
+    for (map<string, PhaseTotal>::const_iterator it = totals.begin(); it != totals.end(); ++it)
+    {
+        order.push_back(make_pair(it->first, it->second.total));
+    }
+    sort(order.begin(), order.end(), ByTotalDescending);
+
+    out << "PerfStats::Timing summary, " << fixed << setprecision(3) << elapsed
+        << "s elapsed" << endl;
+    out << "PerfStats::  " << left << setw(24) << "Phase" << right << setw(10) << "Calls"
+        << setw(12) << "Total (s)" << setw(12) << "Mean (ms)" << setw(12) << "Max (ms)"
+        << setw(8) << "%" << endl;
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const PhaseTotal &total = totals.find(order[i].first)->second;
+        out << "PerfStats::  " << left << setw(24) << order[i].first << right << setw(10)
+            << total.calls << setw(12) << setprecision(3) << total.total << setw(12)
+            << 1000 * total.total / total.calls << setw(12) << 1000 * total.max << setw(8)
+            << setprecision(1) << (elapsed > 0 ? 100 * total.total / elapsed : 0) << endl;
+    }
+    // Timed phases can be nested so percentages are not expected to sum to 100
+    for (map<string, long>::const_iterator it = counters.begin(); it != counters.end(); ++it)
+    {
+        out << "PerfStats::  " << left << setw(24) << it->first << right << setw(10)
+            << it->second << endl;
+    }
+    for (size_t i = 0; i < m_threads.size(); i++)
+    {
+        if (m_threads[i]->events_dropped)
+        {
+            out << "PerfStats::Trace limited to first " << MAX_EVENTS << " events per thread"
+                << endl;
+            break;
+        }
+    }
+    out.unsetf(ios::floatfield | ios::adjustfield);
+    out << setprecision(6);
+}
+
+void PerfStats::WriteTrace(const string &filename) const
+{
+    ofstream out(filename.c_str());
+    if (!out)
+        throw FabberRunDataError("Could not open performance trace file for writing: " + filename);
+
+    PerfLock lock;
+    // Trace event timestamps and durations are in microseconds
+    out << fixed << setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << endl;
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": "
+           "\"fabber\"}}";
+    for (size_t t = 0; t < m_threads.size(); t++)
+    {
+        const vector<Event> &events = m_threads[t]->events;
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            const Event &event = events[i];
+            out << "," << endl
+                << "{\"name\": " << JsonString(event.name) << ", \"cat\": \"fabber\", \"ph\": \"X\""
+                << ", \"pid\": 1, \"tid\": " << event.thread
+                << ", \"ts\": " << 1e6 * (event.start - m_start_time)
+                << ", \"dur\": " << 1e6 * event.duration;
+            if (event.detail != "")
+                out << ", \"args\": {\"detail\": " << JsonString(event.detail) << "}";
+            out << "}";
+        }
+    }
+    // Counters are recorded as a single sample at the end of the run
+    map<string, PhaseTotal> totals;
+    map<string, long> counters;
+    MergeTotals(totals, counters);
+    double end = 1e6 * (wall_time() - m_start_time);
+    for (map<string, long>::const_iterator it = counters.begin(); it != counters.end(); ++it)
+    {
+        out << "," << endl
+            << "{\"name\": " << JsonString(it->first) << ", \"ph\": \"C\", \"pid\": 1"
+            << ", \"ts\": " << end << ", \"args\": {\"value\": " << it->second << "}}";
+    }
+    out << endl << "]}" << endl;
+    if (!out)
+        throw FabberRunDataError("Failed writing performance trace file: " + filename);
+}
+
+PerfStats *PerfStats::Current()
+{
+    return current_stats;
+}
+
+void PerfStats::SetCurrent(PerfStats *stats)
+{
+    current_stats = stats;
+}
+
+ScopedTimer::ScopedTimer(const char *name)
+    : m_stats(current_stats)
+    , m_name(name)
+    , m_start(0)
+{
+    if (m_stats)
+        m_start = wall_time();
+}
+
+ScopedTimer::ScopedTimer(PerfStats *stats, const char *name, const string &detail)
+    : m_stats((stats && stats->IsEnabled()) ? stats : NULL)
+    , m_name(name)
+    , m_start(0)
+{
+    if (m_stats)
+    {
+        m_detail = detail;
+        m_start = wall_time();
+    }
+}
+
+ScopedTimer::~ScopedTimer()
+{
+    if (m_stats)
+        m_stats->AddTime(m_name, m_start, wall_time(), m_detail);
+}
+
+PerfScope::PerfScope(PerfStats *stats)
+    : m_previous(current_stats)
+{
+    current_stats = stats;
+}
+
+PerfScope::~PerfScope()
+{
+    current_stats = m_previous;
+}
+}
@@ -0,0 +1,238 @@
+/*  perf.h - Lightweight timing and counter instrumentation
+
+ Copyright (C) 2007-2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace fabber
+{
+/**
+ * Collects timings and counters for the phases of a run
+ *
+ * Instrumented code uses ScopedTimer and PerfCount, which record into the
+ * collector which is current for the calling thread. When no collector is
+ * current (the default) they do nothing beyond a thread-local pointer check,
+ * so instrumentation can be left in hot loops.
+ *
+ * Totals are kept per phase name. If tracing is enabled each timed scope is
+ * also kept as an individual event so the run can be viewed as a timeline
+ * using WriteTrace.
+ *
+ * Recording is thread safe, so one collector may be shared between threads.
+ * Each thread records into its own buffer, so the only locking is when a
+ * thread first records after Start. Buffers are merged by LogSummary and
+ * WriteTrace, which must not be called while other threads are recording.
+ * Events are tagged with a small integer identifying the recording thread.
+ */
+class PerfStats
+{
+public:
+    PerfStats();
+    ~PerfStats();
+
+    /**
+     * Copies do not share or copy collected data, and are not enabled
+     */
+    PerfStats(const PerfStats &);
+    PerfStats &operator=(const PerfStats &);
+
+    /**
+     * Start collecting, discarding anything collected previously
+     *
+     * @param trace If true keep individual events for WriteTrace
+     */
+    void Start(bool trace);
+
+    /**
+     * Stop collecting and discard collected data
+     */
+    void Reset();
+
+    /** @return true if collecting */
+    bool IsEnabled() const
+    {
+        return m_enabled;
+    }
+
+    /**
+     * Record a timed scope
+     *
+     * @param name Phase name. Must be a string with static lifetime (normally a literal)
+     * @param start Start time as returned by wall_time()
+     * @param end End time as returned by wall_time()
+     * @param detail Optional extra information to include in the trace event, e.g. a filename
+     */
+    void AddTime(const char *name, double start, double end, const std::string &detail = "");
+
+    /**
+     * Add to a named counter
+     */
+    void AddCount(const char *name, long count = 1);
+
+    /**
+     * Write a table of phase timings and counters
+     *
+     * Each line is prefixed with PerfStats:: for consistency with other log output
+     */
+    void LogSummary(std::ostream &out) const;
+
+    /**
+     * Write collected events in Chrome trace event JSON format
+     *
+     * The file can be loaded into chrome://tracing or https://ui.perfetto.dev
+     *
+     * @throw FabberRunDataError if the file could not be written
+     */
+    void WriteTrace(const std::string &filename) const;
+
+    /**
+     * @return Collector for the calling thread, or NULL if instrumentation is not active
+     */
+    static PerfStats *Current();
+
+    /**
+     * Set the collector for the calling thread. NULL disables instrumentation
+     */
+    static void SetCurrent(PerfStats *stats);
+
+    /**
+     * Maximum number of trace events which will be kept for each thread. Further
+     * events are included in the summary totals but not the trace
+     */
+    static const size_t MAX_EVENTS = 1000000;
+
+private:
+    struct PhaseTotal
+    {
+        PhaseTotal()
+            : calls(0)
+            , total(0)
+            , max(0)
+        {
+        }
+        long calls;
+        double total;
+        double max;
+    };
+
+    struct Event
+    {
+        const char *name;
+        int thread;
+        double start;
+        double duration;
+        std::string detail;
+    };
+
+    /**
+     * Data recorded by a single thread. Phases are keyed by the address of the
+     * name so recording does not need to compare or copy strings
+     */
+    struct ThreadStats
+    {
+        ThreadStats()
+            : thread(0)
+            , events_dropped(false)
+        {
+        }
+        int thread;
+        std::map<const char *, PhaseTotal> totals;
+        std::map<const char *, long> counters;
+        std::vector<Event> events;
+        bool events_dropped;
+    };
+
+    /** Buffer for the calling thread, created if necessary */
+    ThreadStats &ThreadBuffer();
+
+    /** Merge per-thread totals by phase name. Must be called with the lock held */
+    void MergeTotals(std::map<std::string, PhaseTotal> &totals,
+        std::map<std::string, long> &counters) const;
+
+    /** Discard all thread buffers. Must be called with the lock held */
+    void ClearThreads();
+
+    bool m_enabled;
+    bool m_trace;
+    double m_start_time;
+
+    /** Changes on every Start and Reset so threads know their cached buffer is stale */
+    long m_generation;
+    std::vector<ThreadStats *> m_threads;
+};
+
+/**
+ * Times the enclosing scope
+ *
+ *   {
+ *       fabber::ScopedTimer timer("UpdateTheta");
+ *       ...
+ *   }
+ */
+class ScopedTimer
+{
+public:
+    /**
+     * Record into the collector current for the calling thread, if any
+     *
+     * @param name Phase name, normally a string literal
+     */
+    explicit ScopedTimer(const char *name);
+
+    /**
+     * Record into a specific collector, if it is enabled
+     *
+     * @param stats Collector, may be NULL
+     * @param name Phase name, normally a string literal
+     * @param detail Extra information for the trace event
+     */
+    ScopedTimer(PerfStats *stats, const char *name, const std::string &detail = "");
+
+    ~ScopedTimer();
+
+private:
+    ScopedTimer(const ScopedTimer &);
+    ScopedTimer &operator=(const ScopedTimer &);
+
+    PerfStats *m_stats;
+    const char *m_name;
+    double m_start;
+    std::string m_detail;
+};
+
+/**
+ * Make a collector current for the calling thread for the lifetime of this object
+ *
+ * The previous collector is restored on destruction, so this is safe when
+ * a run is started from within another instrumented scope.
+ */
+class PerfScope
+{
+public:
+    explicit PerfScope(PerfStats *stats);
+    ~PerfScope();
+
+private:
+    PerfScope(const PerfScope &);
+    PerfScope &operator=(const PerfScope &);
+
+    PerfStats *m_previous;
+};
+
+/**
+ * Add to a named counter in the collector current for the calling thread, if any
+ */
+inline void PerfCount(const char *name, long count = 1)
+{
+    PerfStats *stats = PerfStats::Current();
+    if (stats)
+        stats->AddCount(name, count);
+}
+}
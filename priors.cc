@@ -17,6 +17,7 @@
 #include <miscmaths/miscmaths.h>
 #include <newmat.h>
 
+#include <algorithm>
 #include <math.h>
 #include <ostream>
 #include <string>
@@ -229,8 +230,14 @@ double SpatialPrior::CalculateaK(const RunContext &ctx)
 
     double trace_term = 0.0;    // First term for gk:   Tr(sigmaK*S'*S)
     double term2 = 0.0;         // Second term for gk:  wK'S'SwK
+    double nvoxels = 0.0;
     for (int v = 1; v <= ctx.nvoxels; v++)
     {
+        // In a domain-decomposed run other processes sum over their own voxels
+        if (!ctx.IsOwned(v))
+            continue;
+        nvoxels++;
+
         // Ignore voxels where numerical issues have occurred. Note that
         // excluded voxels are also deleted from neighbour lists for other voxels
         if (std::find(ctx.ignore_voxels.begin(), ctx.ignore_voxels.end(), v)
@@ -298,20 +305,29 @@ double SpatialPrior::CalculateaK(const RunContext &ctx)
             term2 += SwK * SwK;
     }
 
-    LOG << "SpatialPrior::Calculate aK " << m_idx << ": trace_term=" << trace_term << ", term2=" << term2 << endl;
+    vector<double> sums(3);
+    sums[0] = trace_term;
+    sums[1] = term2;
+    sums[2] = nvoxels;
+    ctx.SumOverDomain(sums);
+    trace_term = sums[0];
+    term2 = sums[1];
+    nvoxels = sums[2];
+
+    LOG_VERBOSE << "SpatialPrior::Calculate aK " << m_idx << ": trace_term=" << trace_term << ", term2=" << term2 << endl;
 
     // Fig 4 in Penny (2005) update equations for gK, hK and aK
     //
     // Following Penny, prior on aK is a relatively uninformative gamma distribution with 
     // q1 = 10 (1/q1 = 0.1) and q2 = 1.0
     double gk = 1 / (0.5 * trace_term + 0.5 * term2 + 0.1); 
-    double hK = (ctx.nvoxels * 0.5 + 1.0);
+    double hK = (nvoxels * 0.5 + 1.0);
     double aK = gk * hK;
 
     if (aK < 1e-50)
     {
         // Don't let aK get too small
-        LOG << "SpatialPrior::Calculate aK " << m_idx << ": was " << aK << endl;
+        LOG_VERBOSE << "SpatialPrior::Calculate aK " << m_idx << ": was " << aK << endl;
         WARN_ONCE("SpatialPrior::Calculate aK - value was tiny - fixing to 1e-50");
         aK = 1e-50;
     }
@@ -330,13 +346,13 @@ double SpatialPrior::CalculateaK(const RunContext &ctx)
 
     if ((m_spatial_speed > 0) && (aK > aKMax))
     {
-        LOG << "SpatialPrior::Calculate aK " << m_idx
-            << ": Rate-limiting the increase on aK: was " << aK << ", now " << aKMax
-            << endl;
+        LOG_VERBOSE << "SpatialPrior::Calculate aK " << m_idx
+                    << ": Rate-limiting the increase on aK: was " << aK << ", now " << aKMax
+                    << endl;
         aK = aKMax;
     }
 
-    LOG << "SpatialPrior::Calculate aK " << m_idx << ": New aK: " << aK << endl;
+    LOG_VERBOSE << "SpatialPrior::Calculate aK " << m_idx << ": New aK: " << aK << endl;
     return aK;
 }
 
@@ -438,8 +454,10 @@ double SpatialPrior::ApplyToMVN(MVNDist *prior, const RunContext &ctx)
     double spatial_mean;
     if (m_type_code == PRIOR_SPATIAL_m)
     {
-        // Dirichlet BCs on MRF i.e. no boundary correction
-        double rec = 1 / (8 * nn);
+        // Dirichlet BCs on MRF i.e. no boundary correction. nn is an int so
+        // the reciprocal must be taken in floating point - integer division
+        // here made the prior mean zero whatever the neighbours were
+        double rec = 1 / (8 * double(nn));
         spatial_mean = contrib_nn * rec;
     }
     else if (m_type_code == PRIOR_SPATIAL_M)
@@ -484,6 +502,125 @@ double SpatialPrior::ApplyToMVN(MVNDist *prior, const RunContext &ctx)
     return 0;
 }
 
+DistancePrior::DistancePrior(const Parameter &p, FabberRunData &rundata)
+    : DefaultPrior(p)
+    , m_rho(1e-8)
+    , m_updated(false)
+{
+    m_log = rundata.GetLogger();
+    m_covar.SetLogger(m_log);
+    m_covar.CalcDistances(
+        rundata.GetVoxelCoords(), rundata.GetStringDefault("distance-measure", "dist1"));
+
+    m_delta_min = rundata.GetDoubleDefault("dist-prior-delta-min", 1.5, 1e-3);
+    m_delta_max = rundata.GetDoubleDefault("dist-prior-delta-max", 3, m_delta_min);
+    m_delta = rundata.GetDoubleDefault("dist-prior-delta", min(max(2.0, m_delta_min), m_delta_max));
+    if (m_delta < m_delta_min || m_delta > m_delta_max)
+    {
+        throw InvalidOptionValue("dist-prior-delta", stringify(m_delta),
+            "Must be between dist-prior-delta-min and dist-prior-delta-max");
+    }
+    m_update_first_iter = rundata.GetBool("update-spatial-prior-on-first-iteration");
+}
+
+void DistancePrior::DumpInfo(std::ostream &out) const
+{
+    out << "DistancePrior: Parameter " << m_idx << " '" << m_param_name << "'"
+        << " mean: " << m_params.mean() << " delta: " << m_delta << " (" << m_delta_min
+        << " - " << m_delta_max << ")";
+}
+
+double DistancePrior::Evaluate(
+    double delta, const vector<double> &dev, vector<double> &z, double &rho)
+{
+    m_covar.Solve(delta, dev, z);
+    const vector<double> &cinv_diag = m_covar.GetCinvDiagonal(delta);
+
+    // The conditional prior for each voxel given the others has precision
+    // rho * Cinv(v, v) and its mean differs from the voxel's own mean by
+    // z(v) / Cinv(v, v). rho has the same weak gamma prior as aK in SpatialPrior
+    int nvoxels = dev.size();
+    double sum_sq = 0, sum_log = 0;
+    for (int v = 0; v < nvoxels; v++)
+    {
+        sum_sq += z[v] * z[v] / cinv_diag[v];
+        sum_log += log(cinv_diag[v]);
+    }
+    rho = (nvoxels * 0.5 + 1.0) / (0.5 * sum_sq + 0.1);
+    return 0.5 * (sum_log + nvoxels * log(rho)) - 0.5 * rho * sum_sq;
+}
+
+void DistancePrior::Update(const RunContext &ctx)
+{
+    fabber::ScopedTimer timer("DistancePrior.Update");
+
+    vector<double> dev(ctx.nvoxels);
+    m_means.resize(ctx.nvoxels);
+    for (int v = 1; v <= ctx.nvoxels; v++)
+    {
+        m_means[v - 1] = ctx.fwd_post[v - 1].means(m_idx + 1);
+        dev[v - 1] = m_means[v - 1] - m_params.mean();
+    }
+
+    double best_rho;
+    double best_L = Evaluate(m_delta, dev, m_z, best_rho);
+
+    // Try larger and smaller values of delta and move to whichever is best. When
+    // there is already a matrix for a nearby value, use that instead
+    const double step = 1.5;
+    double trial[2] = { m_delta * step, m_delta / step };
+    double current = m_delta;
+    for (int i = 0; i < 2; i++)
+    {
+        double delta = min(max(trial[i], m_delta_min), m_delta_max);
+        if (delta == current)
+            continue;
+        if (delta > current)
+            m_covar.GetCachedInRange(&delta, max(delta / 1.2, current), delta * 1.2);
+        else
+            m_covar.GetCachedInRange(&delta, delta / 1.2, min(delta * 1.2, current));
+
+        vector<double> z = m_z;
+        double rho;
+        double L = Evaluate(delta, dev, z, rho);
+        if (L > best_L)
+        {
+            best_L = L;
+            best_rho = rho;
+            m_delta = delta;
+            m_z = z;
+        }
+    }
+
+    m_rho = best_rho;
+    m_cinv_diag = m_covar.GetCinvDiagonal(m_delta);
+    LOG_VERBOSE << "DistancePrior::Update " << m_idx << ": delta=" << m_delta
+                << ", rho=" << m_rho << endl;
+}
+
+double DistancePrior::ApplyToMVN(MVNDist *prior, const RunContext &ctx)
+{
+    if (ctx.v == 1 && (ctx.it > 0 || m_update_first_iter))
+    {
+        // Hyperparameters are updated on the first voxel of each iteration. See
+        // SpatialPrior::ApplyToMVN
+        Update(ctx);
+        m_updated = true;
+    }
+
+    if (!m_updated)
+        return DefaultPrior::ApplyToMVN(prior, ctx);
+
+    int v = ctx.v;
+    SymmetricMatrix precs = prior->GetPrecisions();
+    precs(m_idx + 1, m_idx + 1) = m_rho * m_cinv_diag[v - 1];
+    prior->SetPrecisions(precs);
+    prior->means(m_idx + 1) = m_means[v - 1] - m_z[v - 1] / m_cinv_diag[v - 1];
+
+    // As for SpatialPrior, no free energy contribution
+    return 0;
+}
+
 std::vector<Prior *> PriorFactory::CreatePriors(const std::vector<Parameter> &params)
 {
     vector<Prior *> priors;
@@ -517,9 +654,11 @@ Prior *PriorFactory::CreatePrior(Parameter p)
     case PRIOR_SPATIAL_P:
     case PRIOR_SPATIAL_p:
         return new SpatialPrior(p, m_rundata);
+    case PRIOR_SPATIAL_D:
+        return new DistancePrior(p, m_rundata);
     case PRIOR_ARD:
         return new ARDPrior(p, m_rundata);
     default:
-        throw InvalidOptionValue("Prior type", stringify(p.prior_type), "Supported types: NMmPpAI");
+        throw InvalidOptionValue("Prior type", stringify(p.prior_type), "Supported types: NMmPpDAI");
     }
 }
@@ -6,6 +6,7 @@
  * Copyright (C) 2007-2017 University of Oxford
  */
 
+#include "covariance_cache.h"
 #include "dist_mvn.h"
 #include "fwdmodel.h"
 #include "run_context.h"
@@ -24,6 +25,7 @@ const char PRIOR_SPATIAL_M = 'M'; // Markov random field - normally used
 const char PRIOR_SPATIAL_m = 'm'; // 'M' with Dirichlet BCs
 const char PRIOR_SPATIAL_P = 'P'; // Alternative to M (Penny prior?)
 const char PRIOR_SPATIAL_p = 'p'; // P with Dirichlet BCs
+const char PRIOR_SPATIAL_D = 'D'; // Distance-based Gaussian process
 const char PRIOR_DEFAULT = '-';   // Use whatever the model specifies
 
 /**
@@ -124,6 +126,19 @@ public:
     virtual void DumpInfo(std::ostream &out) const;
     virtual double ApplyToMVN(MVNDist *prior, const RunContext &ctx);
 
+    /**
+     * Spatial precision, e.g. to start a run from the result of a run
+     * at a different resolution
+     */
+    double GetaK() const
+    {
+        return m_aK;
+    }
+    void SetaK(double aK)
+    {
+        m_aK = aK;
+    }
+
 protected:
     double CalculateaK(const RunContext &ctx);
     double m_aK;
@@ -132,6 +147,60 @@ protected:
     bool m_update_first_iter;
 };
 
+/**
+ * Distance-based spatial prior
+ *
+ * The parameter has a Gaussian process prior across voxels with mean given
+ * by the parameter's prior mean and covariance C/rho, where C is a compactly
+ * supported function of the distance between voxels with support radius
+ * delta (see CovarianceCache). Each voxel receives the conditional prior given
+ * the posterior means of all other voxels at the start of the iteration.
+ *
+ * rho is updated each iteration in the same way as aK for SpatialPrior. delta
+ * is adapted to maximise the leave-one-out predictive likelihood of the
+ * posterior means, within the range given by dist-prior-delta-min and
+ * dist-prior-delta-max.
+ */
+class DistancePrior : public DefaultPrior
+{
+public:
+    DistancePrior(const Parameter &param, FabberRunData &rundata);
+
+    virtual void DumpInfo(std::ostream &out) const;
+    virtual double ApplyToMVN(MVNDist *prior, const RunContext &ctx);
+
+protected:
+    /** Update the hyperparameters from the current posterior means */
+    void Update(const RunContext &ctx);
+
+    /**
+     * Leave-one-out log likelihood of the posterior means for a value of delta
+     *
+     * @param dev Difference between posterior means and the prior mean
+     * @param z On entry, starting guess. On exit, C(delta)^-1 dev
+     * @param rho On exit, the corresponding value of rho
+     */
+    double Evaluate(double delta, const std::vector<double> &dev, std::vector<double> &z,
+        double &rho);
+
+    CovarianceCache m_covar;
+    double m_delta;
+    double m_delta_min;
+    double m_delta_max;
+    double m_rho;
+    bool m_update_first_iter;
+    bool m_updated;
+
+    /** Posterior means at the start of the iteration */
+    std::vector<double> m_means;
+
+    /** C^-1 times the deviation of the means from the prior mean */
+    std::vector<double> m_z;
+
+    /** Diagonal of C^-1 */
+    std::vector<double> m_cinv_diag;
+};
+
 /**
  * Creates instances of Prior depending on the input options
  */
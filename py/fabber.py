@@ -140,29 +140,39 @@ def generate_test_data(rundata, param_testvalues, nt=10, patchsize=10,
                 param_roi_data[param] = np.zeros(shape)
     fab = Fabber(rundata=rundata, **kwargs)
 
-    # I bet there's a neater way to do this!
-    patch_label = 1
+    # Collect the parameter values for every patch and evaluate them in one batch
+    patches, batch_params = [], {}
     for x in range(dim_sizes[0]):
         for y in range(dim_sizes[1]):
             for z in range(dim_sizes[2]):
                 pos = [x, y, z]
                 for idx, param in enumerate(dim_params):
                     if param is not None:
-                        param_value = dim_values[idx][pos[idx]]
-                        fixed_params[param] = param_value
-                        if param_rois:
-                            param_roi_data[param][x*patchsize:(x+1)*patchsize, y*patchsize:(y+1)*patchsize, z*patchsize:(z+1)*patchsize] = pos[idx]+1
-                model_curve = fab.model_evaluate(rundata, fixed_params, nt)
-                
-                data[x*patchsize:(x+1)*patchsize, y*patchsize:(y+1)*patchsize, z*patchsize:(z+1)*patchsize,:] = model_curve
-                #if noise is not None:
-                #    # Add Gaussian noise
-                #    signal_mean = np.mean(model_curve)
-                #    noise_data = np.random.normal(0, signal_mean*noise, [patchsize, patchsize, patchsize, nt])
-                #    data[x*patchsize:(x+1)*patchsize, y*patchsize:(y+1)*patchsize, z*patchsize:(z+1)*patchsize,:] += noise_data
-                if patch_rois: 
-                    patch_roi_data[x*patchsize:(x+1)*patchsize, y*patchsize:(y+1)*patchsize, z*patchsize:(z+1)*patchsize] = patch_label
-                    patch_label += 1
+                        fixed_params[param] = dim_values[idx][pos[idx]]
+                for param, value in fixed_params.items():
+                    batch_params.setdefault(param, []).append(value)
+                patches.append(pos)
+    model_curves = fab.model_evaluate_batch(rundata, batch_params, nt)
+
+    # I bet there's a neater way to do this!
+    patch_label = 1
+    for patch_idx, pos in enumerate(patches):
+        x, y, z = pos
+        if param_rois:
+            for idx, param in enumerate(dim_params):
+                if param is not None:
+                    param_roi_data[param][x*patchsize:(x+1)*patchsize, y*patchsize:(y+1)*patchsize, z*patchsize:(z+1)*patchsize] = pos[idx]+1
+        model_curve = model_curves[patch_idx]
+        
+        data[x*patchsize:(x+1)*patchsize, y*patchsize:(y+1)*patchsize, z*patchsize:(z+1)*patchsize,:] = model_curve
+        #if noise is not None:
+        #    # Add Gaussian noise
+        #    signal_mean = np.mean(model_curve)
+        #    noise_data = np.random.normal(0, signal_mean*noise, [patchsize, patchsize, patchsize, nt])
+        #    data[x*patchsize:(x+1)*patchsize, y*patchsize:(y+1)*patchsize, z*patchsize:(z+1)*patchsize,:] += noise_data
+        if patch_rois: 
+            patch_roi_data[x*patchsize:(x+1)*patchsize, y*patchsize:(y+1)*patchsize, z*patchsize:(z+1)*patchsize] = patch_label
+            patch_label += 1
 
     if noise is not None:
         # Add Gaussian noise
@@ -489,6 +499,9 @@ class FabberRun:
 class Fabber:
     """
     Interface to Fabber in library mode using simplified C-API
+
+    Separate Fabber instances may run concurrently in different threads. A
+    single instance should only be used by one thread at a time
     """
     def __init__(self, lib=None, model_libs=[], rundata=None, auto_load_models=False):
         self.ex, def_lib, models = find_fabber()
@@ -517,6 +530,8 @@ class Fabber:
         self.errbuf = create_string_buffer(255)
         self.outbuf = create_string_buffer(1000000)
         self.progress_cb_type = CFUNCTYPE(None, c_int, c_int)
+        self.cancel_cb_type = CFUNCTYPE(c_int, c_void_p)
+        self.results_cb_type = CFUNCTYPE(None, c_int, c_int, c_int, POINTER(c_float), POINTER(c_float), c_void_p)
         self._init_clib()
 
     def get_methods(self):
@@ -605,12 +620,53 @@ class Fabber:
 
         return ret
 
-    def run(self, rundata, progress_cb=None):
+    def model_evaluate_batch(self, rundata, params, nt, indata=None, output_name=""):
+        """
+        Evaluate the model for many sets of parameters
+
+        The model is initialized once and evaluated for every parameter set.
+
+        :param rundata: Options used to initialize the model
+        :param params: Either a dictionary of parameter name to sequence of N values,
+                       or an N x P array with parameters in the order returned by
+                       get_model_params
+        :param nt: Number of time points to evaluate
+        :param indata: Optional N x nt array of input data for each parameter set
+        :param output_name: Optional name of alternative model output
+        :return: N x nt array of model outputs
+        """
+        self._init_clib()
+        for key, value in rundata.items():
+            self._trycall(self.clib.fabber_set_opt, self.handle, str(key), str(value), self.errbuf)
+
+        # Get model parameter names
+        self._trycall(self.clib.fabber_get_model_params, self.handle, len(self.outbuf), self.outbuf, self.errbuf)
+        model_params = self.outbuf.value.splitlines()
+        if isinstance(params, dict):
+            for p in model_params:
+                if p not in params:
+                    raise FabberException("Model parameter %s not specified" % p)
+            params = np.array([params[p] for p in model_params], dtype=np.float32).T
+        params = np.ascontiguousarray(params, dtype=np.float32)
+        if params.ndim != 2 or params.shape[1] != len(model_params):
+            raise FabberException("Incorrect number of parameters specified: expected %i (%s)" % (len(model_params), ",".join(model_params)))
+
+        nrows = params.shape[0]
+        ret = np.zeros([nrows, nt], dtype=np.float32)
+        if indata is not None:
+            indata = np.ascontiguousarray(indata, dtype=np.float32).reshape([nrows * nt])
+        self._trycall(self.clib.fabber_model_evaluate_batch, self.handle, nrows, len(model_params), params.reshape([nrows * len(model_params)]),
+                      nt, indata, str(output_name), ret.reshape([nrows * nt]), self.errbuf)
+
+        return ret
+
+    def run(self, rundata, progress_cb=None, **kwargs):
         """
         Run fabber on the provided rundata options
 
         :param rundata: FabberRunData instance
         :param progress_cb: Callable which will be called periodically during processing
+        :param kwargs: Cancellation and partial results options, see run_with_data
         :return: On success, a FabberRun instance
         """
         mask = None
@@ -629,15 +685,23 @@ class Fabber:
                 # Otherwise ignore, most options will not be data files
                 pass
 
-        return self.run_with_data(rundata, data, mask, progress_cb)
+        return self.run_with_data(rundata, data, mask, progress_cb, **kwargs)
 
-    def run_with_data(self, rundata, data, mask=None, progress_cb=None):
+    def run_with_data(self, rundata, data, mask=None, progress_cb=None, cancel_cb=None, results_cb=None, results_block=1000):
         """
         Run fabber
 
         :param data: Dictionary of data: string key, Numpy array value
         :param mask: Mask as Numpy array, or None if no mask
         :param progress_cb: Callable which will be called periodically during processing
+        :param cancel_cb: Callable taking no arguments which is checked at voxel and iteration
+                          boundaries. If it returns True the run stops and FabberException
+                          is raised. The run may also be stopped from another thread using cancel()
+        :param results_cb: Callable taking (first voxel, means, variances) which receives partial
+                           results as blocks of voxels are completed. Voxel indices refer to masked
+                           voxels in Fortran order starting from 0. Means and variances are
+                           Numpy arrays of shape [number of voxels in block, number of parameters]
+        :param results_block: Number of voxels in each block passed to results_cb
         :return: On success, a FabberRun instance
         """
         if not data.has_key("data"):
@@ -685,21 +749,52 @@ class Fabber:
 
         retdata, log = {}, ""
         self._trycall(self.clib.fabber_set_extent, self.handle, s[0], s[1], s[2], mask, self.errbuf)
+
+        # Input data is read in place by Fabber so we must keep a reference to
+        # each buffer until the run is complete. No copy is made if the data is
+        # already a Fortran-ordered float32 array
+        buffers = []
         for key, item in data.items():
             if len(item.shape) == 3:
                 size = 1
             else:
                 size = item.shape[3]
-            item = np.ascontiguousarray(item.flatten(order='F'), dtype=np.float32)
-            self._trycall(self.clib.fabber_set_data, self.handle, key, size, item, self.errbuf)
+            item = np.asfortranarray(item, dtype=np.float32).ravel(order='F')
+            buffers.append(item)
+            self._trycall(self.clib.fabber_set_data_buffer, self.handle, key, size, item, 0, self.errbuf)
+
+        # Single-valued outputs are written directly into the returned arrays. Others
+        # (e.g. model fit) may have a size which depends on the model so are retrieved
+        # after the run
+        for key in output_items:
+            if key.startswith("mean_") or key.startswith("std_") or key.startswith("zstat_") or \
+               key in ("noise_means", "noise_stdevs", "freeEnergy"):
+                arr = np.zeros([s[0], s[1], s[2]], dtype=np.float32, order='F')
+                retdata[key] = arr
+                self._trycall(self.clib.fabber_set_output_buffer, self.handle, key, nv, arr.ravel(order='F'), 0, self.errbuf)
 
         progress_cb_func = self.progress_cb_type(0)
         if progress_cb is not None:
             progress_cb_func = self.progress_cb_type(progress_cb)
 
-        self._trycall(self.clib.fabber_dorun, self.handle, len(self.outbuf), self.outbuf, self.errbuf, progress_cb_func)
+        cancel_cb_func = self.cancel_cb_type(0)
+        if cancel_cb is not None:
+            cancel_cb_func = self.cancel_cb_type(lambda user_data: int(bool(cancel_cb())))
+
+        results_cb_func = self.results_cb_type(0)
+        if results_cb is not None:
+            def _results(first_voxel, nvoxels, nparams, means, variances, user_data):
+                shape = [nvoxels, nparams]
+                results_cb(first_voxel, np.ctypeslib.as_array(means, shape=shape).copy(),
+                           np.ctypeslib.as_array(variances, shape=shape).copy())
+            results_cb_func = self.results_cb_type(_results)
+
+        self._trycall(self.clib.fabber_dorun_callbacks, self.handle, len(self.outbuf), self.outbuf, self.errbuf,
+                      progress_cb_func, cancel_cb_func, results_block, results_cb_func, None)
         log = self.outbuf.value
         for key in output_items:
+            if key in retdata:
+                continue
             size = self._trycall(self.clib.fabber_get_data_size, self.handle, key, self.errbuf)
 
             arr = np.ascontiguousarray(np.empty(nv * size, dtype=np.float32))
@@ -712,6 +807,15 @@ class Fabber:
 
         return FabberRun(retdata, log)
 
+    def cancel(self):
+        """
+        Stop a run in progress at the next voxel or iteration boundary
+
+        This may be called from a different thread to the one running the fit
+        """
+        if getattr(self, "handle", None) is not None:
+            self.clib.fabber_cancel(self.handle)
+
     def __del__(self):
         self._destroy_handle()
 
@@ -735,15 +839,26 @@ class Fabber:
             c_int_arr = npct.ndpointer(dtype=np.int32, ndim=1, flags='CONTIGUOUS')
             c_float_arr = npct.ndpointer(dtype=np.float32, ndim=1, flags='CONTIGUOUS')
 
+            # Allow None to be passed for optional array arguments
+            def _from_param(cls, obj):
+                if obj is None: return obj
+                return c_float_arr.from_param(obj)
+            c_float_arr_or_null = type('c_float_arr_or_null', (c_float_arr,), {'from_param': classmethod(_from_param)})
+
             self.clib.fabber_new.argtypes = [c_char_p]
             self.clib.fabber_new.restype = c_void_p
             self.clib.fabber_load_models.argtypes = [c_void_p, c_char_p, c_char_p]
             self.clib.fabber_set_extent.argtypes = [c_void_p, c_uint, c_uint, c_uint, c_int_arr, c_char_p]
             self.clib.fabber_set_opt.argtypes = [c_void_p, c_char_p, c_char_p, c_char_p]
             self.clib.fabber_set_data.argtypes = [c_void_p, c_char_p, c_uint, c_float_arr, c_char_p]
+            self.clib.fabber_set_data_buffer.argtypes = [c_void_p, c_char_p, c_uint, c_float_arr, c_int, c_char_p]
+            self.clib.fabber_set_output_buffer.argtypes = [c_void_p, c_char_p, c_uint, c_float_arr, c_int, c_char_p]
             self.clib.fabber_get_data_size.argtypes = [c_void_p, c_char_p, c_char_p]
             self.clib.fabber_get_data.argtypes = [c_void_p, c_char_p, c_float_arr, c_char_p]
             self.clib.fabber_dorun.argtypes = [c_void_p, c_uint, c_char_p, c_char_p, self.progress_cb_type]
+            self.clib.fabber_dorun_callbacks.argtypes = [c_void_p, c_uint, c_char_p, c_char_p, self.progress_cb_type,
+                                                         self.cancel_cb_type, c_int, self.results_cb_type, c_void_p]
+            self.clib.fabber_cancel.argtypes = [c_void_p]
             self.clib.fabber_destroy.argtypes = [c_void_p]
 
             self.clib.fabber_get_options.argtypes = [c_void_p, c_char_p, c_char_p, c_uint, c_char_p, c_char_p]
@@ -753,6 +868,7 @@ class Fabber:
             self.clib.fabber_get_model_params.argtypes = [c_void_p, c_uint, c_char_p, c_char_p]
             self.clib.fabber_get_model_outputs.argtypes = [c_void_p, c_uint, c_char_p, c_char_p]
             self.clib.fabber_model_evaluate.argtypes = [c_void_p, c_uint, c_float_arr, c_uint, c_float_arr, c_float_arr, c_char_p]
+            self.clib.fabber_model_evaluate_batch.argtypes = [c_void_p, c_uint, c_uint, c_float_arr, c_uint, c_float_arr_or_null, c_char_p, c_float_arr, c_char_p]
         except Exception, e:
             raise FabberException("Error initializing Fabber library: %s" % str(e))
 
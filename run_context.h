@@ -10,6 +10,7 @@
 #include "dist_mvn.h"
 #include "fwdmodel_linear.h"
 #include "noisemodel.h"
+#include "transport.h"
 
 #include <vector>
 
@@ -26,9 +27,28 @@ struct RunContext
         : it(0)
         , v(1)
         , nvoxels(nv)
+        , transport(NULL)
     {
     }
 
+    /**
+     * @return true if voxel v (from 1) is updated by this process
+     */
+    bool IsOwned(int v) const
+    {
+        return owned.empty() || owned[v - 1];
+    }
+
+    /**
+     * Replace values with their sums over all parts of a domain-decomposed
+     * run. Does nothing if the run is not decomposed
+     */
+    void SumOverDomain(std::vector<double> &values) const
+    {
+        if (transport)
+            transport->SumAll(values);
+    }
+
     /** Current iteration, starting at 0 */
     int it;
 
@@ -47,4 +67,15 @@ struct RunContext
     std::vector<NoiseParams *> noise_post;
     std::vector<std::vector<int> > neighbours;
     std::vector<std::vector<int> > neighbours2;
+
+    /**
+     * For one part of a domain-decomposed run, flags for the voxels owned by
+     * this process. The others are halo copies of voxels owned by other
+     * processes, whose posterior means are read but not updated. Empty if
+     * all voxels are owned
+     */
+    std::vector<char> owned;
+
+    /** Communication with the other parts of a domain-decomposed run, or NULL */
+    Transport *transport;
 };
\ No newline at end of file
@@ -12,10 +12,12 @@
 #include "fwdmodel.h"
 #include "inference.h"
 #include "setup.h"
+#include "tools.h"
 #include "version.h"
 
 #include <newmat.h>
 
+#include <algorithm>
 #include <errno.h>
 #include <fstream>
 #include <sstream>
@@ -169,6 +171,9 @@ static OptionSpec OPTIONS[] = {
         OPT_NONREQ, "interleave" },
     { "mask", OPT_IMAGE, "Mask file. Inference will only be performed where mask value > 0",
         OPT_NONREQ, "" },
+    { "data-cache", OPT_STR, "Directory for caching preprocessed input data. Repeated runs with "
+                             "identical data, mask and data options will reload the cached data",
+        OPT_NONREQ, "" },
     { "mt<n>", OPT_INT, "List of masked time points, indexed from 1. These will be ignored in the "
                         "parameter updates",
         OPT_NONREQ, "" },
@@ -177,6 +182,22 @@ static OptionSpec OPTIONS[] = {
     { "dump-param-names", OPT_BOOL,
         "Write the file paramnames.txt containing the names of the model parameters", OPT_NONREQ,
         "" },
+    { "split", OPT_INT, "Split the voxels in the mask into this number of parts which can be "
+                        "run separately and merged afterwards",
+        OPT_NONREQ, "" },
+    { "part", OPT_INT, "With --split, run only this part (1 to the number of parts). Output is "
+                       "saved to <output>_part<n>",
+        OPT_NONREQ, "" },
+    { "split-cost", OPT_IMAGE, "With --split, image of the cost of each voxel, e.g. diag_time "
+                               "from a previous run. Parts are chosen to have equal total cost "
+                               "rather than equal numbers of voxels",
+        OPT_NONREQ, "" },
+    { "merge", OPT_BOOL, "With --split, combine the outputs of all the parts into <output>",
+        OPT_NONREQ, "" },
+    { "sparse-output", OPT_STR, "Save only the masked voxels of output images: bbox = crop to the "
+                                "bounding box of the mask, voxellist = list of voxels in the "
+                                "order given by the voxel_coords output",
+        OPT_NONREQ, "" },
     { "save-model-fit", OPT_BOOL, "Output the model prediction as a 4d volume", OPT_NONREQ, "" },
     { "save-residuals", OPT_BOOL,
         "Output the residuals (difference between the data and the model prediction)", OPT_NONREQ,
@@ -184,6 +205,14 @@ static OptionSpec OPTIONS[] = {
     { "save-model-extras", OPT_BOOL, "Output any additional model-specific timeseries data",
         OPT_NONREQ, "" },
     { "save-mvn", OPT_BOOL, "Output the final MVN distributions.", OPT_NONREQ, "" },
+    { "save-mvn-format", OPT_STR, "Format for saved MVN distributions: nifti = NIFTI symmetric "
+                                  "matrix image, compact = compressed binary .mvnc file",
+        OPT_NONREQ, "nifti" },
+    { "mvn-diag-only", OPT_BOOL, "When saving compact MVN files, store only the parameter variances",
+        OPT_NONREQ, "" },
+    { "mvn-half", OPT_BOOL, "When saving compact MVN files, store parameter correlations in half "
+                            "precision",
+        OPT_NONREQ, "" },
     { "save-mean", OPT_BOOL, "Output the parameter means.", OPT_NONREQ, "" },
     { "save-std", OPT_BOOL, "Output the parameter standard deviations.", OPT_NONREQ, "" },
     { "save-var", OPT_BOOL, "Output the parameter variances.", OPT_NONREQ, "" },
@@ -191,9 +220,30 @@ static OptionSpec OPTIONS[] = {
     { "save-noise-mean", OPT_BOOL, "Output the noise means. The noise distribution inferred is the precision of a Gaussian noise source", OPT_NONREQ, "" },
     { "save-noise-std", OPT_BOOL, "Output the noise standard deviations. ", OPT_NONREQ, "" },
     { "save-free-energy", OPT_BOOL, "Output the free energy, if calculated. ", OPT_NONREQ, "" },
+    { "save-voxel-diagnostics", OPT_BOOL, "Output the cost of the calculation in each voxel: "
+                                          "wall time, iterations, model evaluations, convergence "
+                                          "reverts and whether the voxel was abandoned",
+        OPT_NONREQ, "" },
     { "optfile", OPT_BOOL, "File containing additional options, one per line, in the same form as "
                            "specified on the command line",
         OPT_NONREQ, "" },
+    { "serve", OPT_BOOL, "Run as a job server, accepting jobs from --submit over a local socket",
+        OPT_NONREQ, "" },
+    { "socket", OPT_STR, "Path of the socket used by --serve and --submit", OPT_NONREQ,
+        "fabber.sock" },
+    { "serve-threads", OPT_INT, "Number of jobs the server may run simultaneously", OPT_NONREQ,
+        "1" },
+    { "submit", OPT_FILE, "Submit a job to a running server. The job file contains options in the "
+                          "same form as --optfile, or a JSON object of option names to values",
+        OPT_NONREQ, "" },
+    { "perf-summary", OPT_BOOL, "Log a summary of the time spent in each phase of the run",
+        OPT_NONREQ, "" },
+    { "save-perf-trace", OPT_BOOL, "Save a timeline of the run to perf_trace.json in the output "
+                                   "directory, in Chrome trace event format",
+        OPT_NONREQ, "" },
+    { "log-level", OPT_STR, "Level of detail in the log: warn, info, verbose or debug. Default is "
+                            "info, or debug if --debug is given",
+        OPT_NONREQ, "" },
     { "debug", OPT_BOOL,
         "Output large amounts of debug information. ONLY USE WITH VERY SMALL NUMBERS OF VOXELS",
         OPT_NONREQ, "" },
@@ -210,6 +260,8 @@ void FabberRunData::GetOptions(std::vector<OptionSpec> &opts)
 
 FabberRunData::FabberRunData(bool compat_options)
     : m_progress(0)
+    , m_neighbours_dims(0)
+    , m_neighbours2_dims(0)
 {
     init(compat_options);
 }
@@ -245,25 +297,120 @@ void FabberRunData::LogParams()
     }
 }
 
+void FabberRunData::SetLogLevel()
+{
+    string name = GetStringDefault("log-level", GetBool("debug") ? "debug" : "info");
+    int level;
+    if (!EasyLog::ParseLevel(name, level))
+    {
+        throw InvalidOptionValue("log-level", name, "Must be warn, info, verbose or debug");
+    }
+    m_log->SetLevel(level);
+}
+
 void FabberRunData::Run(ProgressCheck *progress)
 {
+    // Runs on different threads take turns unless the matrix library is thread safe
+    fabber::MatrixLock matrix_lock;
     if (!m_log)
     {
         m_log = &m_default_log;
     }
 
     m_progress = progress;
+    SetLogLevel();
     LOG << "FabberRunData::FABBER release: " << fabber_version() << endl;
     LOG << "FabberRunData::Last commit: " << fabber_source_date() << endl;
 
     time_t startTime;
     time(&startTime);
+    double start_wall = fabber::wall_time();
     LOG << "FabberRunData::Start time: " << ctime(&startTime);
 
+    // Instrumented code records into the collector which is current for this thread
+    fabber::PerfStats *perf = GetPerfStats();
+    if (GetBool("perf-summary") || GetBool("save-perf-trace"))
+    {
+        perf->Start(GetBool("save-perf-trace"));
+    }
+    else
+    {
+        perf->Reset();
+    }
+    fabber::PerfScope perf_scope(perf->IsEnabled() ? perf : NULL);
+
     LogParams();
 
+    // Create the forward model and inference technique, unless we already have them
+    // from the current session
+    boost::shared_ptr<FwdModel> fwd_model = m_session_model;
+    boost::shared_ptr<InferenceTechnique> infer = m_session_method;
+    if (InSession())
+    {
+        LOG << "FabberRunData::Reusing forward model and inference method from session" << endl;
+        infer->ClearResults();
+    }
+    else
+    {
+        CreateModelAndMethod(fwd_model, infer);
+    }
+
+    // Calculations
+    int nvoxels = GetVoxelCoords().Ncols();
+    LOG << "FabberRunData::Num voxels " << nvoxels << endl;
+    Progress(0, nvoxels);
+    CheckCancelled();
+    infer->DoCalculations(*this);
+    Progress(nvoxels, nvoxels);
+    LOG << "FabberRunData::Saving results " << endl;
+    infer->SaveResults(*this);
+
+    LOG << "FabberRunData::All done." << endl;
+
+    // Options should all have been used by now, so complain if there's anything left.
+    CheckAllOptionsUsed();
+
+    time_t endTime;
+    time(&endTime);
+    LOG << "FabberRunData::Start time: " << ctime(&startTime); // Bizarrely, ctime() ends with a \n.
+    LOG << "FabberRunData::End time: " << ctime(&endTime);
+    LOG << "FabberRunData::Duration: " << fabber::wall_time() - start_wall << " seconds." << endl;
+
+    if (perf->IsEnabled())
+    {
+        if (GetBool("perf-summary"))
+        {
+            perf->LogSummary(LOG_STREAM);
+        }
+        if (GetBool("save-perf-trace"))
+        {
+            string filename = GetOutputDir() + "/perf_trace.json";
+            LOG << "FabberRunData::Saving performance trace: " << filename << endl;
+            perf->WriteTrace(filename);
+        }
+        perf->Reset();
+    }
+}
+
+fabber::PerfStats *FabberRunData::GetPerfStats()
+{
+    return &m_perf;
+}
+
+void FabberRunData::CheckCancelled()
+{
+    if (m_progress && m_progress->Cancelled())
+    {
+        LOG << "FabberRunData::Run cancelled" << endl;
+        throw FabberRunCancelled();
+    }
+}
+
+void FabberRunData::CreateModelAndMethod(
+    boost::shared_ptr<FwdModel> &fwd_model, boost::shared_ptr<InferenceTechnique> &infer)
+{
     // Set the forward model
-    std::auto_ptr<FwdModel> fwd_model(FwdModel::NewFromName(GetString("model")));
+    fwd_model.reset(FwdModel::NewFromName(GetString("model")));
 
     // For backwards compatibility - model may not have called superclass initialize
     fwd_model->SetLogger(m_log);
@@ -286,28 +433,27 @@ void FabberRunData::Run(ProgressCheck *progress)
     }
 
     // Set the inference technique (and pass in the model)
-    std::auto_ptr<InferenceTechnique> infer(InferenceTechnique::NewFromName(GetString("method")));
+    infer.reset(InferenceTechnique::NewFromName(GetString("method")));
     infer->Initialize(fwd_model.get(), *this);
+}
 
-    // Calculations
-    int nvoxels = GetVoxelCoords().Ncols();
-    LOG << "FabberRunData::Num voxels " << nvoxels << endl;
-    Progress(0, nvoxels);
-    infer->DoCalculations(*this);
-    Progress(nvoxels, nvoxels);
-    LOG << "FabberRunData::Saving results " << endl;
-    infer->SaveResults(*this);
-
-    LOG << "FabberRunData::All done." << endl;
+void FabberRunData::StartSession()
+{
+    if (!m_log)
+    {
+        m_log = &m_default_log;
+    }
 
-    // Options should all have been used by now, so complain if there's anything left.
-    CheckAllOptionsUsed();
+    EndSession();
+    LOG << "FabberRunData::Starting session" << endl;
+    CreateModelAndMethod(m_session_model, m_session_method);
+}
 
-    time_t endTime;
-    time(&endTime);
-    LOG << "FabberRunData::Start time: " << ctime(&startTime); // Bizarrely, ctime() ends with a \n.
-    LOG << "FabberRunData::End time: " << ctime(&endTime);
-    LOG << "FabberRunData::Duration: " << endTime - startTime << " seconds." << endl;
+void FabberRunData::EndSession()
+{
+    // Inference method refers to the model so must go first
+    m_session_method.reset();
+    m_session_model.reset();
 }
 
 static string trim(string const &str)
@@ -328,6 +474,11 @@ void FabberRunData::ParseParamFile(const string &filename)
     {
         throw FabberRunDataError("Couldn't read input options file:" + filename);
     }
+    ParseParams(is);
+}
+
+void FabberRunData::ParseParams(istream &is)
+{
     while (is.good())
     {
         string input;
@@ -472,6 +623,10 @@ void FabberRunData::Unset(const std::string &key)
 {
     m_params.erase(key);
 }
+void FabberRunData::CopyOptions(const FabberRunData &from)
+{
+    m_params = from.m_params;
+}
 bool FabberRunData::HaveKey(const string &key)
 {
     return m_params.count(key) > 0;
@@ -652,7 +807,9 @@ void FabberRunData::CheckAllOptionsUsed() const
     {
         if ((iter->first != "") && m_used_params.find(iter->first) == m_used_params.end())
         {
-            WARN_ONCE("Unused option specified: " + iter->first);
+            // Not WARN_ONCE since each unused option should be reported
+            if (m_log)
+                m_log->WarnOnce("Unused option specified: " + iter->first);
         }
     }
 }
@@ -666,6 +823,10 @@ string FabberRunData::GetOutputDir()
         return m_outdir;
 
     string basename = GetStringDefault("output", "");
+    if (HaveKey("part"))
+    {
+        basename = GetPartOutputName(GetInt("part"));
+    }
     if (basename == "")
     {
         m_outdir = ".";
@@ -737,6 +898,16 @@ string FabberRunData::GetOutputDir()
     return m_outdir;
 }
 
+string FabberRunData::GetPartOutputName(int part) const
+{
+    string basename = GetStringDefault("output", "");
+    if (basename == "")
+    {
+        return "part" + stringify(part);
+    }
+    return basename + "_part" + stringify(part);
+}
+
 ostream &operator<<(ostream &out, const FabberRunData &opts)
 {
     for (map<string, string>::const_iterator i = opts.m_params.begin(); i != opts.m_params.end();
@@ -799,14 +970,8 @@ const NEWMAT::Matrix &FabberRunData::GetVoxelCoords()
     return GetVoxelData("coords");
 }
 
-const NEWMAT::Matrix &FabberRunData::GetVoxelData(const std::string &key)
+string FabberRunData::GetVoxelDataKey(const std::string &key) const
 {
-    // Attempt to load data if not already present. Will
-    // throw an exception if parameter not specified
-    // or file could not be loaded
-    //
-    // FIXME different exceptions? What about use case where
-    // data is optional?
     string key_cur = key;
     string data_key = "";
     while (key_cur != "")
@@ -817,7 +982,18 @@ const NEWMAT::Matrix &FabberRunData::GetVoxelData(const std::string &key)
         if (key_cur == key)
             break;
     }
+    return data_key;
+}
 
+const NEWMAT::Matrix &FabberRunData::GetVoxelData(const std::string &key)
+{
+    // Attempt to load data if not already present. Will
+    // throw an exception if parameter not specified
+    // or file could not be loaded
+    //
+    // FIXME different exceptions? What about use case where
+    // data is optional?
+    string data_key = GetVoxelDataKey(key);
     const NEWMAT::Matrix &m = LoadVoxelData(data_key);
     double mean = m.Sum() / (m.Nrows() * m.Ncols());
     LOG << "FabberRunData::GetVoxelData: " << key << "=" << data_key << " mean value=" << mean << endl;
@@ -836,26 +1012,50 @@ const NEWMAT::Matrix &FabberRunData::LoadVoxelData(const std::string &key)
     }
 }
 
-const Matrix &FabberRunData::GetMainVoxelDataMultiple()
+ReturnMatrix FabberRunData::LoadVoxelDataSubset(const std::string &key, const vector<int> &voxels)
 {
-    vector<Matrix> dataSets;
-    int n = 1;
-    while (true)
+    const Matrix &data = LoadVoxelData(key);
+    int nfull = GetVoxelCoords().Ncols();
+    if (data.Ncols() != nfull)
     {
-        try
+        throw InvalidOptionValue("Voxels in " + key, stringify(data.Ncols()),
+            "Incorrect size - should contain " + stringify(nfull));
+    }
+
+    int nv = voxels.size();
+    Matrix subset(data.Nrows(), nv);
+    fabber::MatrixLayout src_layout(data), dest_layout(subset);
+    const Real *src = data.Store();
+    Real *dest = subset.Store();
+    for (int r = 1; r <= data.Nrows(); r++)
+    {
+        for (int v = 0; v < nv; v++)
         {
-            dataSets.push_back(GetVoxelData("data" + stringify(n)));
-            n++;
+            dest[dest_layout.Index(r, v + 1)] = src[src_layout.Index(r, voxels[v])];
         }
-        catch (DataNotFound &e)
+    }
+    return subset;
+}
+
+const Matrix &FabberRunData::GetMainVoxelDataMultiple()
+{
+    // Find the data sets without loading them. The combined matrix is built
+    // directly from the loaded data, and each data set is released as soon as
+    // it has been copied so we never hold more than one extra copy of the data
+    vector<string> keys;
+    while (true)
+    {
+        string key = "data" + stringify(keys.size() + 1);
+        if (!HaveKey(key) && (m_voxel_data.count(key) == 0))
         {
             // No more data sets to combine, carry on with what we've got
             break;
         }
+        keys.push_back(GetVoxelDataKey(key));
     }
 
     string order = GetStringDefault("data-order", "interleave");
-    int nSets = dataSets.size();
+    int nSets = keys.size();
     if (nSets < 1)
     {
         throw DataNotFound("data");
@@ -865,26 +1065,42 @@ const Matrix &FabberRunData::GetMainVoxelDataMultiple()
         throw InvalidOptionValue("data-order", "singlefile", "More than one file specified");
     }
 
+    // Free any previously combined data before we start
+    m_mainDataMultiple.CleanUp();
+
     if (order == "interleave")
     {
         LOG << "FabberRunData::Combining data into one big matrix by interleaving..." << endl;
         // Interleave - For example if the data sets are A, B, C and each
         // has 3 time points 1, 2, 3 the final time series will be
         // A1B1C1A2B2C2A3B3C3
-        int nTimes = dataSets[0].Nrows();
-        m_mainDataMultiple.ReSize(nTimes * nSets, dataSets[0].Ncols());
-        for (int i = 0; i < nTimes; i++)
+        int nTimes = 0, nVoxels = 0;
+        for (int j = 0; j < nSets; j++)
         {
-            for (int j = 0; j < nSets; j++)
+            const Matrix &data = LoadVoxelData(keys[j]);
+            if (j == 0)
             {
-                if (dataSets[j].Nrows() != nTimes)
-                {
-                    // Data sets need same number of time points if they are to be interleaved
-                    throw InvalidOptionValue("data-order", "interleave",
-                        "Data sets must all have the same number of time points");
-                }
-                m_mainDataMultiple.Row(nSets * i + j + 1) = dataSets.at(j).Row(i + 1);
+                nTimes = data.Nrows();
+                nVoxels = data.Ncols();
+                m_mainDataMultiple.ReSize(nTimes * nSets, nVoxels);
+            }
+            else if (data.Nrows() != nTimes)
+            {
+                // Data sets need same number of time points if they are to be interleaved
+                throw InvalidOptionValue("data-order", "interleave",
+                    "Data sets must all have the same number of time points");
+            }
+            if (data.Ncols() != nVoxels)
+            {
+                throw InvalidOptionValue("Voxels in " + keys[j], stringify(data.Ncols()),
+                    "Incorrect size - should contain " + stringify(nVoxels));
+            }
+
+            for (int i = 0; i < nTimes; i++)
+            {
+                fabber::CopyRows(data, i + 1, m_mainDataMultiple, nSets * i + j + 1, 1);
             }
+            ReleaseVoxelData(keys[j]);
         }
     }
     else if (order == "concatenate")
@@ -893,15 +1109,35 @@ const Matrix &FabberRunData::GetMainVoxelDataMultiple()
         // Concatentate - For example if the data sets are A, B, C and each
         // has 3 time points 1, 2, 3 the final time series will be
         // A1A2A3B1B2B3C1C2C3
-        m_mainDataMultiple = dataSets.at(0);
-        for (unsigned j = 1; j < dataSets.size(); j++)
+        int nTimes = 0, nVoxels = 0;
+        for (int j = 0; j < nSets; j++)
         {
-            m_mainDataMultiple &= dataSets.at(j);
+            const Matrix &data = LoadVoxelData(keys[j]);
+            if (j == 0)
+            {
+                nVoxels = data.Ncols();
+            }
+            else if (data.Ncols() != nVoxels)
+            {
+                throw InvalidOptionValue("Voxels in " + keys[j], stringify(data.Ncols()),
+                    "Incorrect size - should contain " + stringify(nVoxels));
+            }
+            nTimes += data.Nrows();
+        }
+
+        m_mainDataMultiple.ReSize(nTimes, nVoxels);
+        int row = 1;
+        for (int j = 0; j < nSets; j++)
+        {
+            const Matrix &data = LoadVoxelData(keys[j]);
+            fabber::CopyRows(data, 1, m_mainDataMultiple, row, data.Nrows());
+            row += data.Nrows();
+            ReleaseVoxelData(keys[j]);
         }
     }
     else if (order == "singlefile")
     {
-        m_mainDataMultiple = dataSets[0];
+        m_mainDataMultiple = LoadVoxelData(keys[0]);
     }
     else
     {
@@ -934,11 +1170,17 @@ void FabberRunData::SetVoxelData(string key, const NEWMAT::Matrix &data)
 void FabberRunData::SaveVoxelData(
     const std::string &filename, NEWMAT::Matrix &data, VoxelDataType data_type)
 {
+    fabber::ScopedTimer timer(GetPerfStats(), "SaveVoxelData", filename);
     LOG << "FabberRunData::Saving to memory: " << filename << endl;
-    // FIXME what should we do with data_type?
+    // Data types only affect how data is written to files
     SetVoxelData(filename, data);
 }
 
+bool FabberRunData::SaveCompactMVN(const std::string &filename, const vector<MVNDist *> &mvns)
+{
+    return false;
+}
+
 void FabberRunData::SetVoxelCoords(const NEWMAT::Matrix &coords)
 {
     // We assume 3D coordinates. Fabber could work for different
@@ -951,6 +1193,11 @@ void FabberRunData::SetVoxelCoords(const NEWMAT::Matrix &coords)
 
     SetVoxelData("coords", coords);
 
+    // Neighbour lists depend on the co-ordinates so must be recalculated
+    m_voxel_offsets.clear();
+    m_neighbours.clear();
+    m_neighbours2.clear();
+
     if (m_extent.size() == 0)
     {
         m_extent.resize(3);
@@ -971,6 +1218,27 @@ void FabberRunData::SetVoxelCoords(const NEWMAT::Matrix &coords)
     }
 }
 
+void FabberRunData::SetVoxelCoordsFromOffsets(const vector<int> &offsets)
+{
+    const int nx = m_extent[0];
+    const int ny = m_extent[1];
+    const int nvoxels = offsets.size();
+
+    Matrix coords(3, nvoxels);
+    fabber::MatrixLayout layout(coords);
+    Real *store = coords.Store();
+    for (int v = 0; v < nvoxels; v++)
+    {
+        int offset = offsets[v];
+        store[layout.Index(1, v + 1)] = offset % nx;
+        store[layout.Index(2, v + 1)] = (offset / nx) % ny;
+        store[layout.Index(3, v + 1)] = offset / (nx * ny);
+    }
+
+    SetVoxelCoords(coords);
+    m_voxel_offsets = offsets;
+}
+
 void FabberRunData::GetExtent(vector<int> &extent, vector<float> &dims)
 {
     extent = m_extent;
@@ -995,68 +1263,64 @@ void FabberRunData::SetExtent(int nx, int ny, int nz, float sx, float sy, float
     m_dims[2] = sz;
 }
 
-// Binary search for data(index) == num
+// Binary search for data[index] == num
 // Assumes data is sorted ascending!!
-// Either returns an index such that data(index) == num
-//   or -1 if num is not present in data.
-static inline int binarySearch(const ColumnVector &data, int num)
+// Either returns index + 1 such that data[index] == num (i.e. the
+// voxel index starting at 1) or -1 if num is not present in data.
+static inline int binarySearch(const vector<int> &data, int num)
 {
-    int first = 1, last = data.Nrows();
-
-    while (first <= last)
+    vector<int>::const_iterator it = std::lower_bound(data.begin(), data.end(), num);
+    if ((it != data.end()) && (*it == num))
     {
-        int test = (first + last) / 2;
-
-        if (data(test) < num)
-        {
-            first = test + 1;
-        }
-        else if (data(test) > num)
-        {
-            last = test - 1;
-        }
-        else if (data(test) == num)
-        {
-            return test;
-        }
-        else
-        {
-            assert(false); // logic error!  data wasn't sorted?
-        }
+        return (it - data.begin()) + 1;
     }
     return -1;
 }
 
 vector<vector<int> > &FabberRunData::GetNeighbours(int n_dims)
 {
-    if (m_neighbours.size() > 0)
+    if (m_neighbours.size() > 0 && m_neighbours_dims == n_dims)
         return m_neighbours;
+    m_neighbours.clear();
+    m_neighbours_dims = n_dims;
 
     const Matrix &coords = GetVoxelCoords();
     const int nvoxels = coords.Ncols();
     if (nvoxels == 0)
         return m_neighbours;
 
+    fabber::ScopedTimer timer(GetPerfStats(), "CalcNeighbours");
+
     // Voxels must be ordered by increasing z, y and x values respectively
     // otherwise binary search for voxel by offset will not work
     // CheckCoordMatrixCorrectlyOrdered(coords);
 
-    // Create a column vector with one entry per voxel.
-    ColumnVector offsets(nvoxels);
-
-    // Populate offsets with the offset into the
-    // matrix of each voxel. We assume that co-ordinates
-    // could be zero but not negative
-    int xsize = coords.Row(1).Maximum() + 1;
-    int ysize = coords.Row(2).Maximum() + 1;
-    for (int v = 1; v <= nvoxels; v++)
+    // Offset into the volume of each voxel. If the co-ordinates were
+    // generated from a mask we already have these, otherwise calculate them
+    // from the co-ordinates. We assume that co-ordinates could be zero but
+    // not negative
+    vector<int> coord_offsets;
+    int xsize, ysize;
+    bool have_offsets = ((int)m_voxel_offsets.size() == nvoxels);
+    if (have_offsets)
     {
-        int x = coords(1, v);
-        int y = coords(2, v);
-        int z = coords(3, v);
-        int offset = z * xsize * ysize + y * xsize + x;
-        offsets(v) = offset;
+        xsize = m_extent[0];
+        ysize = m_extent[1];
+    }
+    else
+    {
+        coord_offsets.resize(nvoxels);
+        xsize = coords.Row(1).Maximum() + 1;
+        ysize = coords.Row(2).Maximum() + 1;
+        for (int v = 1; v <= nvoxels; v++)
+        {
+            int x = coords(1, v);
+            int y = coords(2, v);
+            int z = coords(3, v);
+            coord_offsets[v - 1] = z * xsize * ysize + y * xsize + x;
+        }
     }
+    const vector<int> &offsets = have_offsets ? m_voxel_offsets : coord_offsets;
 
     // Delta is a list of offsets to find nearest
     // neighbours in x y and z direction (not diagonally)
@@ -1088,7 +1352,7 @@ vector<vector<int> > &FabberRunData::GetNeighbours(int n_dims)
     for (int vid = 1; vid <= nvoxels; vid++)
     {
         // Get the voxel offset into the matrix
-        int pos = int(offsets(vid));
+        int pos = offsets[vid - 1];
 
         // Now search for neighbours
         for (int n = 0; n <= max_delta; n++)
@@ -1137,8 +1401,10 @@ vector<vector<int> > &FabberRunData::GetNeighbours(int n_dims)
 
 vector<vector<int> > &FabberRunData::GetSecondNeighbours(int n_dims)
 {
-    if (m_neighbours2.size() > 0)
+    if (m_neighbours2.size() > 0 && m_neighbours2_dims == n_dims)
         return m_neighbours2;
+    m_neighbours2.clear();
+    m_neighbours2_dims = n_dims;
 
     GetNeighbours(n_dims);
     const int nvoxels = m_neighbours.size();
@@ -1177,6 +1443,7 @@ vector<vector<int> > &FabberRunData::GetSecondNeighbours(int n_dims)
         }
     }
 
+    NeighboursCalculated(n_dims);
     return m_neighbours2;
 }
 
@@ -9,6 +9,7 @@
 #pragma once
 
 #include "easylog.h"
+#include "perf.h"
 
 #include <newmat.h>
 
@@ -90,11 +91,13 @@ std::ostream &operator<<(std::ostream &out, const OptionSpec &value);
 enum VoxelDataType
 {
     VDT_SCALAR,
-    VDT_MVN
+    VDT_MVN,
+    /** MVN data to be written in the compact binary format if saved to a file */
+    VDT_MVN_COMPACT
 };
 
 /**
- * Functor which is be called to monitor progress.
+ * Functor which is be called to monitor and control a run.
  *
  * The default does nothing.
  */
@@ -107,6 +110,43 @@ public:
     virtual void Progress(int voxel, int nVoxels)
     {
     }
+
+    /**
+     * Return true to stop the run
+     *
+     * This is checked at voxel and iteration boundaries. When it returns true
+     * the run is abandoned by throwing FabberRunCancelled and no output is saved.
+     * Note that this may be called from within the inference loop so should be cheap.
+     */
+    virtual bool Cancelled()
+    {
+        return false;
+    }
+
+    /**
+     * @return Number of voxels in each block passed to PartialResults, or 0 if
+     *         partial results are not required
+     */
+    virtual int PartialResultsInterval()
+    {
+        return 0;
+    }
+
+    /**
+     * Receive intermediate results for a block of voxels
+     *
+     * Voxelwise methods call this as each block of voxels is completed. Methods which
+     * update all voxels together, such as spatial VB, call this after each iteration with
+     * the current estimates for every voxel.
+     *
+     * @param first_voxel Index of the first voxel in the block, starting at 1
+     * @param means Parameter means, one column per voxel in the block
+     * @param variances Parameter variances, one column per voxel in the block
+     */
+    virtual void PartialResults(
+        int first_voxel, const NEWMAT::Matrix &means, const NEWMAT::Matrix &variances)
+    {
+    }
 };
 
 /**
@@ -167,6 +207,10 @@ private:
     void (*m_cb)(int, int);
 };
 
+class FwdModel;
+class InferenceTechnique;
+class MVNDist;
+
 /**
  * Encapsulates all the input and output data associated with a fabber run
  *
@@ -204,9 +248,40 @@ public:
 
     /**
      * Run fabber
+     *
+     * If a session has been started using StartSession, the forward model and
+     * inference method from the session are reused.
      */
     void Run(ProgressCheck *check = 0);
 
+    /**
+     * Start a session for running inference repeatedly with the same options
+     *
+     * The forward model and inference method are created and initialized from
+     * the current options. Subsequent calls to Run reuse them, so only the voxel
+     * data should change between runs. Neighbour lists are also reused provided
+     * the voxel co-ordinates do not change.
+     *
+     * The logger must remain valid until EndSession is called.
+     */
+    void StartSession();
+
+    /**
+     * End a session started with StartSession, freeing the model and method
+     *
+     * Must be called if options are changed. Does nothing if no session
+     * is active.
+     */
+    void EndSession();
+
+    /**
+     * @return true if a session has been started and not ended
+     */
+    bool InSession() const
+    {
+        return m_session_model.get() != NULL;
+    }
+
     /**
      * Parse command line arguments into run data
      *
@@ -235,6 +310,11 @@ public:
      */
     void ParseParamFile(const std::string &file);
 
+    /**
+     * Parse options from a stream in the same format as ParseParamFile
+     */
+    void ParseParams(std::istream &is);
+
     /**
      * Set string option.
      *
@@ -263,6 +343,13 @@ public:
      */
     void Unset(const std::string &key);
 
+    /**
+     * Replace all options with those of another run
+     *
+     * Voxel data, co-ordinates and the extent are not copied
+     */
+    void CopyOptions(const FabberRunData &from);
+
     /**
      * Set boolean option.
      *
@@ -392,9 +479,19 @@ public:
      *
      * If 'output' is not set, "." is returned so output is written
      * to the working directory.
+     *
+     * For one part of a split run (--part), the name from
+     * GetPartOutputName is used instead of 'output'
      */
     std::string GetOutputDir();
 
+    /**
+     * Get the name of the output directory for one part of a split run
+     *
+     * @param part Part number, starting at 1
+     */
+    std::string GetPartOutputName(int part) const;
+
     /**
      * Save the specified voxel data
      *
@@ -413,6 +510,15 @@ public:
     virtual void SaveVoxelData(
         const std::string &filename, NEWMAT::Matrix &coords, VoxelDataType data_type = VDT_SCALAR);
 
+    /**
+     * Save per-voxel MVN distributions in the compact binary format, written
+     * straight from the distributions rather than converted to voxel data first
+     *
+     * @return false if this run data does not save to files, in which case the
+     *         MVNs should be saved using SaveVoxelData with VDT_MVN_COMPACT
+     */
+    virtual bool SaveCompactMVN(const std::string &filename, const std::vector<MVNDist *> &mvns);
+
     /**
      * Get the voxel co-ordinates
      *
@@ -450,6 +556,14 @@ public:
      */
     const NEWMAT::Matrix &GetVoxelData(const std::string &key);
 
+    /**
+     * Resolve a voxel data key in the same way as GetVoxelData
+     *
+     * @param key Name identifying the voxel data required.
+     * @return the key which will be passed to LoadVoxelData, e.g. a filename
+     */
+    std::string GetVoxelDataKey(const std::string &key) const;
+
     /**
      * Get named voxel data, with no further resolution of the name.
      *
@@ -458,6 +572,20 @@ public:
      */
     virtual const NEWMAT::Matrix &LoadVoxelData(const std::string &key);
 
+    /**
+     * Get named voxel data for some of the voxels, with no further resolution
+     * of the name
+     *
+     * The default selects the voxels from LoadVoxelData. Subclasses which load
+     * files may instead read only the part of the file containing the voxels,
+     * so the data for every voxel is never held in memory. The result is not
+     * kept by this object.
+     *
+     * @param voxels Voxels to include, indexed from 1, in increasing order
+     */
+    virtual NEWMAT::ReturnMatrix LoadVoxelDataSubset(
+        const std::string &key, const std::vector<int> &voxels);
+
     /**
      * Get the number of data values associated with each voxel for the named data
      *
@@ -550,6 +678,20 @@ public:
      */
     void SetVoxelCoords(const NEWMAT::Matrix &coords);
 
+    /**
+     * Set the voxel co-ordinates from a mask
+     *
+     * The co-ordinates are generated directly from the masked voxels without
+     * creating any full-extent intermediate data. The voxel offsets are retained
+     * and used by GetNeighbours. The extent must have been set using SetExtent.
+     *
+     * @param mask Array of size nx*ny*nz in column-major order (x varies fastest).
+     *             Voxels are included where the mask value is non-zero. If NULL,
+     *             all voxels are included.
+     */
+    template <class T>
+    void SetVoxelCoordsFromMask(const T *mask);
+
     /**
      * Get list of nearest neighbours for each voxel
      *
@@ -589,6 +731,45 @@ public:
             m_progress->Progress(voxel, nVoxels);
     }
 
+    /**
+     * Stop the run if the user-supplied progress checker has requested it
+     *
+     * InferenceMethods call this at voxel and iteration boundaries
+     *
+     * @throw FabberRunCancelled if the run has been cancelled
+     */
+    void CheckCancelled();
+
+    /**
+     * @return Number of voxels per block of partial results, or 0 if not required
+     */
+    int PartialResultsInterval()
+    {
+        return m_progress ? m_progress->PartialResultsInterval() : 0;
+    }
+
+    /**
+     * Pass intermediate results to the user-supplied progress checker
+     *
+     * @see ProgressCheck::PartialResults
+     */
+    void PartialResults(int first_voxel, const NEWMAT::Matrix &means, const NEWMAT::Matrix &variances)
+    {
+        if (m_progress)
+            m_progress->PartialResults(first_voxel, means, variances);
+    }
+
+    /**
+     * Get the timing and counter collector for this run
+     *
+     * Collection starts at the beginning of Run if --perf-summary or
+     * --save-perf-trace was given, and the collector is reset at the end of
+     * the run. Loading data before Run is not included.
+     *
+     * @return Collector, which will not be enabled if instrumentation was not requested
+     */
+    fabber::PerfStats *GetPerfStats();
+
     /**
      * Send list of all parameters to the logfile
      */
@@ -622,7 +803,40 @@ protected:
     void AddKeyEqualsValue(const std::string &key, bool trim_comments = false);
     void CheckAllOptionsUsed() const;
     const NEWMAT::Matrix &GetMainVoxelDataMultiple();
+
+    /**
+     * Set the level of the logger from --log-level, or --debug
+     */
+    void SetLogLevel();
+
+    /**
+     * Release cached voxel data which is no longer required
+     *
+     * This is called once source data has been copied elsewhere, e.g. when
+     * combining multiple data sets. Subclasses which can reload the data on
+     * demand (e.g. from a file) may free the memory. The default does nothing
+     * since data supplied by SetVoxelData cannot be recovered.
+     *
+     * @param key Resolved data key, as passed to LoadVoxelData
+     */
+    virtual void ReleaseVoxelData(const std::string &key)
+    {
+    }
+
+    /**
+     * Called when the neighbour lists have been calculated
+     *
+     * Both m_neighbours and m_neighbours2 are valid for the given number of
+     * spatial dimensions. Subclasses may store them for later runs. The default
+     * does nothing.
+     */
+    virtual void NeighboursCalculated(int n_dims)
+    {
+    }
     void CheckSize(std::string key, const NEWMAT::Matrix &mat);
+    void SetVoxelCoordsFromOffsets(const std::vector<int> &offsets);
+    void CreateModelAndMethod(boost::shared_ptr<FwdModel> &fwd_model,
+        boost::shared_ptr<InferenceTechnique> &infer);
 
     std::map<std::string, NEWMAT::Matrix> m_voxel_data;
     std::vector<int> m_extent;
@@ -631,6 +845,9 @@ protected:
     /** Optional progress checker, could be NULL - not owned and will not be freed */
     ProgressCheck *m_progress;
 
+    /** Timings and counters for the current run */
+    fabber::PerfStats m_perf;
+
     /**
      * Empty matrix
      *
@@ -658,15 +875,31 @@ protected:
      */
     mutable std::set<std::string> m_used_params;
 
+    /**
+     * Offset of each voxel into the extent, if known from SetVoxelCoordsFromMask.
+     * Otherwise empty and calculated from the co-ordinates in GetNeighbours()
+     */
+    std::vector<int> m_voxel_offsets;
+
     /** Nearest neighbour lists, calculated lazily in GetNeighbours() */
     std::vector<std::vector<int> > m_neighbours;
 
     /** Second nearest neighbour lists, calculated lazily in GetSecondNeighbours() */
     std::vector<std::vector<int> > m_neighbours2;
 
+    /** Number of spatial dimensions m_neighbours and m_neighbours2 were found for */
+    int m_neighbours_dims;
+    int m_neighbours2_dims;
+
     std::string m_outdir;
 
     EasyLog m_default_log;
+
+    /** Forward model for the current session, if any */
+    boost::shared_ptr<FwdModel> m_session_model;
+
+    /** Inference method for the current session, if any */
+    boost::shared_ptr<InferenceTechnique> m_session_method;
 };
 
 /**
@@ -703,6 +936,18 @@ public:
     }
 };
 
+/**
+ * Thrown when a run is stopped because the caller cancelled it
+ */
+class FabberRunCancelled : public FabberError
+{
+public:
+    FabberRunCancelled()
+        : FabberError("Run cancelled")
+    {
+    }
+};
+
 /**
  * Thrown for errors that are directly caused
  * by invalid user input
@@ -768,6 +1013,36 @@ template <typename T> inline T convertTo(const std::string &s, const std::string
     return x;
 }
 
+template <class T> void FabberRunData::SetVoxelCoordsFromMask(const T *mask)
+{
+    if (m_extent.size() != 3)
+    {
+        throw FabberInternalError("SetVoxelCoordsFromMask: Extent has not been set");
+    }
+    const int nv = m_extent[0] * m_extent[1] * m_extent[2];
+
+    // Count first so the offset list is allocated once at its final size
+    int nmasked = nv;
+    if (mask)
+    {
+        nmasked = 0;
+        for (int i = 0; i < nv; i++)
+        {
+            if (mask[i] != 0)
+                nmasked++;
+        }
+    }
+
+    std::vector<int> offsets;
+    offsets.reserve(nmasked);
+    for (int i = 0; i < nv; i++)
+    {
+        if (!mask || (mask[i] != 0))
+            offsets.push_back(i);
+    }
+    SetVoxelCoordsFromOffsets(offsets);
+}
+
 #ifdef DEPRECATED
 typedef class FabberRunData ArgsType;
 typedef class FabberRunData EasyOptions;
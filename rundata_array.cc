@@ -11,9 +11,11 @@
 
 #include "easylog.h"
 #include "rundata.h"
+#include "tools.h"
 
 #include "newmat.h"
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -27,107 +29,211 @@ void FabberRunDataArray::SetExtent(int nx, int ny, int nz, const int *mask)
     assert(nz > 0);
     assert(mask);
 
-    FabberRunData::SetExtent(nx, ny, nz);
-
     int nv = nx * ny * nz;
+    vector<int> new_mask;
     if (mask)
     {
-        m_mask.insert(m_mask.end(), mask, mask + nv);
+        new_mask.assign(mask, mask + nv);
     }
     else
     {
-        m_mask.resize(nv, 1);
+        new_mask.assign(nv, 1);
     }
 
-    int *maskPtr = &m_mask[0];
-    int v = 0;
-    Matrix coords(3, nv);
-    for (int z = 0; z < nz; z++)
+    // If the extent and mask are unchanged keep the existing co-ordinates so that
+    // neighbour lists do not need to be recalculated, e.g. in a session
+    if ((m_extent.size() == 3) && (m_extent[0] == nx) && (m_extent[1] == ny)
+        && (m_extent[2] == nz) && (new_mask == m_mask) && (m_voxel_data.count("coords") > 0)
+        && (m_voxel_data["coords"].Ncols() == (int)m_voxel_offsets.size()))
     {
-        for (int y = 0; y < ny; y++)
-        {
-            for (int x = 0; x < nx; x++)
-            {
-                bool masked = (*maskPtr == 0);
-                if (!masked)
-                {
-                    coords(1, v + 1) = x;
-                    coords(2, v + 1) = y;
-                    coords(3, v + 1) = z;
-                    ++v;
-                }
-                ++maskPtr;
-            }
-        }
+        LOG << "FabberRunDataArray::Extent and mask unchanged" << endl;
+        return;
     }
 
-    coords = coords.Columns(1, v);
-    SetVoxelCoords(coords);
+    FabberRunData::SetExtent(nx, ny, nz);
+    m_mask.swap(new_mask);
+    SetVoxelCoordsFromMask(&m_mask[0]);
 }
 
 void FabberRunDataArray::GetVoxelDataArray(string key, float *data)
 {
     assert(data);
-    Matrix mdata = FabberRunData::GetVoxelData(key);
-    int nt = mdata.Nrows();
-    float *dataPtr = data;
+    const Matrix &mdata = FabberRunData::GetVoxelData(key);
+    int num_voxels = m_extent[0] * m_extent[1] * m_extent[2];
+    CopyToBuffer(mdata, data, num_voxels * mdata.Nrows(), false);
+}
+
+void FabberRunDataArray::SetVoxelDataArray(string key, int data_size, const float *data)
+{
+    assert(data);
+    Matrix matrixData;
+    CopyFromBuffer(data, data_size, false, matrixData);
+    FabberRunData::SetVoxelData(key, matrixData);
+}
+
+void FabberRunDataArray::SetVoxelDataBuffer(
+    string key, int data_size, const float *data, bool masked)
+{
+    assert(data);
+    if (data_size <= 0)
+    {
+        throw InvalidOptionValue("Data size for " + key, stringify(data_size), "Must be > 0");
+    }
+
+    // Any data previously loaded for this key is now out of date
+    m_voxel_data.erase(key);
+    InputBuffer buf = { data_size, data, masked };
+    m_input_buffers[key] = buf;
+}
+
+void FabberRunDataArray::SetOutputBuffer(string key, int buf_size, float *data, bool masked)
+{
+    assert(data);
+    OutputBuffer buf = { buf_size, data, masked };
+    m_output_buffers[key] = buf;
+}
+
+const Matrix &FabberRunDataArray::LoadVoxelData(const string &key)
+{
+    if (m_voxel_data.find(key) == m_voxel_data.end())
+    {
+        map<string, InputBuffer>::const_iterator buf = m_input_buffers.find(key);
+        if (buf != m_input_buffers.end())
+        {
+            fabber::ScopedTimer timer(GetPerfStats(), "LoadVoxelData", key);
+            LOG << "FabberRunDataArray::Reading data from buffer '" << key << "'" << endl;
+            CopyFromBuffer(
+                buf->second.data, buf->second.data_size, buf->second.masked, m_voxel_data[key]);
+        }
+    }
+    return FabberRunData::LoadVoxelData(key);
+}
+
+void FabberRunDataArray::ReleaseVoxelData(const string &key)
+{
+    // Data read from an external buffer can be read again if required
+    if (m_input_buffers.count(key) > 0)
+    {
+        m_voxel_data.erase(key);
+    }
+}
+
+void FabberRunDataArray::SaveVoxelData(
+    const string &filename, Matrix &data, VoxelDataType data_type)
+{
+    map<string, OutputBuffer>::const_iterator buf = m_output_buffers.find(filename);
+    if (buf != m_output_buffers.end())
+    {
+        fabber::ScopedTimer timer(GetPerfStats(), "SaveVoxelData", filename);
+        LOG << "FabberRunDataArray::Saving to buffer: " << filename << endl;
+        CopyToBuffer(data, buf->second.data, buf->second.buf_size, buf->second.masked);
+    }
+    else
+    {
+        FabberRunData::SaveVoxelData(filename, data, data_type);
+    }
+}
 
-    for (int t = 0; t < nt; t++)
+void FabberRunDataArray::ClearVoxelData(string key)
+{
+    FabberRunData::ClearVoxelData(key);
+    if (key != "")
+    {
+        m_input_buffers.erase(key);
+        m_output_buffers.erase(key);
+    }
+    else
+    {
+        m_input_buffers.clear();
+        m_output_buffers.clear();
+    }
+}
+
+const vector<int> &FabberRunDataArray::GetMaskOffsets()
+{
+    // Offsets are generated from the mask in SetExtent
+    map<string, Matrix>::const_iterator coords = m_voxel_data.find("coords");
+    if ((coords == m_voxel_data.end()) || (coords->second.Ncols() != (int)m_voxel_offsets.size()))
+    {
+        throw FabberInternalError("FabberRunDataArray: SetExtent must be called before setting data");
+    }
+    return m_voxel_offsets;
+}
+
+void FabberRunDataArray::CopyFromBuffer(
+    const float *data, int data_size, bool masked, Matrix &mat)
+{
+    const vector<int> &offsets = GetMaskOffsets();
+    const int nv = offsets.size();
+    mat.ReSize(data_size, nv);
+
+    fabber::MatrixLayout layout(mat);
+    Real *out = mat.Store();
+    if (masked)
+    {
+        for (int v = 0; v < nv; v++)
+        {
+            for (int t = 0; t < data_size; t++)
+            {
+                out[layout.Index(t + 1, v + 1)] = *data++;
+            }
+        }
+    }
+    else
     {
-        int v = 0;
-        const int *maskPtr = &m_mask[0];
-        for (int z = 0; z < m_extent[2]; z++)
+        const int num_voxels = m_extent[0] * m_extent[1] * m_extent[2];
+        for (int t = 0; t < data_size; t++)
         {
-            for (int y = 0; y < m_extent[1]; y++)
+            const float *vol = data + t * num_voxels;
+            for (int v = 0; v < nv; v++)
             {
-                for (int x = 0; x < m_extent[0]; x++)
-                {
-                    bool masked = (*maskPtr == 0);
-                    if (!masked)
-                        *dataPtr = mdata(t + 1, v + 1);
-                    else
-                        *dataPtr = 0;
-                    ++dataPtr;
-                    ++maskPtr;
-                    if (!masked)
-                        ++v;
-                }
+                out[layout.Index(t + 1, v + 1)] = vol[offsets[v]];
             }
         }
     }
 }
 
-void FabberRunDataArray::SetVoxelDataArray(string key, int data_size, const float *data)
+void FabberRunDataArray::CopyToBuffer(const Matrix &mat, float *data, int buf_size, bool masked)
 {
-    assert(data);
-    const float *dataPtr = data;
-    int num_voxels = m_extent[0] * m_extent[1] * m_extent[2];
-    Matrix matrixData(data_size, num_voxels);
+    const vector<int> &offsets = GetMaskOffsets();
+    const int nv = offsets.size();
+    const int data_size = mat.Nrows();
+    if (mat.Ncols() != nv)
+    {
+        throw FabberInternalError("FabberRunDataArray: Output data has "
+            + stringify(mat.Ncols()) + " voxels, expected " + stringify(nv));
+    }
 
-    int v = 0;
-    for (int t = 0; t < data_size; t++)
+    const int num_voxels = m_extent[0] * m_extent[1] * m_extent[2];
+    int required = data_size * (masked ? nv : num_voxels);
+    if (buf_size < required)
     {
-        v = 0;
-        const int *maskPtr = &m_mask[0];
-        for (int z = 0; z < m_extent[2]; z++)
+        throw FabberRunDataError("Output buffer too small - size " + stringify(buf_size)
+            + " but data requires " + stringify(required));
+    }
+
+    fabber::MatrixLayout layout(mat);
+    const Real *in = mat.Store();
+    if (masked)
+    {
+        for (int v = 0; v < nv; v++)
         {
-            for (int y = 0; y < m_extent[1]; y++)
+            for (int t = 0; t < data_size; t++)
             {
-                for (int x = 0; x < m_extent[0]; x++)
-                {
-                    bool masked = (*maskPtr == 0);
-                    if (!masked)
-                    {
-                        matrixData(t + 1, v + 1) = *dataPtr;
-                    }
-                    ++dataPtr;
-                    ++maskPtr;
-                    if (!masked)
-                        ++v;
-                }
+                *data++ = in[layout.Index(t + 1, v + 1)];
+            }
+        }
+    }
+    else
+    {
+        std::fill(data, data + required, 0.0f);
+        for (int t = 0; t < data_size; t++)
+        {
+            float *vol = data + t * num_voxels;
+            for (int v = 0; v < nv; v++)
+            {
+                vol[offsets[v]] = in[layout.Index(t + 1, v + 1)];
             }
         }
     }
-    matrixData = matrixData.Columns(1, v);
-    FabberRunData::SetVoxelData(key, matrixData);
 }
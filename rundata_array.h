@@ -11,6 +11,7 @@
 
 #include "rundata.h"
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -33,6 +34,70 @@ public:
     void GetVoxelDataArray(std::string key, float *data);
     void SetVoxelDataArray(std::string key, int data_size, const float *data);
 
+    /**
+     * Register an externally owned input buffer
+     *
+     * The buffer is not copied here. It is read in place when the data is first
+     * required, so it must remain valid until the run has completed.
+     *
+     * @param key Data key, e.g. 'data'
+     * @param data_size Number of values for each voxel, e.g. number of timepoints
+     * @param data If masked is false, a full volume of size nx*ny*nz*data_size in
+     *             column-major order. If masked is true, an array of size
+     *             nvoxels*data_size containing only the voxels in the mask, in
+     *             voxel-major order (i.e. all values for the first masked voxel,
+     *             then all values for the second, etc)
+     * @param masked Whether the data contains masked voxels only
+     */
+    void SetVoxelDataBuffer(std::string key, int data_size, const float *data, bool masked);
+
+    /**
+     * Register an externally owned output buffer
+     *
+     * When output data with this key is saved it will be written directly to
+     * the buffer instead of being stored internally, so it cannot subsequently
+     * be retrieved using GetVoxelData. The buffer must remain valid until the
+     * run has completed.
+     *
+     * @param key Output data key, e.g. 'mean_c0'
+     * @param buf_size Size of the buffer in floats. An error occurs on save if
+     *                 this is too small for the output data
+     * @param data Output buffer, in the same layout as for SetVoxelDataBuffer.
+     *             Unmasked voxels in a full volume are set to zero.
+     * @param masked Whether the buffer should contain masked voxels only
+     */
+    void SetOutputBuffer(std::string key, int buf_size, float *data, bool masked);
+
+    virtual const NEWMAT::Matrix &LoadVoxelData(const std::string &key);
+    virtual void SaveVoxelData(
+        const std::string &filename, NEWMAT::Matrix &data, VoxelDataType data_type = VDT_SCALAR);
+    virtual void ClearVoxelData(std::string key = "");
+
+protected:
+    virtual void ReleaseVoxelData(const std::string &key);
+
 private:
+    /** Externally owned input buffer */
+    struct InputBuffer
+    {
+        int data_size;
+        const float *data;
+        bool masked;
+    };
+
+    /** Externally owned output buffer */
+    struct OutputBuffer
+    {
+        int buf_size;
+        float *data;
+        bool masked;
+    };
+
+    const std::vector<int> &GetMaskOffsets();
+    void CopyFromBuffer(const float *data, int data_size, bool masked, NEWMAT::Matrix &mat);
+    void CopyToBuffer(const NEWMAT::Matrix &mat, float *data, int buf_size, bool masked);
+
     std::vector<int> m_mask;
+    std::map<std::string, InputBuffer> m_input_buffers;
+    std::map<std::string, OutputBuffer> m_output_buffers;
 };
\ No newline at end of file
@@ -0,0 +1,123 @@
+/*  rundata_coarse.cc - Downsampled copy of run data for multiresolution fitting
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "rundata_coarse.h"
+
+#include "easylog.h"
+#include "rundata.h"
+#include "tools.h"
+
+#include "newmat.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace NEWMAT;
+
+FabberRunDataCoarse::FabberRunDataCoarse(FabberRunData &fine, int n_dims)
+    : FabberRunData(false)
+    , m_fine(fine)
+{
+    SetLogger(fine.GetLogger());
+    CopyOptions(fine);
+
+    vector<int> fine_extent;
+    vector<float> fine_dims;
+    fine.GetExtent(fine_extent, fine_dims);
+    const Matrix &fine_coords = fine.GetVoxelCoords();
+    int nfine = fine_coords.Ncols();
+
+    // Co-ordinates of the block containing each fine voxel
+    vector<int> block(3 * nfine);
+    int extent[3] = { 1, 1, 1 };
+    for (int v = 0; v < nfine; v++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            int c = int(fine_coords(d + 1, v + 1));
+            if (d < n_dims)
+                c /= 2;
+            block[3 * v + d] = c;
+            if (c + 1 > extent[d])
+                extent[d] = c + 1;
+        }
+    }
+
+    // Number the blocks in z, y, x order as required for voxel co-ordinates
+    map<int, int> offsets;
+    for (int v = 0; v < nfine; v++)
+    {
+        int offset = block[3 * v] + extent[0] * (block[3 * v + 1] + extent[1] * block[3 * v + 2]);
+        offsets[offset] = 0;
+    }
+    vector<int> coarse_offsets;
+    for (map<int, int>::iterator iter = offsets.begin(); iter != offsets.end(); ++iter)
+    {
+        coarse_offsets.push_back(iter->first);
+        iter->second = coarse_offsets.size();
+    }
+
+    m_coarse_voxel.resize(nfine);
+    m_block_size.assign(coarse_offsets.size(), 0);
+    for (int v = 0; v < nfine; v++)
+    {
+        int offset = block[3 * v] + extent[0] * (block[3 * v + 1] + extent[1] * block[3 * v + 2]);
+        m_coarse_voxel[v] = offsets[offset];
+        m_block_size[m_coarse_voxel[v] - 1]++;
+    }
+
+    float dims[3] = { 1, 1, 1 };
+    for (int d = 0; d < 3 && d < int(fine_dims.size()); d++)
+    {
+        dims[d] = (d < n_dims) ? fine_dims[d] * 2 : fine_dims[d];
+    }
+    SetExtent(extent[0], extent[1], extent[2], dims[0], dims[1], dims[2]);
+    SetVoxelCoordsFromOffsets(coarse_offsets);
+
+    LOG << "FabberRunDataCoarse::" << nfine << " voxels downsampled to "
+        << coarse_offsets.size() << endl;
+}
+
+const Matrix &FabberRunDataCoarse::LoadVoxelData(const string &key)
+{
+    map<string, Matrix>::iterator iter = m_voxel_data.find(key);
+    if (iter != m_voxel_data.end())
+    {
+        return iter->second;
+    }
+
+    // Throws DataNotFound if the fine run does not have it either
+    const Matrix &data = m_fine.LoadVoxelData(key);
+    int nfine = m_coarse_voxel.size();
+    if (data.Ncols() != nfine)
+    {
+        throw InvalidOptionValue("Voxels in " + key, stringify(data.Ncols()),
+            "Incorrect size - should contain " + stringify(nfine));
+    }
+
+    int ncoarse = m_block_size.size();
+    Matrix coarse(data.Nrows(), ncoarse);
+    coarse = 0;
+    fabber::MatrixLayout src_layout(data), dest_layout(coarse);
+    const Real *src = data.Store();
+    Real *dest = coarse.Store();
+    for (int r = 1; r <= data.Nrows(); r++)
+    {
+        for (int v = 0; v < nfine; v++)
+        {
+            dest[dest_layout.Index(r, m_coarse_voxel[v])] += src[src_layout.Index(r, v + 1)];
+        }
+        for (int c = 0; c < ncoarse; c++)
+        {
+            dest[dest_layout.Index(r, c + 1)] /= m_block_size[c];
+        }
+    }
+
+    SetVoxelData(key, coarse);
+    return m_voxel_data[key];
+}
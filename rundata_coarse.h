@@ -0,0 +1,57 @@
+/*  rundata_coarse.h - Downsampled copy of run data for multiresolution fitting
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#pragma once
+
+#include "rundata.h"
+
+#include "newmat.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * Run data for a lower resolution copy of another run
+ *
+ * Each coarse voxel covers a 2x2x2 block of the fine grid (2x2 in-plane
+ * with 2 spatial dimensions) and its data is the mean of the fine voxels in
+ * the block which are in the mask. Voxel data is averaged from the fine run
+ * when it is first requested, so the main data, supplementary data and any
+ * image priors are all available at the coarse level. The options are
+ * copied from the fine run.
+ */
+class FabberRunDataCoarse : public FabberRunData
+{
+public:
+    /**
+     * @param fine Run data to downsample. Must remain valid for the
+     *             lifetime of this object
+     * @param n_dims Number of spatial dimensions to downsample in (1-3)
+     */
+    FabberRunDataCoarse(FabberRunData &fine, int n_dims);
+
+    /**
+     * Get the coarse voxel containing each fine voxel
+     *
+     * @return Vector indexed by fine voxel (from 0) of coarse voxel
+     *         indices starting at 1
+     */
+    const std::vector<int> &GetCoarseVoxels() const
+    {
+        return m_coarse_voxel;
+    }
+
+    virtual const NEWMAT::Matrix &LoadVoxelData(const std::string &key);
+
+private:
+    FabberRunData &m_fine;
+
+    /** Coarse voxel for each fine voxel, starting at 1 */
+    std::vector<int> m_coarse_voxel;
+
+    /** Number of fine voxels in each coarse voxel */
+    std::vector<int> m_block_size;
+};
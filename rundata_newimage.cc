@@ -9,6 +9,8 @@
 
 #include "rundata_newimage.h"
 
+#include "data_cache.h"
+#include "dist_mvn.h"
 #include "easylog.h"
 #include "rundata.h"
 
@@ -16,6 +18,8 @@
 #include <newimage/newimageio.h>
 #include <newmat.h>
 
+#include <algorithm>
+#include <fstream>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -49,14 +53,138 @@ FabberRunDataNewimage::FabberRunDataNewimage(bool compat_options)
     : FabberRunData(compat_options)
     , m_mask(1, 1, 1)
     , m_have_mask(false)
+    , m_saved_voxel_list(false)
+    , m_split_part(false)
+    , m_part_z0(0)
+    , m_part_z1(-1)
+    , m_started_manifest(false)
+    , m_data_cache_dims(0)
 {
 }
 
+// Name of the file in each part's output directory listing the outputs it saved
+static const string PART_MANIFEST = "split_outputs.txt";
+
+// Largest image dimension which can be stored in a NIFTI-1 header
+static const int NIFTI_MAX_DIM = 32767;
+
+/**
+ * Get the image size used to save a list of voxels
+ *
+ * @param nvoxels Number of voxels in the list
+ * @param extent Returns the x, y and z size. The voxels fill x first, then y, then z
+ */
+static void GetVoxelListExtent(int nvoxels, int extent[3])
+{
+    extent[0] = std::max(1, std::min(nvoxels, NIFTI_MAX_DIM));
+    extent[1] = std::max(1, std::min((nvoxels + extent[0] - 1) / extent[0], NIFTI_MAX_DIM));
+    extent[2] = std::max(1, (nvoxels + extent[0] * extent[1] - 1) / (extent[0] * extent[1]));
+    if (extent[2] > NIFTI_MAX_DIM)
+    {
+        throw FabberRunDataError("Too many voxels to save as a voxel list: " + stringify(nvoxels));
+    }
+}
+
+/**
+ * Read a list of voxels saved by SetVoxelListOutput into a matrix with one column per voxel
+ *
+ * @param vol Voxel list image
+ * @param nvoxels Number of voxels in the list, or -1 to find it from the
+ *                unused positions in a co-ordinates image, which are -1
+ */
+static Matrix ReadVoxelList(const volume4D<float> &vol, int nvoxels = -1)
+{
+    int npositions = vol.xsize() * vol.ysize() * vol.zsize();
+    if (nvoxels < 0)
+    {
+        for (nvoxels = 0; nvoxels < npositions; nvoxels++)
+        {
+            int v = nvoxels;
+            if (vol(v % vol.xsize(), (v / vol.xsize()) % vol.ysize(),
+                    v / (vol.xsize() * vol.ysize()), 0)
+                < 0)
+                break;
+        }
+    }
+    if (nvoxels > npositions)
+    {
+        throw FabberRunDataError("Voxel list image is too small");
+    }
+
+    Matrix data(vol.tsize(), nvoxels);
+    for (int v = 0; v < nvoxels; v++)
+    {
+        for (int t = 0; t < vol.tsize(); t++)
+        {
+            data(t + 1, v + 1) = vol(v % vol.xsize(), (v / vol.xsize()) % vol.ysize(),
+                v / (vol.xsize() * vol.ysize()), t);
+        }
+    }
+    return data;
+}
+
+/**
+ * Find the first voxel of each part of a split run
+ *
+ * Parts are contiguous ranges of voxels in mask order, chosen so that
+ * each has an equal share of the total weight
+ *
+ * @param weights Weight of each voxel
+ * @param nparts Number of parts
+ * @return Index of the first voxel in each part, plus the number of voxels
+ */
+static vector<int> GetPartBoundaries(const vector<double> &weights, int nparts)
+{
+    int nvoxels = weights.size();
+    double total = 0;
+    for (int v = 0; v < nvoxels; v++)
+    {
+        total += weights[v];
+    }
+
+    vector<int> starts(nparts + 1, nvoxels);
+    starts[0] = 0;
+    if (total <= 0)
+    {
+        // No cost information, so balance by number of voxels
+        for (int p = 1; p < nparts; p++)
+        {
+            starts[p] = int((long long)nvoxels * p / nparts);
+        }
+        return starts;
+    }
+
+    double cumulative = 0;
+    int p = 1;
+    for (int v = 0; v < nvoxels && p < nparts; v++)
+    {
+        while (p < nparts && cumulative >= total * p / nparts)
+        {
+            starts[p++] = v;
+        }
+        cumulative += weights[v];
+    }
+
+    // Every part must have at least one voxel
+    for (p = 1; p < nparts; p++)
+    {
+        starts[p] = std::max(starts[p], starts[p - 1] + 1);
+    }
+    for (p = nparts - 1; p > 0; p--)
+    {
+        starts[p] = std::min(starts[p], starts[p + 1] - 1);
+    }
+    return starts;
+}
+
 void FabberRunDataNewimage::SetExtentFromData()
 {
     string mask_fname = GetStringDefault("mask", "");
     m_have_mask = (mask_fname != "");
 
+    // Reference volume used to initialize the mask if there is none and we
+    // load data from the cache
+    volume<float> main_vol;
     if (m_have_mask)
     {
         LOG << "FabberRunDataNewimage::Loading mask data from '" + mask_fname << "'" << endl;
@@ -66,8 +194,8 @@ void FabberRunDataNewimage::SetExtentFromData()
         }
         read_volume(m_mask, mask_fname);
         m_mask.binarise(1e-16, m_mask.max() + 1, exclusive);
-        DumpVolumeInfo(m_mask, LOG);
-        SetCoordsFromExtent(m_mask.xsize(), m_mask.ysize(), m_mask.zsize());
+        if (EasyLog::Enabled(m_log, EasyLog::LEVEL_INFO))
+            DumpVolumeInfo(m_mask, LOG_STREAM);
     }
     else
     {
@@ -75,13 +203,251 @@ void FabberRunDataNewimage::SetExtentFromData()
         // have a mask, and that the reference volume is initialized
         LOG << "FabberRunDataNewimage::No mask, using data for extent" << endl;
         string data_fname = GetStringDefault("data", GetStringDefault("data1", ""));
+        int compact_voxels = MVNDist::GetCompactFileVoxels(data_fname);
+        if (compact_voxels >= 0)
+        {
+            // Compact MVN files have no image geometry, so without a mask the
+            // voxels are treated as a single row in file order
+            if (compact_voxels > NIFTI_MAX_DIM)
+            {
+                throw InvalidOptionValue("mask", "",
+                    "Required for compact MVN files with more than " + stringify(NIFTI_MAX_DIM)
+                        + " voxels");
+            }
+            LOG << "FabberRunDataNewimage::No mask, using " << compact_voxels
+                << " voxels from compact MVN file" << endl;
+            SetCoordsFromExtent(compact_voxels, 1, 1);
+            return;
+        }
         if (!fsl_imageexists(data_fname))
         {
             throw DataNotFound(data_fname, "File is invalid or does not exist");
         }
-        volume<float> main_vol;
-        read_volume(main_vol, data_fname);
-        SetCoordsFromExtent(main_vol.xsize(), main_vol.ysize(), main_vol.zsize());
+
+        // Only the geometry is needed here. The data is read when it is first
+        // used, which it may not be if it comes from the data cache
+        read_volume_hdr_only(main_vol, data_fname);
+    }
+
+    // Split runs and merging need a mask to select voxels, so create one from the
+    // data as we would do when loading it
+    bool merge = GetBool("merge");
+    m_split_part = HaveKey("part");
+    if ((m_split_part || merge) && !m_have_mask)
+    {
+        SetUnitMask(main_vol);
+    }
+    if (m_split_part)
+    {
+        SelectSplitPart();
+    }
+
+    const volume<float> &ref_vol = m_have_mask ? m_mask : main_vol;
+    string cache_dir = GetStringDefault("data-cache", "");
+    if (cache_dir == "")
+    {
+        SetCoordsFromExtent(ref_vol.xsize(), ref_vol.ysize(), ref_vol.zsize());
+    }
+    else
+    {
+        SetExtentFromCache(cache_dir, ref_vol);
+    }
+}
+
+void FabberRunDataNewimage::SetUnitMask(const volume<float> &ref_vol)
+{
+    // The reference volume may only have been read from the header, so copy
+    // its geometry rather than its data
+    m_mask.reinitialize(ref_vol.xsize(), ref_vol.ysize(), ref_vol.zsize());
+    m_mask.copyproperties(ref_vol);
+    m_mask = 1;
+    m_have_mask = true;
+}
+
+void FabberRunDataNewimage::SelectSplitPart()
+{
+    int nparts = GetInt("split", 1);
+    int part = GetInt("part", 1, nparts);
+    if (GetStringDefault("save-mvn-format", "nifti") != "nifti")
+    {
+        throw InvalidOptionValue("save-mvn-format", GetString("save-mvn-format"),
+            "Only nifti format can be merged after a split run");
+    }
+
+    // Parts are always saved as voxel lists so they are compact and can be merged
+    string sparse = GetStringDefault("sparse-output", "voxellist");
+    if (sparse != "voxellist")
+    {
+        WARN_ONCE_TEXT("Ignoring --sparse-output=" + sparse
+            + " for part of a split run. Set it for the merge instead");
+    }
+    Set("sparse-output", "voxellist");
+
+    // Weight voxels by the cost map if given, otherwise equally
+    string cost_fname = GetStringDefault("split-cost", "");
+    volume<float> cost;
+    if (cost_fname != "")
+    {
+        if (!fsl_imageexists(cost_fname))
+        {
+            throw DataNotFound(cost_fname, "File is invalid or does not exist");
+        }
+        read_volume(cost, cost_fname);
+        if (!samesize(cost, m_mask))
+        {
+            throw InvalidOptionValue("split-cost", cost_fname, "Must be the same size as the mask");
+        }
+    }
+
+    // Voxels are in the same order as the co-ordinates, with x varying fastest
+    vector<double> weights;
+    for (int z = 0; z < m_mask.zsize(); z++)
+    {
+        for (int y = 0; y < m_mask.ysize(); y++)
+        {
+            for (int x = 0; x < m_mask.xsize(); x++)
+            {
+                if (m_mask(x, y, z) > 0)
+                {
+                    weights.push_back((cost_fname == "") ? 1 : std::max(cost(x, y, z), 0.0f));
+                }
+            }
+        }
+    }
+    int nvoxels = weights.size();
+    if (nparts > nvoxels)
+    {
+        throw InvalidOptionValue("split", stringify(nparts),
+            "More parts than voxels in the mask (" + stringify(nvoxels) + ")");
+    }
+
+    vector<int> starts = GetPartBoundaries(weights, nparts);
+    int start = starts[part - 1];
+    int end = starts[part];
+    LOG << "FabberRunDataNewimage::Part " << part << " of " << nparts << " contains voxels "
+        << start + 1 << "-" << end << " of " << nvoxels << endl;
+
+    // Remove the other parts' voxels from the mask and find the slices which
+    // contain this part
+    m_part_z0 = m_mask.zsize();
+    m_part_z1 = -1;
+    int v = 0;
+    for (int z = 0; z < m_mask.zsize(); z++)
+    {
+        for (int y = 0; y < m_mask.ysize(); y++)
+        {
+            for (int x = 0; x < m_mask.xsize(); x++)
+            {
+                if (m_mask(x, y, z) > 0)
+                {
+                    if (v < start || v >= end)
+                    {
+                        m_mask(x, y, z) = 0;
+                    }
+                    else
+                    {
+                        m_part_z0 = std::min(m_part_z0, z);
+                        m_part_z1 = std::max(m_part_z1, z);
+                    }
+                    v++;
+                }
+            }
+        }
+    }
+
+    // The part's voxels are contiguous in z, so selecting them from these
+    // slices gives them in the same order as from the whole volume
+    m_part_mask.reinitialize(m_mask.xsize(), m_mask.ysize(), m_part_z1 - m_part_z0 + 1);
+    for (int z = m_part_z0; z <= m_part_z1; z++)
+    {
+        for (int y = 0; y < m_mask.ysize(); y++)
+        {
+            for (int x = 0; x < m_mask.xsize(); x++)
+            {
+                m_part_mask(x, y, z - m_part_z0) = m_mask(x, y, z);
+            }
+        }
+    }
+    LOG << "FabberRunDataNewimage::Part is in slices " << m_part_z0 << "-" << m_part_z1 << endl;
+}
+
+void FabberRunDataNewimage::SetExtentFromCache(const string &cache_dir, const volume<float> &ref_vol)
+{
+    // Key is the content of all input files plus options affecting preprocessing
+    m_data_cache.reset(new DataCache(cache_dir, m_log));
+    DataCache &cache = *m_data_cache;
+    cache.AddFile(GetStringDefault("mask", ""));
+    if (GetStringDefault("data", "") != "")
+    {
+        cache.AddFile(GetVoxelDataKey("data"));
+    }
+    for (int n = 1; HaveKey("data" + stringify(n)); n++)
+    {
+        cache.AddFile(GetVoxelDataKey("data" + stringify(n)));
+    }
+    if (GetStringDefault("suppdata", "") != "")
+    {
+        cache.AddFile(GetVoxelDataKey("suppdata"));
+    }
+    cache.AddOption("data-order", GetStringDefault("data-order", "interleave"));
+    if (m_split_part)
+    {
+        cache.AddFile(GetStringDefault("split-cost", ""));
+        cache.AddOption("split", GetString("split"));
+        cache.AddOption("part", GetString("part"));
+    }
+    string spatial_dims = GetStringDefault("spatial-dims", "3");
+    cache.AddOption("spatial-dims", spatial_dims);
+    m_data_cache_dims = convertTo<int>(spatial_dims, "spatial-dims");
+
+    // Main data and suppdata are stored under their resolved keys so that
+    // GetMainVoxelData and GetVoxelSuppData return them without loading files.
+    // Where multiple data sets are combined, the resolved key will be 'data'
+    Matrix coords;
+    vector<vector<int> > neighbours, neighbours2;
+    string data_key = GetVoxelDataKey("data");
+    string supp_key = GetVoxelDataKey("suppdata");
+    if (cache.Load(coords, m_voxel_data[data_key], m_voxel_data[supp_key], neighbours,
+            neighbours2))
+    {
+        FabberRunData::SetExtent(ref_vol.xsize(), ref_vol.ysize(), ref_vol.zsize());
+        SetVoxelCoords(coords);
+        if (neighbours.size() > 0)
+        {
+            m_neighbours.swap(neighbours);
+            m_neighbours2.swap(neighbours2);
+            m_neighbours_dims = m_data_cache_dims;
+            m_neighbours2_dims = m_data_cache_dims;
+            m_data_cache.reset();
+        }
+        if (m_voxel_data[supp_key].Nrows() == 0)
+        {
+            m_voxel_data.erase(supp_key);
+        }
+        if (!m_have_mask)
+        {
+            // Set the reference volume as we would do when loading the data
+            SetUnitMask(ref_vol);
+        }
+        return;
+    }
+
+    // Cache miss - do the preprocessing now and save the result. Neighbour
+    // lists are only needed by spatial priors so are added to the entry if
+    // and when they are calculated
+    m_voxel_data.erase(data_key);
+    m_voxel_data.erase(supp_key);
+    SetCoordsFromExtent(ref_vol.xsize(), ref_vol.ysize(), ref_vol.zsize());
+    cache.Save(GetVoxelCoords(), GetMainVoxelData(), GetVoxelSuppData(), neighbours, neighbours2);
+}
+
+void FabberRunDataNewimage::NeighboursCalculated(int n_dims)
+{
+    if (m_data_cache && n_dims == m_data_cache_dims)
+    {
+        m_data_cache->Save(
+            GetVoxelCoords(), GetMainVoxelData(), GetVoxelSuppData(), m_neighbours, m_neighbours2);
+        m_data_cache.reset();
     }
 }
 
@@ -96,11 +462,30 @@ const Matrix &FabberRunDataNewimage::LoadVoxelData(const std::string &filename)
             throw DataNotFound(filename, "File is invalid or does not exist");
         }
 
+        fabber::ScopedTimer timer(GetPerfStats(), "LoadVoxelData", filename);
         LOG << "FabberRunDataNewimage::Loading data from '" + filename << "'" << endl;
-        volume4D<float> vol;
+        volume4D<float> vol, hdr;
+        if (m_split_part)
+        {
+            read_volume4D_hdr_only(hdr, filename);
+            if (hdr.xsize() != m_mask.xsize() || hdr.ysize() != m_mask.ysize()
+                || hdr.zsize() != m_mask.zsize())
+            {
+                throw DataNotFound(filename, "Dimensions do not match the mask");
+            }
+        }
         try
         {
-            read_volume4D(vol, filename);
+            if (m_split_part)
+            {
+                // Only read the slices containing this part of a split run
+                read_volume4DROI(vol, filename, 0, 0, m_part_z0, 0, hdr.xsize() - 1,
+                    hdr.ysize() - 1, m_part_z1, hdr.tsize() - 1);
+            }
+            else
+            {
+                read_volume4D(vol, filename);
+            }
             if (!m_have_mask)
             {
                 // We need a mask volume so that when we save we can make sure
@@ -114,11 +499,17 @@ const Matrix &FabberRunDataNewimage::LoadVoxelData(const std::string &filename)
         {
             throw DataNotFound(filename, "Error loading file");
         }
-        DumpVolumeInfo4D(vol, LOG);
+        if (EasyLog::Enabled(m_log, EasyLog::LEVEL_INFO))
+            DumpVolumeInfo4D(vol, LOG_STREAM);
 
         try
         {
-            if (m_have_mask)
+            if (m_split_part)
+            {
+                LOG << "FabberRunDataNewimage::Applying mask to slices of split part..." << endl;
+                m_voxel_data[filename] = vol.matrix(m_part_mask);
+            }
+            else if (m_have_mask)
             {
                 LOG << "FabberRunDataNewimage::Applying mask to data..." << endl;
                 m_voxel_data[filename] = vol.matrix(m_mask);
@@ -127,10 +518,11 @@ const Matrix &FabberRunDataNewimage::LoadVoxelData(const std::string &filename)
             {
                 m_voxel_data[filename] = vol.matrix();
             }
+            m_file_data.insert(filename);
         }
         catch (exception &e)
         {
-            LOG << "NEWMAT error while applying mask... Most likely a dimension mismatch. ***\n";
+            LOG_WARN << "NEWMAT error while applying mask... Most likely a dimension mismatch. ***\n";
             throw;
         }
     }
@@ -138,9 +530,88 @@ const Matrix &FabberRunDataNewimage::LoadVoxelData(const std::string &filename)
     return m_voxel_data[filename];
 }
 
+ReturnMatrix FabberRunDataNewimage::LoadVoxelDataSubset(
+    const std::string &filename, const vector<int> &voxels)
+{
+    // Data already in memory, e.g. from the data cache, is selected from directly.
+    // Split parts already read only their own slices
+    if (m_voxel_data.find(filename) != m_voxel_data.end() || m_split_part || voxels.empty()
+        || !fsl_imageexists(filename))
+    {
+        return FabberRunData::LoadVoxelDataSubset(filename, voxels);
+    }
+
+    fabber::ScopedTimer timer(GetPerfStats(), "LoadVoxelData", filename);
+    volume4D<float> vol, hdr;
+    read_volume4D_hdr_only(hdr, filename);
+    if (!m_have_mask)
+    {
+        // The mask is normally created from the first data loaded, and gives
+        // the geometry of the output files
+        volume<float> ref_vol;
+        read_volume_hdr_only(ref_vol, filename);
+        SetUnitMask(ref_vol);
+    }
+    if (hdr.xsize() != m_mask.xsize() || hdr.ysize() != m_mask.ysize()
+        || hdr.zsize() != m_mask.zsize())
+    {
+        throw DataNotFound(filename, "Dimensions do not match the mask");
+    }
+
+    // Voxels are ordered by z, so the subset is selected in the same order
+    // from a mask of just the slices which contain it
+    const Matrix &coords = GetVoxelCoords();
+    int z0 = int(coords(3, voxels.front()));
+    int z1 = int(coords(3, voxels.back()));
+    volume<float> subset_mask(m_mask.xsize(), m_mask.ysize(), z1 - z0 + 1);
+    subset_mask = 0;
+    for (unsigned int v = 0; v < voxels.size(); v++)
+    {
+        subset_mask(int(coords(1, voxels[v])), int(coords(2, voxels[v])),
+            int(coords(3, voxels[v])) - z0)
+            = 1;
+    }
+
+    LOG << "FabberRunDataNewimage::Loading slices " << z0 << "-" << z1 << " from '" << filename
+        << "'" << endl;
+    try
+    {
+        read_volume4DROI(vol, filename, 0, 0, z0, 0, hdr.xsize() - 1, hdr.ysize() - 1, z1,
+            hdr.tsize() - 1);
+    }
+    catch (...)
+    {
+        throw DataNotFound(filename, "Error loading file");
+    }
+    Matrix data = vol.matrix(subset_mask);
+    if (data.Ncols() != int(voxels.size()))
+    {
+        throw FabberInternalError("FabberRunDataNewimage::LoadVoxelDataSubset - Voxels "
+                                  "are not in the mask");
+    }
+    return data;
+}
+
+void FabberRunDataNewimage::ReleaseVoxelData(const std::string &key)
+{
+    if (m_file_data.count(key) > 0)
+    {
+        LOG << "FabberRunDataNewimage::Releasing data loaded from '" << key << "'" << endl;
+        m_voxel_data.erase(key);
+        m_file_data.erase(key);
+    }
+}
+
 void FabberRunDataNewimage::SaveVoxelData(
     const std::string &filename, NEWMAT::Matrix &data, VoxelDataType data_type)
 {
+    fabber::ScopedTimer timer(GetPerfStats(), "SaveVoxelData", filename);
+    if (data_type == VDT_MVN_COMPACT)
+    {
+        SaveCompactMVN(filename, data);
+        return;
+    }
+
     LOG << "FabberRunDataNewimage::Saving to nifti: " << filename << endl;
     int nifti_intent_code;
     switch (data_type)
@@ -152,20 +623,201 @@ void FabberRunDataNewimage::SaveVoxelData(
         nifti_intent_code = NIFTI_INTENT_NONE;
     }
 
-    int data_size = data.Nrows();
-    volume4D<float> output(m_extent[0], m_extent[1], m_extent[2], data_size);
-    if (m_have_mask)
+    // Sparse output avoids allocating and compressing the full image extent, which
+    // dominates the time taken to save small ROIs in high resolution images
+    string sparse = GetStringDefault("sparse-output", "");
+    volume4D<float> output;
+    if (sparse == "")
+    {
+        output.reinitialize(m_extent[0], m_extent[1], m_extent[2], data.Nrows());
+        if (m_have_mask)
+        {
+            output.setmatrix(data, m_mask);
+        }
+        else
+        {
+            output.setmatrix(data);
+        }
+    }
+    else if (sparse == "bbox")
     {
-        output.setmatrix(data, m_mask);
+        SetBoundingBoxOutput(output, data);
+    }
+    else if (sparse == "voxellist")
+    {
+        SetVoxelListOutput(output, data);
     }
     else
     {
-        output.setmatrix(data);
+        throw InvalidOptionValue("sparse-output", sparse, "Must be bbox or voxellist");
     }
 
     output.set_intent(nifti_intent_code, 0, 0, 0);
     output.setDisplayMaximumMinimum(output.max(), output.min());
+    SaveVolume(output, filename);
+    if (m_split_part)
+    {
+        AddToPartManifest(filename, data_type);
+    }
+}
+
+string FabberRunDataNewimage::GetCompactMVNPath(const string &filename)
+{
+    string filepath = filename;
+    if ((filepath.size() < 5) || (filepath.substr(filepath.size() - 5) != ".mvnc"))
+        filepath += ".mvnc";
+    if (filepath[0] != '/')
+        filepath = GetOutputDir() + "/" + filepath;
+    return filepath;
+}
+
+void FabberRunDataNewimage::SaveCompactMVN(const string &filename, const Matrix &data)
+{
+    string filepath = GetCompactMVNPath(filename);
+    LOG << "FabberRunDataNewimage::Saving compact MVN: " << filepath << endl;
+    MVNDist::SaveCompact(data, filepath, GetBool("mvn-diag-only"), GetBool("mvn-half"));
+}
+
+bool FabberRunDataNewimage::SaveCompactMVN(const string &filename, const vector<MVNDist *> &mvns)
+{
+    fabber::ScopedTimer timer(GetPerfStats(), "SaveVoxelData", filename);
+    string filepath = GetCompactMVNPath(filename);
+    LOG << "FabberRunDataNewimage::Saving compact MVN: " << filepath << endl;
+    MVNDist::SaveCompact(mvns, filepath, GetBool("mvn-diag-only"), GetBool("mvn-half"));
+    return true;
+}
+
+void FabberRunDataNewimage::AddToPartManifest(const string &filename, VoxelDataType data_type)
+{
+    if (filename[0] == '/')
+    {
+        WARN_ONCE_TEXT("Output saved to absolute path will not be merged: " + filename);
+        return;
+    }
+
+    // Start a new list on the first save in case the output directory is being reused
+    string path = GetOutputDir() + "/" + PART_MANIFEST;
+    ofstream manifest(path.c_str(), m_started_manifest ? ios::app : ios::trunc);
+    if (!manifest.good())
+    {
+        throw FabberRunDataError("Could not write list of outputs: " + path);
+    }
+    manifest << filename << " " << int(data_type) << endl;
+    m_started_manifest = true;
+}
+
+void FabberRunDataNewimage::MergeParts()
+{
+    int nparts = GetInt("split", 1);
+    if (HaveKey("part"))
+    {
+        throw InvalidOptionValue("part", GetString("part"), "Cannot be given with --merge");
+    }
+
+    // Column of each masked voxel, found by its offset in the volume
+    const Matrix &coords = GetVoxelCoords();
+    int nvoxels = coords.Ncols();
+    vector<int> offsets(nvoxels);
+    for (int v = 0; v < nvoxels; v++)
+    {
+        offsets[v] = int(coords(1, v + 1))
+            + m_extent[0] * (int(coords(2, v + 1)) + m_extent[1] * int(coords(3, v + 1)));
+    }
+
+    // Map each part's voxels to columns of the full output
+    vector<vector<int> > part_cols(nparts);
+    vector<bool> covered(nvoxels, false);
+    int ncovered = 0;
+    for (int p = 0; p < nparts; p++)
+    {
+        string part_dir = GetPartOutputName(p + 1);
+        string coords_fname = part_dir + "/voxel_coords";
+        if (!fsl_imageexists(coords_fname))
+        {
+            throw DataNotFound(coords_fname, "Part output not found - has this part finished?");
+        }
+        volume4D<float> part_coords_vol;
+        read_volume4D(part_coords_vol, coords_fname);
+        Matrix part_coords = ReadVoxelList(part_coords_vol);
+        for (int v = 1; v <= part_coords.Ncols(); v++)
+        {
+            int offset = int(part_coords(1, v))
+                + m_extent[0] * (int(part_coords(2, v)) + m_extent[1] * int(part_coords(3, v)));
+            vector<int>::iterator iter = std::lower_bound(offsets.begin(), offsets.end(), offset);
+            if (iter == offsets.end() || *iter != offset || covered[iter - offsets.begin()])
+            {
+                throw FabberRunDataError("Voxels in " + coords_fname
+                    + " do not match the mask. Check --mask and --split are the same as for "
+                      "the parts");
+            }
+            part_cols[p].push_back(iter - offsets.begin());
+            covered[iter - offsets.begin()] = true;
+            ncovered++;
+        }
+    }
+    if (ncovered != nvoxels)
+    {
+        throw FabberRunDataError("Parts contain " + stringify(ncovered) + " voxels but the mask has "
+            + stringify(nvoxels) + ". Check --mask and --split are the same as for the parts");
+    }
+
+    // Every part saves the same outputs, so take the list from the first
+    string manifest_fname = GetPartOutputName(1) + "/" + PART_MANIFEST;
+    ifstream manifest(manifest_fname.c_str());
+    if (!manifest.good())
+    {
+        throw DataNotFound(manifest_fname, "Part output not found - has this part finished?");
+    }
+    string name;
+    int data_type;
+    while (manifest >> name >> data_type)
+    {
+        LOG << "FabberRunDataNewimage::Merging " << name << endl;
+        Matrix merged;
+        for (int p = 0; p < nparts; p++)
+        {
+            string fname = GetPartOutputName(p + 1) + "/" + name;
+            if (!fsl_imageexists(fname))
+            {
+                throw DataNotFound(fname, "Part output not found - has this part finished?");
+            }
+            volume4D<float> part_vol;
+            read_volume4D(part_vol, fname);
+            int npart = part_cols[p].size();
+            if (part_vol.xsize() * part_vol.ysize() * part_vol.zsize() < npart)
+            {
+                throw FabberRunDataError("Size of " + fname + " does not match the other parts");
+            }
+            Matrix part_data = ReadVoxelList(part_vol, npart);
+            if (p == 0)
+            {
+                merged.ReSize(part_data.Nrows(), nvoxels);
+                merged = 0;
+            }
+            if (part_data.Nrows() != merged.Nrows())
+            {
+                throw FabberRunDataError("Size of " + fname + " does not match the other parts");
+            }
+            for (int v = 0; v < npart; v++)
+            {
+                merged.Column(part_cols[p][v] + 1) = part_data.Column(v + 1);
+            }
+        }
+        SaveVoxelData(name, merged, VoxelDataType(data_type));
+    }
 
+    // Parameter names are the same for every part
+    ifstream param_names((GetPartOutputName(1) + "/paramnames.txt").c_str());
+    if (param_names.good())
+    {
+        ofstream out((GetOutputDir() + "/paramnames.txt").c_str());
+        out << param_names.rdbuf();
+    }
+    LOG << "FabberRunDataNewimage::Merged " << nparts << " parts" << endl;
+}
+
+void FabberRunDataNewimage::SaveVolume(const volume4D<float> &output, const string &filename)
+{
     if (filename[0] == '/')
     {
         // Absolute path
@@ -179,32 +831,109 @@ void FabberRunDataNewimage::SaveVoxelData(
     }
 }
 
-void FabberRunDataNewimage::SetCoordsFromExtent(int nx, int ny, int nz)
+void FabberRunDataNewimage::SetBoundingBoxOutput(volume4D<float> &output, const Matrix &data)
 {
-    LOG << "FabberRunDataNewimage::Setting coordinates from extent" << endl;
+    // Find the bounding box of the voxels we are saving
+    const Matrix &coords = GetVoxelCoords();
+    int nvoxels = coords.Ncols();
+    int lower[3] = { 0, 0, 0 };
+    int upper[3] = { -1, -1, -1 };
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            int c = int(coords(d + 1, v));
+            if (v == 1 || c < lower[d])
+                lower[d] = c;
+            if (v == 1 || c > upper[d])
+                upper[d] = c;
+        }
+    }
+    LOG << "FabberRunDataNewimage::Saving bounding box (" << lower[0] << ", " << lower[1] << ", "
+        << lower[2] << ") - (" << upper[0] << ", " << upper[1] << ", " << upper[2] << ")"
+        << endl;
 
-    FabberRunData::SetExtent(nx, ny, nz);
+    // Copy geometry from the reference volume, then shift the origin so the
+    // cropped volume remains aligned with the original in world co-ordinates
+    output.reinitialize(
+        upper[0] - lower[0] + 1, upper[1] - lower[1] + 1, upper[2] - lower[2] + 1, data.Nrows());
+    output.copyproperties(m_mask);
+    Matrix shift = IdentityMatrix(4);
+    for (int d = 0; d < 3; d++)
+    {
+        shift(d + 1, 4) = lower[d];
+    }
+    output.set_sform(m_mask.sform_code(), m_mask.sform_mat() * shift);
+    output.set_qform(m_mask.qform_code(), m_mask.qform_mat() * shift);
 
-    volume4D<float> coordvol(nx, ny, nz, 3);
-    for (int i = 0; i < nx; i++)
+    output = 0;
+    for (int v = 1; v <= nvoxels; v++)
     {
-        for (int j = 0; j < ny; j++)
+        int x = int(coords(1, v)) - lower[0];
+        int y = int(coords(2, v)) - lower[1];
+        int z = int(coords(3, v)) - lower[2];
+        for (int t = 0; t < data.Nrows(); t++)
         {
-            for (int k = 0; k < nz; k++)
+            output(x, y, z, t) = data(t + 1, v);
+        }
+    }
+}
+
+void FabberRunDataNewimage::SetVoxelListOutput(volume4D<float> &output, const Matrix &data)
+{
+    // Voxels are written in the same order as the voxel co-ordinates, filling x first
+    // and moving on to y and z only where needed to keep within the NIFTI limit on the
+    // size of each dimension. The co-ordinates are saved once, alongside the first
+    // output, so that the full image can be reconstructed later. Unused positions at
+    // the end have co-ordinates of -1
+    const Matrix &coords = GetVoxelCoords();
+    int nvoxels = coords.Ncols();
+    int extent[3];
+    GetVoxelListExtent(nvoxels, extent);
+    if (!m_saved_voxel_list)
+    {
+        volume4D<float> coordvol(extent[0], extent[1], extent[2], 3);
+        coordvol = -1;
+        for (int v = 1; v <= nvoxels; v++)
+        {
+            for (int d = 0; d < 3; d++)
             {
-                ColumnVector vcoord(3);
-                vcoord << i << j << k;
-                coordvol.setvoxelts(vcoord, i, j, k);
+                coordvol((v - 1) % extent[0], ((v - 1) / extent[0]) % extent[1],
+                    (v - 1) / (extent[0] * extent[1]), d)
+                    = coords(d + 1, v);
             }
         }
+        SaveVolume(coordvol, "voxel_coords");
+        m_saved_voxel_list = true;
+    }
+
+    output.reinitialize(extent[0], extent[1], extent[2], data.Nrows());
+    output = 0;
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        for (int t = 0; t < data.Nrows(); t++)
+        {
+            output((v - 1) % extent[0], ((v - 1) / extent[0]) % extent[1],
+                (v - 1) / (extent[0] * extent[1]), t)
+                = data(t + 1, v);
+        }
     }
+}
+
+void FabberRunDataNewimage::SetCoordsFromExtent(int nx, int ny, int nz)
+{
+    LOG << "FabberRunDataNewimage::Setting coordinates from extent" << endl;
+
+    FabberRunData::SetExtent(nx, ny, nz);
 
+    // Mask volume is stored contiguously with x varying fastest and has been
+    // binarised, so co-ordinates can be generated from it directly
     if (m_have_mask)
     {
-        SetVoxelCoords(coordvol.matrix(m_mask));
+        SetVoxelCoordsFromMask(&(*m_mask.fbegin()));
     }
     else
     {
-        SetVoxelCoords(coordvol.matrix());
+        SetVoxelCoordsFromMask((const float *)NULL);
     }
 }
@@ -20,8 +20,13 @@
 #include "newimage/newimage.h"
 #include "newmat.h"
 
+#include <boost/shared_ptr.hpp>
+
+#include <set>
 #include <string>
 
+class DataCache;
+
 /**
  * Run data which uses NEWIMAGE to load NIFTII files
  */
@@ -31,14 +36,68 @@ public:
     FabberRunDataNewimage(bool compat_options = true);
 
     void SetExtentFromData();
+
+    /**
+     * Combine the outputs of the parts of a split run
+     *
+     * Reads the outputs saved by each of the --split parts and saves them
+     * for the full mask, as a single run would have done. The extent must
+     * have been set with SetExtentFromData using the same mask as the parts.
+     */
+    void MergeParts();
+
     const NEWMAT::Matrix &LoadVoxelData(const std::string &filename);
+    virtual NEWMAT::ReturnMatrix LoadVoxelDataSubset(
+        const std::string &filename, const std::vector<int> &voxels);
     virtual void SaveVoxelData(
         const std::string &filename, NEWMAT::Matrix &data, VoxelDataType data_type = VDT_SCALAR);
+    virtual bool SaveCompactMVN(const std::string &filename, const std::vector<MVNDist *> &mvns);
+
+protected:
+    virtual void ReleaseVoxelData(const std::string &key);
+    virtual void NeighboursCalculated(int n_dims);
 
 private:
     void SetCoordsFromExtent(int nx, int ny, int nz);
+    void SetUnitMask(const NEWIMAGE::volume<float> &ref_vol);
+    void SelectSplitPart();
+    void SaveCompactMVN(const std::string &filename, const NEWMAT::Matrix &data);
+    std::string GetCompactMVNPath(const std::string &filename);
+    void AddToPartManifest(const std::string &filename, VoxelDataType data_type);
+    void SetExtentFromCache(const std::string &cache_dir, const NEWIMAGE::volume<float> &ref_vol);
+    void SaveVolume(const NEWIMAGE::volume4D<float> &output, const std::string &filename);
+    void SetBoundingBoxOutput(NEWIMAGE::volume4D<float> &output, const NEWMAT::Matrix &data);
+    void SetVoxelListOutput(NEWIMAGE::volume4D<float> &output, const NEWMAT::Matrix &data);
+
     NEWIMAGE::volume<float> m_mask;
     bool m_have_mask;
+
+    /** True once the voxel co-ordinates have been saved for sparse voxel list output */
+    bool m_saved_voxel_list;
+
+    /** Keys of voxel data which were loaded from files and so can be reloaded on demand */
+    std::set<std::string> m_file_data;
+
+    /** True if this is one part of a split run */
+    bool m_split_part;
+
+    /**
+     * For one part of a split run, the slices containing its voxels and the
+     * mask for these slices. Only these slices are read from data files
+     */
+    int m_part_z0, m_part_z1;
+    NEWIMAGE::volume<float> m_part_mask;
+
+    /** True once the list of outputs saved by a split part has been started */
+    bool m_started_manifest;
+
+    /**
+     * Data cache entry which was saved without neighbour lists, if any, and
+     * the number of spatial dimensions its key was created for. The neighbour
+     * lists are added to the entry if they are calculated later
+     */
+    boost::shared_ptr<DataCache> m_data_cache;
+    int m_data_cache_dims;
 };
 
 #endif /* NO_NEWIMAGE */
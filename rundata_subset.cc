@@ -0,0 +1,60 @@
+/*  rundata_subset.cc - Run data for a subset of the voxels of another run
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "rundata_subset.h"
+
+#include "easylog.h"
+#include "rundata.h"
+
+#include "newmat.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace NEWMAT;
+
+FabberRunDataSubset::FabberRunDataSubset(FabberRunData &full, const vector<int> &voxels)
+    : FabberRunData(false)
+    , m_full(full)
+    , m_voxels(voxels)
+{
+    SetLogger(full.GetLogger());
+    CopyOptions(full);
+
+    vector<int> extent;
+    vector<float> dims;
+    full.GetExtent(extent, dims);
+    if (extent.size() == 3)
+    {
+        SetExtent(extent[0], extent[1], extent[2], dims[0], dims[1], dims[2]);
+    }
+
+    // Co-ordinates are copied directly since they have already been resolved
+    const Matrix &coords = full.GetVoxelCoords();
+    Matrix subset_coords(3, m_voxels.size());
+    for (unsigned int v = 0; v < m_voxels.size(); v++)
+    {
+        subset_coords.Column(v + 1) = coords.Column(m_voxels[v]);
+    }
+    SetVoxelCoords(subset_coords);
+}
+
+const Matrix &FabberRunDataSubset::LoadVoxelData(const string &key)
+{
+    map<string, Matrix>::iterator iter = m_voxel_data.find(key);
+    if (iter != m_voxel_data.end())
+    {
+        return iter->second;
+    }
+
+    // Throws DataNotFound if the full run does not have it either. The full
+    // run may load only the part of a file containing our voxels
+    Matrix subset = m_full.LoadVoxelDataSubset(key, m_voxels);
+    SetVoxelData(key, subset);
+    return m_voxel_data[key];
+}
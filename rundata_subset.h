@@ -0,0 +1,43 @@
+/*  rundata_subset.h - Run data for a subset of the voxels of another run
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#pragma once
+
+#include "rundata.h"
+
+#include "newmat.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * Run data for a subset of the voxels of another run
+ *
+ * This is used for one part of a domain-decomposed run. Voxel data is
+ * obtained from the full run using LoadVoxelDataSubset when it is first
+ * requested, so run data which loads files only reads the part containing
+ * the subset. The options are copied from the full run. Neighbour lists are calculated from the
+ * co-ordinates of the subset, so voxels at the edge of the subset may have
+ * fewer neighbours than in the full run.
+ */
+class FabberRunDataSubset : public FabberRunData
+{
+public:
+    /**
+     * @param full Run data for all voxels. Must remain valid for the
+     *             lifetime of this object
+     * @param voxels Voxels to include, indexed from 1, in increasing order
+     */
+    FabberRunDataSubset(FabberRunData &full, const std::vector<int> &voxels);
+
+    virtual const NEWMAT::Matrix &LoadVoxelData(const std::string &key);
+
+private:
+    FabberRunData &m_full;
+
+    /** Voxels of the full run, from 1 */
+    std::vector<int> m_voxels;
+};
@@ -55,6 +55,7 @@ void FabberSetup::SetupDefaultConvergenceDetectors()
     factory->Add("freduce", &FreduceConvergenceDetector::NewInstance);
     factory->Add("trialmode", &TrialModeConvergenceDetector::NewInstance);
     factory->Add("lm", &LMConvergenceDetector::NewInstance);
+    factory->Add("accel", &AcceleratedConvergenceDetector::NewInstance);
 }
 
 void FabberSetup::SetupDefaults()
@@ -70,4 +71,5 @@ void FabberSetup::Destroy()
     FwdModelFactory::Destroy();
     NoiseModelFactory::Destroy();
     InferenceTechniqueFactory::Destroy();
+    ConvergenceDetectorFactory::Destroy();
 }
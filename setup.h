@@ -44,6 +44,9 @@ public:
     static void SetupDefaultConvergenceDetectors();
     /**
      * Destroy all singleton factory instances.
+     *
+     * This is only intended for use at process shutdown. It must not be
+     * called while any run is in progress on another thread.
      */
     static void Destroy();
 };
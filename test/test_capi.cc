@@ -0,0 +1,203 @@
+// Tests of the C API
+
+#include "gtest/gtest.h"
+
+#include "fabber_capi.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#ifndef _WIN32
+namespace
+{
+const int NX = 5;
+const int NY = 4;
+const int NZ = 3;
+const int NTIMES = 10;
+const int NVOXELS = NX * NY * NZ;
+
+/**
+ * A handle and the results of using it on a thread
+ */
+struct Job
+{
+    Job()
+        : fab(NULL)
+        , ret(0)
+    {
+        err[0] = '\0';
+    }
+
+    void *fab;
+    int ret;
+    char err[FABBER_ERR_MAXC + 1];
+    vector<float> data;
+    vector<float> params;
+    vector<float> output;
+};
+
+void *NewPolyHandle(const vector<float> &data)
+{
+    char err[FABBER_ERR_MAXC + 1];
+    void *fab = fabber_new(err);
+    fabber_set_extent(fab, NX, NY, NZ, NULL, err);
+    fabber_set_opt(fab, "model", "poly", err);
+    fabber_set_opt(fab, "degree", "2", err);
+    fabber_set_opt(fab, "method", "vb", err);
+    fabber_set_opt(fab, "noise", "white", err);
+    fabber_set_opt(fab, "save-mean", "", err);
+    fabber_set_data(fab, "data", NTIMES, &data[0], err);
+    return fab;
+}
+
+vector<float> PolyData(int seed)
+{
+    vector<float> data(NVOXELS * NTIMES);
+    for (int t = 0; t < NTIMES; t++)
+    {
+        for (int v = 0; v < NVOXELS; v++)
+        {
+            data[t * NVOXELS + v] = 1 + (v % 7 + seed) * (t + 1) + 0.1 * (t + 1) * (t + 1);
+        }
+    }
+    return data;
+}
+
+void *RunJob(void *arg)
+{
+    Job &job = *static_cast<Job *>(arg);
+    vector<char> log(10000);
+    job.ret = fabber_dorun(job.fab, log.size(), &log[0], job.err, NULL);
+    if (job.ret == 0)
+    {
+        job.output.resize(NVOXELS);
+        job.ret = fabber_get_data(job.fab, "mean_c1", &job.output[0], job.err);
+    }
+    return NULL;
+}
+
+void *EvaluateJob(void *arg)
+{
+    Job &job = *static_cast<Job *>(arg);
+    int nrows = job.params.size() / 3;
+    job.output.resize(nrows * NTIMES);
+    job.ret = fabber_model_evaluate_batch(
+        job.fab, nrows, 3, &job.params[0], NTIMES, NULL, "", &job.output[0], job.err);
+    return NULL;
+}
+
+void RunThreads(vector<Job> &jobs, void *(*fn)(void *))
+{
+    vector<pthread_t> threads(jobs.size());
+    for (unsigned int j = 0; j < jobs.size(); j++)
+    {
+        ASSERT_EQ(0, pthread_create(&threads[j], NULL, fn, &jobs[j]));
+    }
+    for (unsigned int j = 0; j < jobs.size(); j++)
+    {
+        pthread_join(threads[j], NULL);
+    }
+}
+}
+
+// Test batch evaluation checks the number of parameters against the model
+TEST(CApiTest, EvaluateBatchParamCount)
+{
+    char err[FABBER_ERR_MAXC + 1];
+    vector<float> data = PolyData(0);
+    void *fab = NewPolyHandle(data);
+
+    vector<float> params(2 * 3), output(2 * NTIMES);
+    for (unsigned int i = 0; i < params.size(); i++)
+    {
+        params[i] = i + 1;
+    }
+    ASSERT_GT(0, fabber_model_evaluate_batch(
+                     fab, 3, 2, &params[0], NTIMES, NULL, "", &output[0], err));
+    ASSERT_TRUE(strstr(err, "parameters") != NULL);
+    ASSERT_GT(0, fabber_model_evaluate_batch(
+                     fab, 1, 4, &params[0], NTIMES, NULL, "", &output[0], err));
+
+    // Each row must match a single evaluation
+    ASSERT_EQ(0, fabber_model_evaluate_batch(
+                     fab, 2, 3, &params[0], NTIMES, NULL, "", &output[0], err));
+    vector<float> single(NTIMES);
+    for (int row = 0; row < 2; row++)
+    {
+        ASSERT_EQ(0, fabber_model_evaluate(fab, 3, &params[row * 3], NTIMES, NULL, &single[0], err));
+        for (int t = 0; t < NTIMES; t++)
+        {
+            ASSERT_FLOAT_EQ(single[t], output[row * NTIMES + t]);
+        }
+    }
+    fabber_destroy(fab);
+}
+
+// Test runs on separate handles in different threads give the same results
+// as running them one at a time
+TEST(CApiTest, ConcurrentHandles)
+{
+    vector<Job> serial(2), concurrent(2);
+    for (int j = 0; j < 2; j++)
+    {
+        serial[j].data = PolyData(j);
+        serial[j].fab = NewPolyHandle(serial[j].data);
+        RunJob(&serial[j]);
+        ASSERT_EQ(0, serial[j].ret) << serial[j].err;
+
+        concurrent[j].data = PolyData(j);
+        concurrent[j].fab = NewPolyHandle(concurrent[j].data);
+    }
+
+    RunThreads(concurrent, RunJob);
+    for (int j = 0; j < 2; j++)
+    {
+        ASSERT_EQ(0, concurrent[j].ret) << concurrent[j].err;
+        ASSERT_EQ(serial[j].output, concurrent[j].output);
+        fabber_destroy(serial[j].fab);
+        fabber_destroy(concurrent[j].fab);
+    }
+}
+
+// Test batch evaluations on separate handles in different threads
+TEST(CApiTest, ConcurrentEvaluateBatch)
+{
+    vector<Job> jobs(2);
+    for (int j = 0; j < 2; j++)
+    {
+        jobs[j].data = PolyData(j);
+        jobs[j].fab = NewPolyHandle(jobs[j].data);
+        for (int row = 0; row < 1000; row++)
+        {
+            jobs[j].params.push_back(row * 0.01 + j);
+            jobs[j].params.push_back(1 - row * 0.001);
+            jobs[j].params.push_back(0.5 * j);
+        }
+    }
+
+    RunThreads(jobs, EvaluateJob);
+    for (int j = 0; j < 2; j++)
+    {
+        ASSERT_EQ(0, jobs[j].ret) << jobs[j].err;
+
+        // Compare with evaluating each row on its own
+        char err[FABBER_ERR_MAXC + 1];
+        vector<float> single(NTIMES);
+        for (int row = 0; row < 1000; row += 99)
+        {
+            ASSERT_EQ(0, fabber_model_evaluate(
+                             jobs[j].fab, 3, &jobs[j].params[row * 3], NTIMES, NULL, &single[0], err));
+            for (int t = 0; t < NTIMES; t++)
+            {
+                ASSERT_FLOAT_EQ(single[t], jobs[j].output[row * NTIMES + t]);
+            }
+        }
+        fabber_destroy(jobs[j].fab);
+    }
+}
+#endif
@@ -2,11 +2,19 @@
 // Tests fabber when run from the command line
 
 #include "easylog.h"
+#include "fabber_server.h"
 #include "newimage/newimageall.h"
 #include "rundata.h"
 #include "setup.h"
 #include "gtest/gtest.h"
 
+#ifndef _WIN32
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 #define ALLOWED_DELTA 0.001
 
 namespace
@@ -29,6 +37,7 @@ protected:
 
     virtual void TearDown()
     {
+        stopServer();
         remove("testfabber.tmp");
         remove("out.tmp_latest");
         remove("uname.txt");
@@ -43,6 +52,55 @@ protected:
         return system(cmd.c_str());
     }
 
+#ifndef _WIN32
+    /**
+     * Start a server in the background and wait until it accepts connections
+     */
+    void startServer()
+    {
+        string cmd = string(FABBER_BUILD_DIR)
+            + "/fabber --serve --socket=fabbertest.sock >/dev/null 2>&1 & echo $! >fabberserver.pid";
+        ASSERT_EQ(0, system(cmd.c_str()));
+        for (int i = 0; i < 100; i++)
+        {
+            int fd = connectServer();
+            if (fd >= 0)
+            {
+                // An empty job fails as soon as it is run
+                shutdown(fd, SHUT_WR);
+                close(fd);
+                return;
+            }
+            usleep(100000);
+        }
+        FAIL() << "Server did not start";
+    }
+
+    void stopServer()
+    {
+        if (system("test -f fabberserver.pid && kill `cat fabberserver.pid`") == 0)
+        {
+            remove("fabberserver.pid");
+            remove("fabbertest.sock");
+        }
+    }
+
+    int connectServer()
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, "fabbertest.sock");
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+#endif
+
     string getStdout()
     {
         ifstream in("testfabber.tmp");
@@ -247,6 +305,182 @@ TEST_F(ClTestTest, OutputCopiesPropsNoMask)
     ASSERT_EQ(d1.xdim(), d2.xdim());
 }
 
+// Test output cropped to the bounding box of the mask
+TEST_F(ClTestTest, SparseOutputBbox)
+{
+    string args = "--model=poly --output=out.tmp  --degree=2 --method=vb --noise=white ";
+    args += " --mask=" + string(FABBER_SRC_DIR) + "/test/test_mask_small.nii.gz --data="
+        + string(FABBER_SRC_DIR) + "/test/test_data.nii.gz --overwrite";
+
+    // Full size output to compare with
+    ASSERT_EQ(0, runFabber(args));
+    NEWIMAGE::volume<float> full;
+    read_volume(full, "out.tmp/mean_c0.nii.gz");
+
+    ASSERT_EQ(0, runFabber(args + " --sparse-output=bbox"));
+
+    NEWIMAGE::volume<float> d1;
+    read_volume(d1, string(FABBER_SRC_DIR) + "/test/test_data.nii.gz");
+    NEWIMAGE::volume<float> d2;
+    read_volume(d2, "out.tmp/mean_c0.nii.gz");
+    ASSERT_LE(d2.xsize(), d1.xsize());
+    ASSERT_LE(d2.ysize(), d1.ysize());
+    ASSERT_LE(d2.zsize(), d1.zsize());
+    ASSERT_EQ(d1.xdim(), d2.xdim());
+
+    // The box starts at the lowest masked voxel in each dimension
+    NEWIMAGE::volume<float> mask;
+    read_volume(mask, string(FABBER_SRC_DIR) + "/test/test_mask_small.nii.gz");
+    int lower[3] = { mask.xsize(), mask.ysize(), mask.zsize() };
+    for (int x = 0; x < mask.xsize(); x++)
+        for (int y = 0; y < mask.ysize(); y++)
+            for (int z = 0; z < mask.zsize(); z++)
+                if (mask(x, y, z) > 0)
+                {
+                    lower[0] = std::min(lower[0], x);
+                    lower[1] = std::min(lower[1], y);
+                    lower[2] = std::min(lower[2], z);
+                }
+
+    // World co-ordinates of the box voxels must match the original image
+    NEWMAT::Matrix shift = NEWMAT::IdentityMatrix(4);
+    for (int d = 0; d < 3; d++)
+    {
+        shift(d + 1, 4) = lower[d];
+    }
+    NEWMAT::Matrix expected_sform = mask.sform_mat() * shift;
+    ASSERT_EQ(mask.sform_code(), d2.sform_code());
+    for (int r = 1; r <= 4; r++)
+    {
+        for (int c = 1; c <= 4; c++)
+        {
+            ASSERT_NEAR(expected_sform(r, c), d2.sform_mat()(r, c), 1e-4);
+        }
+    }
+
+    // Values must be the same as the full output at the same position
+    for (int x = 0; x < d2.xsize(); x++)
+        for (int y = 0; y < d2.ysize(); y++)
+            for (int z = 0; z < d2.zsize(); z++)
+            {
+                ASSERT_FLOAT_EQ(full(x + lower[0], y + lower[1], z + lower[2]), d2(x, y, z));
+            }
+}
+
+// Test output as a list of masked voxels
+TEST_F(ClTestTest, SparseOutputVoxelList)
+{
+    string args = "--model=poly --output=out.tmp  --degree=2 --method=vb --noise=white ";
+    args += " --mask=" + string(FABBER_SRC_DIR) + "/test/test_mask_small.nii.gz --data="
+        + string(FABBER_SRC_DIR) + "/test/test_data.nii.gz --sparse-output=voxellist";
+
+    ASSERT_EQ(0, runFabber(args));
+
+    NEWIMAGE::volume<float> mask;
+    read_volume(mask, string(FABBER_SRC_DIR) + "/test/test_mask_small.nii.gz");
+    int nvoxels = 0;
+    for (int x = 0; x < mask.xsize(); x++)
+        for (int y = 0; y < mask.ysize(); y++)
+            for (int z = 0; z < mask.zsize(); z++)
+                if (mask(x, y, z) > 0)
+                    nvoxels++;
+
+    NEWIMAGE::volume<float> mean;
+    read_volume(mean, "out.tmp/mean_c0.nii.gz");
+    ASSERT_EQ(nvoxels, mean.xsize());
+    ASSERT_EQ(1, mean.ysize());
+    ASSERT_EQ(1, mean.zsize());
+
+    NEWIMAGE::volume4D<float> coords;
+    read_volume4D(coords, "out.tmp/voxel_coords.nii.gz");
+    ASSERT_EQ(nvoxels, coords.xsize());
+    ASSERT_EQ(3, coords.tsize());
+}
+
+// Test a run split into parts and merged gives the same output as a single run
+TEST_F(ClTestTest, SplitMerge)
+{
+    string args = "--model=poly --output=out.tmp  --degree=2 --method=vb --noise=white ";
+    args += " --mask=" + string(FABBER_SRC_DIR) + "/test/test_mask_small.nii.gz --data="
+        + string(FABBER_SRC_DIR) + "/test/test_data.nii.gz --save-mean --save-std --save-mvn "
+                                   "--split=3 --overwrite";
+
+    for (int part = 1; part <= 3; part++)
+    {
+        ASSERT_EQ(0, runFabber(args + " --part=" + stringify(part)));
+    }
+    ASSERT_EQ(0, runFabber(args + " --merge"));
+    int ret = system("rm -rf out.tmp_part*");
+    if (ret != 0)
+        cerr << "WARNING: failed to remove temp directories" << endl;
+
+    compareNifti(
+        "out.tmp/mean_c0.nii.gz", string(FABBER_SRC_DIR) + "/test/outdata_poly/mean_c0.nii.gz");
+    compareNifti(
+        "out.tmp/mean_c2.nii.gz", string(FABBER_SRC_DIR) + "/test/outdata_poly/mean_c2.nii.gz");
+    compareNifti(
+        "out.tmp/std_c1.nii.gz", string(FABBER_SRC_DIR) + "/test/outdata_poly/std_c1.nii.gz");
+
+    NEWIMAGE::volume4D<float> mvn;
+    read_volume4D(mvn, "out.tmp/finalMVN.nii.gz");
+    ASSERT_EQ(NIFTI_INTENT_SYMMATRIX, mvn.intent_code());
+}
+
+// Test a split whose parts have very different numbers of voxels still merges
+// to the same output as a single run
+TEST_F(ClTestTest, SplitMergeUneven)
+{
+    // Give the first masked voxel twice the cost of all the others together,
+    // so the first two parts get one voxel each and the last gets the rest
+    NEWIMAGE::volume<float> mask;
+    read_volume(mask, string(FABBER_SRC_DIR) + "/test/test_mask_small.nii.gz");
+    int nvoxels = 0;
+    for (int z = 0; z < mask.zsize(); z++)
+        for (int y = 0; y < mask.ysize(); y++)
+            for (int x = 0; x < mask.xsize(); x++)
+                if (mask(x, y, z) > 0)
+                    nvoxels++;
+    ASSERT_GT(nvoxels, 3);
+
+    NEWIMAGE::volume<float> cost(mask);
+    cost = 0;
+    bool first = true;
+    for (int z = 0; z < mask.zsize(); z++)
+        for (int y = 0; y < mask.ysize(); y++)
+            for (int x = 0; x < mask.xsize(); x++)
+                if (mask(x, y, z) > 0)
+                {
+                    cost(x, y, z) = first ? 2 * (nvoxels - 1) : 1;
+                    first = false;
+                }
+    save_volume(cost, "out.tmp_cost");
+
+    string args = "--model=poly --output=out.tmp  --degree=2 --method=vb --noise=white ";
+    args += " --mask=" + string(FABBER_SRC_DIR) + "/test/test_mask_small.nii.gz --data="
+        + string(FABBER_SRC_DIR) + "/test/test_data.nii.gz --save-mean --save-std "
+                                   "--split=3 --split-cost=out.tmp_cost --overwrite";
+
+    int expected_size[3] = { 1, 1, nvoxels - 2 };
+    for (int part = 1; part <= 3; part++)
+    {
+        ASSERT_EQ(0, runFabber(args + " --part=" + stringify(part)));
+        NEWIMAGE::volume<float> mean;
+        read_volume(mean, "out.tmp_part" + stringify(part) + "/mean_c0.nii.gz");
+        ASSERT_EQ(expected_size[part - 1], mean.xsize());
+    }
+    ASSERT_EQ(0, runFabber(args + " --merge"));
+    int ret = system("rm -rf out.tmp_part* out.tmp_cost*");
+    if (ret != 0)
+        cerr << "WARNING: failed to remove temp files" << endl;
+
+    compareNifti(
+        "out.tmp/mean_c0.nii.gz", string(FABBER_SRC_DIR) + "/test/outdata_poly/mean_c0.nii.gz");
+    compareNifti(
+        "out.tmp/mean_c2.nii.gz", string(FABBER_SRC_DIR) + "/test/outdata_poly/mean_c2.nii.gz");
+    compareNifti(
+        "out.tmp/std_c1.nii.gz", string(FABBER_SRC_DIR) + "/test/outdata_poly/std_c1.nii.gz");
+}
+
 // Test fabber will run without a mask
 TEST_F(ClTestTest, PolyModelNoMask)
 {
@@ -429,6 +663,84 @@ TEST_F(ClTestTest, OptFileNewStyle)
     ASSERT_TRUE(contains(out, "test_data_small.nii.gz"));
 }
 
+TEST_F(ClTestTest, ServerJobJson)
+{
+    FabberRunData rundata;
+    ParseServerJob("  { \"model\" : \"poly\", \"degree\": 2, \"overwrite\" : true,\n"
+                   "    \"save-mean\" : false, \"output\" : \"out\\\"tmp\" }",
+        rundata);
+    ASSERT_EQ("poly", rundata.GetString("model"));
+    ASSERT_EQ(2, rundata.GetInt("degree"));
+    ASSERT_TRUE(rundata.GetBool("overwrite"));
+    ASSERT_FALSE(rundata.GetBool("save-mean"));
+    ASSERT_EQ("out\"tmp", rundata.GetString("output"));
+
+    FabberRunData rundata2;
+    ASSERT_THROW(ParseServerJob("{ \"model\" : \"poly\" ", rundata2), FabberRunDataError);
+}
+
+TEST_F(ClTestTest, ServerJobOptions)
+{
+    FabberRunData rundata;
+    ParseServerJob("model=poly\ndegree=2\noverwrite\n", rundata);
+    ASSERT_EQ("poly", rundata.GetString("model"));
+    ASSERT_EQ(2, rundata.GetInt("degree"));
+    ASSERT_TRUE(rundata.GetBool("overwrite"));
+}
+
+TEST_F(ClTestTest, ServerJobUnsupported)
+{
+    FabberRunData rundata;
+    ASSERT_THROW(ParseServerJob("{ \"model\" : \"poly\", \"loadmodels\" : \"libfoo.so\" }", rundata),
+        InvalidOptionValue);
+    FabberRunData rundata2;
+    ASSERT_THROW(ParseServerJob("model=poly\n  loadmodels = libfoo.so\n", rundata2), InvalidOptionValue);
+    FabberRunData rundata3;
+    ASSERT_THROW(ParseServerJob("model=poly\nmerge\n", rundata3), InvalidOptionValue);
+
+    // Unset booleans and comments are not options
+    FabberRunData rundata4;
+    ParseServerJob("{ \"model\" : \"poly\", \"merge\" : false }", rundata4);
+    FabberRunData rundata5;
+    ParseServerJob("model=poly\n# loadmodels=libfoo.so\n", rundata5);
+    ASSERT_EQ("poly", rundata5.GetString("model"));
+}
+
+#ifndef _WIN32
+TEST_F(ClTestTest, ServerSubmit)
+{
+    ASSERT_NO_FATAL_FAILURE(startServer());
+
+    // A client which connects but never sends its job must not hold up others
+    int stalled = connectServer();
+    ASSERT_GE(stalled, 0);
+
+    ofstream job("testfabber_job.tmp");
+    job << "model=poly\ndegree=2\nmethod=vb\nnoise=white\nsave-mean\noverwrite\n";
+    job << "output=out.tmp\ndata=" << FABBER_SRC_DIR << "/test/test_data_small.nii.gz\n";
+    job.close();
+    ASSERT_EQ(0, runFabber("--submit=testfabber_job.tmp --socket=fabbertest.sock"));
+    string out = getStdout();
+    ASSERT_TRUE(contains(out, "QUEUED "));
+    ASSERT_TRUE(contains(out, "DONE "));
+    NEWIMAGE::volume<float> mean;
+    ASSERT_NO_THROW(read_volume(mean, "out.tmp/mean_c0"));
+
+    // Unsupported options are rejected with an error reply
+    ofstream badjob("testfabber_job.tmp");
+    badjob << "{ \"model\" : \"poly\", \"loadmodels\" : \"libfoo.so\" }";
+    badjob.close();
+    ASSERT_NE(0, runFabber("--submit=testfabber_job.tmp --socket=fabbertest.sock"));
+    out = getStdout();
+    ASSERT_TRUE(contains(out, "FAILED "));
+    ASSERT_TRUE(contains(out, "loadmodels"));
+    ASSERT_FALSE(contains(out, "QUEUED "));
+
+    close(stalled);
+    remove("testfabber_job.tmp");
+}
+#endif
+
 INSTANTIATE_TEST_CASE_P(ClMethodTests, ClTestTest, ::testing::Values("vb", "nlls", "spatialvb"));
 }
 #endif
@@ -5,6 +5,8 @@
 #include "convergence.h"
 #include "easylog.h"
 
+#include <math.h>
+
 namespace
 {
 class ConvergenceTest : public ::testing::Test
@@ -304,4 +306,165 @@ TEST_F(ConvergenceTest, TestTrialModeConvergenceDetectorReduce)
     }
     ASSERT_EQ(true, c->Test(F - 2 * MAXTRIALS * FCHANGE));
 }
+
+// Tests each entry into trial mode is counted as a revert
+TEST_F(ConvergenceTest, TestTrialModeConvergenceDetectorNumReverts)
+{
+    double F = 12.1;
+
+    rundata.Set("max-iterations", 37);
+    rundata.Set("min-fchange", 0.0001);
+    rundata.Set("max-trials", 3);
+    ConvergenceDetector *c = ConvergenceDetector::NewFromName("trialmode");
+    c->Initialize(rundata);
+    ASSERT_EQ(0, c->NumReverts());
+
+    ASSERT_EQ(false, c->Test(F));
+    ASSERT_EQ(0, c->NumReverts());
+
+    // Decrease enters trial mode
+    ASSERT_EQ(false, c->Test(F - 1));
+    ASSERT_EQ(true, c->NeedRevert());
+    ASSERT_EQ(1, c->NumReverts());
+
+    // Increase leaves trial mode, the next decrease enters it again
+    ASSERT_EQ(false, c->Test(F + 1));
+    ASSERT_EQ(1, c->NumReverts());
+    ASSERT_EQ(false, c->Test(F));
+    ASSERT_EQ(2, c->NumReverts());
+
+    c->Reset();
+    ASSERT_EQ(0, c->NumReverts());
+}
+
+// Tests each increase in the LM adjustment is counted as a revert
+TEST_F(ConvergenceTest, TestLMConvergenceDetectorNumReverts)
+{
+    double F = 12.1;
+
+    rundata.Set("max-iterations", 37);
+    ConvergenceDetector *c = ConvergenceDetector::NewFromName("lm");
+    c->Initialize(rundata);
+    ASSERT_EQ(0, c->NumReverts());
+
+    ASSERT_EQ(false, c->Test(F));
+    ASSERT_EQ(0, c->NumReverts());
+
+    // Decrease enters LM mode, a further decrease increases the adjustment
+    ASSERT_EQ(false, c->Test(F - 1));
+    ASSERT_EQ(true, c->NeedRevert());
+    ASSERT_EQ(1, c->NumReverts());
+    ASSERT_EQ(false, c->Test(F - 1));
+    ASSERT_EQ(2, c->NumReverts());
+
+    // Increase reduces the adjustment without reverting
+    ASSERT_EQ(false, c->Test(F + 1));
+    ASSERT_EQ(false, c->NeedRevert());
+    ASSERT_EQ(2, c->NumReverts());
+
+    c->Reset();
+    ASSERT_EQ(0, c->NumReverts());
+}
+
+// Tests detectors which never revert report no reverts
+TEST_F(ConvergenceTest, TestFchangeConvergenceDetectorNumReverts)
+{
+    rundata.Set("max-iterations", 10);
+    rundata.Set("min-fchange", 0.0001);
+    ConvergenceDetector *c = ConvergenceDetector::NewFromName("pointzeroone");
+    c->Initialize(rundata);
+
+    ASSERT_EQ(false, c->Test(12.1));
+    ASSERT_EQ(false, c->Test(11.1));
+    ASSERT_EQ(0, c->NumReverts());
+}
+
+// Iterate the linear fixed-point map x -> Ax + b, using the accelerated
+// detector's proposals, and return the distance from the fixed point
+double AcceleratedDistance(ConvergenceDetector *c, int iterations)
+{
+    NEWMAT::Matrix A(2, 2);
+    A << 0.9 << 0.05 << 0.0 << 0.8;
+    NEWMAT::ColumnVector b(2), fixed(2);
+    b << 1.0 << 1.0;
+    fixed << 12.5 << 5.0;
+
+    NEWMAT::ColumnVector x(2), proposal;
+    x = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        NEWMAT::ColumnVector g = A * x + b;
+        if (c && c->Extrapolate(x, g, proposal))
+        {
+            c->ExtrapolationResult(true, 0);
+            x = proposal;
+        }
+        else
+        {
+            x = g;
+        }
+    }
+    return sqrt((x - fixed).SumSquare());
+}
+
+TEST_F(ConvergenceTest, TestAcceleratedAnderson)
+{
+    rundata.Set("max-iterations", 10);
+    rundata.Set("accel-method", "anderson");
+    ConvergenceDetector *c = ConvergenceDetector::NewFromName("accel");
+    c->Initialize(rundata);
+    ASSERT_EQ(true, c->UseF());
+
+    // With at least as many differences as dimensions, Anderson mixing
+    // finds the fixed point of a linear map exactly
+    ASSERT_LT(1, AcceleratedDistance(NULL, 10));
+    ASSERT_GT(1e-6, AcceleratedDistance(c, 10));
+}
+
+TEST_F(ConvergenceTest, TestAcceleratedSquarem)
+{
+    rundata.Set("max-iterations", 10);
+    rundata.Set("accel-method", "squarem");
+    ConvergenceDetector *c = ConvergenceDetector::NewFromName("accel");
+    c->Initialize(rundata);
+
+    ASSERT_GT(1e-4, AcceleratedDistance(c, 10));
+}
+
+TEST_F(ConvergenceTest, TestAcceleratedSaveRevert)
+{
+    double F = 12.1;
+    double FCHANGE = 0.0001;
+
+    rundata.Set("max-iterations", 10);
+    rundata.Set("min-fchange", FCHANGE);
+    ConvergenceDetector *c = ConvergenceDetector::NewFromName("accel");
+    c->Initialize(rundata);
+
+    // Increasing F is saved as the best so far
+    ASSERT_EQ(false, c->Test(F));
+    ASSERT_EQ(true, c->NeedSave());
+    ASSERT_EQ(false, c->Test(F + 1));
+    ASSERT_EQ(true, c->NeedSave());
+
+    // A decrease is not, and is reverted at the end
+    ASSERT_EQ(false, c->Test(F));
+    ASSERT_EQ(false, c->NeedSave());
+    ASSERT_EQ(true, c->Test(F + FCHANGE / 2));
+    ASSERT_EQ(true, c->NeedRevert());
+
+    // Rejected proposals are counted as reverts
+    c->Reset();
+    c->ExtrapolationResult(false, F);
+    ASSERT_EQ(1, c->NumReverts());
+    c->Reset();
+    ASSERT_EQ(0, c->NumReverts());
+}
+
+TEST_F(ConvergenceTest, TestAcceleratedBadMethod)
+{
+    rundata.Set("accel-method", "magic");
+    ConvergenceDetector *c = ConvergenceDetector::NewFromName("accel");
+    ASSERT_THROW(c->Initialize(rundata), InvalidOptionValue);
+}
 }
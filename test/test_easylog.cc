@@ -0,0 +1,272 @@
+// Tests for the logger
+
+#include "gtest/gtest.h"
+
+#include "easylog.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace
+{
+class LogUser : public Loggable
+{
+public:
+    explicit LogUser(EasyLog *log)
+        : Loggable(log)
+        , evaluated(0)
+    {
+    }
+
+    string Message()
+    {
+        ++evaluated;
+        return "Something odd happened";
+    }
+
+    void Log()
+    {
+        LOG << "info" << endl;
+        LOG_VERBOSE << "verbose " << Message() << endl;
+        LOG_DEBUG << "debug " << Message() << endl;
+    }
+
+    void LogInfo()
+    {
+        LOG << "info " << Message() << endl;
+    }
+
+    void LogProblem()
+    {
+        LOG_WARN << "problem" << endl;
+    }
+
+    void Warn()
+    {
+        WARN_ONCE(Message());
+    }
+
+    void WarnValue(int value)
+    {
+        WARN_ONCE_TEXT("Value was " + stringify(value));
+    }
+
+    int evaluated;
+};
+
+int Count(const string &str, const string &sub)
+{
+    int count = 0;
+    for (size_t pos = str.find(sub); pos != string::npos; pos = str.find(sub, pos + 1))
+        count++;
+    return count;
+}
+
+void *LogFromThread(void *log)
+{
+    LogUser user(static_cast<EasyLog *>(log));
+    for (int i = 0; i < 1000; i++)
+        user.Log();
+    return NULL;
+}
+}
+
+// Tests messages above the log level are not formatted or output
+TEST(EasyLogTest, Levels)
+{
+    stringstream out;
+    EasyLog log;
+    log.StartLog(out);
+    LogUser user(&log);
+
+    user.Log();
+    log.Flush();
+    ASSERT_EQ(1, Count(out.str(), "info"));
+    ASSERT_EQ(0, Count(out.str(), "verbose"));
+    ASSERT_EQ(0, user.evaluated);
+
+    log.SetLevel(EasyLog::LEVEL_VERBOSE);
+    user.Log();
+    log.StopLog();
+    ASSERT_EQ(2, Count(out.str(), "info"));
+    ASSERT_EQ(1, Count(out.str(), "verbose"));
+    ASSERT_EQ(0, Count(out.str(), "debug"));
+    ASSERT_EQ(1, user.evaluated);
+
+    int level;
+    ASSERT_TRUE(EasyLog::ParseLevel("debug", level));
+    ASSERT_EQ(EasyLog::LEVEL_DEBUG, level);
+    ASSERT_FALSE(EasyLog::ParseLevel("loud", level));
+}
+
+// Tests only warnings are logged at the warn level
+TEST(EasyLogTest, LevelWarn)
+{
+    stringstream out;
+    EasyLog log;
+    log.StartLog(out);
+    log.SetLevel(EasyLog::LEVEL_WARN);
+    LogUser user(&log);
+
+    user.LogInfo();
+    user.LogProblem();
+    user.Warn();
+    log.StopLog();
+    ASSERT_EQ(0, Count(out.str(), "info"));
+    ASSERT_EQ(1, Count(out.str(), "problem"));
+    ASSERT_EQ(1, Count(out.str(), "WARNING ONCE"));
+
+    // Only the warning message is formatted
+    ASSERT_EQ(1, user.evaluated);
+}
+
+// Tests output before StartLog is kept
+TEST(EasyLogTest, BeforeStart)
+{
+    EasyLog log;
+    LogUser user(&log);
+    user.Log();
+
+    stringstream out;
+    log.StartLog(out);
+    log.StopLog();
+    ASSERT_EQ(1, Count(out.str(), "info"));
+}
+
+// Tests a WARN_ONCE site only formats and logs its message once, but
+// repeats are counted in the summary
+TEST(EasyLogTest, WarnOnce)
+{
+    stringstream out;
+    EasyLog log;
+    log.StartLog(out);
+    LogUser user(&log);
+    for (int i = 0; i < 5; i++)
+        user.Warn();
+    log.ReissueWarnings();
+    log.StopLog();
+
+    ASSERT_EQ(1, user.evaluated);
+    ASSERT_EQ(1, Count(out.str(), "WARNING ONCE: Something odd happened"));
+    ASSERT_EQ(1, Count(out.str(), "Issued 5 times: Something odd happened"));
+
+    // Counts are separate for each log
+    stringstream out2;
+    EasyLog log2;
+    log2.StartLog(out2);
+    LogUser user2(&log2);
+    user2.Warn();
+    log2.StopLog();
+    ASSERT_EQ(1, Count(out2.str(), "WARNING ONCE: Something odd happened"));
+}
+
+// Tests lines from multiple threads are all written and not interleaved
+TEST(EasyLogTest, Threads)
+{
+    stringstream out;
+    EasyLog log;
+    log.StartLog(out);
+
+    pthread_t threads[4];
+    for (int t = 0; t < 4; t++)
+        ASSERT_EQ(0, pthread_create(&threads[t], NULL, LogFromThread, &log));
+    for (int t = 0; t < 4; t++)
+        pthread_join(threads[t], NULL);
+    log.StopLog();
+
+    string line;
+    int lines = 0;
+    while (getline(out, line))
+    {
+        ASSERT_EQ("info", line);
+        lines++;
+    }
+    ASSERT_EQ(4000, lines);
+}
+
+// Tests WARN_ONCE_TEXT logs each distinct message once
+TEST(EasyLogTest, WarnOnceText)
+{
+    stringstream out;
+    EasyLog log;
+    log.StartLog(out);
+    LogUser user(&log);
+    for (int i = 0; i < 6; i++)
+        user.WarnValue(i % 3);
+    log.ReissueWarnings();
+    log.StopLog();
+
+    for (int i = 0; i < 3; i++)
+    {
+        ASSERT_EQ(1, Count(out.str(), "WARNING ONCE: Value was " + stringify(i) + "\n"));
+        ASSERT_EQ(1, Count(out.str(), "Issued 2 times: Value was " + stringify(i)));
+    }
+}
+
+// Tests log lines are written to a stream as soon as they are complete, so they
+// stay in order with output written to the stream directly
+TEST(EasyLogTest, StreamOrder)
+{
+    stringstream out;
+    EasyLog log;
+    log.StartLog(out);
+    LogUser user(&log);
+    for (int i = 0; i < 100; i++)
+    {
+        user.Log();
+        out << "direct" << endl;
+    }
+
+    string line;
+    for (int i = 0; i < 100; i++)
+    {
+        ASSERT_TRUE(getline(out, line));
+        ASSERT_EQ("info", line);
+        ASSERT_TRUE(getline(out, line));
+        ASSERT_EQ("direct", line);
+    }
+    log.StopLog();
+}
+
+// Tests everything logged to a file from several threads and several logs is written
+TEST(EasyLogTest, FileLogs)
+{
+    string dirs[2] = { "easylog_test1.tmp", "easylog_test2.tmp" };
+    EasyLog logs[2];
+    for (int i = 0; i < 2; i++)
+    {
+        mkdir(dirs[i].c_str(), 0755);
+        logs[i].StartLog(dirs[i]);
+    }
+
+    pthread_t threads[4];
+    for (int t = 0; t < 4; t++)
+        ASSERT_EQ(0, pthread_create(&threads[t], NULL, LogFromThread, &logs[t % 2]));
+    for (int t = 0; t < 4; t++)
+        pthread_join(threads[t], NULL);
+
+    for (int i = 0; i < 2; i++)
+    {
+        logs[i].StopLog();
+        string filename = dirs[i] + "/logfile";
+        ifstream in(filename.c_str());
+        string line;
+        int lines = 0;
+        while (getline(in, line))
+        {
+            ASSERT_EQ("info", line);
+            lines++;
+        }
+        ASSERT_EQ(2000, lines);
+        remove(filename.c_str());
+        rmdir(dirs[i].c_str());
+    }
+}
@@ -7,14 +7,38 @@
 #include "gtest/gtest.h"
 
 #include "easylog.h"
+#include "fwdmodel_poly.h"
 #include "inference.h"
 #include "rundata.h"
 #include "setup.h"
 
 #include <fstream>
+#include <limits>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 namespace
 {
+/**
+ * Polynomial model which claims to use the voxel co-ordinates, so
+ * voxels at different positions are never duplicates
+ */
+class CoordsPolyModel : public PolynomialFwdModel
+{
+public:
+    static FwdModel *NewInstance()
+    {
+        return new CoordsPolyModel();
+    }
+
+    bool UsesCoords() const
+    {
+        return true;
+    }
+};
+
 // The fixture for testing class Foo.
 class InferenceMethodTest : public ::testing::TestWithParam<string>
 {
@@ -44,6 +68,37 @@ protected:
             diff = -diff;
         return diff < epsilon;
     }
+
+    /**
+     * Set up a run of the method under test fitting a polynomial to each
+     * column of data, with the voxels laid out along the x axis
+     */
+    void SetupPolyRun(FabberRunData &rundata, const NEWMAT::Matrix &data, int degree)
+    {
+        NEWMAT::Matrix voxelCoords(3, data.Ncols());
+        for (int v = 0; v < data.Ncols(); v++)
+        {
+            voxelCoords(1, v + 1) = v;
+            voxelCoords(2, v + 1) = 0;
+            voxelCoords(3, v + 1) = 0;
+        }
+
+        ostringstream deg;
+        deg << degree;
+        rundata.SetVoxelCoords(voxelCoords);
+        rundata.SetVoxelData("data", data);
+        rundata.Set("noise", "white");
+        rundata.Set("model", "poly");
+        rundata.Set("degree", deg.str());
+        rundata.Set("method", GetParam());
+    }
+
+    NEWMAT::Matrix ConstantData(int ntimes, int nvoxels, double val)
+    {
+        NEWMAT::Matrix data(ntimes, nvoxels);
+        data = val;
+        return data;
+    }
 };
 
 // Tests that the VB inference method can be created
@@ -633,6 +688,539 @@ TEST_F(InferenceMethodTest, MaskedTimepointsArNoise)
     ASSERT_THROW(rundata.Run(), InvalidOptionValue);
 }
 
+// Tests repeated runs on new data reusing the model and method from a session
+TEST_P(InferenceMethodTest, Session)
+{
+    int NTIMES = 10;
+    int NVOXELS = 5;
+    float VAL = 7.32;
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, NVOXELS);
+    voxelCoords.ReSize(3, NVOXELS);
+    for (int v = 0; v < NVOXELS; v++)
+    {
+        voxelCoords(1, v + 1) = v;
+        voxelCoords(2, v + 1) = 0;
+        voxelCoords(3, v + 1) = 0;
+    }
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("degree", "0");
+    rundata.Set("method", GetParam());
+    rundata.StartSession();
+    ASSERT_TRUE(rundata.InSession());
+
+    for (int run = 1; run <= 3; run++)
+    {
+        data = VAL * run;
+        rundata.SetVoxelData("data", data);
+        rundata.Run();
+
+        NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c0");
+        ASSERT_EQ(mean.Nrows(), 1);
+        ASSERT_EQ(mean.Ncols(), NVOXELS);
+        for (int v = 0; v < NVOXELS; v++)
+        {
+            ASSERT_FLOAT_EQ(mean(1, v + 1), VAL * run);
+        }
+    }
+
+    rundata.EndSession();
+    ASSERT_FALSE(rundata.InSession());
+}
+
+TEST_P(InferenceMethodTest, TimeBudget)
+{
+    int NVOXELS = 5;
+    float VAL = 7.32;
+
+    FabberRunData rundata;
+    SetupPolyRun(rundata, ConstantData(10, NVOXELS, VAL), 0);
+    rundata.Set("max-iterations", "5");
+    rundata.Set("time-budget", "60");
+    rundata.Run();
+
+    // Budget is ample so everything should converge to the normal result
+    NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix iterations = rundata.GetVoxelData("iterations");
+    NEWMAT::Matrix convergence = rundata.GetVoxelData("convergence");
+    ASSERT_EQ(NVOXELS, mean.Ncols());
+    ASSERT_EQ(NVOXELS, iterations.Ncols());
+    ASSERT_EQ(NVOXELS, convergence.Ncols());
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_FLOAT_EQ(VAL, mean(1, v));
+        ASSERT_EQ(1, convergence(1, v));
+        ASSERT_TRUE(iterations(1, v) > 0);
+        if (GetParam() != "nlls")
+        {
+            ASSERT_EQ(5, iterations(1, v));
+        }
+    }
+}
+
+// Tests the results when the time budget runs out before every voxel is fitted
+TEST_P(InferenceMethodTest, TimeBudgetExhausted)
+{
+    // Spatial VB spends its budget on whole iterations rather than voxels
+    if (GetParam() == "spatialvb")
+        return;
+
+    int NVOXELS = 2000;
+    float VAL = 7.32;
+
+    FabberRunData rundata;
+    SetupPolyRun(rundata, ConstantData(10, NVOXELS, VAL), 0);
+    rundata.Set("max-iterations", "5");
+    rundata.Set("time-budget", "0.000001");
+    rundata.SetBool("save-voxel-diagnostics");
+    rundata.Run();
+
+    // Every voxel has a result, whether or not it was reached
+    NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix iterations = rundata.GetVoxelData("iterations");
+    NEWMAT::Matrix convergence = rundata.GetVoxelData("convergence");
+    NEWMAT::Matrix diag_iterations = rundata.GetVoxelData("diag_iterations");
+    ASSERT_EQ(NVOXELS, mean.Ncols());
+    ASSERT_EQ(NVOXELS, iterations.Ncols());
+    ASSERT_EQ(NVOXELS, convergence.Ncols());
+    ASSERT_EQ(NVOXELS, diag_iterations.Ncols());
+
+    int unfitted = 0;
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_EQ(iterations(1, v), diag_iterations(1, v));
+        if (iterations(1, v) == 0)
+        {
+            // Voxels which were never reached keep the initial estimate
+            ASSERT_EQ(0, convergence(1, v));
+            ASSERT_FALSE(FloatEq(VAL, mean(1, v), 0.1));
+            unfitted++;
+        }
+        else
+        {
+            ASSERT_TRUE(FloatEq(VAL, mean(1, v), 0.1));
+        }
+    }
+    ASSERT_GT(unfitted, 0);
+}
+
+// Tests the timing summary is logged and the collector reset after the run
+TEST_P(InferenceMethodTest, PerfSummary)
+{
+    stringstream logstr;
+    EasyLog log;
+    log.StartLog(logstr);
+
+    FabberRunData rundata;
+    rundata.SetLogger(&log);
+    SetupPolyRun(rundata, ConstantData(10, 5, 7.32), 0);
+    rundata.SetBool("perf-summary");
+    rundata.Run();
+    log.StopLog();
+
+    string output = logstr.str();
+    ASSERT_NE(string::npos, output.find("PerfStats::Timing summary"));
+    ASSERT_NE(string::npos, output.find("ModelEvaluations"));
+    ASSERT_NE(string::npos, output.find("SaveVoxelData"));
+    if (GetParam() != "nlls")
+    {
+        ASSERT_NE(string::npos, output.find("UpdateTheta"));
+        ASSERT_NE(string::npos, output.find("ReCentre"));
+    }
+    ASSERT_FALSE(rundata.GetPerfStats()->IsEnabled());
+}
+
+// Tests fitting only distinct voxels gives the same result as fitting them all
+TEST_P(InferenceMethodTest, DedupVoxels)
+{
+    int NTIMES = 10;
+    int NVOXELS = 30;
+    int NDISTINCT = 3;
+
+    NEWMAT::Matrix data(NTIMES, NVOXELS);
+    for (int v = 0; v < NVOXELS; v++)
+    {
+        double val = v % NDISTINCT + 1;
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v + 1) = val + 1.5 * val * n + 0.01 * (n % 3);
+        }
+    }
+
+    NEWMAT::Matrix means[2];
+    string output;
+    for (int i = 0; i < 2; i++)
+    {
+        stringstream logstr;
+        EasyLog log;
+        log.StartLog(logstr);
+
+        FabberRunData rundata;
+        rundata.SetLogger(&log);
+        SetupPolyRun(rundata, data, 1);
+        rundata.Set("max-iterations", "5");
+        rundata.SetBool("dedup-voxels", i == 1);
+        rundata.Run();
+        log.StopLog();
+        output = logstr.str();
+
+        means[i] = rundata.GetVoxelData("mean_c1");
+        ASSERT_EQ(1, means[i].Nrows());
+        ASSERT_EQ(NVOXELS, means[i].Ncols());
+    }
+
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        EXPECT_FLOAT_EQ(means[0](1, v), means[1](1, v));
+    }
+
+    // Spatial VB fits all voxels together so duplicates are not removed
+    if (GetParam() != "spatialvb")
+    {
+        ASSERT_NE(string::npos, output.find("3 distinct voxels out of 30"));
+    }
+}
+
+// Tests voxels with the same data but different image prior values are not
+// treated as duplicates
+TEST_P(InferenceMethodTest, DedupImagePrior)
+{
+    int NVOXELS = 30;
+    float VAL = 7.32;
+
+    NEWMAT::Matrix iprior_data(1, NVOXELS);
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        iprior_data(1, v) = VAL + v;
+    }
+
+    NEWMAT::Matrix means[2];
+    string output;
+    for (int i = 0; i < 2; i++)
+    {
+        stringstream logstr;
+        EasyLog log;
+        log.StartLog(logstr);
+
+        FabberRunData rundata;
+        rundata.SetLogger(&log);
+        SetupPolyRun(rundata, ConstantData(10, NVOXELS, VAL), 0);
+        rundata.Set("PSP_byname1", "c0");
+        rundata.Set("PSP_byname1_type", "I");
+        rundata.SetVoxelData("PSP_byname1_image", iprior_data);
+        rundata.Set("PSP_byname1_prec", "1e12");
+        rundata.Set("max-iterations", "5");
+        rundata.SetBool("dedup-voxels", i == 1);
+        rundata.Run();
+        log.StopLog();
+        output = logstr.str();
+
+        means[i] = rundata.GetVoxelData("mean_c0");
+        ASSERT_EQ(1, means[i].Nrows());
+        ASSERT_EQ(NVOXELS, means[i].Ncols());
+    }
+
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        EXPECT_FLOAT_EQ(means[0](1, v), means[1](1, v));
+        if (GetParam() != "nlls")
+        {
+            // The prior has high precision so each voxel follows its own
+            // prior value, not that of another voxel with the same data
+            EXPECT_NEAR(iprior_data(1, v), means[1](1, v), 0.1);
+        }
+    }
+    if (GetParam() != "spatialvb")
+    {
+        ASSERT_NE(string::npos, output.find("30 distinct voxels out of 30"));
+    }
+}
+
+// Tests voxels with the same data at different positions are not treated as
+// duplicates when the model uses the voxel co-ordinates
+TEST_P(InferenceMethodTest, DedupUsesCoords)
+{
+    int NVOXELS = 30;
+    FwdModelFactory::GetInstance()->Add("polycoords", &CoordsPolyModel::NewInstance);
+
+    const char *models[2] = { "poly", "polycoords" };
+    string output[2];
+    for (int i = 0; i < 2; i++)
+    {
+        stringstream logstr;
+        EasyLog log;
+        log.StartLog(logstr);
+
+        FabberRunData rundata;
+        rundata.SetLogger(&log);
+        SetupPolyRun(rundata, ConstantData(10, NVOXELS, 7.32), 0);
+        rundata.Set("model", models[i]);
+        rundata.Set("max-iterations", "5");
+        rundata.SetBool("dedup-voxels", true);
+        rundata.Run();
+        log.StopLog();
+        output[i] = logstr.str();
+
+        NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c0");
+        ASSERT_EQ(NVOXELS, mean.Ncols());
+        for (int v = 1; v <= NVOXELS; v++)
+        {
+            EXPECT_NEAR(7.32, mean(1, v), 0.01);
+        }
+    }
+
+    if (GetParam() != "spatialvb")
+    {
+        ASSERT_NE(string::npos, output[0].find("1 distinct voxels out of 30"));
+        ASSERT_NE(string::npos, output[1].find("30 distinct voxels out of 30"));
+    }
+}
+
+// Tests per-voxel diagnostics are saved
+TEST_P(InferenceMethodTest, VoxelDiagnostics)
+{
+    int NVOXELS = 5;
+
+    FabberRunData rundata;
+    SetupPolyRun(rundata, ConstantData(10, NVOXELS, 7.32), 0);
+    rundata.Set("max-iterations", "5");
+    rundata.SetBool("save-voxel-diagnostics");
+    rundata.Run();
+
+    NEWMAT::Matrix time = rundata.GetVoxelData("diag_time");
+    NEWMAT::Matrix iterations = rundata.GetVoxelData("diag_iterations");
+    NEWMAT::Matrix evaluations = rundata.GetVoxelData("diag_evaluations");
+    NEWMAT::Matrix reverts = rundata.GetVoxelData("diag_reverts");
+    NEWMAT::Matrix ignored = rundata.GetVoxelData("diag_ignored");
+    ASSERT_EQ(NVOXELS, time.Ncols());
+    ASSERT_EQ(NVOXELS, ignored.Ncols());
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_TRUE(time(1, v) >= 0);
+        ASSERT_TRUE(iterations(1, v) > 0);
+        ASSERT_TRUE(evaluations(1, v) > 0);
+        ASSERT_EQ(0, reverts(1, v));
+        ASSERT_EQ(0, ignored(1, v));
+        if (GetParam() != "nlls")
+        {
+            ASSERT_EQ(5, iterations(1, v));
+        }
+    }
+}
+
+// Tests a voxel which fails is reported as ignored in the per-voxel
+// diagnostics when bad voxels are allowed
+TEST_P(InferenceMethodTest, VoxelDiagnosticsBadVoxel)
+{
+    // Spatial VB ignores failed voxels in later iterations rather than
+    // abandoning them, and NLLS does not calculate the free energy
+    if (GetParam() != "vb")
+        return;
+
+    int NVOXELS = 5;
+    int BAD_VOXEL = 3;
+
+    NEWMAT::Matrix data = ConstantData(10, NVOXELS, 7.32);
+    data(4, BAD_VOXEL) = numeric_limits<double>::quiet_NaN();
+
+    FabberRunData rundata;
+    SetupPolyRun(rundata, data, 0);
+    rundata.Set("max-iterations", "5");
+    rundata.Set("convergence", "trialmode");
+    rundata.SetBool("allow-bad-voxels");
+    rundata.SetBool("save-voxel-diagnostics");
+    rundata.Run();
+
+    NEWMAT::Matrix ignored = rundata.GetVoxelData("diag_ignored");
+    ASSERT_EQ(NVOXELS, ignored.Ncols());
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_EQ(v == BAD_VOXEL ? 1 : 0, ignored(1, v));
+    }
+}
+
+// Tests instrumentation does nothing unless a collector is current
+TEST(PerfStatsTest, Disabled)
+{
+    fabber::PerfStats stats;
+    {
+        fabber::PerfScope scope(&stats);
+        fabber::ScopedTimer timer("Phase");
+        fabber::PerfCount("Counter");
+    }
+    stringstream out;
+    stats.Start(false);
+    stats.LogSummary(out);
+    ASSERT_EQ(string::npos, out.str().find("Phase"));
+    ASSERT_EQ(string::npos, out.str().find("Counter"));
+
+    {
+        fabber::PerfScope scope(&stats);
+        fabber::ScopedTimer timer("Phase");
+        fabber::PerfCount("Counter", 3);
+    }
+    ASSERT_TRUE(fabber::PerfStats::Current() == NULL);
+    out.str("");
+    stats.LogSummary(out);
+    ASSERT_NE(string::npos, out.str().find("Phase"));
+    ASSERT_NE(string::npos, out.str().find("Counter"));
+}
+
+#ifndef _WIN32
+void *RecordPerfStats(void *arg)
+{
+    fabber::PerfScope scope((fabber::PerfStats *)arg);
+    for (int i = 0; i < 1000; i++)
+    {
+        fabber::ScopedTimer timer("Phase");
+        fabber::PerfCount("Counter", 2);
+    }
+    return NULL;
+}
+
+/** Find the number in the second column of a summary line */
+long SummaryColumn(const string &summary, const string &name)
+{
+    size_t pos = summary.find("PerfStats::  " + name + " ");
+    if (pos == string::npos)
+        return -1;
+    istringstream line(summary.substr(pos + 13 + name.size()));
+    long value = -1;
+    line >> value;
+    return value;
+}
+
+// Tests threads recording into a shared collector are all counted
+TEST(PerfStatsTest, Threads)
+{
+    fabber::PerfStats stats;
+    stats.Start(true);
+
+    pthread_t threads[4];
+    for (int t = 0; t < 4; t++)
+    {
+        ASSERT_EQ(0, pthread_create(&threads[t], NULL, RecordPerfStats, &stats));
+    }
+    for (int t = 0; t < 4; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    stringstream out;
+    stats.LogSummary(out);
+    ASSERT_EQ(4000, SummaryColumn(out.str(), "Phase"));
+    ASSERT_EQ(8000, SummaryColumn(out.str(), "Counter"));
+
+    // Restarting discards everything recorded
+    stats.Start(false);
+    RecordPerfStats(&stats);
+    out.str("");
+    stats.LogSummary(out);
+    ASSERT_EQ(1000, SummaryColumn(out.str(), "Phase"));
+    ASSERT_EQ(2000, SummaryColumn(out.str(), "Counter"));
+}
+#endif
+
+// Tests collection is only started by a run which asks for it
+TEST(PerfStatsTest, StartedByRun)
+{
+    FabberRunData rundata;
+    rundata.SetBool("perf-summary");
+    ASSERT_FALSE(rundata.GetPerfStats()->IsEnabled());
+}
+
+/**
+ * Records partial results and cancels the run when requested
+ */
+class RecordingProgressCheck : public ProgressCheck
+{
+public:
+    RecordingProgressCheck(int interval, int cancel_after = -1)
+        : m_interval(interval)
+        , m_cancel_after(cancel_after)
+        , m_cancel_checks(0)
+    {
+    }
+
+    bool Cancelled()
+    {
+        m_cancel_checks++;
+        return (m_cancel_after >= 0) && (m_cancel_checks > m_cancel_after);
+    }
+
+    int PartialResultsInterval()
+    {
+        return m_interval;
+    }
+
+    void PartialResults(int first_voxel, const NEWMAT::Matrix &means, const NEWMAT::Matrix &variances)
+    {
+        m_first_voxels.push_back(first_voxel);
+        m_means.push_back(means);
+        ASSERT_EQ(means.Nrows(), variances.Nrows());
+        ASSERT_EQ(means.Ncols(), variances.Ncols());
+    }
+
+    int m_interval;
+    int m_cancel_after;
+    int m_cancel_checks;
+    vector<int> m_first_voxels;
+    vector<NEWMAT::Matrix> m_means;
+};
+
+TEST_P(InferenceMethodTest, PartialResults)
+{
+    int NVOXELS = 5;
+    float VAL = 7.32;
+
+    FabberRunData rundata;
+    SetupPolyRun(rundata, ConstantData(10, NVOXELS, VAL), 0);
+
+    RecordingProgressCheck check(2);
+    rundata.Run(&check);
+    ASSERT_FALSE(check.m_means.empty());
+
+    if (GetParam() == "spatialvb")
+    {
+        // Current estimates for all voxels after each iteration
+        for (unsigned int i = 0; i < check.m_means.size(); i++)
+        {
+            ASSERT_EQ(1, check.m_first_voxels[i]);
+            ASSERT_EQ(NVOXELS, check.m_means[i].Ncols());
+        }
+    }
+    else
+    {
+        // Blocks of 2 voxels, the last one incomplete
+        ASSERT_EQ(3, (int)check.m_means.size());
+        ASSERT_EQ(1, check.m_first_voxels[0]);
+        ASSERT_EQ(3, check.m_first_voxels[1]);
+        ASSERT_EQ(5, check.m_first_voxels[2]);
+        ASSERT_EQ(2, check.m_means[0].Ncols());
+        ASSERT_EQ(1, check.m_means[2].Ncols());
+    }
+
+    NEWMAT::Matrix &last = check.m_means.back();
+    ASSERT_EQ(1, last.Nrows());
+    ASSERT_FLOAT_EQ(VAL, last(1, last.Ncols()));
+}
+
+TEST_P(InferenceMethodTest, Cancel)
+{
+    FabberRunData rundata;
+    SetupPolyRun(rundata, ConstantData(10, 5, 1), 0);
+
+    RecordingProgressCheck check(0, 2);
+    ASSERT_THROW(rundata.Run(&check), FabberRunCancelled);
+    ASSERT_EQ(3, check.m_cancel_checks);
+    ASSERT_THROW(rundata.GetVoxelData("mean_c0"), DataNotFound);
+}
+
 INSTANTIATE_TEST_CASE_P(
     MethodTests, InferenceMethodTest, ::testing::Values("vb", "nlls", "spatialvb"));
 
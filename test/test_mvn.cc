@@ -0,0 +1,321 @@
+//
+// Tests of the MVN distribution class and its file formats
+
+#include "gtest/gtest.h"
+
+#include "dist_mvn.h"
+#include "easylog.h"
+#include "rundata.h"
+#ifndef NO_NEWIMAGE
+#include "rundata_newimage.h"
+#endif
+
+#include <fstream>
+#include <iterator>
+#include <string.h>
+
+namespace
+{
+class MVNTest : public ::testing::Test
+{
+protected:
+    MVNTest()
+    {
+    }
+
+    virtual ~MVNTest()
+    {
+    }
+
+    virtual void SetUp()
+    {
+        // Create a set of MVNs with distinct means and a correlated covariance
+        for (int v = 0; v < NVOXELS; v++)
+        {
+            MVNDist *mvn = new MVNDist(NPARAMS);
+            NEWMAT::SymmetricMatrix cov(NPARAMS);
+            for (int r = 1; r <= NPARAMS; r++)
+            {
+                mvn->means(r) = v * 10 + r;
+                for (int c = 1; c < r; c++)
+                {
+                    cov(r, c) = 0.1 * (r + c);
+                }
+                cov(r, r) = 2 + r + 0.001 * v;
+            }
+            mvn->SetCovariance(cov);
+            m_mvns.push_back(mvn);
+        }
+    }
+
+    virtual void TearDown()
+    {
+        Clear(m_mvns);
+        Clear(m_loaded);
+        remove(FILENAME.c_str());
+    }
+
+    void Clear(std::vector<MVNDist *> &mvns)
+    {
+        for (unsigned int i = 0; i < mvns.size(); i++)
+        {
+            delete mvns[i];
+        }
+        mvns.clear();
+    }
+
+    static const int NVOXELS = 5000;
+    static const int NPARAMS = 4;
+    static const std::string FILENAME;
+    std::vector<MVNDist *> m_mvns;
+    std::vector<MVNDist *> m_loaded;
+};
+
+const int MVNTest::NVOXELS;
+const int MVNTest::NPARAMS;
+const std::string MVNTest::FILENAME = "test_mvn.mvnc";
+
+// Tests round trip of full covariance in the compact format
+TEST_F(MVNTest, CompactFull)
+{
+    MVNDist::SaveCompact(m_mvns, FILENAME);
+    ASSERT_TRUE(MVNDist::IsCompactFile(FILENAME));
+    MVNDist::LoadCompact(m_loaded, FILENAME, NULL);
+
+    ASSERT_EQ(m_loaded.size(), m_mvns.size());
+    for (int v = 0; v < NVOXELS; v++)
+    {
+        ASSERT_EQ(m_loaded[v]->GetSize(), NPARAMS);
+        for (int r = 1; r <= NPARAMS; r++)
+        {
+            ASSERT_FLOAT_EQ(m_mvns[v]->means(r), m_loaded[v]->means(r));
+            for (int c = 1; c <= r; c++)
+            {
+                ASSERT_FLOAT_EQ(
+                    m_mvns[v]->GetCovariance()(r, c), m_loaded[v]->GetCovariance()(r, c));
+            }
+        }
+    }
+}
+
+// Tests diagonal-only compact format discards off-diagonal covariances
+TEST_F(MVNTest, CompactDiagOnly)
+{
+    MVNDist::SaveCompact(m_mvns, FILENAME, true);
+    MVNDist::LoadCompact(m_loaded, FILENAME, NULL);
+
+    ASSERT_EQ(m_loaded.size(), m_mvns.size());
+    for (int v = 0; v < NVOXELS; v++)
+    {
+        for (int r = 1; r <= NPARAMS; r++)
+        {
+            ASSERT_FLOAT_EQ(m_mvns[v]->means(r), m_loaded[v]->means(r));
+            ASSERT_FLOAT_EQ(m_mvns[v]->GetCovariance()(r, r), m_loaded[v]->GetCovariance()(r, r));
+            for (int c = 1; c < r; c++)
+            {
+                ASSERT_EQ(0, m_loaded[v]->GetCovariance()(r, c));
+            }
+        }
+    }
+}
+
+// Tests half precision compact format gives approximately correct covariances
+TEST_F(MVNTest, CompactHalf)
+{
+    MVNDist::SaveCompact(m_mvns, FILENAME, false, true);
+    MVNDist::LoadCompact(m_loaded, FILENAME, NULL);
+
+    ASSERT_EQ(m_loaded.size(), m_mvns.size());
+    for (int v = 0; v < NVOXELS; v++)
+    {
+        for (int r = 1; r <= NPARAMS; r++)
+        {
+            ASSERT_FLOAT_EQ(m_mvns[v]->means(r), m_loaded[v]->means(r));
+            ASSERT_FLOAT_EQ(m_mvns[v]->GetCovariance()(r, r), m_loaded[v]->GetCovariance()(r, r));
+            for (int c = 1; c < r; c++)
+            {
+                ASSERT_NEAR(m_mvns[v]->GetCovariance()(r, c), m_loaded[v]->GetCovariance()(r, c),
+                    0.001 * m_mvns[v]->GetCovariance()(r, r));
+            }
+        }
+    }
+}
+
+// Tests saving straight from the MVNs gives the same file as saving their voxel data
+TEST_F(MVNTest, CompactFromMVNsSameAsVoxelData)
+{
+    std::string VOXFILE = "test_mvn_voxeldata.mvnc";
+    NEWMAT::Matrix vols;
+    MVNDist::ToVoxelData(m_mvns, vols);
+    MVNDist::SaveCompact(vols, VOXFILE);
+    MVNDist::SaveCompact(m_mvns, FILENAME);
+
+    std::ifstream in1(FILENAME.c_str(), std::ios::in | std::ios::binary);
+    std::ifstream in2(VOXFILE.c_str(), std::ios::in | std::ios::binary);
+    std::string bytes1((std::istreambuf_iterator<char>(in1)), std::istreambuf_iterator<char>());
+    std::string bytes2((std::istreambuf_iterator<char>(in2)), std::istreambuf_iterator<char>());
+    remove(VOXFILE.c_str());
+    ASSERT_GT(bytes1.size(), 0u);
+    ASSERT_TRUE(bytes1 == bytes2);
+}
+
+// Tests reading a compact file a voxel at a time into existing storage
+TEST_F(MVNTest, CompactReaderIntoStore)
+{
+    MVNDist::SaveCompact(m_mvns, FILENAME);
+
+    MVNCompactReader reader(FILENAME, NVOXELS);
+    ASSERT_EQ(NVOXELS, reader.NumVoxels());
+    ASSERT_EQ(NPARAMS, reader.NumParams());
+    std::vector<MVNDist> store(NVOXELS, MVNDist(NPARAMS));
+    for (int v = 0; v < NVOXELS; v++)
+    {
+        reader.Next(store[v]);
+    }
+    ASSERT_THROW(reader.Next(store[0]), FabberInternalError);
+
+    for (int v = 0; v < NVOXELS; v++)
+    {
+        for (int r = 1; r <= NPARAMS; r++)
+        {
+            ASSERT_FLOAT_EQ(m_mvns[v]->means(r), store[v].means(r));
+            for (int c = 1; c <= r; c++)
+            {
+                ASSERT_FLOAT_EQ(m_mvns[v]->GetCovariance()(r, c), store[v].GetCovariance()(r, c));
+            }
+        }
+    }
+}
+
+// Tests the compact writer checks the voxels against its header
+TEST_F(MVNTest, CompactWriterVoxelCount)
+{
+    MVNCompactWriter writer(FILENAME, NPARAMS, 2);
+    writer.Add(m_mvns[0]->means, m_mvns[0]->GetCovariance());
+    ASSERT_THROW(writer.Close(), FabberInternalError);
+
+    NEWMAT::ColumnVector means(NPARAMS + 1);
+    means = 0;
+    ASSERT_THROW(writer.Add(means, m_mvns[1]->GetCovariance()), FabberInternalError);
+}
+
+// Tests that compact files are picked up when loading via run data options
+TEST_F(MVNTest, CompactFromRunData)
+{
+    MVNDist::SaveCompact(m_mvns, FILENAME);
+
+    FabberRunData rundata;
+    NEWMAT::Matrix coords(3, NVOXELS);
+    coords = 0;
+    rundata.SetVoxelCoords(coords);
+    rundata.Set("continue-from-mvn", FILENAME);
+    MVNDist::Load(m_loaded, "continue-from-mvn", rundata, NULL);
+
+    ASSERT_EQ(m_loaded.size(), m_mvns.size());
+    for (int v = 0; v < NVOXELS; v++)
+    {
+        for (int r = 1; r <= NPARAMS; r++)
+        {
+            ASSERT_FLOAT_EQ(m_mvns[v]->means(r), m_loaded[v]->means(r));
+        }
+    }
+}
+
+// Tests that a compact file with the wrong number of voxels is rejected
+TEST_F(MVNTest, CompactVoxelCountMismatch)
+{
+    MVNDist::SaveCompact(m_mvns, FILENAME);
+    ASSERT_EQ(NVOXELS, MVNDist::GetCompactFileVoxels(FILENAME));
+    ASSERT_THROW(MVNDist::LoadCompact(m_loaded, FILENAME, NULL, NVOXELS + 1), FabberRunDataError);
+
+    FabberRunData rundata;
+    NEWMAT::Matrix coords(3, NVOXELS - 1);
+    coords = 0;
+    rundata.SetVoxelCoords(coords);
+    rundata.Set("continue-from-mvn", FILENAME);
+    ASSERT_THROW(
+        MVNDist::Load(m_loaded, "continue-from-mvn", rundata, NULL), FabberRunDataError);
+}
+
+// Tests that compact files are little-endian whatever the platform
+TEST_F(MVNTest, CompactLittleEndian)
+{
+    MVNDist::SaveCompact(m_mvns, FILENAME, true);
+
+    std::ifstream in(FILENAME.c_str(), std::ios::in | std::ios::binary);
+    unsigned char header[24];
+    in.read((char *)header, sizeof(header));
+    ASSERT_TRUE(in.good());
+    ASSERT_EQ(0, memcmp(header, "FABMVNC1", 8));
+
+    // nparams then nvoxels
+    ASSERT_EQ(NPARAMS, header[8]);
+    ASSERT_EQ(0, header[9] | header[10] | header[11]);
+    ASSERT_EQ(NVOXELS & 0xff, header[12]);
+    ASSERT_EQ((NVOXELS >> 8) & 0xff, header[13]);
+    ASSERT_EQ(0, header[14] | header[15]);
+
+    // First block is 4096 voxels of 2 * NPARAMS floats
+    unsigned char sizes[8];
+    in.read((char *)sizes, sizeof(sizes));
+    unsigned int raw_size = sizes[0] | (sizes[1] << 8) | (sizes[2] << 16) | (sizes[3] << 24);
+    ASSERT_EQ(4096u * 2 * NPARAMS * 4, raw_size);
+}
+
+// Tests that saving in the compact format goes through the run data, so
+// the result can be retrieved from memory rather than written to a file
+TEST_F(MVNTest, CompactSaveToRunData)
+{
+    std::string OUTFILE = "test_mvn_rundata";
+    remove((OUTFILE + ".mvnc").c_str());
+
+    FabberRunData rundata;
+    rundata.Set("save-mvn-format", "compact");
+    MVNDist::Save(m_mvns, OUTFILE, rundata);
+    ASSERT_FALSE(MVNDist::IsCompactFile(OUTFILE + ".mvnc"));
+
+    NEWMAT::Matrix saved = rundata.GetVoxelData(OUTFILE);
+    ASSERT_EQ(NVOXELS, saved.Ncols());
+    MVNDist::Load(m_loaded, saved, NULL);
+    ASSERT_EQ(m_loaded.size(), m_mvns.size());
+    for (int v = 0; v < NVOXELS; v++)
+    {
+        for (int r = 1; r <= NPARAMS; r++)
+        {
+            ASSERT_FLOAT_EQ(m_mvns[v]->means(r), m_loaded[v]->means(r));
+        }
+    }
+}
+
+#ifndef NO_NEWIMAGE
+// Tests that a compact file can be used as the main data without a mask, as
+// mvntool does, with one voxel per MVN
+TEST_F(MVNTest, CompactExtentWithoutMask)
+{
+    MVNDist::SaveCompact(m_mvns, FILENAME);
+
+    FabberRunDataNewimage rundata;
+    rundata.Set("data", FILENAME);
+    rundata.SetExtentFromData();
+    ASSERT_EQ(NVOXELS, rundata.GetVoxelCoords().Ncols());
+
+    MVNDist::Load(m_loaded, "data", rundata, NULL);
+    ASSERT_EQ(m_loaded.size(), m_mvns.size());
+    for (int r = 1; r <= NPARAMS; r++)
+    {
+        ASSERT_FLOAT_EQ(m_mvns[NVOXELS - 1]->means(r), m_loaded[NVOXELS - 1]->means(r));
+    }
+}
+#endif
+
+// Tests that a non-MVN file is not detected as compact
+TEST_F(MVNTest, NotCompactFile)
+{
+    std::ofstream os(FILENAME.c_str());
+    os << "--not-an-mvn" << std::endl;
+    os.close();
+    ASSERT_FALSE(MVNDist::IsCompactFile(FILENAME));
+    ASSERT_FALSE(MVNDist::IsCompactFile("no_such_file.mvnc"));
+    ASSERT_THROW(MVNDist::LoadCompact(m_loaded, FILENAME, NULL), FabberRunDataError);
+}
+}
@@ -1,9 +1,13 @@
 #include "gtest/gtest.h"
 
+#include "covariance_cache.h"
 #include "priors.h"
 
 #include "rundata.h"
 
+#include <math.h>
+#include <vector>
+
 // Tests for the base class - static ExpandPriorTypesString is the only relevant method
 
 class PriorTest : public ::testing::Test
@@ -251,3 +255,202 @@ TEST_F(ImagePriorTest, ApplyToMVN)
         ASSERT_EQ(mvn.GetCovariance()(PARAM_IDX + 1, PARAM_IDX + 1), PRIOR_VAR);
     }
 }
+
+class SpatialPriorTest : public ::testing::Test
+{
+};
+
+// Tests the m prior mean is the average of the neighbouring posterior means,
+// with voxels outside the boundary counting as zero
+TEST_F(SpatialPriorTest, MrfMean)
+{
+    FabberRunData rundata;
+    rundata.Set("spatial-dims", "1");
+
+    Parameter p(PARAM_IDX, PARAM_NAME, DistParams(PRIOR_MEAN, PRIOR_VAR),
+        DistParams(POST_MEAN, POST_VAR), PRIOR_SPATIAL_m);
+    SpatialPrior prior(p, rundata);
+
+    // A line of voxels each of which is a neighbour of the next
+    RunContext ctx(NUM_VOXELS);
+    for (int i = 1; i <= NUM_VOXELS; i++)
+    {
+        MVNDist post(PARAM_IDX + 7);
+        post.means = 0;
+        post.means(PARAM_IDX + 1) = i;
+        ctx.fwd_post.push_back(post);
+
+        std::vector<int> nbs;
+        if (i > 1)
+            nbs.push_back(i - 1);
+        if (i < NUM_VOXELS)
+            nbs.push_back(i + 1);
+        ctx.neighbours.push_back(nbs);
+        ctx.neighbours2.push_back(std::vector<int>());
+    }
+
+    MVNDist mvn(PARAM_IDX + 7);
+    for (int i = 1; i <= NUM_VOXELS; i++)
+    {
+        ctx.v = i;
+        prior.ApplyToMVN(&mvn, ctx);
+        double expected = i;
+        if (i == 1)
+            expected = 1;
+        else if (i == NUM_VOXELS)
+            expected = double(NUM_VOXELS - 1) / 2;
+        ASSERT_NEAR(mvn.means(PARAM_IDX + 1), expected, 1e-6 * NUM_VOXELS);
+    }
+}
+
+class DistancePriorTest : public ::testing::Test
+{
+};
+
+// Tests an outlying voxel is pulled towards its neighbours, and a uniform
+// region equal to the prior mean is left alone
+TEST_F(DistancePriorTest, ApplyToMVN)
+{
+    NEWMAT::Matrix coords(3, NUM_VOXELS);
+    coords = 0;
+    for (int i = 1; i <= NUM_VOXELS; i++)
+        coords(1, i) = i;
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(coords);
+    rundata.Set("dist-prior-delta", "2");
+
+    Parameter p(PARAM_IDX, PARAM_NAME, DistParams(PRIOR_MEAN, PRIOR_VAR),
+        DistParams(POST_MEAN, POST_VAR), PRIOR_SPATIAL_D);
+    DistancePrior prior(p, rundata);
+
+    const int OUTLIER = NUM_VOXELS / 2;
+    RunContext ctx(NUM_VOXELS);
+    for (int i = 1; i <= NUM_VOXELS; i++)
+    {
+        MVNDist post(PARAM_IDX + 7);
+        post.means = 0;
+        post.means(PARAM_IDX + 1) = (i == OUTLIER) ? PRIOR_MEAN + 10 : PRIOR_MEAN;
+        ctx.fwd_post.push_back(post);
+    }
+
+    // First iteration uses the non-spatial prior
+    MVNDist mvn(PARAM_IDX + 7);
+    ctx.it = 0;
+    prior.ApplyToMVN(&mvn, ctx);
+    ASSERT_EQ(mvn.means(PARAM_IDX + 1), PRIOR_MEAN);
+
+    ctx.it = 1;
+    for (int i = 1; i <= NUM_VOXELS; i++)
+    {
+        ctx.v = i;
+        prior.ApplyToMVN(&mvn, ctx);
+        double mean = mvn.means(PARAM_IDX + 1);
+        ASSERT_GT(mvn.GetPrecisions()(PARAM_IDX + 1, PARAM_IDX + 1), 0);
+        if (i == OUTLIER)
+        {
+            ASSERT_LT(mean, PRIOR_MEAN + 5);
+        }
+        else if (abs(i - OUTLIER) > 4)
+        {
+            ASSERT_NEAR(mean, PRIOR_MEAN, 0.5);
+        }
+    }
+}
+
+class CovarianceCacheTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        m_coords.ReSize(3, NX * NY * NZ);
+        int v = 1;
+        for (int z = 0; z < NZ; z++)
+        {
+            for (int y = 0; y < NY; y++)
+            {
+                for (int x = 0; x < NX; x++)
+                {
+                    m_coords(1, v) = x;
+                    m_coords(2, v) = y;
+                    m_coords(3, v) = z;
+                    v++;
+                }
+            }
+        }
+        m_covar.CalcDistances(m_coords, "dist1");
+    }
+
+    /** Form C(delta) as a dense matrix and invert it */
+    NEWMAT::SymmetricMatrix DenseInverse(double delta)
+    {
+        int n = m_covar.GetNumVoxels();
+        NEWMAT::SymmetricMatrix C(n);
+        std::vector<double> e(n, 0), col;
+        for (int j = 0; j < n; j++)
+        {
+            e[j] = 1;
+            m_covar.Multiply(delta, e, col);
+            for (int i = j; i < n; i++)
+                C(i + 1, j + 1) = col[i];
+            e[j] = 0;
+        }
+        return C.i();
+    }
+
+    static const int NX = 6;
+    static const int NY = 5;
+    static const int NZ = 4;
+    NEWMAT::Matrix m_coords;
+    CovarianceCache m_covar;
+};
+
+// Tests preconditioned conjugate gradients solves C x = b
+TEST_F(CovarianceCacheTest, Solve)
+{
+    int n = m_covar.GetNumVoxels();
+    std::vector<double> b(n), x, Cx;
+    for (int v = 0; v < n; v++)
+        b[v] = sin(0.3 * v) + 0.1 * (v % 5);
+
+    double deltas[] = { 1.5, 2.5, 3.5 };
+    for (int d = 0; d < 3; d++)
+    {
+        x.clear();
+        int its = m_covar.Solve(deltas[d], b, x);
+        ASSERT_GT(its, 0);
+        m_covar.Multiply(deltas[d], x, Cx);
+        for (int v = 0; v < n; v++)
+        {
+            ASSERT_NEAR(b[v], Cx[v], 1e-6);
+        }
+
+        // Starting from the solution needs no further iterations
+        ASSERT_EQ(0, m_covar.Solve(deltas[d], b, x));
+    }
+}
+
+// Tests the probed diagonal of C^-1 against a dense inverse
+TEST_F(CovarianceCacheTest, CinvDiagonal)
+{
+    // Relative tolerances for each delta, from the documented accuracy of probing
+    double deltas[] = { 1.5, 2.5 };
+    double tolerance[] = { 0.02, 0.15 };
+    double mean_tolerance[] = { 0.01, 0.05 };
+    for (int d = 0; d < 2; d++)
+    {
+        NEWMAT::SymmetricMatrix Cinv = DenseInverse(deltas[d]);
+        const std::vector<double> &diag = m_covar.GetCinvDiagonal(deltas[d]);
+        ASSERT_EQ(m_covar.GetNumVoxels(), (int)diag.size());
+        double mean_error = 0;
+        for (int v = 0; v < m_covar.GetNumVoxels(); v++)
+        {
+            double exact = Cinv(v + 1, v + 1);
+            ASSERT_GE(exact, 1);
+            ASSERT_GE(diag[v], 1);
+            ASSERT_NEAR(exact, diag[v], tolerance[d] * exact);
+            mean_error += fabs(diag[v] - exact) / exact;
+        }
+        ASSERT_LT(mean_error / m_covar.GetNumVoxels(), mean_tolerance[d]);
+    }
+}
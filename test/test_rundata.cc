@@ -3,12 +3,25 @@
 
 #include "gtest/gtest.h"
 
+#include "data_cache.h"
 #include "easylog.h"
 #include "rundata.h"
+#include "rundata_array.h"
+#include "rundata_coarse.h"
+#include "rundata_subset.h"
 #include "setup.h"
 
+#ifndef NO_NEWIMAGE
+#include "newimage/newimageall.h"
+#include "rundata_newimage.h"
+#endif
+
 #include <fstream>
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 namespace
 {
 // The fixture for testing class Foo.
@@ -202,6 +215,42 @@ TEST_F(RunDataTest, MultiDataInconsistent)
     ASSERT_THROW(NEWMAT::Matrix data = rundata.GetMainVoxelData(), InvalidOptionValue);
 }
 
+// Tests multi-data sets referenced indirectly by option
+TEST_F(RunDataTest, MultiDataIndirect)
+{
+    int NTIMES = 3;
+    int NVOXELS = 4;
+    NEWMAT::Matrix tes1, tes2;
+    tes1.ReSize(NTIMES, NVOXELS);
+    tes2.ReSize(NTIMES, NVOXELS);
+    for (int t = 1; t <= NTIMES; t++)
+    {
+        for (int v = 1; v <= NVOXELS; v++)
+        {
+            tes1(t, v) = t * 10 + v;
+            tes2(t, v) = -(t * 10 + v);
+        }
+    }
+
+    FabberRunData rundata;
+    rundata.SetVoxelData("te1", tes1);
+    rundata.SetVoxelData("te2", tes2);
+    rundata.Set("data1", "te1");
+    rundata.Set("data2", "te2");
+    NEWMAT::Matrix data = rundata.GetMainVoxelData();
+
+    ASSERT_EQ(data.Nrows(), NTIMES * 2);
+    ASSERT_EQ(data.Ncols(), NVOXELS);
+    for (int t = 1; t <= NTIMES; t++)
+    {
+        for (int v = 1; v <= NVOXELS; v++)
+        {
+            ASSERT_FLOAT_EQ(data(2 * t - 1, v), t * 10 + v);
+            ASSERT_FLOAT_EQ(data(2 * t, v), -(t * 10 + v));
+        }
+    }
+}
+
 // Tests that we can read config from a .fab file
 TEST_F(RunDataTest, OptionsFile)
 {
@@ -511,4 +560,552 @@ TEST_F(RunDataTest, ClearVoxelData)
     ASSERT_THROW(rundata.GetVoxelData("data2"), DataNotFound);
     ASSERT_THROW(rundata.GetVoxelData("data3"), DataNotFound);
 }
+
+// Tests co-ordinates and neighbours generated directly from a mask match
+// those calculated from an explicit co-ordinate matrix
+TEST_F(RunDataTest, CoordsFromMask)
+{
+    int NX = 4, NY = 3, NZ = 2;
+    vector<int> mask(NX * NY * NZ);
+    NEWMAT::Matrix voxelCoords(3, NX * NY * NZ);
+    int nv = 0;
+    for (int z = 0; z < NZ; z++)
+    {
+        for (int y = 0; y < NY; y++)
+        {
+            for (int x = 0; x < NX; x++)
+            {
+                int idx = z * NX * NY + y * NX + x;
+                mask[idx] = (idx % 3 != 1);
+                if (mask[idx])
+                {
+                    nv++;
+                    voxelCoords(1, nv) = x;
+                    voxelCoords(2, nv) = y;
+                    voxelCoords(3, nv) = z;
+                }
+            }
+        }
+    }
+    voxelCoords = voxelCoords.Columns(1, nv);
+
+    FabberRunData rundata;
+    rundata.SetExtent(NX, NY, NZ);
+    rundata.SetVoxelCoordsFromMask(&mask[0]);
+    FabberRunData rundata2;
+    rundata2.SetVoxelCoords(voxelCoords);
+
+    const NEWMAT::Matrix &coords = rundata.GetVoxelCoords();
+    ASSERT_EQ(3, coords.Nrows());
+    ASSERT_EQ(nv, coords.Ncols());
+    for (int v = 1; v <= nv; v++)
+    {
+        ASSERT_EQ(voxelCoords(1, v), coords(1, v));
+        ASSERT_EQ(voxelCoords(2, v), coords(2, v));
+        ASSERT_EQ(voxelCoords(3, v), coords(3, v));
+    }
+    ASSERT_EQ(rundata2.GetNeighbours(), rundata.GetNeighbours());
+    ASSERT_EQ(rundata2.GetSecondNeighbours(), rundata.GetSecondNeighbours());
+
+    // No mask includes every voxel
+    rundata.SetVoxelCoordsFromMask((const int *)NULL);
+    ASSERT_EQ(NX * NY * NZ, rundata.GetVoxelCoords().Ncols());
+}
+
+// Tests reading and writing data using externally owned buffers
+TEST_F(RunDataTest, ArrayBuffers)
+{
+    int NX = 3, NY = 2, NZ = 2, NT = 4;
+    int NVOL = NX * NY * NZ;
+    vector<int> mask(NVOL);
+    int nv = 0;
+    for (int i = 0; i < NVOL; i++)
+    {
+        mask[i] = (i % 2);
+        nv += mask[i];
+    }
+
+    // Full volume data and the equivalent masked voxel-major data
+    vector<float> full(NVOL * NT), masked(nv * NT);
+    for (int t = 0; t < NT; t++)
+    {
+        int v = 0;
+        for (int i = 0; i < NVOL; i++)
+        {
+            full[t * NVOL + i] = i * 10 + t;
+            if (mask[i])
+            {
+                masked[v * NT + t] = i * 10 + t;
+                v++;
+            }
+        }
+    }
+
+    FabberRunDataArray rundata;
+    rundata.SetExtent(NX, NY, NZ, &mask[0]);
+    rundata.SetVoxelDataBuffer("full", NT, &full[0], false);
+    rundata.SetVoxelDataBuffer("masked", NT, &masked[0], true);
+
+    const NEWMAT::Matrix &fulldata = rundata.GetVoxelData("full");
+    ASSERT_EQ(NT, fulldata.Nrows());
+    ASSERT_EQ(nv, fulldata.Ncols());
+    const NEWMAT::Matrix &maskeddata = rundata.GetVoxelData("masked");
+    ASSERT_EQ(NT, maskeddata.Nrows());
+    ASSERT_EQ(nv, maskeddata.Ncols());
+    for (int t = 1; t <= NT; t++)
+    {
+        for (int v = 1; v <= nv; v++)
+        {
+            ASSERT_FLOAT_EQ(fulldata(t, v), maskeddata(t, v));
+        }
+    }
+
+    // Outputs written directly into buffers in both layouts
+    NEWMAT::Matrix out = fulldata;
+    vector<float> fullout(NVOL * NT, -1), maskedout(nv * NT, -1);
+    rundata.SetOutputBuffer("fullout", NVOL * NT, &fullout[0], false);
+    rundata.SetOutputBuffer("maskedout", nv * NT, &maskedout[0], true);
+    rundata.SaveVoxelData("fullout", out);
+    rundata.SaveVoxelData("maskedout", out);
+    for (int i = 0; i < NVOL * NT; i++)
+    {
+        if (mask[i % NVOL])
+            ASSERT_FLOAT_EQ(full[i], fullout[i]);
+        else
+            ASSERT_FLOAT_EQ(0, fullout[i]);
+    }
+    for (int i = 0; i < nv * NT; i++)
+    {
+        ASSERT_FLOAT_EQ(masked[i], maskedout[i]);
+    }
+    ASSERT_THROW(rundata.GetVoxelData("fullout"), DataNotFound);
+
+    // Output buffer too small
+    rundata.SetOutputBuffer("small", nv * NT - 1, &maskedout[0], true);
+    ASSERT_THROW(rundata.SaveVoxelData("small", out), FabberRunDataError);
+}
+
+// Tests downsampling of voxel data for multiresolution fitting
+TEST_F(RunDataTest, CoarseData)
+{
+    int NX = 4, NY = 3, NZ = 2;
+    vector<int> mask(NX * NY * NZ);
+    for (unsigned int i = 0; i < mask.size(); i++)
+    {
+        mask[i] = (i != 0);
+    }
+
+    FabberRunData rundata;
+    rundata.SetExtent(NX, NY, NZ);
+    rundata.SetVoxelCoordsFromMask(&mask[0]);
+    rundata.Set("model", "poly");
+    const NEWMAT::Matrix &coords = rundata.GetVoxelCoords();
+    int nv = coords.Ncols();
+    NEWMAT::Matrix data(2, nv);
+    for (int v = 1; v <= nv; v++)
+    {
+        data(1, v) = coords(1, v);
+        data(2, v) = v;
+    }
+    rundata.SetVoxelData("data", data);
+
+    FabberRunDataCoarse coarse(rundata, 3);
+    ASSERT_EQ("poly", coarse.GetString("model"));
+
+    // Blocks are 2x2x2 apart from the edge, and are ordered by z, y, x
+    const NEWMAT::Matrix &coarse_coords = coarse.GetVoxelCoords();
+    ASSERT_EQ(4, coarse_coords.Ncols());
+    const vector<int> &coarse_voxels = coarse.GetCoarseVoxels();
+    ASSERT_EQ(nv, (int)coarse_voxels.size());
+    for (int v = 1; v <= nv; v++)
+    {
+        int c = coarse_voxels[v - 1];
+        ASSERT_EQ(int(coords(1, v)) / 2, coarse_coords(1, c));
+        ASSERT_EQ(int(coords(2, v)) / 2, coarse_coords(2, c));
+        ASSERT_EQ(int(coords(3, v)) / 2, coarse_coords(3, c));
+    }
+
+    // Data is the mean of the masked voxels in each block
+    const NEWMAT::Matrix &coarse_data = coarse.GetMainVoxelData();
+    ASSERT_EQ(2, coarse_data.Nrows());
+    ASSERT_EQ(4, coarse_data.Ncols());
+    for (int c = 1; c <= 4; c++)
+    {
+        double sum1 = 0, sum2 = 0;
+        int n = 0;
+        for (int v = 1; v <= nv; v++)
+        {
+            if (coarse_voxels[v - 1] == c)
+            {
+                sum1 += data(1, v);
+                sum2 += data(2, v);
+                n++;
+            }
+        }
+        ASSERT_FLOAT_EQ(sum1 / n, coarse_data(1, c));
+        ASSERT_FLOAT_EQ(sum2 / n, coarse_data(2, c));
+    }
+
+    // 2x2 in-plane blocks only
+    FabberRunDataCoarse coarse2d(rundata, 2);
+    ASSERT_EQ(8, coarse2d.GetVoxelCoords().Ncols());
+    ASSERT_EQ(8, (int)coarse2d.GetNeighbours(2).size());
+
+    ASSERT_THROW(coarse.GetVoxelData("nonexistent"), DataNotFound);
+}
+
+// Tests saving and loading preprocessed data in the data cache
+TEST_F(RunDataTest, DataCache)
+{
+    string INPUT = "test_cache_input.tmp";
+    string CACHEDIR = "test_cache.tmp";
+    ofstream os(INPUT.c_str());
+    os << "some input data" << endl;
+    os.close();
+
+    NEWMAT::Matrix coords(3, 4), data(2, 4), suppdata;
+    vector<vector<int> > neighbours(4), neighbours2(4);
+    for (int v = 1; v <= 4; v++)
+    {
+        coords(1, v) = v - 1;
+        coords(2, v) = 0;
+        coords(3, v) = 0;
+        data(1, v) = v * 1.5;
+        data(2, v) = -v;
+        if (v > 1)
+            neighbours[v - 1].push_back(v - 1);
+        if (v < 4)
+            neighbours[v - 1].push_back(v + 1);
+    }
+    neighbours2[0].push_back(3);
+
+    DataCache cache(CACHEDIR);
+    cache.AddFile(INPUT);
+    cache.AddOption("data-order", "interleave");
+
+    NEWMAT::Matrix coords_in, data_in, suppdata_in;
+    vector<vector<int> > neighbours_in, neighbours2_in;
+    remove(cache.GetFilename().c_str());
+    ASSERT_FALSE(cache.Load(coords_in, data_in, suppdata_in, neighbours_in, neighbours2_in));
+
+    cache.Save(coords, data, suppdata, neighbours, neighbours2);
+    ASSERT_TRUE(cache.Load(coords_in, data_in, suppdata_in, neighbours_in, neighbours2_in));
+    ASSERT_EQ(3, coords_in.Nrows());
+    ASSERT_EQ(4, coords_in.Ncols());
+    ASSERT_EQ(2, data_in.Nrows());
+    ASSERT_EQ(4, data_in.Ncols());
+    ASSERT_EQ(0, suppdata_in.Nrows());
+    for (int v = 1; v <= 4; v++)
+    {
+        ASSERT_EQ(coords(1, v), coords_in(1, v));
+        ASSERT_FLOAT_EQ(data(1, v), data_in(1, v));
+        ASSERT_FLOAT_EQ(data(2, v), data_in(2, v));
+        ASSERT_EQ(neighbours[v - 1], neighbours_in[v - 1]);
+        ASSERT_EQ(neighbours2[v - 1], neighbours2_in[v - 1]);
+    }
+
+    // Neighbour lists are optional
+    vector<vector<int> > none;
+    cache.Save(coords, data, suppdata, none, none);
+    ASSERT_TRUE(cache.Load(coords_in, data_in, suppdata_in, neighbours_in, neighbours2_in));
+    ASSERT_EQ(4, data_in.Ncols());
+    ASSERT_EQ(0, (int)neighbours_in.size());
+    ASSERT_EQ(0, (int)neighbours2_in.size());
+
+    // Different options must give a different cache entry
+    DataCache cache2(CACHEDIR);
+    cache2.AddFile(INPUT);
+    cache2.AddOption("data-order", "concatenate");
+    ASSERT_NE(cache.GetFilename(), cache2.GetFilename());
+    ASSERT_FALSE(cache2.Load(coords_in, data_in, suppdata_in, neighbours_in, neighbours2_in));
+
+    remove(cache.GetFilename().c_str());
+    remove(CACHEDIR.c_str());
+    remove(INPUT.c_str());
+}
+
+#ifndef _WIN32
+namespace
+{
+struct CacheSaveJob
+{
+    DataCache *cache;
+    NEWMAT::Matrix *coords, *data, *suppdata;
+    vector<vector<int> > *neighbours;
+};
+
+void *SaveCacheRepeatedly(void *arg)
+{
+    CacheSaveJob &job = *static_cast<CacheSaveJob *>(arg);
+    for (int i = 0; i < 20; i++)
+    {
+        job.cache->Save(*job.coords, *job.data, *job.suppdata, *job.neighbours, *job.neighbours);
+    }
+    return NULL;
+}
+}
+
+// Tests threads of one process saving the same cache entry do not share a
+// temporary file, e.g. server jobs on the same data
+TEST_F(RunDataTest, DataCacheConcurrentSave)
+{
+    string INPUT = "test_cache_concurrent_input.tmp";
+    string CACHEDIR = "test_cache_concurrent.tmp";
+    ofstream os(INPUT.c_str());
+    os << "some input data" << endl;
+    os.close();
+
+    int NV = 1000;
+    NEWMAT::Matrix coords(3, NV), data(10, NV), suppdata;
+    vector<vector<int> > neighbours(NV);
+    for (int v = 1; v <= NV; v++)
+    {
+        coords(1, v) = v - 1;
+        coords(2, v) = 0;
+        coords(3, v) = 0;
+        for (int t = 1; t <= 10; t++)
+        {
+            data(t, v) = v * t;
+        }
+    }
+
+    DataCache cache(CACHEDIR);
+    cache.AddFile(INPUT);
+    remove(cache.GetFilename().c_str());
+
+    CacheSaveJob job = { &cache, &coords, &data, &suppdata, &neighbours };
+    vector<pthread_t> threads(4);
+    for (unsigned int t = 0; t < threads.size(); t++)
+    {
+        ASSERT_EQ(0, pthread_create(&threads[t], NULL, SaveCacheRepeatedly, &job));
+    }
+    for (unsigned int t = 0; t < threads.size(); t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    NEWMAT::Matrix coords_in, data_in, suppdata_in;
+    vector<vector<int> > neighbours_in, neighbours2_in;
+    ASSERT_TRUE(cache.Load(coords_in, data_in, suppdata_in, neighbours_in, neighbours2_in));
+    ASSERT_EQ(NV, data_in.Ncols());
+    for (int v = 1; v <= NV; v++)
+    {
+        for (int t = 1; t <= 10; t++)
+        {
+            ASSERT_FLOAT_EQ(data(t, v), data_in(t, v));
+        }
+    }
+
+    remove(cache.GetFilename().c_str());
+    remove(CACHEDIR.c_str());
+    remove(INPUT.c_str());
+}
+#endif
+
+// Tests neighbour lists are recalculated when a different number of spatial
+// dimensions is requested
+TEST_F(RunDataTest, NeighboursDims)
+{
+    int N = 3;
+    NEWMAT::Matrix coords(3, N * N * N);
+    int v = 1;
+    for (int z = 0; z < N; z++)
+    {
+        for (int y = 0; y < N; y++)
+        {
+            for (int x = 0; x < N; x++)
+            {
+                coords(1, v) = x;
+                coords(2, v) = y;
+                coords(3, v) = z;
+                v++;
+            }
+        }
+    }
+
+    // Centre voxel has 6 neighbours in 3D and 4 in its slice
+    int CENTRE = 14;
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(coords);
+    ASSERT_EQ(6, (int)rundata.GetNeighbours(3)[CENTRE - 1].size());
+    ASSERT_EQ(4, (int)rundata.GetNeighbours(2)[CENTRE - 1].size());
+    ASSERT_EQ(6, (int)rundata.GetNeighbours(3)[CENTRE - 1].size());
+
+    vector<int> second3d = rundata.GetSecondNeighbours(3)[CENTRE - 1];
+    vector<int> second2d = rundata.GetSecondNeighbours(2)[CENTRE - 1];
+    ASSERT_GT(second3d.size(), second2d.size());
+}
+
+#ifndef NO_NEWIMAGE
+// Tests the data cache when loading NIFTI data without a mask
+TEST_F(RunDataTest, DataCacheNoMask)
+{
+    string DATAFILE = "test_cache_data_tmp";
+    string CACHEDIR = "test_cache_nii.tmp";
+    int NX = 4, NY = 3, NZ = 2, NT = 2;
+    NEWIMAGE::volume4D<float> vol(NX, NY, NZ, NT);
+    for (int z = 0; z < NZ; z++)
+        for (int y = 0; y < NY; y++)
+            for (int x = 0; x < NX; x++)
+                for (int t = 0; t < NT; t++)
+                    vol(x, y, z, t) = x + 10 * y + 100 * z + 1000 * t;
+    save_volume4D(vol, DATAFILE);
+
+    // First run fills the cache, the second loads from it and adds the
+    // neighbour lists, the third loads them as well
+    NEWMAT::Matrix data[3], coords[3];
+    for (int run = 0; run < 3; run++)
+    {
+        stringstream logstr;
+        EasyLog log;
+        log.StartLog(logstr);
+        FabberRunDataNewimage rundata;
+        rundata.SetLogger(&log);
+        rundata.Set("data", DATAFILE);
+        rundata.Set("data-cache", CACHEDIR);
+        rundata.SetExtentFromData();
+        coords[run] = rundata.GetVoxelCoords();
+        data[run] = rundata.GetMainVoxelData();
+        ASSERT_EQ(4, (int)rundata.GetNeighbours(2)[NX + 1].size());
+        if (run > 0)
+        {
+            ASSERT_EQ(NX * NY * NZ, (int)rundata.GetSecondNeighbours(3).size());
+        }
+        log.StopLog();
+        bool loaded_neighbours = logstr.str().find("and neighbour lists") != string::npos;
+        ASSERT_EQ(run == 2, loaded_neighbours);
+    }
+
+    ASSERT_EQ(NX * NY * NZ, coords[1].Ncols());
+    ASSERT_EQ(NT, data[1].Nrows());
+    ASSERT_EQ(NX * NY * NZ, data[1].Ncols());
+    for (int v = 1; v <= NX * NY * NZ; v++)
+    {
+        for (int d = 1; d <= 3; d++)
+        {
+            ASSERT_EQ(coords[0](d, v), coords[1](d, v));
+        }
+        for (int t = 1; t <= NT; t++)
+        {
+            ASSERT_FLOAT_EQ(data[0](t, v), data[1](t, v));
+        }
+    }
+
+    remove((DATAFILE + ".nii.gz").c_str());
+    int ret = system(("rm -rf " + CACHEDIR).c_str());
+    if (ret != 0)
+        cerr << "WARNING: failed to remove cache directory" << endl;
+}
+#endif
+
+#ifndef NO_NEWIMAGE
+// Tests a subset of the voxels of a NIFTI run, as used by each process of a
+// domain-decomposed run, gets the same data as the full run from its slices
+TEST_F(RunDataTest, SubsetFromSlices)
+{
+    string DATAFILE = "test_subset_data_tmp";
+    string MASKFILE = "test_subset_mask_tmp";
+    int NX = 4, NY = 3, NZ = 5, NT = 2;
+    NEWIMAGE::volume4D<float> vol(NX, NY, NZ, NT);
+    NEWIMAGE::volume<float> mask(NX, NY, NZ);
+    for (int z = 0; z < NZ; z++)
+        for (int y = 0; y < NY; y++)
+            for (int x = 0; x < NX; x++)
+            {
+                mask(x, y, z) = (x > 0) ? 1 : 0;
+                for (int t = 0; t < NT; t++)
+                    vol(x, y, z, t) = x + 10 * y + 100 * z + 1000 * t;
+            }
+    save_volume4D(vol, DATAFILE);
+    save_volume(mask, MASKFILE);
+
+    FabberRunDataNewimage rundata;
+    rundata.Set("data", DATAFILE);
+    rundata.Set("mask", MASKFILE);
+    rundata.SetExtentFromData();
+    const NEWMAT::Matrix &coords = rundata.GetVoxelCoords();
+
+    // Slices 1 and 2 plus the first voxel of slice 3
+    int per_slice = (NX - 1) * NY;
+    vector<int> voxels;
+    for (int v = per_slice + 1; v <= 3 * per_slice + 1; v++)
+    {
+        voxels.push_back(v);
+    }
+    FabberRunDataSubset subset(rundata, voxels);
+    NEWMAT::Matrix data = subset.GetMainVoxelData();
+    ASSERT_EQ(NT, data.Nrows());
+    ASSERT_EQ((int)voxels.size(), data.Ncols());
+    for (unsigned int i = 0; i < voxels.size(); i++)
+    {
+        int x = int(coords(1, voxels[i]));
+        int y = int(coords(2, voxels[i]));
+        int z = int(coords(3, voxels[i]));
+        for (int t = 0; t < NT; t++)
+        {
+            ASSERT_FLOAT_EQ(vol(x, y, z, t), data(t + 1, i + 1));
+        }
+    }
+
+    // Same data as selecting from the full data
+    NEWMAT::Matrix full = rundata.GetMainVoxelData();
+    for (unsigned int i = 0; i < voxels.size(); i++)
+    {
+        ASSERT_FLOAT_EQ(full(1, voxels[i]), data(1, i + 1));
+    }
+
+    remove((DATAFILE + ".nii.gz").c_str());
+    remove((MASKFILE + ".nii.gz").c_str());
+}
+#endif
+
+#ifndef NO_NEWIMAGE
+// Tests voxel list output with more voxels than fit in one NIFTI dimension
+TEST_F(RunDataTest, VoxelListLarge)
+{
+    int NX = 200;
+    int NY = 200;
+    int NVOXELS = NX * NY;
+    string FILENAME = "test_voxellist_tmp";
+
+    NEWMAT::Matrix coords(3, NVOXELS), data(2, NVOXELS);
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        coords(1, v) = (v - 1) % NX;
+        coords(2, v) = (v - 1) / NX;
+        coords(3, v) = 0;
+        data(1, v) = v;
+        data(2, v) = -v;
+    }
+
+    FabberRunDataNewimage rundata;
+    rundata.SetVoxelCoords(coords);
+    rundata.Set("sparse-output", "voxellist");
+    rundata.SaveVoxelData(FILENAME, data);
+
+    // Voxels fill x and continue along y
+    NEWIMAGE::volume4D<float> vol;
+    read_volume4D(vol, FILENAME);
+    ASSERT_EQ(32767, vol.xsize());
+    ASSERT_EQ(2, vol.ysize());
+    ASSERT_EQ(1, vol.zsize());
+    ASSERT_EQ(2, vol.tsize());
+    ASSERT_FLOAT_EQ(6, vol(5, 0, 0, 0));
+    ASSERT_FLOAT_EQ(32767 + 6, vol(5, 1, 0, 0));
+    ASSERT_FLOAT_EQ(-NVOXELS, vol(NVOXELS - 32767 - 1, 1, 0, 1));
+
+    // Co-ordinates are in the same order, with -1 after the last voxel
+    NEWIMAGE::volume4D<float> coordvol;
+    read_volume4D(coordvol, "voxel_coords");
+    ASSERT_EQ(32767, coordvol.xsize());
+    ASSERT_EQ(2, coordvol.ysize());
+    ASSERT_EQ(3, coordvol.tsize());
+    ASSERT_FLOAT_EQ(NX - 1, coordvol(NVOXELS - 32767 - 1, 1, 0, 0));
+    ASSERT_FLOAT_EQ(NY - 1, coordvol(NVOXELS - 32767 - 1, 1, 0, 1));
+    ASSERT_FLOAT_EQ(-1, coordvol(NVOXELS - 32767, 1, 0, 0));
+
+    remove((FILENAME + ".nii.gz").c_str());
+    remove("voxel_coords.nii.gz");
+}
+#endif
 }
@@ -0,0 +1,439 @@
+// Tests for communication between the processes of a domain-decomposed run
+//
+// Each rank other than 0 runs in a child process created with fork. Rank 0
+// runs in the test process and the results of the others are sent back to
+// it through pipes
+
+#include "gtest/gtest.h"
+
+#include "easylog.h"
+#include "rundata.h"
+#include "setup.h"
+#include "transport.h"
+
+#include <newmat.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#ifndef _WIN32
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+struct Process
+{
+    Process()
+        : rank(0)
+        , size(1)
+        , seconds(0)
+    {
+    }
+
+    int rank;
+    int size;
+    string error;
+
+    // Extra options, and what a process should do instead of taking part in
+    // collective operations: abort or stall
+    map<string, string> options;
+    string action;
+
+    // Time taken to fail
+    double seconds;
+
+    // Results of collective operations
+    vector<double> sum;
+    vector<double> from_prev, from_next;
+    vector<vector<double> > gathered;
+
+    // Options and results of a VB run. Only rank 0 has results
+    NEWMAT::Matrix coords, data, mean, iterations, diag_evaluations;
+};
+
+double Now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void SetDomainOptions(FabberRunData &rundata, const Process &proc)
+{
+    rundata.Set("domain-transport", "socket");
+    rundata.Set("domain-size", proc.size);
+    rundata.Set("domain-rank", proc.rank);
+    rundata.Set("domain-socket-dir", ".");
+    for (map<string, string>::const_iterator iter = proc.options.begin();
+         iter != proc.options.end(); ++iter)
+    {
+        rundata.Set(iter->first, iter->second);
+    }
+}
+
+void Collectives(Process &proc)
+{
+    FabberRunData rundata(false);
+    SetDomainOptions(rundata, proc);
+    auto_ptr<Transport> transport(Transport::NewFromRunData(rundata));
+
+    proc.sum.push_back(proc.rank);
+    proc.sum.push_back(1);
+    transport->SumAll(proc.sum);
+
+    vector<double> mine(proc.rank + 1, proc.rank);
+    if (proc.rank > 0)
+        transport->Exchange(proc.rank - 1, mine, proc.from_prev);
+    if (proc.rank < proc.size - 1)
+        transport->Exchange(proc.rank + 1, mine, proc.from_next);
+
+    transport->Gather(vector<double>(1, proc.rank * 10), proc.gathered);
+}
+
+// Sum over processes, where one process may fail or stop responding
+void Failures(Process &proc)
+{
+    FabberRunData rundata(false);
+    SetDomainOptions(rundata, proc);
+    auto_ptr<Transport> transport(Transport::NewFromRunData(rundata));
+
+    if (proc.action == "abort")
+    {
+        transport->Abort("test failure");
+        return;
+    }
+    else if (proc.action == "stall")
+    {
+        sleep(4);
+        return;
+    }
+
+    double start = Now();
+    try
+    {
+        proc.sum.push_back(1);
+        transport->SumAll(proc.sum);
+    }
+    catch (exception &e)
+    {
+        proc.seconds = Now() - start;
+
+        // As a VB run does, pass the failure on to the other processes
+        transport->Abort(e.what());
+        throw;
+    }
+}
+
+void RunVb(Process &proc)
+{
+    FabberRunData rundata(false);
+    if (proc.size > 1)
+        SetDomainOptions(rundata, proc);
+    rundata.SetVoxelCoords(proc.coords);
+    rundata.SetVoxelData("data", proc.data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("degree", "1");
+    rundata.Set("method", "spatialvb");
+    rundata.Set("param-spatial-priors", "M+");
+    rundata.Set("max-iterations", "50");
+    rundata.Set("time-budget", "1000");
+    rundata.SetBool("save-mean");
+    rundata.SetBool("save-voxel-diagnostics");
+    rundata.Run();
+    if (proc.rank == 0)
+    {
+        proc.mean = rundata.GetVoxelData("mean_c0");
+        proc.iterations = rundata.GetVoxelData("iterations");
+        proc.diag_evaluations = rundata.GetVoxelData("diag_evaluations");
+    }
+}
+
+void RunProcess(Process &proc, void (*fn)(Process &))
+{
+    try
+    {
+        fn(proc);
+    }
+    catch (exception &e)
+    {
+        proc.error = e.what();
+    }
+    catch (...)
+    {
+        proc.error = "Unexpected error";
+    }
+}
+
+void WriteBytes(int fd, const void *data, size_t size)
+{
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        ssize_t n = write(fd, bytes, size);
+        if (n <= 0)
+            return;
+        bytes += n;
+        size -= n;
+    }
+}
+
+bool ReadBytes(int fd, void *data, size_t size)
+{
+    char *bytes = static_cast<char *>(data);
+    while (size > 0)
+    {
+        ssize_t n = read(fd, bytes, size);
+        if (n <= 0)
+            return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+void WriteVector(int fd, const vector<double> &values)
+{
+    size_t size = values.size();
+    WriteBytes(fd, &size, sizeof(size));
+    if (size > 0)
+        WriteBytes(fd, &values[0], size * sizeof(double));
+}
+
+bool ReadVector(int fd, vector<double> &values)
+{
+    size_t size;
+    if (!ReadBytes(fd, &size, sizeof(size)))
+        return false;
+    values.resize(size);
+    return size == 0 || ReadBytes(fd, &values[0], size * sizeof(double));
+}
+
+// Send the results of a child process back to the test process
+void WriteResults(int fd, const Process &proc)
+{
+    vector<double> error(proc.error.begin(), proc.error.end());
+    WriteVector(fd, error);
+    WriteVector(fd, vector<double>(1, proc.seconds));
+    WriteVector(fd, proc.sum);
+    WriteVector(fd, proc.from_prev);
+    WriteVector(fd, proc.from_next);
+}
+
+void ReadResults(int fd, Process &proc)
+{
+    vector<double> error, seconds;
+    if (!ReadVector(fd, error) || !ReadVector(fd, seconds) || !ReadVector(fd, proc.sum)
+        || !ReadVector(fd, proc.from_prev) || !ReadVector(fd, proc.from_next))
+    {
+        proc.error = "Process " + stringify(proc.rank) + " did not send its results";
+        return;
+    }
+    proc.error = string(error.begin(), error.end());
+    proc.seconds = seconds.at(0);
+}
+
+void RunProcesses(vector<Process> &procs, void (*fn)(Process &))
+{
+    vector<pid_t> pids(procs.size());
+    vector<int> fds(procs.size());
+    for (unsigned int r = 0; r < procs.size(); r++)
+    {
+        procs[r].rank = r;
+        procs[r].size = procs.size();
+    }
+    for (unsigned int r = 1; r < procs.size(); r++)
+    {
+        int pipe_fds[2];
+        ASSERT_EQ(0, pipe(pipe_fds));
+        pids[r] = fork();
+        ASSERT_GE(pids[r], 0);
+        if (pids[r] == 0)
+        {
+            close(pipe_fds[0]);
+            RunProcess(procs[r], fn);
+            WriteResults(pipe_fds[1], procs[r]);
+            close(pipe_fds[1]);
+            _exit(0);
+        }
+        close(pipe_fds[1]);
+        fds[r] = pipe_fds[0];
+    }
+
+    RunProcess(procs[0], fn);
+
+    for (unsigned int r = 1; r < procs.size(); r++)
+    {
+        ReadResults(fds[r], procs[r]);
+        close(fds[r]);
+        int status;
+        waitpid(pids[r], &status, 0);
+        ASSERT_TRUE(WIFEXITED(status));
+        ASSERT_EQ(0, WEXITSTATUS(status));
+    }
+}
+}
+
+// Tests sums, exchanges and gathers between three processes
+TEST(TransportTest, SocketCollectives)
+{
+    vector<Process> procs(3);
+    RunProcesses(procs, Collectives);
+
+    for (int r = 0; r < 3; r++)
+    {
+        ASSERT_EQ("", procs[r].error);
+        ASSERT_EQ(2, (int)procs[r].sum.size());
+        ASSERT_EQ(3, procs[r].sum[0]);
+        ASSERT_EQ(3, procs[r].sum[1]);
+        if (r > 0)
+        {
+            ASSERT_EQ(r, (int)procs[r].from_prev.size());
+            ASSERT_EQ(r - 1, procs[r].from_prev[0]);
+        }
+        if (r < 2)
+        {
+            ASSERT_EQ(r + 2, (int)procs[r].from_next.size());
+            ASSERT_EQ(r + 1, procs[r].from_next[0]);
+        }
+    }
+
+    ASSERT_EQ(3, (int)procs[0].gathered.size());
+    for (int r = 0; r < 3; r++)
+    {
+        ASSERT_EQ(1, (int)procs[0].gathered[r].size());
+        ASSERT_EQ(r * 10, procs[0].gathered[r][0]);
+    }
+}
+
+// Tests a process which fails stops the others, including process 1 which
+// is only connected to it through process 0
+TEST(TransportTest, SocketAbort)
+{
+    vector<Process> procs(4);
+    procs[3].action = "abort";
+    RunProcesses(procs, Failures);
+
+    ASSERT_EQ("", procs[3].error);
+    for (int r = 0; r < 3; r++)
+    {
+        ASSERT_NE(string::npos, procs[r].error.find("test failure")) << procs[r].error;
+    }
+    ASSERT_NE(string::npos, procs[0].error.find("Process 3 failed")) << procs[0].error;
+}
+
+// Tests a process which stops responding makes the others time out
+TEST(TransportTest, SocketTimeout)
+{
+    vector<Process> procs(2);
+    for (int r = 0; r < 2; r++)
+    {
+        procs[r].options["domain-timeout"] = "1";
+    }
+    procs[1].action = "stall";
+
+    RunProcesses(procs, Failures);
+    ASSERT_NE(string::npos, procs[0].error.find("Timed out")) << procs[0].error;
+    ASSERT_LT(procs[0].seconds, 3);
+    ASSERT_EQ("", procs[1].error);
+}
+
+namespace
+{
+void MakeSlabData(NEWMAT::Matrix &coords, NEWMAT::Matrix &data)
+{
+    int NTIMES = 10;
+    int VSIZE = 6;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+    coords.ReSize(3, n_voxels);
+    data.ReSize(NTIMES, n_voxels);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                coords(1, v) = x;
+                coords(2, v) = y;
+                coords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    float noise = (float(rand()) / RAND_MAX - 0.5);
+                    data(n + 1, v) = 5 + z + (n + 1) * 0.5 + noise;
+                }
+                v++;
+            }
+        }
+    }
+}
+}
+
+// Tests spatial VB split between processes gives the same result as a single
+// process, and the iteration counts and diagnostics of every process reach rank 0
+TEST(TransportTest, DomainSpatialVb)
+{
+    FabberSetup::SetupDefaults();
+    NEWMAT::Matrix coords, data;
+    MakeSlabData(coords, data);
+    int n_voxels = coords.Ncols();
+
+    vector<Process> single(1);
+    single[0].coords = coords;
+    single[0].data = data;
+    RunProcesses(single, RunVb);
+    ASSERT_EQ("", single[0].error);
+
+    vector<Process> procs(2);
+    for (int r = 0; r < 2; r++)
+    {
+        procs[r].coords = coords;
+        procs[r].data = data;
+    }
+    RunProcesses(procs, RunVb);
+    ASSERT_EQ("", procs[0].error);
+    ASSERT_EQ("", procs[1].error);
+
+    ASSERT_EQ(n_voxels, procs[0].mean.Ncols());
+    ASSERT_EQ(n_voxels, procs[0].iterations.Ncols());
+    ASSERT_EQ(n_voxels, procs[0].diag_evaluations.Ncols());
+    int its = int(procs[0].iterations(1, 1));
+    ASSERT_GT(its, 0);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        EXPECT_NEAR(single[0].mean(1, v), procs[0].mean(1, v), 0.05);
+
+        // All processes stop on the same iteration
+        ASSERT_EQ(its, int(procs[0].iterations(1, v)));
+        ASSERT_GT(procs[0].diag_evaluations(1, v), 0);
+    }
+    FabberSetup::Destroy();
+}
+
+// Tests a VB run stops with the error from a process which fails
+TEST(TransportTest, DomainAbort)
+{
+    FabberSetup::SetupDefaults();
+    NEWMAT::Matrix coords, data;
+    MakeSlabData(coords, data);
+    vector<Process> procs(2);
+    for (int r = 0; r < 2; r++)
+    {
+        procs[r].coords = coords;
+        procs[r].data = data;
+    }
+    procs[1].options["checkpoint-its"] = "1";
+
+    RunProcesses(procs, RunVb);
+    ASSERT_NE(string::npos, procs[1].error.find("Checkpoints are not supported"));
+    ASSERT_NE(string::npos, procs[0].error.find("Process 1 failed")) << procs[0].error;
+    ASSERT_NE(string::npos, procs[0].error.find("Checkpoints are not supported"));
+    FabberSetup::Destroy();
+}
+#endif
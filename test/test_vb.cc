@@ -9,14 +9,76 @@
 
 #include "gtest/gtest.h"
 
+#include "dist_mvn.h"
 #include "easylog.h"
+#include "fwdmodel.h"
 #include "inference.h"
 #include "inference_vb.h"
 #include "rundata_newimage.h"
 #include "setup.h"
 
+#include <math.h>
+
+#include <fstream>
+#include <sstream>
+
 namespace
 {
+/**
+ * Nonlinear model for testing - a sum of decaying exponentials
+ * amp1 exp(-r1 t) + amp2 exp(-r2 t) + ... with t = 0.1, 0.2, ...
+ *
+ * The number of exponentials is given by num-exps (default 1)
+ */
+class ExpTestModel : public FwdModel
+{
+public:
+    static FwdModel *NewInstance()
+    {
+        return new ExpTestModel();
+    }
+
+    ExpTestModel()
+        : m_num_exps(1)
+    {
+    }
+
+    void Initialize(FabberRunData &rundata)
+    {
+        FwdModel::Initialize(rundata);
+        m_num_exps = rundata.GetIntDefault("num-exps", 1, 1);
+    }
+
+    void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
+        const std::string &key = "") const
+    {
+        result.ReSize(data.Nrows());
+        for (int i = 1; i <= result.Nrows(); i++)
+        {
+            result(i) = 0;
+            for (int n = 0; n < m_num_exps; n++)
+            {
+                result(i) += params(2 * n + 1) * exp(-params(2 * n + 2) * i * 0.1);
+            }
+        }
+    }
+
+protected:
+    void GetParameterDefaults(std::vector<Parameter> &params) const
+    {
+        for (int n = 0; n < m_num_exps; n++)
+        {
+            params.push_back(Parameter(2 * n, "amp" + stringify(n + 1), DistParams(1, 1e6),
+                DistParams(1, 1e6)));
+            params.push_back(Parameter(2 * n + 1, "r" + stringify(n + 1), DistParams(1, 1e6),
+                DistParams(1, 1e6)));
+        }
+    }
+
+private:
+    int m_num_exps;
+};
+
 class VbTest : public ::testing::TestWithParam<string>
 {
 protected:
@@ -26,6 +88,7 @@ protected:
         , vb(NULL)
     {
         FabberSetup::SetupDefaults();
+        FwdModelFactory::GetInstance()->Add("exptest", &ExpTestModel::NewInstance);
     }
 
     virtual ~VbTest()
@@ -613,6 +676,90 @@ TEST_P(VbTest, RestartFromFile)
 }
 #endif
 
+#ifndef NO_NEWIMAGE
+// Test continuing a VB run from an MVN saved in the compact format
+TEST_P(VbTest, RestartFromCompactFile)
+{
+    int NTIMES = 10;
+    int VSIZE = 5;
+    float VAL = 7.32;
+    int DEGREE = 5;
+    int NVOXELS = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, NVOXELS);
+    voxelCoords.ReSize(3, NVOXELS);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    data(n + 1, v) = VAL + (1.5 * VAL) * (n + 1) * (n + 1);
+                }
+                v++;
+            }
+        }
+    }
+
+    // Save the result of one iteration in each format
+    NEWMAT::Matrix first;
+    const char *formats[2] = { "compact", "nifti" };
+    for (int f = 0; f < 2; f++)
+    {
+        TearDown();
+        SetUp();
+        rundata->SetVoxelCoords(voxelCoords);
+        rundata->SetVoxelData("data", data);
+        rundata->Set("noise", "white");
+        rundata->Set("model", "poly");
+        rundata->Set("degree", stringify(DEGREE));
+        rundata->Set("max-iterations", "1");
+        rundata->SetBool("save-mvn");
+        rundata->Set("save-mvn-format", formats[f]);
+        Run();
+        first = rundata->GetVoxelData("mean_c2");
+    }
+    ASSERT_TRUE(MVNDist::IsCompactFile("finalMVN.mvnc"));
+
+    // Continue for another iteration from each
+    NEWMAT::Matrix continued[2];
+    const char *files[2] = { "finalMVN.mvnc", "finalMVN" };
+    for (int f = 0; f < 2; f++)
+    {
+        TearDown();
+        SetUp();
+        rundata->SetVoxelCoords(voxelCoords);
+        rundata->SetVoxelData("data", data);
+        rundata->Set("noise", "white");
+        rundata->Set("model", "poly");
+        rundata->Set("degree", stringify(DEGREE));
+        rundata->Set("max-iterations", "1");
+        rundata->Set("continue-from-mvn", files[f]);
+        Run();
+        continued[f] = rundata->GetVoxelData("mean_c2");
+    }
+    remove("finalMVN.mvnc");
+    remove("finalMVN.nii.gz");
+
+    // Continuing from the compact file must give the same result as from NIFTI,
+    // and not the result of starting again
+    ASSERT_EQ(NVOXELS, continued[0].Ncols());
+    ASSERT_EQ(NVOXELS, continued[1].Ncols());
+    for (int i = 1; i <= NVOXELS; i++)
+    {
+        ASSERT_NEAR(continued[1](1, i), continued[0](1, i), 1e-4 * fabs(continued[1](1, i)));
+        ASSERT_GT(fabs(continued[0](1, i) - first(1, i)), 1e-3 * fabs(first(1, i)));
+    }
+}
+#endif
+
 // Test fitting to a simple polynomial model with noise
 TEST_P(VbTest, ArNoise)
 {
@@ -773,6 +920,690 @@ TEST_P(VbTest, WhiteNoise)
     }
 }
 
+// Test fitting from the coarsest resolution level gives the same result
+TEST_P(VbTest, Multires)
+{
+    int NTIMES = 10;
+    int VSIZE = 6;
+    float VAL = 2;
+    int DEGREE = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, n_voxels);
+    voxelCoords.ReSize(3, n_voxels);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    float noise = (float(rand()) / RAND_MAX - 0.5) * VAL / 100;
+                    data(n + 1, v) = VAL + (1.5 * VAL + x * 0.1) * (n + 1) * (n + 1) + noise;
+                }
+                v++;
+            }
+        }
+    }
+
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("max-iterations", "20");
+    rundata->Set("degree", stringify(DEGREE));
+    rundata->Set("multires", "3");
+    rundata->Run();
+
+    NEWMAT::Matrix mean = rundata->GetVoxelData("mean_c0");
+    ASSERT_EQ(mean.Nrows(), 1);
+    ASSERT_EQ(mean.Ncols(), n_voxels);
+    for (int i = 0; i < n_voxels; i++)
+    {
+        EXPECT_NEAR(VAL, mean(1, i + 1), 0.2);
+    }
+
+    mean = rundata->GetVoxelData("mean_c2");
+    ASSERT_EQ(mean.Nrows(), 1);
+    ASSERT_EQ(mean.Ncols(), n_voxels);
+    for (int i = 0; i < n_voxels; i++)
+    {
+        EXPECT_NEAR(VAL * 1.5 + voxelCoords(1, i + 1) * 0.1, mean(1, i + 1), 0.2);
+    }
+}
+
+// Test solving for all voxels together gives the same result as sweeping
+TEST_P(VbTest, SpatialSolver)
+{
+    int NTIMES = 10;
+    int VSIZE = 5;
+    float VAL = 2;
+    int DEGREE = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, n_voxels);
+    voxelCoords.ReSize(3, n_voxels);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    float noise = (float(rand()) / RAND_MAX - 0.5) * VAL / 10;
+                    data(n + 1, v) = VAL + (1.5 * VAL) * (n + 1) * (n + 1) + noise;
+                }
+                v++;
+            }
+        }
+    }
+
+    NEWMAT::Matrix means[2];
+    const char *solvers[2] = { "sweep", "pcg" };
+    for (int i = 0; i < 2; i++)
+    {
+        FabberRunData rundata;
+        rundata.SetLogger(&log);
+        rundata.SetVoxelCoords(voxelCoords);
+        rundata.SetVoxelData("data", data);
+        rundata.Set("noise", "white");
+        rundata.Set("model", "poly");
+        rundata.Set("degree", stringify(DEGREE));
+        rundata.Set("method", GetParam());
+        rundata.Set("param-spatial-priors", "M+");
+        rundata.Set("max-iterations", "100");
+        rundata.Set("spatial-solver", solvers[i]);
+        rundata.Run();
+        means[i] = rundata.GetVoxelData("mean_c0");
+        ASSERT_EQ(1, means[i].Nrows());
+        ASSERT_EQ(n_voxels, means[i].Ncols());
+    }
+
+    for (int i = 1; i <= n_voxels; i++)
+    {
+        EXPECT_NEAR(VAL, means[1](1, i), 0.2);
+        EXPECT_NEAR(means[0](1, i), means[1](1, i), 0.01);
+    }
+}
+
+// Test resuming from a checkpoint gives the same result as an uninterrupted run
+TEST_P(VbTest, CheckpointResume)
+{
+    int NTIMES = 10;
+    int VSIZE = 5;
+    float VAL = 2;
+    int DEGREE = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+    string checkpoint_file = "vb_test_checkpoint";
+    bool spatial = (GetParam() == "spatialvb");
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, n_voxels);
+    voxelCoords.ReSize(3, n_voxels);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    float noise = (float(rand()) / RAND_MAX - 0.5) * VAL / 10;
+                    data(n + 1, v) = VAL + (1.5 * VAL) * (n + 1) * (n + 1) + noise;
+                }
+                v++;
+            }
+        }
+    }
+
+    // The first run saves checkpoints part way through, the second resumes
+    // from the last of them. In voxelwise mode a checkpoint is saved after 50
+    // and 100 voxels, and the third run resumes after the second was cut short,
+    // so only the first is used.
+    int nruns = spatial ? 2 : 3;
+    NEWMAT::Matrix means[3], fs[3];
+    for (int i = 0; i < nruns; i++)
+    {
+        stringstream logstr;
+        EasyLog run_log;
+        run_log.StartLog(logstr);
+
+        NEWMAT::Matrix run_data = data;
+        FabberRunData rundata;
+        rundata.SetLogger(&run_log);
+        rundata.SetVoxelCoords(voxelCoords);
+        rundata.Set("noise", "white");
+        rundata.Set("model", "poly");
+        rundata.Set("degree", stringify(DEGREE));
+        rundata.Set("method", GetParam());
+        rundata.Set("max-iterations", "5");
+        rundata.SetBool("save-free-energy");
+        if (i == 0)
+        {
+            rundata.Set("checkpoint-its", "2");
+            rundata.Set("checkpoint-voxels", "50");
+            rundata.Set("checkpoint-file", checkpoint_file);
+        }
+        else
+        {
+            if (i == 2)
+            {
+                ifstream in(checkpoint_file.c_str(), ios::binary);
+                ostringstream contents;
+                contents << in.rdbuf();
+                in.close();
+                string file = contents.str();
+                ofstream out(checkpoint_file.c_str(), ios::binary | ios::trunc);
+                out << file.substr(0, file.size() - 1);
+            }
+            if (!spatial)
+            {
+                // Voxels restored from the checkpoint must not be fitted
+                // again, so changing their data must not change the result
+                int restored = (i == 1) ? 100 : 50;
+                for (int vox = 1; vox <= restored; vox++)
+                {
+                    run_data.Column(vox) = 0;
+                }
+            }
+            rundata.Set("resume-from", checkpoint_file);
+        }
+        rundata.SetVoxelData("data", run_data);
+        rundata.Run();
+        run_log.StopLog();
+        means[i] = rundata.GetVoxelData("mean_c0");
+        fs[i] = rundata.GetVoxelData("freeEnergy");
+        ASSERT_EQ(1, means[i].Nrows());
+        ASSERT_EQ(n_voxels, means[i].Ncols());
+
+        if (i > 0)
+        {
+            string output = logstr.str();
+            string resuming = "Resuming from checkpoint after ";
+            size_t pos = output.find(resuming);
+            ASSERT_NE(string::npos, pos);
+            int position = 0;
+            istringstream(output.substr(pos + resuming.size())) >> position;
+            if (spatial)
+            {
+                // Iterations continue from the checkpoint, not the start
+                ASSERT_GT(position, 0);
+                ASSERT_EQ(string::npos, output.find("*** Spatial iteration *** 1\n"));
+                ASSERT_NE(string::npos,
+                    output.find("*** Spatial iteration *** " + stringify(position + 1) + "\n"));
+            }
+            else
+            {
+                ASSERT_EQ((i == 1) ? 100 : 50, position);
+            }
+        }
+    }
+    remove(checkpoint_file.c_str());
+
+    for (int i = 1; i < nruns; i++)
+    {
+        for (int vox = 1; vox <= n_voxels; vox++)
+        {
+            EXPECT_NEAR(VAL, means[i](1, vox), 0.2);
+            EXPECT_FLOAT_EQ(means[0](1, vox), means[i](1, vox));
+            EXPECT_FLOAT_EQ(fs[0](1, vox), fs[i](1, vox));
+        }
+    }
+}
+
+// Test resuming a run with different data or options is rejected
+TEST_P(VbTest, CheckpointResumeMismatch)
+{
+    int NTIMES = 10;
+    string checkpoint_file = "vb_test_checkpoint";
+    string other_method = (GetParam() == "vb") ? "spatialvb" : "vb";
+
+    // Each change is checked by resuming from a checkpoint of the same
+    // unchanged run
+    const char *changes[] = { "nvoxels", "degree", "noise", "method", "garbage", NULL };
+    for (int c = 0; changes[c]; c++)
+    {
+        string change = changes[c];
+        for (int i = 0; i < 2; i++)
+        {
+            int n_voxels = (i == 1 && change == "nvoxels") ? 101 : 100;
+            NEWMAT::Matrix voxelCoords(3, n_voxels), data(NTIMES, n_voxels);
+            for (int v = 1; v <= n_voxels; v++)
+            {
+                voxelCoords(1, v) = (v - 1) % 10;
+                voxelCoords(2, v) = (v - 1) / 10;
+                voxelCoords(3, v) = 0;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    data(n + 1, v) = 1.0 + n;
+                }
+            }
+
+            FabberRunData rundata;
+            rundata.SetLogger(&log);
+            rundata.SetVoxelCoords(voxelCoords);
+            rundata.SetVoxelData("data", data);
+            rundata.Set("noise", "white");
+            rundata.Set("model", "poly");
+            rundata.Set("degree", "1");
+            rundata.Set("method", GetParam());
+            rundata.Set("max-iterations", "5");
+            if (i == 0)
+            {
+                rundata.Set("checkpoint-its", "2");
+                rundata.Set("checkpoint-voxels", "50");
+                rundata.Set("checkpoint-file", checkpoint_file);
+                rundata.Run();
+                continue;
+            }
+
+            if (change == "degree")
+            {
+                rundata.Set("degree", "2");
+            }
+            else if (change == "noise")
+            {
+                rundata.Set("noise", "ar");
+            }
+            else if (change == "method")
+            {
+                rundata.Set("method", other_method);
+            }
+            else if (change == "garbage")
+            {
+                ofstream out(checkpoint_file.c_str(), ios::binary | ios::trunc);
+                out << "Not a checkpoint";
+            }
+            rundata.Set("resume-from", checkpoint_file);
+            if (change == "garbage")
+            {
+                ASSERT_THROW(rundata.Run(), FabberRunDataError) << change;
+            }
+            else
+            {
+                ASSERT_THROW(rundata.Run(), InvalidOptionValue) << change;
+            }
+        }
+    }
+    remove(checkpoint_file.c_str());
+}
+
+// Test initializing from a dictionary of simulations, and caching the dictionary.
+// The model is nonlinear, so starting close to the solution needs fewer iterations
+TEST_P(VbTest, InitDictionary)
+{
+    int NTIMES = 10;
+    int VSIZE = 4;
+    float AMP = 10;
+    float RATE = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+    string dict_file = "vb_test_dictionary";
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, n_voxels);
+    voxelCoords.ReSize(3, n_voxels);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    float noise = (float(rand()) / RAND_MAX - 0.5) * AMP / 100;
+                    data(n + 1, v) = (AMP + x) * exp(-RATE * (n + 1) * 0.1) + noise;
+                }
+                v++;
+            }
+        }
+    }
+
+    // The first run creates the dictionary, the second loads it from the
+    // cache and the third does not use it. The priors are centred well away
+    // from the solution, which is within the range of the dictionary.
+    NEWMAT::Matrix means[3];
+    double iterations[3];
+    string output[3];
+    for (int i = 0; i < 3; i++)
+    {
+        stringstream logstr;
+        EasyLog runlog;
+        runlog.StartLog(logstr);
+
+        FabberRunData rundata;
+        rundata.SetLogger(&runlog);
+        rundata.SetVoxelCoords(voxelCoords);
+        rundata.SetVoxelData("data", data);
+        rundata.Set("noise", "white");
+        rundata.Set("model", "exptest");
+        rundata.Set("method", GetParam());
+        rundata.Set("convergence", "pointzeroone");
+        rundata.Set("max-iterations", "50");
+        rundata.SetBool("save-voxel-diagnostics");
+        rundata.Set("PSP_byname1", "amp1");
+        rundata.Set("PSP_byname1_mean", stringify(AMP / 2));
+        rundata.Set("PSP_byname1_prec", "0.04");
+        rundata.Set("PSP_byname2", "r1");
+        rundata.Set("PSP_byname2_mean", stringify(RATE / 2));
+        rundata.Set("PSP_byname2_prec", "1");
+        if (i < 2)
+        {
+            rundata.Set("init-dict", "200");
+            rundata.Set("init-dict-file", dict_file);
+        }
+        rundata.Run();
+        runlog.StopLog();
+        output[i] = logstr.str();
+
+        means[i] = rundata.GetVoxelData("mean_amp1");
+        ASSERT_EQ(1, means[i].Nrows());
+        ASSERT_EQ(n_voxels, means[i].Ncols());
+        iterations[i] = rundata.GetVoxelData("diag_iterations").Sum();
+    }
+    remove(dict_file.c_str());
+
+    ASSERT_NE(string::npos, output[0].find("ModelDictionary::Saved 200 simulations"));
+    ASSERT_NE(string::npos, output[1].find("ModelDictionary::Loaded 200 simulations"));
+    ASSERT_EQ(string::npos, output[2].find("ModelDictionary"));
+    ASSERT_EQ(iterations[0], iterations[1]);
+    ASSERT_LT(iterations[0], iterations[2]);
+    for (int i = 1; i <= n_voxels; i++)
+    {
+        EXPECT_NEAR(AMP + voxelCoords(1, i), means[0](1, i), 0.5);
+        EXPECT_FLOAT_EQ(means[0](1, i), means[1](1, i));
+        EXPECT_NEAR(means[2](1, i), means[0](1, i), 0.1);
+    }
+}
+
+// Test accelerated iterations converge to the same solution
+TEST_P(VbTest, AcceleratedConvergence)
+{
+    int NTIMES = 20;
+    int VSIZE = 4;
+    float VAL = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, n_voxels);
+    voxelCoords.ReSize(3, n_voxels);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    float noise = (float(rand()) / RAND_MAX - 0.5) * VAL;
+                    data(n + 1, v) = VAL + (0.5 * VAL + x * 0.1) * (n + 1) + noise;
+                }
+                v++;
+            }
+        }
+    }
+
+    const char *methods[3] = { "", "anderson", "squarem" };
+    NEWMAT::Matrix means[3];
+    for (int i = 0; i < 3; i++)
+    {
+        FabberRunData rundata;
+        rundata.SetLogger(&log);
+        rundata.SetVoxelCoords(voxelCoords);
+        rundata.SetVoxelData("data", data);
+        rundata.Set("noise", "white");
+        rundata.Set("model", "poly");
+        rundata.Set("degree", "1");
+        rundata.Set("method", GetParam());
+        rundata.Set("max-iterations", "50");
+        rundata.Set("min-fchange", "0.0001");
+        if (i == 0)
+        {
+            rundata.Set("convergence", "pointzeroone");
+        }
+        else
+        {
+            rundata.Set("convergence", "accel");
+            rundata.Set("accel-method", methods[i]);
+        }
+        rundata.Run();
+        means[i] = rundata.GetVoxelData("mean_c1");
+        ASSERT_EQ(1, means[i].Nrows());
+        ASSERT_EQ(n_voxels, means[i].Ncols());
+    }
+
+    for (int i = 1; i <= n_voxels; i++)
+    {
+        EXPECT_NEAR(means[0](1, i), means[1](1, i), 0.01);
+        EXPECT_NEAR(means[0](1, i), means[2](1, i), 0.01);
+    }
+}
+
+// Test accelerated iterations need fewer iterations and model evaluations on
+// nonlinear models - single and biexponential decays. Extrapolated steps are
+// included in the iteration count. Spatial VB does not extrapolate.
+TEST_P(VbTest, AcceleratedConvergenceNonlinear)
+{
+    int NTIMES = 20;
+    int n_voxels = 20;
+    float AMPS[2] = { 10, 5 };
+    float RATES[2] = { 5, 0.5 };
+    bool spatial = (GetParam() == "spatialvb");
+
+    for (int num_exps = 1; num_exps <= 2; num_exps++)
+    {
+        NEWMAT::Matrix voxelCoords(3, n_voxels), data(NTIMES, n_voxels);
+        for (int v = 1; v <= n_voxels; v++)
+        {
+            voxelCoords(1, v) = v - 1;
+            voxelCoords(2, v) = 0;
+            voxelCoords(3, v) = 0;
+            for (int n = 0; n < NTIMES; n++)
+            {
+                float noise = (float(rand()) / RAND_MAX - 0.5) * AMPS[0] / 20;
+                data(n + 1, v) = noise;
+                for (int e = 0; e < num_exps; e++)
+                {
+                    data(n + 1, v) += (AMPS[e] + v * 0.1) * exp(-RATES[e] * (n + 1) * 0.1);
+                }
+            }
+        }
+
+        const char *methods[3] = { "", "anderson", "squarem" };
+        NEWMAT::Matrix means[3];
+        double iterations[3], evaluations[3];
+        for (int i = 0; i < 3; i++)
+        {
+            FabberRunData rundata;
+            rundata.SetLogger(&log);
+            rundata.SetVoxelCoords(voxelCoords);
+            rundata.SetVoxelData("data", data);
+            rundata.Set("noise", "white");
+            rundata.Set("model", "exptest");
+            rundata.Set("num-exps", stringify(num_exps));
+            rundata.Set("method", GetParam());
+            rundata.Set("max-iterations", "100");
+            rundata.Set("min-fchange", "0.0001");
+            rundata.SetBool("save-voxel-diagnostics");
+            for (int e = 0; e < num_exps; e++)
+            {
+                string amp = stringify(2 * e + 1), rate = stringify(2 * e + 2);
+                rundata.Set("PSP_byname" + amp, "amp" + stringify(e + 1));
+                rundata.Set("PSP_byname" + amp + "_mean", stringify(AMPS[e]));
+                rundata.Set("PSP_byname" + amp + "_prec", "0.01");
+                rundata.Set("PSP_byname" + rate, "r" + stringify(e + 1));
+                rundata.Set("PSP_byname" + rate + "_mean", stringify(RATES[e]));
+                rundata.Set("PSP_byname" + rate + "_prec", "0.1");
+            }
+            if (i == 0)
+            {
+                rundata.Set("convergence", "pointzeroone");
+            }
+            else
+            {
+                rundata.Set("convergence", "accel");
+                rundata.Set("accel-method", methods[i]);
+            }
+            rundata.Run();
+            means[i] = rundata.GetVoxelData("mean_amp1");
+            ASSERT_EQ(n_voxels, means[i].Ncols());
+            iterations[i] = rundata.GetVoxelData("diag_iterations").Sum();
+            evaluations[i] = rundata.GetVoxelData("diag_evaluations").Sum();
+        }
+
+        for (int i = 1; i < 3; i++)
+        {
+            // Report the savings in the test results
+            string name = stringify(num_exps) + "exp_" + methods[i];
+            RecordProperty(
+                name + "_iterations", stringify(iterations[i]) + "/" + stringify(iterations[0]));
+            RecordProperty(
+                name + "_evaluations", stringify(evaluations[i]) + "/" + stringify(evaluations[0]));
+            if (spatial)
+            {
+                ASSERT_EQ(iterations[0], iterations[i]) << name;
+            }
+            else
+            {
+                ASSERT_LT(iterations[i], iterations[0]) << name;
+                ASSERT_LT(evaluations[i], evaluations[0]) << name;
+            }
+            for (int v = 1; v <= n_voxels; v++)
+            {
+                EXPECT_NEAR(means[0](1, v), means[i](1, v), 0.1) << name;
+            }
+        }
+    }
+}
+
+// Tests a time budget is spent on the voxels which need it. Half the voxels
+// are at the initial posterior so converge almost immediately, the others are
+// far from it. The budget is small, so once every voxel has had the minimum
+// number of iterations what is left must go to the difficult voxels
+TEST_P(VbTest, TimeBudgetDifficultVoxels)
+{
+    // Spatial VB spends its budget on whole iterations rather than voxels
+    if (GetParam() == "spatialvb")
+        return;
+
+    int NTIMES = 20;
+    int n_voxels = 40;
+    float AMPS[2] = { 1, 20 };
+    float RATES[2] = { 1, 8 };
+
+    NEWMAT::Matrix voxelCoords(3, n_voxels), data(NTIMES, n_voxels);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        int difficult = v % 2;
+        voxelCoords(1, v) = v - 1;
+        voxelCoords(2, v) = 0;
+        voxelCoords(3, v) = 0;
+        for (int n = 0; n < NTIMES; n++)
+        {
+            float noise = 0.005 * ((n * 7 + v) % 5 - 2);
+            data(n + 1, v) = AMPS[difficult] * exp(-RATES[difficult] * (n + 1) * 0.1) + noise;
+        }
+    }
+
+    FabberRunData rundata;
+    rundata.SetLogger(&log);
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "exptest");
+    rundata.Set("method", GetParam());
+    rundata.Set("convergence", "pointzeroone");
+    rundata.Set("max-iterations", "1000");
+    rundata.Set("time-budget", "0.01");
+    rundata.Run();
+
+    NEWMAT::Matrix iterations = rundata.GetVoxelData("iterations");
+    ASSERT_EQ(n_voxels, iterations.Ncols());
+    double its[2] = { 0, 0 };
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        ASSERT_GE(iterations(1, v), 2);
+        its[v % 2] += iterations(1, v);
+    }
+    RecordProperty("iterations", stringify(its[1]) + "/" + stringify(its[0]));
+    ASSERT_GT(its[1], its[0]);
+}
+
+// Tests reverts by the trial mode and LM convergence detectors are counted in
+// the per-voxel diagnostics. The initial posterior is far from the solution
+// so the nonlinear fit does not increase the free energy at every iteration
+TEST_P(VbTest, VoxelDiagnosticsReverts)
+{
+    // Spatial VB uses one convergence detector for all voxels
+    if (GetParam() == "spatialvb")
+        return;
+
+    int NTIMES = 20;
+    int n_voxels = 20;
+
+    NEWMAT::Matrix voxelCoords(3, n_voxels), data(NTIMES, n_voxels);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        voxelCoords(1, v) = v - 1;
+        voxelCoords(2, v) = 0;
+        voxelCoords(3, v) = 0;
+        for (int n = 0; n < NTIMES; n++)
+        {
+            float noise = 0.05 * ((n * 7 + v) % 5 - 2);
+            data(n + 1, v) = (10 + v) * exp(-(v + 1) * (n + 1) * 0.1) + noise;
+        }
+    }
+
+    const char *detectors[2] = { "trialmode", "lm" };
+    for (int i = 0; i < 2; i++)
+    {
+        FabberRunData rundata;
+        rundata.SetLogger(&log);
+        rundata.SetVoxelCoords(voxelCoords);
+        rundata.SetVoxelData("data", data);
+        rundata.Set("noise", "white");
+        rundata.Set("model", "exptest");
+        rundata.Set("method", GetParam());
+        rundata.Set("convergence", detectors[i]);
+        rundata.Set("max-iterations", "50");
+        rundata.SetBool("save-voxel-diagnostics");
+        rundata.Run();
+
+        NEWMAT::Matrix iterations = rundata.GetVoxelData("diag_iterations");
+        NEWMAT::Matrix reverts = rundata.GetVoxelData("diag_reverts");
+        ASSERT_EQ(n_voxels, reverts.Ncols());
+        for (int v = 1; v <= n_voxels; v++)
+        {
+            ASSERT_GE(reverts(1, v), 0) << detectors[i];
+            ASSERT_LE(reverts(1, v), iterations(1, v)) << detectors[i];
+        }
+        ASSERT_GT(reverts.Sum(), 0) << detectors[i];
+    }
+}
+
 #ifdef __FABBER_MOTION
 // Turn motion correction on, but no motion to correct!
 TEST_P(VbTest, MotionCorNull)
@@ -13,11 +13,20 @@
 #include <miscmaths/miscmaths.h>
 #include <newmat.h>
 
+#include <algorithm>
 #include <limits>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
 using namespace std;
 using NEWMAT::Matrix;
 using NEWMAT::ColumnVector;
+using NEWMAT::Real;
 using MISCMATHS::read_vest;
 using MISCMATHS::read_ascii_matrix;
 
@@ -81,6 +90,147 @@ ReturnMatrix MaskRows(ColumnVector v, vector<int> masked_rows)
         return masked;
     }
 }
+
+double wall_time()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return double(count.QuadPart) / double(freq.QuadPart);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static bool ProbeRowMajor()
+{
+    Matrix probe(2, 2);
+    probe = 0;
+    probe(1, 2) = 1;
+    return probe.Store()[1] == 1;
+}
+
+// The layout is a property of the matrix library so it only needs checking
+// once. The compiler makes initialization of the static thread safe
+static bool MatrixRowMajor()
+{
+    static const bool row_major = ProbeRowMajor();
+    return row_major;
+}
+
+MatrixLayout::MatrixLayout(const Matrix &m)
+{
+    if (MatrixRowMajor())
+    {
+        m_row_stride = m.Ncols();
+        m_col_stride = 1;
+    }
+    else
+    {
+        m_row_stride = 1;
+        m_col_stride = m.Nrows();
+    }
+}
+
+void CopyRows(const Matrix &src, int src_row, Matrix &dest, int dest_row, int nrows)
+{
+    if (src.Ncols() != dest.Ncols() || src_row < 1 || src_row + nrows - 1 > src.Nrows()
+        || dest_row < 1 || dest_row + nrows - 1 > dest.Nrows())
+    {
+        throw FabberInternalError("CopyRows: Rows out of range");
+    }
+    int ncols = src.Ncols();
+    if (nrows <= 0 || ncols == 0)
+        return;
+
+    MatrixLayout src_layout(src), dest_layout(dest);
+    const Real *in = src.Store();
+    Real *out = dest.Store();
+    if (src_layout.RowMajor())
+    {
+        // Consecutive rows form a single block
+        const Real *start = in + src_layout.Index(src_row, 1);
+        std::copy(start, start + size_t(nrows) * ncols, out + dest_layout.Index(dest_row, 1));
+    }
+    else
+    {
+        for (int c = 1; c <= ncols; c++)
+        {
+            const Real *start = in + src_layout.Index(src_row, c);
+            std::copy(start, start + nrows, out + dest_layout.Index(dest_row, c));
+        }
+    }
+}
+
+#ifndef FABBER_THREADSAFE_MATRIX
+// Recursive locks cannot be statically initialized portably, so they are
+// created on first use
+#ifdef _WIN32
+static INIT_ONCE matrix_lock_once = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION matrix_lock;
+
+static BOOL CALLBACK InitMatrixLock(PINIT_ONCE, PVOID, PVOID *)
+{
+    InitializeCriticalSection(&matrix_lock);
+    return TRUE;
+}
+
+MatrixLock::MatrixLock()
+{
+    InitOnceExecuteOnce(&matrix_lock_once, InitMatrixLock, NULL, NULL);
+    EnterCriticalSection(&matrix_lock);
+}
+
+MatrixLock::~MatrixLock()
+{
+    LeaveCriticalSection(&matrix_lock);
+}
+#else
+static pthread_once_t matrix_lock_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t matrix_lock;
+
+static void InitMatrixLock()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&matrix_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+MatrixLock::MatrixLock()
+{
+    pthread_once(&matrix_lock_once, InitMatrixLock);
+    pthread_mutex_lock(&matrix_lock);
+}
+
+MatrixLock::~MatrixLock()
+{
+    pthread_mutex_unlock(&matrix_lock);
+}
+#endif
+
+bool MatrixLock::ThreadSafe()
+{
+    return false;
+}
+#else
+MatrixLock::MatrixLock()
+{
+}
+
+MatrixLock::~MatrixLock()
+{
+}
+
+bool MatrixLock::ThreadSafe()
+{
+    return true;
+}
+#endif
 }
 
 double gammaln(double x)
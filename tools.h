@@ -25,6 +25,76 @@ NEWMAT::Matrix read_matrix_file(std::string filename);
 
 NEWMAT::ReturnMatrix MaskRows(NEWMAT::Matrix m, std::vector<int> masked_rows);
 NEWMAT::ReturnMatrix MaskRows(NEWMAT::ColumnVector v, std::vector<int> masked_rows);
+
+/**
+ * @return Wall clock time in seconds from an arbitrary starting point. Used for
+ *         measuring elapsed time within a run
+ */
+double wall_time();
+
+/**
+ * Position of the elements of a NEWMAT::Matrix within Store()
+ *
+ * NEWMAT stores a Matrix row by row but other implementations of its
+ * interface, e.g. armawrap, store it column by column. Code which reads or
+ * writes matrix storage directly uses this rather than assuming either.
+ * Row and column vectors are contiguous in both cases.
+ */
+class MatrixLayout
+{
+public:
+    explicit MatrixLayout(const NEWMAT::Matrix &m);
+
+    /** @return Index in Store() of element (r, c), both 1-based */
+    size_t Index(int r, int c) const
+    {
+        return size_t(r - 1) * m_row_stride + size_t(c - 1) * m_col_stride;
+    }
+
+    /** @return true if each row is stored contiguously */
+    bool RowMajor() const { return m_col_stride == 1; }
+
+private:
+    size_t m_row_stride;
+    size_t m_col_stride;
+};
+
+/**
+ * Copy rows from one matrix to another with the same number of columns
+ *
+ * @param src_row First row to copy from src, 1-based
+ * @param dest_row Row of dest to copy the first row to, 1-based
+ * @param nrows Number of rows to copy
+ */
+void CopyRows(const NEWMAT::Matrix &src, int src_row, NEWMAT::Matrix &dest, int dest_row,
+    int nrows);
+
+/**
+ * Scoped lock serialising use of the matrix library between threads
+ *
+ * The original NEWMAT library records the function being executed through a
+ * single global pointer, which threads using it at the same time can leave
+ * dangling. Since NEWMAT exceptions are thrown and caught routinely during
+ * a run, every entry point which may use matrices from more than one thread
+ * holds this lock, so runs on different threads take turns.
+ *
+ * If the build uses a thread-safe matrix library (FABBER_THREADSAFE_MATRIX)
+ * the lock does nothing. It is recursive, so code holding it may call other
+ * code which takes it.
+ */
+class MatrixLock
+{
+public:
+    MatrixLock();
+    ~MatrixLock();
+
+    /** @return true if the matrix library may be used from several threads at once */
+    static bool ThreadSafe();
+
+private:
+    MatrixLock(const MatrixLock &);
+    MatrixLock &operator=(const MatrixLock &);
+};
 }
 
 // Calculate log-gamma from a Taylor expansion; good to one part in 2e-10.
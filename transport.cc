@@ -0,0 +1,461 @@
+/*  transport.cc - Communication between the processes of a domain-decomposed run
+
+ Copyright (C) 2007-2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "transport.h"
+
+#include "easylog.h"
+#include "rundata.h"
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef FABBER_MPI
+#include <mpi.h>
+#endif
+
+using namespace std;
+
+Transport *Transport::NewFromRunData(FabberRunData &rundata)
+{
+    string name = rundata.GetStringDefault("domain-transport", "");
+    if (name == "")
+    {
+        return NULL;
+    }
+
+    auto_ptr<Transport> transport;
+#ifndef _WIN32
+    if (name == "socket")
+    {
+        transport.reset(new SocketTransport());
+    }
+#endif
+#ifdef FABBER_MPI
+    if (name == "mpi")
+    {
+        transport.reset(new MpiTransport());
+    }
+#endif
+    if (!transport.get())
+    {
+        throw InvalidOptionValue(
+            "domain-transport", name, "Unknown transport or not available in this build");
+    }
+
+    transport->SetLogger(rundata.GetLogger());
+    transport->Initialize(rundata);
+    return transport.release();
+}
+
+void Transport::Exchange(int rank, const vector<double> &send, vector<double> &recv)
+{
+    if (GetRank() < rank)
+    {
+        Send(rank, send);
+        Recv(rank, recv);
+    }
+    else
+    {
+        Recv(rank, recv);
+        Send(rank, send);
+    }
+}
+
+void Transport::SumAll(vector<double> &values)
+{
+    if (GetRank() == 0)
+    {
+        vector<double> part;
+        for (int r = 1; r < GetSize(); r++)
+        {
+            Recv(r, part);
+            if (part.size() != values.size())
+            {
+                throw FabberInternalError("Transport::SumAll - processes sent different sizes");
+            }
+            for (unsigned int i = 0; i < values.size(); i++)
+            {
+                values[i] += part[i];
+            }
+        }
+        for (int r = 1; r < GetSize(); r++)
+        {
+            Send(r, values);
+        }
+    }
+    else
+    {
+        Send(0, values);
+        Recv(0, values);
+    }
+}
+
+void Transport::Gather(const vector<double> &data, vector<vector<double> > &all)
+{
+    if (GetRank() == 0)
+    {
+        all.resize(GetSize());
+        all[0] = data;
+        for (int r = 1; r < GetSize(); r++)
+        {
+            Recv(r, all[r]);
+        }
+    }
+    else
+    {
+        Send(0, data);
+    }
+}
+
+#ifndef _WIN32
+
+// Avoid being killed by SIGPIPE if another process has died
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+// How long to wait for the other processes to start
+static const int CONNECT_TIMEOUT = 60;
+
+// Size sent in place of a message by a process which has failed
+static const long long ABORT_MESSAGE = -1;
+
+static void WriteAll(int fd, const char *data, size_t size, int rank, int flags = SEND_FLAGS)
+{
+    size_t sent = 0;
+    while (sent < size)
+    {
+        ssize_t n = send(fd, data + sent, size - sent, flags);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            throw FabberRunDataError("Timed out sending to process " + stringify(rank));
+        }
+        if (n <= 0)
+        {
+            throw FabberRunDataError("Failed to send to process " + stringify(rank) + ": "
+                + strerror(errno));
+        }
+        sent += n;
+    }
+}
+
+static void ReadAll(int fd, char *data, size_t size, int rank)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = recv(fd, data + done, size - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            throw FabberRunDataError(
+                "Timed out waiting for a message from process " + stringify(rank));
+        }
+        if (n <= 0)
+        {
+            throw FabberRunDataError("Lost connection to process " + stringify(rank));
+        }
+        done += n;
+    }
+}
+
+// Apply the message timeout to a connected socket
+static void SetTimeout(int fd, int timeout)
+{
+    struct timeval tv;
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+SocketTransport::SocketTransport()
+    : m_rank(0)
+    , m_size(1)
+    , m_timeout(3600)
+    , m_listen_fd(-1)
+{
+}
+
+SocketTransport::~SocketTransport()
+{
+    for (map<int, int>::iterator iter = m_fds.begin(); iter != m_fds.end(); ++iter)
+    {
+        close(iter->second);
+    }
+    if (m_listen_fd >= 0)
+    {
+        close(m_listen_fd);
+        unlink(SocketPath(m_rank).c_str());
+    }
+}
+
+string SocketTransport::SocketPath(int rank) const
+{
+    return m_dir + "/fabber_rank" + stringify(rank) + ".sock";
+}
+
+void SocketTransport::Initialize(FabberRunData &rundata)
+{
+    m_size = rundata.GetIntDefault("domain-size", 1, 1);
+    m_rank = rundata.GetIntDefault("domain-rank", 0, 0);
+    if (m_rank >= m_size)
+    {
+        throw InvalidOptionValue("domain-rank", stringify(m_rank), "Must be less than domain-size");
+    }
+    m_dir = rundata.GetStringDefault("domain-socket-dir", ".");
+    m_timeout = rundata.GetIntDefault("domain-timeout", 3600, 1);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    string path = SocketPath(m_rank);
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        throw InvalidOptionValue("domain-socket-dir", m_dir, "Path is too long for a socket");
+    }
+
+    // Listen before connecting, so lower ranks never wait for us
+    m_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_listen_fd < 0)
+    {
+        throw FabberRunDataError(string("Failed to create socket: ") + strerror(errno));
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    if (bind(m_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(m_listen_fd, m_size) != 0)
+    {
+        throw FabberRunDataError("Failed to listen on socket " + path + ": " + strerror(errno));
+    }
+
+    // Connect to the previous rank and rank 0
+    set<int> targets;
+    if (m_rank > 0)
+    {
+        targets.insert(0);
+        targets.insert(m_rank - 1);
+    }
+    for (set<int>::iterator iter = targets.begin(); iter != targets.end(); ++iter)
+    {
+        string target = SocketPath(*iter);
+        strncpy(addr.sun_path, target.c_str(), sizeof(addr.sun_path) - 1);
+        time_t start = time(NULL);
+        int fd = -1;
+        while (true)
+        {
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+                break;
+            if (fd >= 0)
+                close(fd);
+            if (time(NULL) - start > CONNECT_TIMEOUT)
+            {
+                throw FabberRunDataError("Timed out connecting to process " + stringify(*iter)
+                    + " at " + target);
+            }
+            usleep(100000);
+        }
+        SetTimeout(fd, m_timeout);
+        int rank = m_rank;
+        WriteAll(fd, (const char *)&rank, sizeof(rank), *iter);
+        m_fds[*iter] = fd;
+    }
+
+    // Accept connections from the next rank, or from everyone for rank 0
+    int expected = (m_rank == 0) ? m_size - 1 : ((m_rank + 1 < m_size) ? 1 : 0);
+    time_t start = time(NULL);
+    for (int i = 0; i < expected; i++)
+    {
+        struct pollfd pfd;
+        pfd.fd = m_listen_fd;
+        pfd.events = POLLIN;
+        int remaining = CONNECT_TIMEOUT - int(time(NULL) - start);
+        int ready = (remaining > 0) ? poll(&pfd, 1, remaining * 1000) : 0;
+        if (ready == 0)
+        {
+            throw FabberRunDataError("Timed out waiting for " + stringify(expected - i)
+                + " other processes to connect to process " + stringify(m_rank));
+        }
+        int fd = (ready > 0) ? accept(m_listen_fd, NULL, NULL) : -1;
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                i--;
+                continue;
+            }
+            throw FabberRunDataError(string("Failed to accept connection: ") + strerror(errno));
+        }
+        SetTimeout(fd, m_timeout);
+        int rank;
+        ReadAll(fd, (char *)&rank, sizeof(rank), -1);
+        m_fds[rank] = fd;
+    }
+    LOG << "SocketTransport::Process " << m_rank << " of " << m_size << " connected to "
+        << m_fds.size() << " others" << endl;
+}
+
+int SocketTransport::GetSocket(int rank) const
+{
+    map<int, int>::const_iterator iter = m_fds.find(rank);
+    if (iter == m_fds.end())
+    {
+        throw FabberInternalError("SocketTransport: no connection to process " + stringify(rank));
+    }
+    return iter->second;
+}
+
+void SocketTransport::Send(int rank, const vector<double> &data)
+{
+    int fd = GetSocket(rank);
+    long long size = data.size();
+    WriteAll(fd, (const char *)&size, sizeof(size), rank);
+    if (size > 0)
+        WriteAll(fd, (const char *)&data[0], size * sizeof(double), rank);
+}
+
+void SocketTransport::Recv(int rank, vector<double> &data)
+{
+    int fd = GetSocket(rank);
+    long long size;
+    ReadAll(fd, (char *)&size, sizeof(size), rank);
+    if (size == ABORT_MESSAGE)
+    {
+        long long len;
+        ReadAll(fd, (char *)&len, sizeof(len), rank);
+        string msg(len, ' ');
+        if (len > 0)
+            ReadAll(fd, &msg[0], len, rank);
+        throw FabberRunDataError("Process " + stringify(rank) + " failed: " + msg);
+    }
+    data.resize(size);
+    if (size > 0)
+        ReadAll(fd, (char *)&data[0], size * sizeof(double), rank);
+}
+
+void SocketTransport::Abort(const string &msg)
+{
+    // Do not wait for processes which are not reading. The connections are
+    // closed so they see a lost connection if the message did not fit
+    long long header[2] = { ABORT_MESSAGE, (long long)msg.size() };
+    for (map<int, int>::iterator iter = m_fds.begin(); iter != m_fds.end(); ++iter)
+    {
+        try
+        {
+            WriteAll(iter->second, (const char *)header, sizeof(header), iter->first,
+                SEND_FLAGS | MSG_DONTWAIT);
+            WriteAll(iter->second, msg.c_str(), msg.size(), iter->first,
+                SEND_FLAGS | MSG_DONTWAIT);
+        }
+        catch (FabberRunDataError &)
+        {
+        }
+        shutdown(iter->second, SHUT_RDWR);
+    }
+}
+
+#endif
+
+#ifdef FABBER_MPI
+
+MpiTransport::MpiTransport()
+    : m_rank(0)
+    , m_size(1)
+    , m_timeout(3600)
+    , m_finalize(false)
+{
+}
+
+MpiTransport::~MpiTransport()
+{
+    if (m_finalize)
+    {
+        MPI_Finalize();
+    }
+}
+
+void MpiTransport::Initialize(FabberRunData &rundata)
+{
+    int initialized;
+    MPI_Initialized(&initialized);
+    if (!initialized)
+    {
+        MPI_Init(NULL, NULL);
+        m_finalize = true;
+    }
+    MPI_Comm_rank(MPI_COMM_WORLD, &m_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &m_size);
+    m_timeout = rundata.GetIntDefault("domain-timeout", 3600, 1);
+    LOG << "MpiTransport::Process " << m_rank << " of " << m_size << endl;
+}
+
+void MpiTransport::Send(int rank, const vector<double> &data)
+{
+    double *buf = data.empty() ? NULL : const_cast<double *>(&data[0]);
+    MPI_Send(buf, data.size(), MPI_DOUBLE, rank, 0, MPI_COMM_WORLD);
+}
+
+void MpiTransport::Recv(int rank, vector<double> &data)
+{
+    // Poll rather than block so a process which has stopped responding
+    // does not hang the others
+    MPI_Status status;
+    double start = MPI_Wtime();
+    int ready = 0;
+    while (true)
+    {
+        MPI_Iprobe(rank, 0, MPI_COMM_WORLD, &ready, &status);
+        if (ready)
+            break;
+        if (MPI_Wtime() - start > m_timeout)
+        {
+            throw FabberRunDataError(
+                "Timed out waiting for a message from process " + stringify(rank));
+        }
+        usleep(1000);
+    }
+    int count;
+    MPI_Get_count(&status, MPI_DOUBLE, &count);
+    data.resize(count);
+    MPI_Recv(data.empty() ? NULL : &data[0], count, MPI_DOUBLE, rank, 0, MPI_COMM_WORLD,
+        MPI_STATUS_IGNORE);
+}
+
+void MpiTransport::Abort(const string &msg)
+{
+    // MPI cannot pass the message on, so log it before stopping every process
+    LOG << "MpiTransport::Process " << m_rank << " failed: " << msg << endl;
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+void MpiTransport::SumAll(vector<double> &values)
+{
+    if (!values.empty())
+    {
+        MPI_Allreduce(MPI_IN_PLACE, &values[0], values.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    }
+}
+
+#endif
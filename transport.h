@@ -0,0 +1,177 @@
+/*  transport.h - Communication between the processes of a domain-decomposed run
+
+ Copyright (C) 2007-2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#pragma once
+
+#include "easylog.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class FabberRunData;
+
+/**
+ * Communication between the processes of a domain-decomposed run
+ *
+ * Each process has a rank from 0 to GetSize()-1 and exchanges blocks of
+ * numbers with the others. Subclasses provide point to point messages;
+ * the collective operations are built from these by default but may be
+ * overridden where the transport has something better.
+ *
+ * All processes must call the collective operations in the same order.
+ */
+class Transport : public Loggable
+{
+public:
+    /**
+     * Create the transport selected by the domain-transport option
+     *
+     * @return New transport, or NULL if domain-transport is not set
+     * @throw InvalidOptionValue if the transport is unknown or not available
+     *        in this build
+     */
+    static Transport *NewFromRunData(FabberRunData &rundata);
+
+    virtual ~Transport()
+    {
+    }
+
+    /**
+     * Set up communication with the other processes
+     */
+    virtual void Initialize(FabberRunData &rundata) = 0;
+
+    /** @return Rank of this process, from 0 */
+    virtual int GetRank() const = 0;
+
+    /** @return Number of processes */
+    virtual int GetSize() const = 0;
+
+    /**
+     * Send a message to another process. May block until it is received
+     */
+    virtual void Send(int rank, const std::vector<double> &data) = 0;
+
+    /**
+     * Receive the next message from another process
+     *
+     * @throw FabberRunDataError if the other process has aborted or
+     *        disconnected, or no message arrives within the time given
+     *        by the domain-timeout option
+     */
+    virtual void Recv(int rank, std::vector<double> &data) = 0;
+
+    /**
+     * Tell the other processes that this one has failed
+     *
+     * Processes waiting for a message from this one will throw an exception
+     * containing msg, rather than waiting until they time out. This is called
+     * while handling another error so it does not throw.
+     */
+    virtual void Abort(const std::string &msg) = 0;
+
+    /**
+     * Send a message to another process and receive one from it
+     *
+     * The lower rank sends first, so this does not deadlock when both
+     * messages are too large to be buffered. A process exchanging with
+     * several others must do so in increasing order of rank.
+     */
+    virtual void Exchange(int rank, const std::vector<double> &send, std::vector<double> &recv);
+
+    /**
+     * Replace values with their sums over all processes
+     */
+    virtual void SumAll(std::vector<double> &values);
+
+    /**
+     * Collect a message from every process on rank 0
+     *
+     * @param data Message from this process
+     * @param all On rank 0, the message from each process in order of rank.
+     *            Not changed on other ranks
+     */
+    virtual void Gather(const std::vector<double> &data, std::vector<std::vector<double> > &all);
+};
+
+#ifndef _WIN32
+/**
+ * Transport between processes on the same machine using Unix domain sockets
+ *
+ * Each process listens on a socket named by its rank in a shared directory.
+ * Processes connect to their neighbours in rank and to rank 0, which is
+ * sufficient for slab decompositions and the collective operations. The
+ * processes may be started in any order.
+ */
+class SocketTransport : public Transport
+{
+public:
+    SocketTransport();
+    virtual ~SocketTransport();
+
+    virtual void Initialize(FabberRunData &rundata);
+    virtual int GetRank() const
+    {
+        return m_rank;
+    }
+    virtual int GetSize() const
+    {
+        return m_size;
+    }
+    virtual void Send(int rank, const std::vector<double> &data);
+    virtual void Recv(int rank, std::vector<double> &data);
+    virtual void Abort(const std::string &msg);
+
+private:
+    /** @return Connected socket for another rank */
+    int GetSocket(int rank) const;
+
+    /** @return Path of the socket which a rank listens on */
+    std::string SocketPath(int rank) const;
+
+    int m_rank;
+    int m_size;
+    int m_timeout;
+    std::string m_dir;
+    int m_listen_fd;
+    std::map<int, int> m_fds;
+};
+#endif
+
+#ifdef FABBER_MPI
+/**
+ * Transport using MPI, for processes on different machines
+ *
+ * The rank and number of processes are taken from MPI_COMM_WORLD.
+ */
+class MpiTransport : public Transport
+{
+public:
+    MpiTransport();
+    virtual ~MpiTransport();
+
+    virtual void Initialize(FabberRunData &rundata);
+    virtual int GetRank() const
+    {
+        return m_rank;
+    }
+    virtual int GetSize() const
+    {
+        return m_size;
+    }
+    virtual void Send(int rank, const std::vector<double> &data);
+    virtual void Recv(int rank, std::vector<double> &data);
+    virtual void Abort(const std::string &msg);
+    virtual void SumAll(std::vector<double> &values);
+
+private:
+    int m_rank;
+    int m_size;
+    int m_timeout;
+    bool m_finalize;
+};
+#endif